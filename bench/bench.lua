@@ -0,0 +1,566 @@
+-- luawav benchmarks
+--
+-- usage: lua bench/bench.lua [-o results.json] [-b builddir] [-f pattern] [-q] [-a] [-c]
+--
+--   -o  write the JSON results to a file instead of stdout
+--   -b  directory holding the built luawav module, searched first
+--   -f  only run cases whose name matches the Lua pattern
+--   -q  quick run, shorter files and timings, for smoke testing
+--   -a  check the steady-state loops don't allocate instead of timing,
+--       exits with a failure status if any of them do
+--   -c  check IMA ADPCM written by luawav decodes back through dr_wav
+--       above a minimum SNR instead of timing, with a failure status if not
+--
+-- Synthetic files are written to temporary files for every format,
+-- channel count and container, then each case is timed for as many runs
+-- as fit in the minimum time. Rates are per audio frame (per operation for
+-- int64), and luaBytes is the Lua heap allocated per frame, measured with
+-- the collector stopped.
+
+local options = {
+  output = nil,
+  build = nil,
+  filter = nil,
+  frames = 48000,
+  minTime = 0.25,
+  allocations = false,
+  quality = false,
+}
+
+do
+  local i = 1
+  while arg and arg[i] do
+    local a = arg[i]
+    if a == '-o' then
+      i = i + 1
+      options.output = arg[i]
+    elseif a == '-b' then
+      i = i + 1
+      options.build = arg[i]
+    elseif a == '-f' then
+      i = i + 1
+      options.filter = arg[i]
+    elseif a == '-q' then
+      options.frames = 4800
+      options.minTime = 0.02
+    elseif a == '-a' then
+      options.allocations = true
+    elseif a == '-c' then
+      options.quality = true
+    else
+      error('unknown option ' .. a)
+    end
+    i = i + 1
+  end
+end
+
+if options.build then
+  local dir = options.build
+  package.cpath = dir .. '/?.so;' .. dir .. '/?.dll;' .. package.cpath
+  package.path = dir .. '/?.lua;' .. package.path
+end
+
+local wav = require'luawav'
+
+local BLOCK = 4096
+
+local formats = {
+  { name = 'pcm8', format = wav.DR_WAVE_FORMAT_PCM, bitsPerSample = 8, type = 's16' },
+  { name = 'pcm16', format = wav.DR_WAVE_FORMAT_PCM, bitsPerSample = 16, type = 's16' },
+  { name = 'pcm24', format = wav.DR_WAVE_FORMAT_PCM, bitsPerSample = 24, type = 's32' },
+  { name = 'pcm32', format = wav.DR_WAVE_FORMAT_PCM, bitsPerSample = 32, type = 's32' },
+  { name = 'f32', format = wav.DR_WAVE_FORMAT_IEEE_FLOAT, bitsPerSample = 32, type = 'f32' },
+  { name = 'f64', format = wav.DR_WAVE_FORMAT_IEEE_FLOAT, bitsPerSample = 64, type = 'f32' },
+  { name = 'alaw', format = wav.DR_WAVE_FORMAT_ALAW, bitsPerSample = 8, type = 's16' },
+  { name = 'mulaw', format = wav.DR_WAVE_FORMAT_MULAW, bitsPerSample = 8, type = 's16' },
+  { name = 'ima', format = wav.DR_WAVE_FORMAT_DVI_ADPCM, bitsPerSample = 4, type = 's16', maxChannels = 2 },
+}
+
+local containers = {
+  { name = 'riff', value = wav.drwav_container_riff },
+  { name = 'rf64', value = wav.drwav_container_rf64 },
+  { name = 'w64', value = wav.drwav_container_w64 },
+}
+
+local channelCounts = { 1, 2, 6, 8 }
+
+-- every format at every channel count in RIFF, and the other containers
+-- with 16-bit stereo, which is enough to show container overhead
+local function build_cases()
+  local cases = {}
+  for _,f in ipairs(formats) do
+    for _,c in ipairs(channelCounts) do
+      if not f.maxChannels or c <= f.maxChannels then
+        cases[#cases + 1] = { format = f, channels = c, container = containers[1] }
+      end
+    end
+  end
+  for i=2,#containers do
+    cases[#cases + 1] = { format = formats[2], channels = 2, container = containers[i] }
+  end
+  for _,c in ipairs(cases) do
+    c.name = string.format('%s_%dch_%s',c.format.name,c.channels,c.container.name)
+  end
+  return cases
+end
+
+-- a block of a quiet sine per channel plus a little noise, in each type
+local function build_blocks(channels)
+  local blocks = { f32 = {}, s32 = {}, s16 = {} }
+  local seed = 1
+  local n = 0
+  for i=0,BLOCK-1 do
+    for c=1,channels do
+      seed = (seed * 1103515245 + 12345) % 2147483648
+      local v = 0.5 * math.sin(2 * math.pi * (220 * c) * i / 48000) + (seed / 2147483648 - 0.5) * 0.01
+      n = n + 1
+      blocks.f32[n] = v
+      blocks.s32[n] = math.floor(v * 2147483647)
+      blocks.s16[n] = math.floor(v * 32767)
+    end
+  end
+  return blocks
+end
+
+local function write_file(path, case, frames, blocks)
+  local w = wav.drwav()
+  local ok = w:init_write(path, {
+    container = case.container.value,
+    format = case.format.format,
+    channels = case.channels,
+    sampleRate = 48000,
+    bitsPerSample = case.format.bitsPerSample,
+  })
+  if not ok then
+    error('unable to write ' .. path)
+  end
+  local written = 0
+  while written < frames do
+    w:write_pcm_frames(blocks.f32,'f32')
+    written = written + BLOCK
+  end
+  w:uninit()
+end
+
+local function read_all(path)
+  local f = assert(io.open(path,'rb'))
+  local data = f:read('*a')
+  f:close()
+  return data
+end
+
+-- runs fn until minTime has passed, returns the seconds and Lua bytes
+-- allocated per run. Each run starts from a collected heap with the
+-- collector stopped, so the growth is what the run allocated.
+local function measure(fn)
+  local runs = 0
+  local seconds = 0
+  local bytes = 0
+  local count = 0
+
+  fn() -- warm up, opens files and fills caches
+  repeat
+    collectgarbage('collect')
+    collectgarbage('stop')
+    local before = collectgarbage('count')
+    local start = os.clock()
+    count = fn()
+    seconds = seconds + (os.clock() - start)
+    bytes = bytes + (collectgarbage('count') - before) * 1024
+    collectgarbage('restart')
+    runs = runs + 1
+  until seconds >= options.minTime
+  return count, seconds / runs, bytes / runs, runs
+end
+
+local results = {}
+
+local function record(case, op, unit, fn)
+  local count, seconds, bytes, runs = measure(fn)
+  results[#results + 1] = {
+    case = case and case.name or nil,
+    format = case and case.format.name or nil,
+    channels = case and case.channels or nil,
+    container = case and case.container.name or nil,
+    op = op,
+    unit = unit,
+    count = count,
+    runs = runs,
+    seconds = seconds,
+    perSec = seconds > 0 and count / seconds or nil,
+    luaBytes = count > 0 and bytes / count or nil,
+  }
+  io.stderr:write(string.format('%-16s %-30s %14.0f %s/s\n',case and case.name or '-',op,seconds > 0 and count / seconds or 0,unit))
+end
+
+local function bench_case(case, path, blocks)
+  local data = read_all(path)
+
+  for _,ty in ipairs({ 'f32', 's32', 's16' }) do
+    record(case,'read_pcm_frames_' .. ty,'frames',function()
+      local w = wav.drwav()
+      local read = w['read_pcm_frames_' .. ty]
+      local total = 0
+      w:init(path)
+      while true do
+        local s = read(w,BLOCK)
+        local n = s and #s / case.channels or 0
+        total = total + n
+        if n < BLOCK then break end
+      end
+      w:uninit()
+      return total
+    end)
+  end
+
+  record(case,'frames','frames',function()
+    local w = wav.drwav()
+    local total = 0
+    w:init(path)
+    for _, n in w:frames(case.format.type,BLOCK) do
+      total = total + n
+    end
+    w:uninit()
+    return total
+  end)
+
+  for _,ty in ipairs({ 'f32', 's32', 's16' }) do
+    record(case,'open_and_read_pcm_frames_' .. ty,'frames',function()
+      local r = wav['drwav_open_and_read_pcm_frames_' .. ty](path)
+      return tonumber(tostring(r.frameCount))
+    end)
+  end
+
+  record(case,'callback_read_pcm_frames_s16','frames',function()
+    local w = wav.drwav()
+    local pos = 0
+    local total = 0
+    w:init({
+      onRead = function(_, n)
+        local s = data:sub(pos + 1,pos + n)
+        pos = pos + #s
+        return s
+      end,
+      onSeek = function(_, whence, offset)
+        if whence == 'set' then pos = offset else pos = pos + offset end
+        return pos >= 0 and pos <= #data
+      end,
+    })
+    while true do
+      local s = w:read_pcm_frames_s16(BLOCK)
+      local n = s and #s / case.channels or 0
+      total = total + n
+      if n < BLOCK then break end
+    end
+    w:uninit()
+    return total
+  end)
+
+  local out = path .. '.out'
+  local ty = case.format.type
+  record(case,'write_pcm_frames_' .. ty,'frames',function()
+    local w = wav.drwav()
+    local total = 0
+    w:init_write(out, {
+      container = case.container.value,
+      format = case.format.format,
+      channels = case.channels,
+      sampleRate = 48000,
+      bitsPerSample = case.format.bitsPerSample,
+    })
+    while total < options.frames do
+      w:write_pcm_frames(blocks[ty],ty)
+      total = total + BLOCK
+    end
+    w:uninit()
+    return total
+  end)
+  os.remove(out)
+end
+
+-- with -a: every loop that reuses its tables should stop allocating once
+-- warmed up, reads seek back to the start at the end of the file
+local failures = 0
+
+local function steady(case, op, step)
+  local iterations = 200
+  for _=1,3 do step() end
+  local lua0, drwav0 = wav.allocations()
+  for _=1,iterations do step() end
+  local lua1, drwav1 = wav.allocations()
+  local ok = lua1 == lua0 and drwav1 == drwav0
+  if not ok then failures = failures + 1 end
+  io.stderr:write(string.format('%-16s %-30s %6d lua %6d dr_wav %s\n',case.name,op,lua1 - lua0,drwav1 - drwav0,ok and 'ok' or 'FAIL'))
+end
+
+local function check_case(case, path, blocks)
+  for _,ty in ipairs({ 'f32', 's32', 's16' }) do
+    for _,planar in ipairs({ false, true }) do
+      local w = wav.drwav()
+      local read = w['read_pcm_frames_' .. ty]
+      local opts = { buffer = {}, planar = planar }
+      w:init(path)
+      steady(case,'read_pcm_frames_' .. ty .. (planar and '_planar' or ''),function()
+        local _, n = read(w,BLOCK,opts)
+        if n < BLOCK then w:seek_to_pcm_frame(0) end
+      end)
+      w:uninit()
+    end
+  end
+
+  local w = wav.drwav()
+  w:init(path)
+  local iter = w:frames(case.format.type,BLOCK)
+  steady(case,'frames',function()
+    if not iter() then w:seek_to_pcm_frame(0) end
+  end)
+  w:uninit()
+
+  local out = path .. '.out'
+  w = wav.drwav()
+  w:init_write(out, {
+    container = case.container.value,
+    format = case.format.format,
+    channels = case.channels,
+    sampleRate = 48000,
+    bitsPerSample = case.format.bitsPerSample,
+  })
+  local types = { case.format.type }
+  if types[1] ~= 'f32' then types[2] = 'f32' end
+  for _,ty in ipairs(types) do
+    steady(case,'write_pcm_frames_' .. ty,function()
+      w:write_pcm_frames(blocks[ty],ty)
+    end)
+  end
+  w:uninit()
+  os.remove(out)
+end
+
+-- with -c: IMA ADPCM from luawav's encoder, read back by dr_wav's decoder,
+-- has to stay above MIN_SNR dB. Each file ends partway through a block,
+-- and the sequential writers declare more frames than are written, so
+-- the last block and the padding after it are covered too.
+local MIN_SNR = 25
+
+local function snr(want, got, from, to)
+  local sig, err = 0, 0
+  for i=from,to do
+    local e = (got[i] or 0) - want[i]
+    sig = sig + want[i] * want[i]
+    err = err + e * e
+  end
+  if err == 0 then return math.huge end
+  return 10 * math.log(sig / err) / math.log(10)
+end
+
+-- writes frames of input as IMA ADPCM, to path or, with no path, through
+-- onWrite alone declaring twice as many frames, then reads it back as s16
+local function adpcm_round_trip(path, channels, blockAlign, input, frames)
+  local chunks = {}
+  local w = wav.drwav()
+  local ok = w:init_write(path or {
+    totalFrames = frames * 2,
+    onWrite = function(_, data)
+      chunks[#chunks + 1] = data
+      return #data
+    end,
+  }, {
+    container = wav.drwav_container_riff,
+    format = wav.DR_WAVE_FORMAT_DVI_ADPCM,
+    channels = channels,
+    sampleRate = 48000,
+    bitsPerSample = 4,
+    blockAlign = blockAlign,
+  })
+  if not ok then
+    error('unable to write IMA ADPCM')
+  end
+  w:write_pcm_frames(input,'s16')
+  w:uninit()
+
+  local r = wav.drwav()
+  if path then
+    r:init(path)
+  else
+    local data = table.concat(chunks)
+    local pos = 0
+    r:init({
+      onRead = function(_, n)
+        local s = data:sub(pos + 1,pos + n)
+        pos = pos + #s
+        return s
+      end,
+      onSeek = function(_, whence, offset)
+        if whence == 'set' then pos = offset else pos = pos + offset end
+        return pos >= 0 and pos <= #data
+      end,
+    })
+  end
+  local out, n = r:read_pcm_frames_s16(frames * 2)
+  r:uninit()
+  return out, n
+end
+
+local function check_adpcm(path, channels, blockAlign)
+  local frames = BLOCK + 700
+  local blocks = build_blocks(channels)
+  local input = {}
+  for i=1,frames * channels do
+    input[i] = blocks.s16[(i - 1) % (BLOCK * channels) + 1]
+  end
+
+  local out, n = adpcm_round_trip(path,channels,blockAlign,input,frames)
+  -- the encoder's step size starts small, skip the first frames while
+  -- it catches up with the signal
+  local db = snr(input,out,100 * channels + 1,frames * channels)
+  local ok = db >= MIN_SNR and n >= frames
+  if not ok then failures = failures + 1 end
+  io.stderr:write(string.format('ima_%dch_%-4s %-20s %6d frames %6.1f dB %s\n',
+    channels,blockAlign and tostring(blockAlign) or 'def',path and 'file' or 'sequential',
+    n,db,ok and 'ok' or 'FAIL'))
+  if path then os.remove(path) end
+end
+
+local function bench_int64()
+  local ops = 100000
+  record(nil,'uint64_arith','ops',function()
+    local a = wav.drwav_uint64(0)
+    local b = wav.drwav_uint64(4096)
+    local c = wav.drwav_uint64(3)
+    for _=1,ops do
+      a = a + b
+      a = a * c / c
+      if a < b then break end
+    end
+    return ops
+  end)
+  record(nil,'int64_arith','ops',function()
+    local a = wav.drwav_int64(0)
+    local b = wav.drwav_int64(-4096)
+    local c = wav.drwav_int64(3)
+    for _=1,ops do
+      a = a + b
+      a = a * c / c
+      if a > b then break end
+    end
+    return ops
+  end)
+end
+
+-- a small JSON encoder, enough for the results: tables with a positive
+-- length are arrays, keys are sorted so runs diff cleanly
+local function json(v, out)
+  local t = type(v)
+  if t == 'table' then
+    if #v > 0 then
+      out[#out + 1] = '['
+      for i=1,#v do
+        if i > 1 then out[#out + 1] = ',' end
+        json(v[i],out)
+      end
+      out[#out + 1] = ']'
+    else
+      local keys = {}
+      for k in pairs(v) do keys[#keys + 1] = k end
+      table.sort(keys)
+      out[#out + 1] = '{'
+      for i,k in ipairs(keys) do
+        if i > 1 then out[#out + 1] = ',' end
+        json(tostring(k),out)
+        out[#out + 1] = ':'
+        json(v[k],out)
+      end
+      out[#out + 1] = '}'
+    end
+  elseif t == 'string' then
+    out[#out + 1] = '"' .. v:gsub('[%c"\\]',function(c)
+      return string.format('\\u%04x',c:byte())
+    end) .. '"'
+  elseif t == 'number' then
+    if v ~= v or v == math.huge or v == -math.huge then
+      out[#out + 1] = 'null'
+    else
+      out[#out + 1] = string.format('%.17g',v)
+    end
+  elseif t == 'boolean' then
+    out[#out + 1] = tostring(v)
+  else
+    out[#out + 1] = 'null'
+  end
+  return out
+end
+
+local dir = os.tmpname()
+os.remove(dir)
+local blocksByChannels = {}
+
+if options.quality then
+  for _,channels in ipairs({ 1, 2 }) do
+    for _,blockAlign in ipairs({ false, 256 }) do
+      local path = dir .. '-ima.wav'
+      check_adpcm(path,channels,blockAlign or nil)
+      check_adpcm(nil,channels,blockAlign or nil)
+    end
+  end
+  if failures > 0 then
+    io.stderr:write(string.format('%d files below %d dB\n',failures,MIN_SNR))
+    os.exit(1)
+  end
+  os.exit(0)
+end
+
+if options.allocations then
+  -- the first call starts counting, so it has to come before any handles
+  -- are opened for their dr_wav allocations to be counted
+  wav.allocations()
+end
+
+for _,case in ipairs(build_cases()) do
+  if not options.filter or case.name:match(options.filter) then
+    local blocks = blocksByChannels[case.channels]
+    if not blocks then
+      blocks = build_blocks(case.channels)
+      blocksByChannels[case.channels] = blocks
+    end
+    local path = dir .. '-' .. case.name .. '.wav'
+    write_file(path,case,options.frames,blocks)
+    if options.allocations then
+      check_case(case,path,blocks)
+    else
+      bench_case(case,path,blocks)
+    end
+    os.remove(path)
+  end
+end
+
+if options.allocations then
+  if failures > 0 then
+    io.stderr:write(string.format('%d loops allocated\n',failures))
+    os.exit(1)
+  end
+  os.exit(0)
+end
+
+if not options.filter or ('int64'):match(options.filter) then
+  bench_int64()
+end
+
+local doc = {
+  luawav = wav._VERSION,
+  dr_wav = wav.drwav_version_string(),
+  lua = _VERSION,
+  simd = wav.simd,
+  date = os.date('!%Y-%m-%dT%H:%M:%SZ'),
+  frames = options.frames,
+  minTime = options.minTime,
+  results = results,
+}
+
+local text = table.concat(json(doc,{})) .. '\n'
+if options.output then
+  local f = assert(io.open(options.output,'wb'))
+  f:write(text)
+  f:close()
+else
+  io.write(text)
+end
@@ -1,22 +1,51 @@
 #include "luawav.h"
 #include "luawav_internal.h"
 #include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <float.h>
+#include <math.h>
 
 #include <stdio.h>
 
 #define F32_BUFFER 4096
 #define S32_BUFFER F32_BUFFER
 #define S16_BUFFER S32_BUFFER * 2
-#define WAV_MIN(a,b) ( (a) < (b) ? (a) : (b) )
+#define RAW_BUFFER F32_BUFFER
+/* samples read_summary reads raw at a time, once per handle */
+#define SUMMARY_BLOCK 65536
+#define THREADED_READ_FRAMES 65536 /* smallest ADPCM read spread over threads */
+#define REPLAY_FETCH 4096 /* least asked of onRead while a yieldable init is short */
+
+/* yieldable calls need the continuations from 5.3, older versions make
+ * plain calls */
+#if LUA_VERSION_NUM >= 503
+#define luawav_callk(L,na,nr,ctx,k) lua_callk((L),(na),(nr),(ctx),(k))
+#else
+typedef ptrdiff_t lua_KContext;
+typedef int (*lua_KFunction)(lua_State *L, int status, lua_KContext ctx);
+#define luawav_callk(L,na,nr,ctx,k) ((void)(ctx), (void)(k), lua_call((L),(na),(nr)))
+#endif
 
 LUAWAV_PRIVATE
 const char * const luawav_mt = "drwav";
 
 /* used on the read, seek, write callbacks */
 struct luawav_stream_userdata_s {
-    lua_State *L;
+    lua_State *L; /* the thread using the object, set on every call */
     int table_ref;
+    /* with yieldable = true, onRead is called ahead of dr_wav from a
+     * point that can yield, and dr_wav is served from this buffer */
+    int yieldable;
+    int replay; /* yieldable init: serve from the start of the buffer, never call onRead */
+    int starved; /* replay ran past the end of the buffer */
+    int eof; /* onRead returned nothing */
+    drwav_uint8 *buffer;
+    size_t size; /* bytes in the buffer */
+    size_t pos; /* bytes of it handed to dr_wav */
+    size_t alloc;
+    size_t shortfall; /* replay: bytes missing past the end */
 };
 
 typedef struct luawav_stream_userdata_s  luawav_stream_userdata;
@@ -29,19 +58,56 @@ struct luawav_chunk_userdata_s {
 
 typedef struct luawav_chunk_userdata_s  luawav_chunk_userdata;
 
+static const char * const luawav_frame_types[] = { "f32", "s32", "s16", NULL };
+
+static const char * const luawav_pinned_keys[] = { "planar", "channels", "buffer", NULL };
+
 struct luawav_userdata_s {
-    luawav_stream_userdata stream;
+    luawav_stream_userdata stream; /* first, so probes in the stream callbacks name the handle */
     luawav_chunk_userdata chunk;
     drwav wav;
     drwav_data_format format;
     float pcm_float[F32_BUFFER];
+    /* used when reading a subset of channels: frames as read from the
+     * file, and the samples picked out of them before conversion */
+    float pcm_raw[RAW_BUFFER];
+    float pcm_pick[RAW_BUFFER];
     drwav_int32 *pcm_int32;
     drwav_int16 *pcm_int16;
+    /* read_summary's block: SUMMARY_BLOCK samples as read, of up to 8
+     * bytes, then as many converted for reducing */
+    drwav_uint8 *block;
+    luawav_stats *stats;
+    /* requantization of float input for integer formats */
+    luawav_dither dither;
+    int writeType; /* sample type write_pcm_frames takes by default */
+    luawav_adpcm_writer *adpcm; /* set instead of wav when writing IMA ADPCM */
+    luawav_block_index seekIndex;
+    unsigned int threads; /* for decoding ADPCM in large reads */
+    luawav_counters counters; /* with instrument = true, kept after uninit */
+    luawav_follow follow; /* with follow = true */
+    luawav_flush flush; /* with flushInterval */
     int (*write)(lua_State *L, struct luawav_userdata_s *u);
 };
 
 typedef struct luawav_userdata_s luawav_userdata;
 
+/* the handle's counters, or NULL when it wasn't opened with
+ * instrument = true */
+static luawav_counters *
+luawav_instrumented(luawav_userdata *u) {
+    return u->counters.enabled ? &u->counters : NULL;
+}
+
+/* with follow = true, takes in frames written since the last look. the
+ * ADPCM seek index covers the old end of the data, so it's rebuilt */
+static int
+luawav_follow_check(luawav_userdata *u) {
+    if(u->follow.file == NULL || !luawav_follow_update(&u->follow,&u->wav)) return 0;
+    memset(&u->seekIndex,0,sizeof(luawav_block_index));
+    return 1;
+}
+
 struct luawav_const_s {
     const char *name;
     int value;
@@ -51,6 +117,88 @@ typedef struct luawav_const_s luawav_const;
 
 #define LUAWAV_CONST(x) { #x, x }
 
+/* pushes the channel tables of the planar samples table at idx,
+ * returns the stack index of the first one */
+static int
+luawav_push_channels(lua_State *L, int idx, unsigned int channels) {
+    unsigned int c = 0;
+    luaL_checkstack(L,channels,"too many channels");
+    for(c=0;c<channels;c++) {
+        lua_rawgeti(L,idx,c + 1);
+    }
+    return lua_gettop(L) - channels + 1;
+}
+
+/* stores the value on top of the stack as sample k (0-based, interleaved
+ * order), into the table at idx, or into the channel tables starting at
+ * base when planar */
+static void
+luawav_store_sample(lua_State *L, int idx, int base, drwav_uint64 k, unsigned int channels) {
+    if(base) {
+        lua_rawseti(L,base + (int)(k % channels),1 + (k / channels));
+    } else {
+        lua_rawseti(L,idx,1 + k);
+    }
+}
+
+/* checks the samples table given to write_pcm_frames and returns the
+ * number of samples in it. A table of tables is taken as planar input,
+ * one table per channel, in which case the channel tables are pushed
+ * and *base is set to the first one. */
+static drwav_uint64
+luawav_samples_to_write(lua_State *L, luawav_userdata *u, int *base) {
+    drwav_uint64 frames = 0;
+    unsigned int c = 0;
+    int planar = 0;
+
+    luaL_checktype(L,2,LUA_TTABLE);
+    lua_rawgeti(L,2,1);
+    planar = lua_istable(L,-1);
+    lua_pop(L,1);
+
+    *base = 0;
+    if(!planar) {
+        frames = lua_rawlen(L,2);
+        if(frames % u->format.channels != 0) {
+            luaL_error(L,"incomplete frame given");
+        }
+        return frames;
+    }
+
+    if(lua_rawlen(L,2) != u->format.channels) {
+        luaL_error(L,"expected %d channel tables",(int)u->format.channels);
+    }
+    *base = luawav_push_channels(L,2,u->format.channels);
+    frames = lua_rawlen(L,*base);
+    for(c=1;c<u->format.channels;c++) {
+        if(lua_rawlen(L,*base + c) != frames) {
+            luaL_error(L,"channel tables differ in length");
+        }
+    }
+    return frames * u->format.channels;
+}
+
+/* pushes sample k (0-based, interleaved order) of the samples table */
+static void
+luawav_fetch_sample(lua_State *L, int base, drwav_uint64 k, unsigned int channels) {
+    if(base) {
+        lua_rawgeti(L,base + (int)(k % channels),1 + (k / channels));
+    } else {
+        lua_rawgeti(L,2,1 + k);
+    }
+}
+
+/* n samples, or as many as an appended file has room for */
+static drwav_uint64
+luawav_write_limit(luawav_userdata *u, drwav_uint64 n) {
+    drwav_uint64 room = 0;
+
+    if(!u->flush.append) return n;
+    room = luawav_append_room(&u->flush,&u->wav);
+    if(room < n / u->format.channels) return room * u->format.channels;
+    return n;
+}
+
 static int
 luawav_write_pcm_frames_f32(lua_State *L,luawav_userdata *u) {
     drwav_uint64 samplesToWrite = 0;
@@ -58,17 +206,16 @@ luawav_write_pcm_frames_f32(lua_State *L,luawav_userdata *u) {
     drwav_uint64 t = 0;
     drwav_uint64 n = 0;
     drwav_uint64 i = 0;
+    int base = 0;
 
-    samplesToWrite = lua_rawlen(L,2);
-    if(samplesToWrite % u->wav.channels != 0) {
-        return luaL_error(L,"incomplete frame given");
-    }
+    samplesToWrite = luawav_samples_to_write(L,u,&base);
 
     while(r<samplesToWrite) {
-        n = WAV_MIN( samplesToWrite - r, F32_BUFFER );
+        n = luawav_write_limit(u,WAV_MIN( samplesToWrite - r, F32_BUFFER ));
+        if(n == 0) break;
         i = 0;
         while(i<n) {
-            lua_rawgeti(L,2,1 + i + r);
+            luawav_fetch_sample(L,base,i + r,u->wav.channels);
             u->pcm_float[i] = lua_tonumber(L,-1);
             lua_pop(L,1);
             i++;
@@ -78,7 +225,7 @@ luawav_write_pcm_frames_f32(lua_State *L,luawav_userdata *u) {
         r += n;
     }
 
-    luawav_pushuint64(L,r);
+    lua_pushinteger(L,(lua_Integer)r);
     return 1;
 }
 
@@ -89,17 +236,16 @@ luawav_write_pcm_frames_s32(lua_State *L,luawav_userdata *u) {
     drwav_uint64 t = 0;
     drwav_uint64 n = 0;
     drwav_uint64 i = 0;
+    int base = 0;
 
-    samplesToWrite = lua_rawlen(L,2);
-    if(samplesToWrite % u->wav.channels != 0) {
-        return luaL_error(L,"incomplete frame given");
-    }
+    samplesToWrite = luawav_samples_to_write(L,u,&base);
 
     while(r<samplesToWrite) {
-        n = WAV_MIN( samplesToWrite - r, S32_BUFFER );
+        n = luawav_write_limit(u,WAV_MIN( samplesToWrite - r, S32_BUFFER ));
+        if(n == 0) break;
         i = 0;
         while(i<n) {
-            lua_rawgeti(L,2,1 + i + r);
+            luawav_fetch_sample(L,base,i + r,u->wav.channels);
             u->pcm_int32[i] = lua_tointeger(L,-1);
             lua_pop(L,1);
             i++;
@@ -109,7 +255,7 @@ luawav_write_pcm_frames_s32(lua_State *L,luawav_userdata *u) {
         r += n;
     }
 
-    luawav_pushuint64(L,r);
+    lua_pushinteger(L,(lua_Integer)r);
     return 1;
 }
 
@@ -120,17 +266,16 @@ luawav_write_pcm_frames_s16(lua_State *L,luawav_userdata *u) {
     drwav_uint64 t = 0;
     drwav_uint64 n = 0;
     drwav_uint64 i = 0;
+    int base = 0;
 
-    samplesToWrite = lua_rawlen(L,2);
-    if(samplesToWrite % u->wav.channels != 0) {
-        return luaL_error(L,"incomplete frame given");
-    }
+    samplesToWrite = luawav_samples_to_write(L,u,&base);
 
     while(r<samplesToWrite) {
-        n = WAV_MIN( samplesToWrite - r, S16_BUFFER );
+        n = luawav_write_limit(u,WAV_MIN( samplesToWrite - r, S16_BUFFER ));
+        if(n == 0) break;
         i = 0;
         while(i<n) {
-            lua_rawgeti(L,2,1 + i + r);
+            luawav_fetch_sample(L,base,i + r,u->wav.channels);
             u->pcm_int16[i] = lua_tointeger(L,-1);
             lua_pop(L,1);
             i++;
@@ -140,11 +285,95 @@ luawav_write_pcm_frames_s16(lua_State *L,luawav_userdata *u) {
         r += n;
     }
 
-    luawav_pushuint64(L,r);
+    lua_pushinteger(L,(lua_Integer)r);
     return 1;
 }
 
-static void
+/* writes through the packers in luawav_pcm.c, for formats dr_wav can't
+ * convert to and for float input to integer formats. Integer input is
+ * full-scale s32 or s16; float input to an integer format is rounded to
+ * the output's bit depth with the dither chosen in init_write */
+static int
+luawav_write_pcm_frames_packed(lua_State *L,luawav_userdata *u, int type) {
+    drwav_uint64 samplesToWrite = 0;
+    drwav_uint64 r = 0;
+    drwav_uint64 n = 0;
+    drwav_uint64 i = 0;
+    drwav_uint64 chunk = 0;
+    size_t bytes = 0;
+    unsigned int sampleSize = u->format.bitsPerSample / 8;
+    drwav_uint16 formatTag = (drwav_uint16)u->format.format;
+    int isFloat = formatTag == DR_WAVE_FORMAT_IEEE_FLOAT;
+    int packed = 0;
+    int base = 0;
+    drwav_uint64 start = 0;
+    luawav_counters *counters = luawav_instrumented(u);
+
+    if(isFloat && type != LUAWAV_F32) {
+        return luaL_error(L,"sample type not supported for this format");
+    }
+
+    samplesToWrite = luawav_samples_to_write(L,u,&base);
+    /* pcm_pick holds the packed bytes, and shaping state is per
+     * channel, so blocks have to be whole frames that fit */
+    chunk = WAV_MIN(RAW_BUFFER, (RAW_BUFFER * sizeof(float)) / (sampleSize ? sampleSize : 1));
+    chunk = (chunk / u->format.channels) * u->format.channels;
+    if(chunk == 0) {
+        return luaL_error(L,"too many channels");
+    }
+
+    while(r<samplesToWrite) {
+        n = luawav_write_limit(u,WAV_MIN( samplesToWrite - r, chunk ));
+        if(n == 0) break;
+        i = 0;
+        while(i<n) {
+            luawav_fetch_sample(L,base,i + r,u->format.channels);
+            switch(type) {
+                case LUAWAV_F32: u->pcm_raw[i] = (float)lua_tonumber(L,-1); break;
+                case LUAWAV_S32: u->pcm_int32[i] = (drwav_int32)lua_tointeger(L,-1); break;
+                default: u->pcm_int32[i] = (drwav_int32)((drwav_uint32)(drwav_uint16)lua_tointeger(L,-1) << 16); break;
+            }
+            lua_pop(L,1);
+            i++;
+        }
+        if(counters != NULL) start = luawav_now_ns();
+        if(isFloat) {
+            luawav_pack_f32(u->pcm_pick,u->pcm_raw,(size_t)n,(drwav_uint16)u->format.bitsPerSample);
+        } else if(type == LUAWAV_F32) {
+            packed = luawav_quantize_pack_f32(u->pcm_pick,u->pcm_raw,(size_t)n,1.0,
+              formatTag,(drwav_uint16)u->format.bitsPerSample,&u->dither);
+            if(!packed) {
+                luawav_quantize_f32(u->pcm_int32,u->pcm_raw,(size_t)n,1.0,
+                  luawav_quantize_bits(formatTag,(drwav_uint16)u->format.bitsPerSample),&u->dither);
+            }
+        }
+
+        if(u->adpcm != NULL) {
+            if(counters != NULL) luawav_counter_add(&counters->convert,start,n);
+            if(!luawav_adpcm_write(u->adpcm,u->pcm_int32,(size_t)n)) break;
+        } else {
+            if(!isFloat && !packed) {
+                luawav_pack_s32(u->pcm_pick,u->pcm_int32,(size_t)n,formatTag,(drwav_uint16)u->format.bitsPerSample);
+            }
+            if(counters != NULL) luawav_counter_add(&counters->convert,start,n);
+            bytes = (size_t)(n * sampleSize);
+            if(drwav_write_raw(&u->wav,bytes,u->pcm_pick) != bytes) break;
+        }
+        r += n;
+    }
+
+    lua_pushinteger(L,(lua_Integer)r);
+    return 1;
+}
+
+/* the write function for formats without a direct path */
+static int
+luawav_write_pcm_frames_native(lua_State *L,luawav_userdata *u) {
+    return luawav_write_pcm_frames_packed(L,u,u->writeType);
+}
+
+LUAWAV_PRIVATE
+void
 luawav_push_fmt(lua_State *L, const drwav_fmt *fmt) {
     lua_newtable(L);
     lua_pushinteger(L,fmt->formatTag);
@@ -194,23 +423,108 @@ luawav_tofmt(lua_State *L, int idx, drwav_data_format *fmt) {
 
 }
 
+/* pushes the callback table, onRead, userData and the byte count, ready
+ * for a call with 2 arguments and 1 result */
+static void
+luawav_push_onread(lua_State *L, luawav_stream_userdata *u, size_t bytes) {
+    lua_rawgeti(L,LUA_REGISTRYINDEX,u->table_ref);
+    lua_getfield(L,-1,"onRead");
+    lua_getfield(L,-2,"userData");
+    lua_pushinteger(L,bytes);
+    LUAWAV_PROBE2(callback__entry,u,"onRead");
+}
+
+/* appends the string onRead returned to the buffer and pops it with the
+ * callback table. An empty string marks the end of the stream. */
+static void
+luawav_prefetch_add(lua_State *L, luawav_stream_userdata *u) {
+    const char *data = NULL;
+    size_t datalen = 0;
+    size_t alloc = 0;
+    drwav_uint8 *buffer = NULL;
+
+    data = lua_tolstring(L,-1,&datalen);
+    LUAWAV_PROBE3(callback__return,u,"onRead",datalen);
+    if(datalen == 0) {
+        u->eof = 1;
+        lua_pop(L,2);
+        return;
+    }
+
+    /* bytes dr_wav has had are only kept while init may replay them */
+    if(!u->replay && u->pos > 0) {
+        memmove(u->buffer,u->buffer + u->pos,u->size - u->pos);
+        u->size -= u->pos;
+        u->pos = 0;
+    }
+    if(u->size + datalen > u->alloc) {
+        alloc = u->alloc > 0 ? u->alloc : REPLAY_FETCH;
+        while(alloc < u->size + datalen) alloc *= 2;
+        buffer = (drwav_uint8 *)realloc(u->buffer,alloc);
+        if(buffer == NULL) {
+            luaL_error(L,"out of memory");
+            return;
+        }
+        u->buffer = buffer;
+        u->alloc = alloc;
+    }
+    memcpy(u->buffer + u->size,data,datalen);
+    u->size += datalen;
+    lua_pop(L,2);
+}
+
+/* forgets buffered bytes and the replay state, keeping the allocation */
+static void
+luawav_stream_reset(luawav_stream_userdata *u) {
+    u->yieldable = 0;
+    u->replay = 0;
+    u->starved = 0;
+    u->eof = 0;
+    u->size = 0;
+    u->pos = 0;
+    u->shortfall = 0;
+}
+
 static size_t luawav_read_proc(void *userdata, void *bufferout, size_t bytesToRead) {
     luawav_stream_userdata *u = (luawav_stream_userdata *)userdata;
     const char *data = 0;
     size_t datalen = 0;
+    size_t buffered = u->size - u->pos;
+
+    if(buffered > 0 || u->replay) {
+        buffered = WAV_MIN(buffered,bytesToRead);
+        if(buffered > 0) {
+            memcpy(bufferout,u->buffer + u->pos,buffered);
+            u->pos += buffered;
+        }
+        if(buffered == bytesToRead) return buffered;
+        if(u->replay) {
+            /* init runs again once onRead has been asked for more */
+            if(!u->eof) {
+                u->starved = 1;
+                u->shortfall = bytesToRead - buffered;
+            }
+            return buffered;
+        }
+        /* dr_wav wanted more than was prefetched */
+        bufferout = (drwav_uint8 *)bufferout + buffered;
+        bytesToRead -= buffered;
+    }
 
     lua_rawgeti(u->L,LUA_REGISTRYINDEX,u->table_ref);
     lua_getfield(u->L,-1,"onRead");
     lua_getfield(u->L,-2,"userData");
     lua_pushinteger(u->L,bytesToRead);
+    LUAWAV_PROBE2(callback__entry,u,"onRead");
     lua_call(u->L,2,1);
 
     data = lua_tolstring(u->L,-1,&datalen);
+    LUAWAV_PROBE3(callback__return,u,"onRead",datalen);
     if(datalen > 0) {
         memcpy(bufferout,data,datalen);
     }
     lua_pop(u->L,2);
-    return datalen;
+    return datalen + buffered;
 }
 
 static size_t luawav_write_proc(void *userdata, const void *bufferout, size_t bytesToWrite) {
@@ -221,9 +535,11 @@ static size_t luawav_write_proc(void *userdata, const void *bufferout, size_t by
     lua_getfield(u->L,-1,"onWrite");
     lua_getfield(u->L,-2,"userData");
     lua_pushlstring(u->L,bufferout,bytesToWrite);
+    LUAWAV_PROBE2(callback__entry,u,"onWrite");
     lua_call(u->L,2,1);
 
     written = lua_tointeger(u->L,-1);
+    LUAWAV_PROBE3(callback__return,u,"onWrite",written);
 
     lua_pop(u->L,2);
     return written;
@@ -232,6 +548,38 @@ static size_t luawav_write_proc(void *userdata, const void *bufferout, size_t by
 static drwav_bool32 luawav_seek_proc(void *userdata, int offset, drwav_seek_origin origin) {
     luawav_stream_userdata *u = (luawav_stream_userdata *)userdata;
     drwav_bool32 r = 0;
+    drwav_int64 target = 0;
+
+    if(u->replay) {
+        switch(origin) {
+            case DRWAV_SEEK_SET: target = offset; break;
+            case DRWAV_SEEK_CUR: target = (drwav_int64)u->pos + offset; break;
+            default: return 0;
+        }
+        if(target < 0) return 0;
+        if((drwav_uint64)target > u->size) {
+            if(!u->eof) {
+                u->starved = 1;
+                u->shortfall = (size_t)((drwav_uint64)target - u->size);
+            }
+            return 0;
+        }
+        u->pos = (size_t)target;
+        return 1;
+    }
+
+    if(u->size > u->pos) {
+        if(origin == DRWAV_SEEK_CUR && offset >= 0 && (size_t)offset <= u->size - u->pos) {
+            u->pos += offset;
+            return 1;
+        }
+        /* onSeek's idea of the current position is past the buffer */
+        if(origin == DRWAV_SEEK_CUR) offset -= (int)(u->size - u->pos);
+    }
+    u->size = 0;
+    u->pos = 0;
+    u->eof = 0;
+
     lua_rawgeti(u->L,LUA_REGISTRYINDEX, u->table_ref);
     lua_getfield(u->L,-1,"onSeek");
     lua_getfield(u->L,-2,"userData");
@@ -242,21 +590,30 @@ static drwav_bool32 luawav_seek_proc(void *userdata, int offset, drwav_seek_orig
         default: return 0;
     }
     lua_pushinteger(u->L,offset);
+    LUAWAV_PROBE2(callback__entry,u,"onSeek");
     lua_call(u->L,3,1);
     r = lua_toboolean(u->L,-1);
+    LUAWAV_PROBE3(callback__return,u,"onSeek",r);
     lua_pop(u->L,2);
     return r;
 }
 
 static drwav_bool32 luawav_tell_proc(void* userdata, drwav_int64* pCursor) {
     luawav_stream_userdata *u = (luawav_stream_userdata *)userdata;
+
+    if(u->replay) {
+        *pCursor = (drwav_int64)u->pos;
+        return 1;
+    }
     lua_rawgeti(u->L,LUA_REGISTRYINDEX, u->table_ref);
     lua_getfield(u->L,-1,"onSeek");
     lua_getfield(u->L,-2,"userData");
     lua_pushliteral(u->L, "cur");
     lua_pushinteger(u->L,0);
+    LUAWAV_PROBE2(callback__entry,u,"onSeek");
     lua_call(u->L,3,1);
-    *pCursor = (drwav_int64)lua_tointeger(u->L, -1);
+    *pCursor = (drwav_int64)lua_tointeger(u->L, -1) - (drwav_int64)(u->size - u->pos);
+    LUAWAV_PROBE3(callback__return,u,"onSeek",*pCursor);
     lua_pop(u->L,2);
     return 1;
 }
@@ -264,14 +621,26 @@ static drwav_bool32 luawav_tell_proc(void* userdata, drwav_int64* pCursor) {
 static drwav_uint64
 luawav_chunk_proc(void *chunkUserData, drwav_read_proc onRead, drwav_seek_proc onSeek, void *readSeekUserData, const drwav_chunk_header *pChunkHeader, drwav_container container, const drwav_fmt *fmt) {
     luawav_chunk_userdata *u = (luawav_chunk_userdata *)chunkUserData;
-    luawav_stream_userdata *s = (luawav_stream_userdata *)readSeekUserData;
+    luawav_stream_userdata *s = NULL;
     drwav_uint64 r = 0;
 
+    if(onRead == luawav_counted_read) {
+        onRead = ((luawav_counters *)readSeekUserData)->onRead;
+        readSeekUserData = ((luawav_counters *)readSeekUserData)->pUserData;
+    }
+
     lua_rawgeti(u->L,LUA_REGISTRYINDEX, u->table_ref);
     lua_getfield(u->L,-1,"onChunk");
     lua_getfield(u->L,-2,"chunkUserData");
 
-    lua_rawgeti(s->L,LUA_REGISTRYINDEX,s->table_ref);
+    /* only streams have a callback table, files opened by name pass their
+     * FILE * here */
+    if(onRead == luawav_read_proc) {
+        s = (luawav_stream_userdata *)readSeekUserData;
+        lua_rawgeti(u->L,LUA_REGISTRYINDEX,s->table_ref);
+    } else {
+        lua_pushnil(u->L);
+    }
 
     lua_newtable(u->L); /* chunk_header */
 
@@ -291,11 +660,13 @@ luawav_chunk_proc(void *chunkUserData, drwav_read_proc onRead, drwav_seek_proc o
 
     luawav_push_fmt(u->L,fmt);
 
+    /* probes name the handle, the chunk userdata is part of it */
+    LUAWAV_PROBE2(callback__entry,(char *)u - offsetof(luawav_userdata,chunk),"onChunk");
     lua_call(u->L,4,1);
     r = luawav_touint64(u->L,-1);
+    LUAWAV_PROBE3(callback__return,(char *)u - offsetof(luawav_userdata,chunk),"onChunk",r);
     lua_pop(u->L,2);
 
-    (void)onRead;
     (void)onSeek;
 
     return r;
@@ -319,6 +690,25 @@ copydown(lua_State *L, const char *tablename) {
     lua_pop(L,1);
 }
 
+/* points the callbacks at the thread making the call, the object may be
+ * used from a different coroutine than the one that opened it */
+static void
+luawav_set_thread(luawav_userdata *u, lua_State *L) {
+    u->stream.L = L;
+    u->chunk.L = L;
+}
+
+/* the decoder behind a drwav object opened for reading, or NULL */
+LUAWAV_PRIVATE
+drwav *
+luawav_todrwav(lua_State *L, int idx) {
+    luawav_userdata *u = NULL;
+    u = luaL_testudata(L,idx,luawav_mt);
+    if(u == NULL || u->wav.onRead == NULL || u->write != NULL) return NULL;
+    luawav_set_thread(u,L);
+    return &u->wav;
+}
+
 static int
 luawav_drwav(lua_State *L) {
     luawav_userdata *u = NULL;
@@ -328,15 +718,26 @@ luawav_drwav(lua_State *L) {
     }
     luaL_setmetatable(L,luawav_mt);
 
-    u->stream.L = NULL;
+    memset(&u->stream,0,sizeof(luawav_stream_userdata));
     u->chunk.L = NULL;
 
     u->stream.table_ref = LUA_NOREF;
     u->chunk.table_ref = LUA_NOREF;
 
+    memset(&u->wav,0,sizeof(drwav));
     memset(u->pcm_float,0,sizeof(float) * F32_BUFFER);
     u->pcm_int32 = (drwav_int32 *)u->pcm_float;
     u->pcm_int16 = (drwav_int16 *)u->pcm_float;
+    u->block = NULL;
+    u->stats = NULL;
+    memset(&u->dither,0,sizeof(luawav_dither));
+    u->adpcm = NULL;
+    memset(&u->seekIndex,0,sizeof(luawav_block_index));
+    u->threads = 1;
+    memset(&u->counters,0,sizeof(luawav_counters));
+    memset(&u->follow,0,sizeof(luawav_follow));
+    u->follow.notify = -1;
+    memset(&u->flush,0,sizeof(luawav_flush));
     u->write = NULL;
 
     return 1;
@@ -346,13 +747,41 @@ static int
 luawav_uninit(lua_State *L) {
     luawav_userdata *u = NULL;
     u = luaL_checkudata(L,1,luawav_mt);
+    luawav_set_thread(u,L);
 
     drwav_uninit(&u->wav);
+    if(u->flush.append) {
+        luawav_append_finish(&u->flush,&u->wav);
+        u->flush.append = 0;
+    }
+    /* uninit may run again from __gc */
+    memset(&u->wav,0,sizeof(drwav));
+    memset(&u->seekIndex,0,sizeof(luawav_block_index));
+
+    if(u->stats != NULL) {
+        luawav_stats_free(u->stats);
+        u->stats = NULL;
+    }
+    luawav_dither_free(&u->dither);
+    if(u->adpcm != NULL) {
+        luawav_adpcm_writer_close(u->adpcm);
+        u->adpcm = NULL;
+    }
+    luawav_counters_close(&u->counters);
+    luawav_follow_close(&u->follow);
+    /* after the writer, which patches the header through it */
+    luawav_flush_close(&u->flush);
 
     if(u->stream.table_ref != LUA_NOREF) {
         luaL_unref(L,LUA_REGISTRYINDEX,u->stream.table_ref);
         u->stream.table_ref = LUA_NOREF;
     }
+    luawav_stream_reset(&u->stream);
+    free(u->stream.buffer);
+    u->stream.buffer = NULL;
+    u->stream.alloc = 0;
+    free(u->block);
+    u->block = NULL;
 
     if(u->chunk.table_ref != LUA_NOREF) {
         luaL_unref(L,LUA_REGISTRYINDEX,u->chunk.table_ref);
@@ -362,14 +791,85 @@ luawav_uninit(lua_State *L) {
     return 0;
 }
 
+/* IMA ADPCM goes through luawav's own encoder, dr_wav can't write it */
+static int
+luawav_init_write_adpcm(lua_State *L, luawav_userdata *u, const char *filename, int seq, drwav_uint64 total, drwav_write_proc onWrite, drwav_seek_proc onSeek, void *pUserData) {
+    const char *err = NULL;
+    drwav_uint32 blockAlign = 0;
+
+    if(luawav_opt_isset(L,3,"blockAlign")) {
+        lua_getfield(L,3,"blockAlign");
+        blockAlign = (drwav_uint32)luaL_checkinteger(L,-1);
+        lua_pop(L,1);
+    }
+    if(seq == 1) {
+        total /= u->format.channels;
+    }
+
+    u->adpcm = luawav_adpcm_writer_new(filename,
+      onWrite,
+      seq == 0 ? onSeek : NULL,
+      pUserData,
+      &u->format,
+      blockAlign,
+      seq == 0 ? 0 : total,
+      &err);
+    LUAWAV_PROBE2(init_write__done,u,u->adpcm != NULL);
+    if(u->adpcm == NULL) {
+        luawav_counters_close(&u->counters);
+        luawav_flush_close(&u->flush);
+        lua_pushboolean(L,0);
+        lua_pushstring(L,err);
+        return 2;
+    }
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* flushInterval is a number of frames, or a string of seconds like "2.5s" */
+static drwav_uint64
+luawav_opt_flush_interval(lua_State *L, int idx, drwav_uint32 sampleRate) {
+    drwav_uint64 frames = 0;
+    const char *s = NULL;
+    char *end = NULL;
+    double seconds = 0.0;
+
+    if(!luawav_opt_isset(L,idx,"flushInterval")) return 0;
+    lua_getfield(L,idx,"flushInterval");
+    if(lua_type(L,-1) == LUA_TSTRING) {
+        s = lua_tostring(L,-1);
+        seconds = strtod(s,&end);
+        if(end == s || strcmp(end,"s") != 0 || !(seconds > 0.0)) {
+            return luaL_error(L,"invalid flushInterval");
+        }
+        frames = (drwav_uint64)(seconds * sampleRate);
+        if(frames == 0) frames = 1;
+    } else {
+        frames = luawav_touint64(L,-1);
+        if(frames == 0) {
+            return luaL_error(L,"invalid flushInterval");
+        }
+    }
+    lua_pop(L,1);
+    return frames;
+}
+
 static int
 luawav_init_write(lua_State *L) {
     luawav_userdata *u = NULL;
     const char *filename = NULL;
     int seq = 0;
     drwav_uint64 totalSamples = 0;
+    drwav_write_proc onWrite = luawav_write_proc;
+    drwav_seek_proc onSeek = luawav_seek_proc;
+    void *pUserData = NULL;
+    drwav_bool32 r = 0;
+    int append = 0;
+    const char *err = NULL;
+    drwav_allocation_callbacks cb;
 
     u = luaL_checkudata(L,1,luawav_mt);
+    pUserData = &u->stream;
 
     if(lua_isstring(L,2)) {
         filename = lua_tostring(L,2);
@@ -383,20 +883,46 @@ luawav_init_write(lua_State *L) {
     luawav_tofmt(L,3,&u->format);
 
     u->write = NULL;
+    u->writeType = LUAWAV_S16;
     if(u->format.format == DR_WAVE_FORMAT_IEEE_FLOAT) {
-        u->write = luawav_write_pcm_frames_f32;
+        u->writeType = LUAWAV_F32;
+        if(u->format.bitsPerSample == 32) {
+            u->write = luawav_write_pcm_frames_f32;
+        } else if(u->format.bitsPerSample == 64) {
+            u->write = luawav_write_pcm_frames_native;
+        }
     } else if(u->format.format == DR_WAVE_FORMAT_PCM) {
         if(u->format.bitsPerSample == 32) {
+            u->writeType = LUAWAV_S32;
             u->write = luawav_write_pcm_frames_s32;
+        } else if(u->format.bitsPerSample == 24) {
+            u->writeType = LUAWAV_S32;
+            u->write = luawav_write_pcm_frames_native;
         } else if(u->format.bitsPerSample == 16) {
             u->write = luawav_write_pcm_frames_s16;
+        } else if(u->format.bitsPerSample == 8) {
+            u->write = luawav_write_pcm_frames_native;
         }
+    } else if(u->format.format == DR_WAVE_FORMAT_ALAW || u->format.format == DR_WAVE_FORMAT_MULAW) {
+        if(u->format.bitsPerSample == 8) {
+            u->write = luawav_write_pcm_frames_native;
+        }
+    } else if(u->format.format == DR_WAVE_FORMAT_DVI_ADPCM) {
+        u->format.bitsPerSample = 4;
+        u->write = luawav_write_pcm_frames_native;
     }
 
     if(u->write == NULL) {
         return luaL_error(L,"format not supported");
     }
 
+    luawav_dither_free(&u->dither);
+    if(!luawav_dither_init(&u->dither,luawav_opt_enum(L,3,"dither",luawav_dither_modes),u->format.channels)) {
+        return luaL_error(L,"out of memory");
+    }
+    luawav_counters_reset(&u->counters,luawav_opt_boolean(L,3,"instrument"));
+    luawav_flush_reset(&u->flush,luawav_opt_flush_interval(L,3,u->format.sampleRate),luawav_opt_boolean(L,3,"flushSync"));
+
     if(lua_istable(L,2)) {
         lua_getfield(L,2,"filename");
         if(!lua_isnil(L,-1)) {
@@ -417,13 +943,36 @@ luawav_init_write(lua_State *L) {
             totalSamples = luawav_touint64(L,-1);
         }
         lua_pop(L,1);
+
+        append = luawav_opt_boolean(L,2,"append");
+    }
+    if(append) {
+        if(filename == NULL) {
+            return luaL_error(L,"append needs a filename");
+        }
+        if(seq != 0) {
+            return luaL_error(L,"append can't be used with totalSamples or totalFrames");
+        }
+        if(u->format.format == DR_WAVE_FORMAT_DVI_ADPCM) {
+            return luaL_error(L,"can't append to IMA ADPCM");
+        }
+    }
+    if(u->flush.interval > 0) {
+        if(filename == NULL) {
+            return luaL_error(L,"flushInterval needs a filename");
+        }
+        if(seq != 0) {
+            return luaL_error(L,"flushInterval can't be used with totalSamples or totalFrames");
+        }
     }
+    LUAWAV_PROBE2(init_write__start,u,filename);
 
     if(filename == NULL) {
         u->stream.L = L;
         if(u->stream.table_ref != LUA_NOREF) {
             luaL_unref(L,LUA_REGISTRYINDEX,u->stream.table_ref);
         }
+        luawav_stream_reset(&u->stream);
         lua_newtable(L);
 
         if(seq== 0) {
@@ -445,60 +994,124 @@ luawav_init_write(lua_State *L) {
 
         u->stream.table_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
+        if(u->counters.enabled) {
+            luawav_counters_wrap(&u->counters,NULL,onWrite,onSeek,NULL,pUserData);
+        }
+    } else if(append || u->flush.interval > 0) {
+        /* opened here so the header can be written through the descriptor,
+         * or read when appending */
+        if(!luawav_flush_open(&u->flush,filename,append ? "r+b" : "wb")) {
+            LUAWAV_PROBE2(init_write__done,u,0);
+            lua_pushboolean(L,0);
+            return 1;
+        }
+        if(append && !luawav_append_open(&u->flush,&u->format,luawav_allocation_callbacks(L,&cb),&err)) {
+            LUAWAV_PROBE2(init_write__done,u,0);
+            luawav_flush_close(&u->flush);
+            lua_pushboolean(L,0);
+            lua_pushstring(L,err);
+            return 2;
+        }
+        onWrite = luawav_stdio_write;
+        onSeek = luawav_stdio_seek;
+        pUserData = u->flush.file;
+        if(u->counters.enabled) {
+            luawav_counters_wrap(&u->counters,NULL,onWrite,onSeek,NULL,pUserData);
+        }
+        filename = NULL;
+    } else if(u->counters.enabled) {
+        /* opened here so the stdio calls can be counted */
+        if(!luawav_counters_open(&u->counters,filename,"wb")) {
+            LUAWAV_PROBE2(init_write__done,u,0);
+            lua_pushboolean(L,0);
+            return 1;
+        }
+        filename = NULL;
+    }
+
+    if(u->counters.enabled) {
+        onWrite = luawav_counted_write;
+        onSeek = luawav_counted_seek;
+        pUserData = &u->counters;
+    }
+
+    if(u->format.format == DR_WAVE_FORMAT_DVI_ADPCM) {
+        return luawav_init_write_adpcm(L,u,filename,seq,totalSamples,onWrite,onSeek,pUserData);
+    }
+
+    if(filename == NULL) {
         if(seq == 0) {
-            lua_pushboolean(L,drwav_init_write(&u->wav,
+            r = drwav_init_write(&u->wav,
                 &u->format,
-                luawav_write_proc,
-                luawav_seek_proc,
-                &u->stream,
-                NULL));
+                append ? luawav_append_discard : onWrite,
+                onSeek,
+                pUserData,
+                luawav_allocation_callbacks(L,&cb));
+            if(r && append) luawav_append_start(&u->flush,&u->wav,onWrite);
         } else if(seq == 1) {
-            lua_pushboolean(L,drwav_init_write_sequential(&u->wav,
+            r = drwav_init_write_sequential(&u->wav,
                 &u->format,
                 totalSamples,
-                luawav_write_proc,
-                &u->stream,
-                NULL));
+                onWrite,
+                pUserData,
+                luawav_allocation_callbacks(L,&cb));
         } else if(seq == 2) {
-            lua_pushboolean(L,drwav_init_write_sequential_pcm_frames(&u->wav,
+            r = drwav_init_write_sequential_pcm_frames(&u->wav,
                 &u->format,
                 totalSamples,
-                luawav_write_proc,
-                &u->stream,
-                NULL));
+                onWrite,
+                pUserData,
+                luawav_allocation_callbacks(L,&cb));
         }
     }
     else {
         if(seq == 0) {
-            lua_pushboolean(L,drwav_init_file_write(&u->wav,
+            r = drwav_init_file_write(&u->wav,
               filename,
               &u->format,
-              NULL));
+              luawav_allocation_callbacks(L,&cb));
         }
         else if(seq == 1) {
-            lua_pushboolean(L,drwav_init_file_write_sequential(&u->wav,
+            r = drwav_init_file_write_sequential(&u->wav,
               filename,
               &u->format,
               totalSamples,
-              NULL));
+              luawav_allocation_callbacks(L,&cb));
         }
         else if(seq == 2) {
-            lua_pushboolean(L,drwav_init_file_write_sequential_pcm_frames(&u->wav,
+            r = drwav_init_file_write_sequential_pcm_frames(&u->wav,
               filename,
               &u->format,
               totalSamples,
-              NULL));
+              luawav_allocation_callbacks(L,&cb));
         }
     }
 
+    LUAWAV_PROBE2(init_write__done,u,r);
+    if(!r) {
+        luawav_counters_close(&u->counters);
+        luawav_flush_close(&u->flush);
+    }
+    lua_pushboolean(L,r);
     return 1;
 }
 
+/* the threads option, how many threads ADPCM is decoded on */
+static unsigned int
+luawav_opt_threads(lua_State *L, int idx) {
+    double n = luawav_opt_number(L,idx,"threads",1.0);
+    if(n < 1.0) {
+        luaL_error(L,"threads must be a positive integer");
+    }
+    return n > 64.0 ? 64 : (unsigned int)n;
+}
+
 /* can be called as
  * wav:init(filename) or
  * wav:init({
  *   filename = filename,
- *   onChunk = onChunk
+ *   onChunk = onChunk,
+ *   follow = true
  * }) or
  * wav:init({
  *   onRead = onRead,
@@ -513,6 +1126,8 @@ luawav_init_file(lua_State *L, luawav_userdata *u, const char *filename) {
     drwav_uint32 flags = 0;
     drwav_chunk_proc onChunk = NULL;
     void *pChunkUserData = NULL;
+    drwav_allocation_callbacks cb;
+    drwav_bool32 r = DRWAV_FALSE;
 
     if(lua_istable(L,2)) {
         lua_getfield(L,2,"onChunk");
@@ -536,30 +1151,57 @@ luawav_init_file(lua_State *L, luawav_userdata *u, const char *filename) {
         lua_pop(L,1);
     }
 
-    return drwav_init_file_ex(&u->wav,filename,onChunk, pChunkUserData, flags, NULL);
+    if(u->follow.enabled) {
+        /* opened here so the file can be watched and stat'ed as it grows */
+        if(!luawav_follow_open(&u->follow,filename)) return 0;
+        luawav_counters_wrap(&u->counters,luawav_stdio_read,NULL,luawav_stdio_seek,luawav_stdio_tell,u->follow.file);
+        r = drwav_init_ex(&u->wav,
+          u->counters.enabled ? luawav_counted_read : luawav_stdio_read,
+          u->counters.enabled ? luawav_counted_seek : luawav_stdio_seek,
+          u->counters.enabled ? luawav_counted_tell : luawav_stdio_tell,
+          onChunk,
+          u->counters.enabled ? (void *)&u->counters : (void *)u->follow.file,
+          pChunkUserData,
+          flags,
+          luawav_allocation_callbacks(L,&cb));
+        if(r) luawav_follow_start(&u->follow,&u->wav);
+        return r;
+    }
+
+    if(u->counters.enabled) {
+        /* opened here so the stdio calls can be counted */
+        if(!luawav_counters_open(&u->counters,filename,"rb")) return 0;
+        return drwav_init_ex(&u->wav,
+          luawav_counted_read,
+          luawav_counted_seek,
+          luawav_counted_tell,
+          onChunk,
+          &u->counters,
+          pChunkUserData,
+          flags,
+          luawav_allocation_callbacks(L,&cb));
+    }
+
+    return drwav_init_file_ex(&u->wav,filename,onChunk, pChunkUserData, flags, luawav_allocation_callbacks(L,&cb));
 }
 
-static int
+/* keeps the callback table and sets up the stream state, the stream is
+ * opened by luawav_init_stream_open or luawav_init_replay */
+static void
 luawav_init_stream(lua_State *L, luawav_userdata *u) {
-    drwav_uint32 flags = 0;
-    drwav_read_proc onRead = luawav_read_proc;
-    drwav_seek_proc onSeek = luawav_seek_proc;
-    drwav_tell_proc onTell = luawav_tell_proc;
-    drwav_chunk_proc onChunk = NULL;
-    void *pUserData = NULL;
-    void *pChunkUserData = NULL;
-
     lua_newtable(L);
 
     lua_getfield(L,2,"onRead");
     if(lua_isnil(L,-1)) {
-        return luaL_error(L,"missing required onRead function");
+        luaL_error(L,"missing required onRead function");
+        return;
     }
     lua_setfield(L,-2,"onRead");
 
     lua_getfield(L,2,"onSeek");
     if(lua_isnil(L,-1)) {
-        return luaL_error(L,"missing required onSeek function");
+        luaL_error(L,"missing required onSeek function");
+        return;
     }
     lua_setfield(L,-2,"onSeek");
 
@@ -567,13 +1209,7 @@ luawav_init_stream(lua_State *L, luawav_userdata *u) {
     lua_setfield(L,-2,"userData");
 
     u->stream.table_ref = luaL_ref(L,LUA_REGISTRYINDEX);
-    pUserData = &u->stream;
-
-    lua_getfield(L,2,"flags");
-    if(lua_isnumber(L,-1)) {
-        flags = lua_tointeger(L,-1);
-    }
-    lua_pop(L,1);
+    u->stream.yieldable = luawav_opt_boolean(L,2,"yieldable");
 
     lua_getfield(L,2,"onChunk");
     if(!lua_isnil(L,-1)) {
@@ -583,12 +1219,44 @@ luawav_init_stream(lua_State *L, luawav_userdata *u) {
         lua_getfield(L,2,"chunkUserData");
         lua_setfield(L,-2,"chunkUserData");
         u->chunk.table_ref = luaL_ref(L,LUA_REGISTRYINDEX);
-        onChunk = luawav_chunk_proc;
-        pChunkUserData = &u->chunk;
     } else {
         lua_pop(L,1);
     }
 
+    if(u->counters.enabled) {
+        luawav_counters_wrap(&u->counters,luawav_read_proc,NULL,luawav_seek_proc,luawav_tell_proc,&u->stream);
+    }
+}
+
+static int
+luawav_init_stream_open(lua_State *L, luawav_userdata *u) {
+    drwav_uint32 flags = 0;
+    drwav_read_proc onRead = luawav_read_proc;
+    drwav_seek_proc onSeek = luawav_seek_proc;
+    drwav_tell_proc onTell = luawav_tell_proc;
+    drwav_chunk_proc onChunk = NULL;
+    void *pUserData = &u->stream;
+    void *pChunkUserData = NULL;
+    drwav_allocation_callbacks cb;
+
+    lua_getfield(L,2,"flags");
+    if(lua_isnumber(L,-1)) {
+        flags = lua_tointeger(L,-1);
+    }
+    lua_pop(L,1);
+
+    if(u->chunk.table_ref != LUA_NOREF) {
+        onChunk = luawav_chunk_proc;
+        pChunkUserData = &u->chunk;
+    }
+
+    if(u->counters.enabled) {
+        onRead = luawav_counted_read;
+        onSeek = luawav_counted_seek;
+        onTell = luawav_counted_tell;
+        pUserData = &u->counters;
+    }
+
     return drwav_init_ex(&u->wav,
       onRead,
       onSeek,
@@ -597,8 +1265,66 @@ luawav_init_stream(lua_State *L, luawav_userdata *u) {
       pUserData,
       pChunkUserData,
       flags,
-      NULL);
+      luawav_allocation_callbacks(L,&cb));
+
+}
+
+/* finishes wav:init() once dr_wav has been through the header */
+static int
+luawav_init_done(lua_State *L, luawav_userdata *u, int r) {
+    if(r && luawav_opt_boolean(L,2,"stats")) {
+        u->stats = luawav_stats_new(&u->wav);
+        if(u->stats == NULL) {
+            return luaL_error(L,"out of memory");
+        }
+    }
+    LUAWAV_PROBE2(init__done,u,r);
+
+    if(!r) {
+        /* dr_wav leaves its callbacks set when init fails */
+        memset(&u->wav,0,sizeof(drwav));
+        luawav_counters_close(&u->counters);
+        luawav_follow_close(&u->follow);
+        lua_pushboolean(L,0);
+    } else {
+        luawav_push_fmt(L,&u->wav.fmt);
+    }
+    return 1;
+}
+
+static int luawav_init_replay(lua_State *L, luawav_userdata *u);
 
+static int
+luawav_init_k(lua_State *L, int status, lua_KContext ctx) {
+    luawav_userdata *u = (luawav_userdata *)lua_touserdata(L,1);
+    (void)status;
+    (void)ctx;
+    luawav_prefetch_add(L,&u->stream);
+    return luawav_init_replay(L,u);
+}
+
+/* opens a yieldable stream. dr_wav can't stop partway through a header, so
+ * it parses whatever has been buffered from the start of the stream; when
+ * that runs out, onRead is called from here, where it can yield, and the
+ * parse starts over with the bytes it returned added on */
+static int
+luawav_init_replay(lua_State *L, luawav_userdata *u) {
+    int r = 0;
+
+    for(;;) {
+        u->stream.replay = 1;
+        u->stream.starved = 0;
+        u->stream.pos = 0;
+        r = luawav_init_stream_open(L,u);
+        if(r || !u->stream.starved) break;
+
+        luawav_push_onread(L,&u->stream,WAV_MAX(u->stream.shortfall,REPLAY_FETCH));
+        luawav_callk(L,2,1,0,luawav_init_k);
+        luawav_prefetch_add(L,&u->stream);
+    }
+    u->stream.replay = 0;
+    u->stream.starved = 0;
+    return luawav_init_done(L,u,r);
 }
 
 static int
@@ -617,128 +1343,1129 @@ luawav_init(lua_State *L) {
         luaL_unref(L,LUA_REGISTRYINDEX,u->chunk.table_ref);
         u->chunk.table_ref = LUA_NOREF;
     }
-    u->stream.L = L;
-    u->chunk.L = L;
+    luawav_set_thread(u,L);
+    luawav_stream_reset(&u->stream);
+
+    if(u->stats != NULL) {
+        luawav_stats_free(u->stats);
+        u->stats = NULL;
+    }
+    memset(&u->seekIndex,0,sizeof(luawav_block_index));
+    u->threads = luawav_opt_threads(L,2);
+    luawav_counters_reset(&u->counters,luawav_opt_boolean(L,2,"instrument"));
+    luawav_follow_close(&u->follow);
+    u->follow.enabled = luawav_opt_boolean(L,2,"follow");
 
     if(lua_isstring(L,2)) {
         filename = lua_tostring(L,2);
+        LUAWAV_PROBE2(init__start,u,filename);
         r = luawav_init_file(L,u,filename);
     } else if(lua_istable(L,2)) {
         lua_getfield(L,2,"filename");
-        if(!lua_isnil(L,-1)) {
-            filename = lua_tostring(L,-1);
-            lua_pop(L,1);
+        filename = lua_tostring(L,-1);
+        lua_pop(L,1);
+        LUAWAV_PROBE2(init__start,u,filename);
+        if(filename != NULL) {
             r = luawav_init_file(L,u,filename);
+        } else {
+            if(u->follow.enabled) {
+                return luaL_error(L,"follow needs a filename");
+            }
+            luawav_init_stream(L,u);
+            /* a replayed header would call onChunk again each time, so
+             * one with onChunk is read with plain calls */
+            if(u->stream.yieldable && u->chunk.table_ref == LUA_NOREF) {
+                return luawav_init_replay(L,u);
+            }
+            r = luawav_init_stream_open(L,u);
         }
-        lua_pop(L,1);
-        r = luawav_init_stream(L,u);
     } else {
         return luaL_error(L,"invalid parameters");
     }
 
-    if(!r) {
-        lua_pushboolean(L,0);
-    } else {
-        luawav_push_fmt(L,&u->wav.fmt);
+    return luawav_init_done(L,u,r);
+}
+
+
+/* indexed by the LUAWAV_F32, LUAWAV_S32, LUAWAV_S16 sample types */
+
+/* how samples are laid out in the tables handed back to Lua */
+typedef struct luawav_layout_s {
+    int planar;
+    unsigned int channels; /* output channels */
+    const drwav_uint16 *select; /* file channel of each output channel, or NULL for all */
+} luawav_layout;
+
+/* reads the channels option from the options table at idx, pushes it as an
+ * array of 0-based channel indexes in a userdata (or nil) and returns the
+ * number of channels selected */
+static unsigned int
+luawav_check_select(lua_State *L, int idx) {
+    drwav_uint16 *sel = NULL;
+    unsigned int count = 0;
+    unsigned int j = 0;
+    lua_Integer c = 0;
+
+    if(!luawav_opt_isset(L,idx,"channels")) {
+        lua_pushnil(L);
+        return 0;
+    }
+
+    lua_getfield(L,idx,"channels");
+    if(!lua_istable(L,-1)) {
+        luaL_error(L,"channels must be a table");
+    }
+    count = lua_rawlen(L,-1);
+    if(count == 0) {
+        luaL_error(L,"channels must not be empty");
+    }
+
+    sel = (drwav_uint16 *)lua_newuserdata(L,sizeof(drwav_uint16) * count);
+    for(j=0;j<count;j++) {
+        lua_rawgeti(L,-2,j + 1);
+        c = lua_tointeger(L,-1);
+        lua_pop(L,1);
+        if(c < 1 || c > 65535) {
+            luaL_error(L,"invalid channel %d",(int)c);
+        }
+        sel[j] = (drwav_uint16)(c - 1);
+    }
+    lua_remove(L,-2);
+    return count;
+}
+
+static int
+luawav_select_valid(const drwav_uint16 *sel, unsigned int count, unsigned int channels) {
+    unsigned int j = 0;
+    for(j=0;j<count;j++) {
+        if(sel[j] >= channels) return 0;
     }
     return 1;
+}
 
+/* sets up a layout from the options table at idx, leaving the channel
+ * selection (or nil) on the stack; it has to stay there while the
+ * layout is in use */
+static void
+luawav_check_layout(lua_State *L, int idx, unsigned int channels, luawav_layout *l) {
+    unsigned int count = 0;
+
+    l->planar = luawav_opt_boolean(L,idx,"planar");
+    l->channels = channels;
+    l->select = NULL;
+
+    count = luawav_check_select(L,idx);
+    if(count) {
+        l->select = (const drwav_uint16 *)lua_touserdata(L,-1);
+        if(!luawav_select_valid(l->select,count,channels)) {
+            luaL_error(L,"channel out of range, file has %d channels",(int)channels);
+        }
+        l->channels = count;
+    }
 }
 
+/* reads frames raw and converts them with a kernel from
+ * luawav_convert_kernel, a stack buffer at a time like dr_wav does. With
+ * stats the statistics are taken from the raw frames, for a kernel from
+ * luawav_stats_kernel. */
+LUAWAV_PRIVATE
+drwav_uint64
+luawav_read_converted(drwav *wav, drwav_uint64 frames, void *out, int type, luawav_convert_func kernel, luawav_counters *counters, luawav_stats *stats) {
+    union { drwav_uint8 b[CONVERT_STAGING]; drwav_uint64 align; } raw;
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    size_t frameSize = (size_t)wav->channels * (wav->bitsPerSample / 8);
+    size_t outSize = (size_t)wav->channels * (type == LUAWAV_S16 ? sizeof(drwav_int16) : sizeof(drwav_int32));
+    drwav_uint64 done = 0;
+    drwav_uint64 want = 0;
+    drwav_uint64 t = 0;
+    drwav_uint64 start = 0;
+
+    while(done < frames) {
+        want = WAV_MIN(frames - done,CONVERT_STAGING / frameSize);
+        t = drwav_read_pcm_frames_le(wav,want,raw.b);
+        if(stats != NULL) luawav_stats_update_raw(stats,wav,raw.b,t);
+        if(counters != NULL) start = luawav_now_ns();
+        kernel(o,raw.b,(size_t)(t * wav->channels));
+        if(counters != NULL) luawav_counter_add(&counters->convert,start,t * wav->channels);
+        o += t * outSize;
+        done += t;
+        if(t != want) break;
+    }
+    return done;
+}
 
-static int
-luawav_read_pcm_frames_f32(lua_State *L) {
-    luawav_userdata *u = NULL;
-    drwav_uint64 framesToRead = 0;
+/* reads frames in one of the LUAWAV_* sample types, keeping statistics
+ * when they're enabled. Conversions luawav has a vectorized kernel for
+ * read the raw frames and convert them here, as do the ones that would
+ * lose precision the statistics need. */
+static drwav_uint64
+luawav_read_native(luawav_userdata *u, drwav_uint64 framesToRead, void *buffer, int type) {
+    drwav_uint64 t = 0;
+    drwav_uint64 start = 0;
+    luawav_counters *counters = luawav_instrumented(u);
+    luawav_convert_func kernel = luawav_convert_kernel(&u->wav,type);
+    luawav_stats *rawStats = NULL;
+
+    if(u->stats != NULL && luawav_stats_kernel(&u->wav,type) != NULL) {
+        kernel = luawav_stats_kernel(&u->wav,type);
+        rawStats = u->stats;
+    }
+
+    if(counters != NULL) start = luawav_now_ns();
+    if(kernel != NULL) {
+        t = luawav_read_converted(&u->wav,framesToRead,buffer,type,kernel,counters,rawStats);
+    } else {
+        switch(type) {
+            case LUAWAV_F32: t = drwav_read_pcm_frames_f32(&u->wav,framesToRead,(float *)buffer); break;
+            case LUAWAV_S32: t = drwav_read_pcm_frames_s32(&u->wav,framesToRead,(drwav_int32 *)buffer); break;
+            default: t = drwav_read_pcm_frames_s16(&u->wav,framesToRead,(drwav_int16 *)buffer); break;
+        }
+    }
+    if(counters != NULL) luawav_counter_add(&counters->decode,start,t);
+    if(u->stats != NULL && rawStats == NULL) {
+        luawav_stats_update(u->stats,buffer,t,type);
+    }
+    return t;
+}
+
+/* size of one sample as stored in the file, when the channel subset can be
+ * picked straight out of the raw frames and converted by dr_wav; 0 when the
+ * frames have to be fully decoded first */
+static unsigned int
+luawav_raw_sample_size(luawav_userdata *u) {
+    drwav *wav = &u->wav;
+    unsigned int size = 0;
+
+    /* statistics need every channel converted */
+    if(u->stats != NULL) return 0;
+    if(wav->container == drwav_container_aiff) return 0;
+    if((wav->bitsPerSample & 0x07) != 0) return 0;
+    size = wav->bitsPerSample / 8;
+
+    switch(wav->translatedFormatTag) {
+        case DR_WAVE_FORMAT_PCM: return size <= 4 ? size : 0;
+        case DR_WAVE_FORMAT_IEEE_FLOAT: return (size == 4 || size == 8) ? size : 0;
+        case DR_WAVE_FORMAT_ALAW: /* fall-through */
+        case DR_WAVE_FORMAT_MULAW: return size == 1 ? size : 0;
+        default: break;
+    }
+    return 0;
+}
+
+/* most frames a single read can produce, given room for `room` samples in
+ * the output buffer */
+static drwav_uint64
+luawav_block_frames(luawav_userdata *u, const luawav_layout *l, unsigned int room, int type) {
+    drwav_uint64 n = room / l->channels;
+    unsigned int size = 0;
+
+    if(l->select == NULL) return n;
+
+    size = luawav_raw_sample_size(u);
+    if(size) {
+        n = WAV_MIN(n, sizeof(u->pcm_pick) / (l->channels * size));
+    } else {
+        size = type == LUAWAV_S16 ? sizeof(drwav_int16) : sizeof(drwav_int32);
+    }
+    return WAV_MIN(n, sizeof(u->pcm_raw) / (u->wav.channels * size));
+}
+
+static void
+luawav_convert_picked(luawav_userdata *u, unsigned int size, size_t count, int type) {
+    const void *in = u->pcm_pick;
+    drwav_uint16 tag = u->wav.translatedFormatTag;
+
+    if(type == LUAWAV_F32) {
+        if(tag == DR_WAVE_FORMAT_ALAW) drwav_alaw_to_f32(u->pcm_float,in,count);
+        else if(tag == DR_WAVE_FORMAT_MULAW) drwav_mulaw_to_f32(u->pcm_float,in,count);
+        else if(tag == DR_WAVE_FORMAT_IEEE_FLOAT && size == 4) memcpy(u->pcm_float,in,count * size);
+        else if(tag == DR_WAVE_FORMAT_IEEE_FLOAT) drwav_f64_to_f32(u->pcm_float,in,count);
+        else if(size == 1) drwav_u8_to_f32(u->pcm_float,in,count);
+        else if(size == 2) luawav_convert.s16_to_f32(u->pcm_float,in,count);
+        else if(size == 3) luawav_convert.s24_to_f32(u->pcm_float,in,count);
+        else luawav_convert.s32_to_f32(u->pcm_float,in,count);
+    } else if(type == LUAWAV_S32) {
+        if(tag == DR_WAVE_FORMAT_ALAW) drwav_alaw_to_s32(u->pcm_int32,in,count);
+        else if(tag == DR_WAVE_FORMAT_MULAW) drwav_mulaw_to_s32(u->pcm_int32,in,count);
+        else if(tag == DR_WAVE_FORMAT_IEEE_FLOAT && size == 4) drwav_f32_to_s32(u->pcm_int32,in,count);
+        else if(tag == DR_WAVE_FORMAT_IEEE_FLOAT) drwav_f64_to_s32(u->pcm_int32,in,count);
+        else if(size == 1) drwav_u8_to_s32(u->pcm_int32,in,count);
+        else if(size == 2) luawav_convert.s16_to_s32(u->pcm_int32,in,count);
+        else if(size == 3) luawav_convert.s24_to_s32(u->pcm_int32,in,count);
+        else memcpy(u->pcm_int32,in,count * size);
+    } else {
+        if(tag == DR_WAVE_FORMAT_ALAW) drwav_alaw_to_s16(u->pcm_int16,in,count);
+        else if(tag == DR_WAVE_FORMAT_MULAW) drwav_mulaw_to_s16(u->pcm_int16,in,count);
+        else if(tag == DR_WAVE_FORMAT_IEEE_FLOAT && size == 4) luawav_convert.f32_to_s16(u->pcm_int16,in,count);
+        else if(tag == DR_WAVE_FORMAT_IEEE_FLOAT) drwav_f64_to_s16(u->pcm_int16,in,count);
+        else if(size == 1) drwav_u8_to_s16(u->pcm_int16,in,count);
+        else if(size == 2) memcpy(u->pcm_int16,in,count * size);
+        else if(size == 3) luawav_convert.s24_to_s16(u->pcm_int16,in,count);
+        else luawav_convert.s32_to_s16(u->pcm_int16,in,count);
+    }
+}
+
+/* reads up to framesToRead frames (at most luawav_block_frames) of the
+ * selected channels into the output buffer for type. Uncompressed formats
+ * only convert the selected samples, anything else is decoded in full and
+ * then picked from. */
+static drwav_uint64
+luawav_read_select(luawav_userdata *u, const luawav_layout *l, drwav_uint64 framesToRead, int type) {
+    const drwav_uint8 *in = (const drwav_uint8 *)u->pcm_raw;
+    drwav_uint8 *out = NULL;
+    unsigned int size = 0;
+    unsigned int channels = u->wav.channels;
+    drwav_uint64 t = 0;
+    drwav_uint64 f = 0;
+    drwav_uint64 start = 0;
+    unsigned int j = 0;
+    int raw = 0;
+    luawav_counters *counters = luawav_instrumented(u);
+
+    size = luawav_raw_sample_size(u);
+    raw = size != 0;
+    if(raw) {
+        out = (drwav_uint8 *)u->pcm_pick;
+        if(counters != NULL) start = luawav_now_ns();
+        t = drwav_read_pcm_frames(&u->wav,framesToRead,u->pcm_raw);
+        if(counters != NULL) luawav_counter_add(&counters->decode,start,t);
+    } else {
+        out = (drwav_uint8 *)u->pcm_float;
+        size = type == LUAWAV_S16 ? sizeof(drwav_int16) : sizeof(drwav_int32);
+        t = luawav_read_native(u,framesToRead,u->pcm_raw,type);
+    }
+
+    /* picking the channels out counts as conversion */
+    if(counters != NULL) start = luawav_now_ns();
+    for(f=0;f<t;f++) {
+        for(j=0;j<l->channels;j++) {
+            memcpy(out,in + (l->select[j] * size),size);
+            out += size;
+        }
+        in += channels * size;
+    }
+
+    if(raw) {
+        luawav_convert_picked(u,size,t * l->channels,type);
+    }
+    if(counters != NULL) luawav_counter_add(&counters->convert,start,t * l->channels);
+    return t;
+}
+
+/* makes sure a samples table passed in with the buffer option has its
+ * channel tables when planar */
+static void
+luawav_reuse_samples(lua_State *L, int idx, drwav_uint64 frames, const luawav_layout *l) {
+    unsigned int c = 0;
+    if(!l->planar) return;
+    for(c=0;c<l->channels;c++) {
+        lua_rawgeti(L,idx,c + 1);
+        if(!lua_istable(L,-1)) {
+            lua_createtable(L,frames,0);
+            lua_rawseti(L,idx,c + 1);
+        }
+        lua_pop(L,1);
+    }
+}
+
+/* clears what's left past the first `frames` frames of a reused samples
+ * table, from an earlier and longer read */
+static void
+luawav_trim_samples(lua_State *L, int idx, drwav_uint64 frames, const luawav_layout *l) {
+    size_t len = 0;
+    unsigned int c = 0;
+
+    if(!l->planar) {
+        len = lua_rawlen(L,idx);
+        while(len > frames * l->channels) {
+            lua_pushnil(L);
+            lua_rawseti(L,idx,(int)len--);
+        }
+        return;
+    }
+    for(c=0;c<l->channels;c++) {
+        lua_rawgeti(L,idx,c + 1);
+        len = lua_rawlen(L,-1);
+        while(len > frames) {
+            lua_pushnil(L);
+            lua_rawseti(L,-2,(int)len--);
+        }
+        lua_pop(L,1);
+    }
+}
+
+static void
+luawav_new_samples(lua_State *L, drwav_uint64 frames, const luawav_layout *l) {
+    unsigned int c = 0;
+    if(!l->planar) {
+        lua_createtable(L,frames * l->channels,0);
+        return;
+    }
+    lua_createtable(L,l->channels,0);
+    for(c=0;c<l->channels;c++) {
+        lua_createtable(L,frames,0);
+        lua_rawseti(L,-2,c + 1);
+    }
+}
+
+/* the fill functions read up to framesToRead frames into the samples table
+ * at idx, starting at frame 1, and return the number of frames read */
+typedef drwav_uint64 (*luawav_fill_func)(lua_State *L, luawav_userdata *u, int idx, const luawav_layout *l, drwav_uint64 framesToRead);
+
+static drwav_uint64
+luawav_fill_f32(lua_State *L, luawav_userdata *u, int idx, const luawav_layout *l, drwav_uint64 framesToRead) {
     drwav_uint64 r = 0;
     drwav_uint64 t = 0;
     drwav_uint64 n = 0;
     drwav_uint64 i = 0;
+    drwav_uint64 block = luawav_block_frames(u,l,F32_BUFFER,LUAWAV_F32);
+    drwav_uint64 start = 0;
+    int base = 0;
+    luawav_counters *counters = luawav_instrumented(u);
 
-    u = luaL_checkudata(L,1,luawav_mt);
-    framesToRead = luawav_touint64(L,2);
-
-    lua_createtable(L,framesToRead * u->wav.channels,0);
+    if(l->planar) base = luawav_push_channels(L,idx,l->channels);
 
     while(r<framesToRead) {
-        n = WAV_MIN( framesToRead - r, F32_BUFFER / u->wav.channels);
-        t = drwav_read_pcm_frames_f32(&u->wav,n,u->pcm_float);
-        i = 0;
-        while(i<(t * u->wav.channels)) {
+        n = WAV_MIN( framesToRead - r, block);
+        if(l->select) {
+            t = luawav_read_select(u,l,n,LUAWAV_F32);
+        } else {
+            t = luawav_read_native(u,n,u->pcm_float,LUAWAV_F32);
+        }
+        if(counters != NULL) start = luawav_now_ns();
+        for(i=0;i<(t * l->channels);i++) {
             lua_pushnumber(L,u->pcm_float[i]);
-            lua_rawseti(L,-2,++i + r);
+            luawav_store_sample(L,idx,base,i + (r * l->channels),l->channels);
         }
-        if(n != t) break;
+        if(counters != NULL) luawav_counter_add(&counters->push,start,t * l->channels);
         r += t;
+        if(n != t) break;
     }
 
-    return 1;
+    if(l->planar) lua_pop(L,l->channels);
+    return r;
 }
 
-static int
-luawav_read_pcm_frames_s32(lua_State *L) {
-    luawav_userdata *u = NULL;
-    drwav_uint64 framesToRead = 0;
+static drwav_uint64
+luawav_fill_s32(lua_State *L, luawav_userdata *u, int idx, const luawav_layout *l, drwav_uint64 framesToRead) {
     drwav_uint64 r = 0;
     drwav_uint64 t = 0;
     drwav_uint64 n = 0;
     drwav_uint64 i = 0;
+    drwav_uint64 block = luawav_block_frames(u,l,S32_BUFFER,LUAWAV_S32);
+    drwav_uint64 start = 0;
+    int base = 0;
+    luawav_counters *counters = luawav_instrumented(u);
 
-    u = luaL_checkudata(L,1,luawav_mt);
-    framesToRead = luawav_touint64(L,2);
-
-    lua_createtable(L,framesToRead * u->wav.channels,0);
+    if(l->planar) base = luawav_push_channels(L,idx,l->channels);
 
     while(r<framesToRead) {
-        n = WAV_MIN( framesToRead - r, S32_BUFFER / u->wav.channels);
-        t = drwav_read_pcm_frames_s32(&u->wav,n,u->pcm_int32);
-        i = 0;
-        while(i<(t * u->wav.channels)) {
+        n = WAV_MIN( framesToRead - r, block);
+        if(l->select) {
+            t = luawav_read_select(u,l,n,LUAWAV_S32);
+        } else {
+            t = luawav_read_native(u,n,u->pcm_int32,LUAWAV_S32);
+        }
+        if(counters != NULL) start = luawav_now_ns();
+        for(i=0;i<(t * l->channels);i++) {
             lua_pushinteger(L,u->pcm_int32[i]);
-            lua_rawseti(L,-2,++i + r);
+            luawav_store_sample(L,idx,base,i + (r * l->channels),l->channels);
         }
+        if(counters != NULL) luawav_counter_add(&counters->push,start,t * l->channels);
+        r += t;
         if(n != t) break;
+    }
+
+    if(l->planar) lua_pop(L,l->channels);
+    return r;
+}
+
+static drwav_uint64
+luawav_fill_s16(lua_State *L, luawav_userdata *u, int idx, const luawav_layout *l, drwav_uint64 framesToRead) {
+    drwav_uint64 r = 0;
+    drwav_uint64 t = 0;
+    drwav_uint64 n = 0;
+    drwav_uint64 i = 0;
+    drwav_uint64 block = luawav_block_frames(u,l,S16_BUFFER,LUAWAV_S16);
+    drwav_uint64 start = 0;
+    int base = 0;
+    luawav_counters *counters = luawav_instrumented(u);
+
+    if(l->planar) base = luawav_push_channels(L,idx,l->channels);
+
+    while(r<framesToRead) {
+        n = WAV_MIN( framesToRead - r, block);
+        if(l->select) {
+            t = luawav_read_select(u,l,n,LUAWAV_S16);
+        } else {
+            t = luawav_read_native(u,n,u->pcm_int16,LUAWAV_S16);
+        }
+        if(counters != NULL) start = luawav_now_ns();
+        for(i=0;i<(t * l->channels);i++) {
+            lua_pushinteger(L,u->pcm_int16[i]);
+            luawav_store_sample(L,idx,base,i + (r * l->channels),l->channels);
+        }
+        if(counters != NULL) luawav_counter_add(&counters->push,start,t * l->channels);
         r += t;
+        if(n != t) break;
+    }
+
+    if(l->planar) lua_pop(L,l->channels);
+    return r;
+}
+
+static const luawav_fill_func luawav_fill_funcs[] = {
+    luawav_fill_f32,
+    luawav_fill_s32,
+    luawav_fill_s16,
+};
+
+/* a large ADPCM read with threads enabled, decoded in one go into a
+ * buffer big enough for the whole request, setting *frames to the frames
+ * read. Returns 0 when it can't be done that way, before anything is
+ * read. */
+static int
+luawav_fill_threaded(lua_State *L, luawav_userdata *u, int idx, const luawav_layout *l, drwav_uint64 framesToRead, int type, drwav_uint64 *frames) {
+    static const size_t sizes[] = { sizeof(float), sizeof(drwav_int32), sizeof(drwav_int16) };
+    void *buffer = NULL;
+    drwav_uint64 t = 0;
+    drwav_uint64 f = 0;
+    drwav_uint64 k = 0;
+    unsigned int c = 0;
+    unsigned int channels = u->wav.channels;
+    int base = 0;
+    drwav_uint64 start = 0;
+    luawav_counters *counters = luawav_instrumented(u);
+
+    if(u->threads < 2 || framesToRead < THREADED_READ_FRAMES || !luawav_adpcm_threadable(&u->wav)) {
+        return 0;
+    }
+    if(u->wav.readCursorInPCMFrames >= u->wav.totalPCMFrameCount) return 0;
+    framesToRead = WAV_MIN(framesToRead,u->wav.totalPCMFrameCount - u->wav.readCursorInPCMFrames);
+
+    buffer = malloc((size_t)(framesToRead * channels * sizes[type]));
+    if(buffer == NULL) return 0;
+
+    if(counters != NULL) start = luawav_now_ns();
+    t = luawav_read_threaded(&u->wav,framesToRead,buffer,type,u->threads);
+    if(counters != NULL) luawav_counter_add(&counters->decode,start,t);
+    if(u->stats != NULL) {
+        luawav_stats_update(u->stats,buffer,t,type);
+    }
+
+    if(counters != NULL) start = luawav_now_ns();
+    if(l->planar) base = luawav_push_channels(L,idx,l->channels);
+    for(f=0;f<t;f++) {
+        for(c=0;c<l->channels;c++) {
+            k = (f * channels) + (l->select ? l->select[c] : c);
+            switch(type) {
+                case LUAWAV_F32: lua_pushnumber(L,((float *)buffer)[k]); break;
+                case LUAWAV_S32: lua_pushinteger(L,((drwav_int32 *)buffer)[k]); break;
+                default: lua_pushinteger(L,((drwav_int16 *)buffer)[k]); break;
+            }
+            luawav_store_sample(L,idx,base,(f * l->channels) + c,l->channels);
+        }
     }
+    if(l->planar) lua_pop(L,l->channels);
+    if(counters != NULL) luawav_counter_add(&counters->push,start,t * l->channels);
 
+    free(buffer);
+    *frames = t;
     return 1;
 }
 
+/* how many more bytes than are buffered reading `frames` frames will take,
+ * for a yieldable stream to fetch ahead of dr_wav */
+static size_t
+luawav_prefetch_want(luawav_userdata *u, drwav_uint64 frames) {
+    drwav *wav = &u->wav;
+    drwav_uint64 bytes = 0;
+    drwav_uint64 cached = 0;
+    drwav_uint64 partial = 0;
+    drwav_uint64 perBlock = 0;
+    unsigned int channels = wav->channels ? wav->channels : 1;
+    size_t buffered = u->stream.size - u->stream.pos;
+
+    if(wav->readCursorInPCMFrames >= wav->totalPCMFrameCount) return 0;
+    frames = WAV_MIN(frames,wav->totalPCMFrameCount - wav->readCursorInPCMFrames);
+
+    switch(wav->translatedFormatTag) {
+        case DR_WAVE_FORMAT_ADPCM: {
+            cached = wav->msadpcm.cachedFrameCount;
+            partial = wav->msadpcm.bytesRemainingInBlock;
+            perBlock = luawav_adpcm_block_frames(wav);
+            if(perBlock == 0) return 0;
+            break;
+        }
+        case DR_WAVE_FORMAT_DVI_ADPCM: {
+            cached = wav->ima.cachedFrameCount;
+            partial = wav->ima.bytesRemainingInBlock;
+            perBlock = luawav_adpcm_block_frames(wav);
+            if(perBlock == 0) return 0;
+            break;
+        }
+        default: {
+            bytes = WAV_MIN(frames * luawav_frame_bytes(wav),wav->bytesRemaining);
+            break;
+        }
+    }
+
+    if(perBlock > 0 && frames > cached) {
+        /* the rest of the current block, a nibble per sample, then whole
+         * blocks */
+        frames -= cached;
+        bytes = partial;
+        frames -= WAV_MIN(frames,partial * 2 / channels);
+        bytes += ((frames + perBlock - 1) / perBlock) * wav->fmt.blockAlign;
+    }
+
+    return bytes > buffered ? (size_t)(bytes - buffered) : 0;
+}
+
+/* asks a yieldable stream's onRead for the bytes the next `frames` frames
+ * need, so dr_wav finds them buffered. onRead may yield, in which case k
+ * is called with ctx when the coroutine resumes, and carries on from
+ * here. */
+static void
+luawav_prefetch(lua_State *L, luawav_userdata *u, drwav_uint64 frames, lua_KContext ctx, lua_KFunction k) {
+    size_t want = 0;
+
+    if(!u->stream.yieldable || u->stream.table_ref == LUA_NOREF) return;
+    while(!u->stream.eof && (want = luawav_prefetch_want(u,frames)) > 0) {
+        luawav_push_onread(L,&u->stream,want);
+        luawav_callk(L,2,1,ctx,k);
+        luawav_prefetch_add(L,&u->stream);
+    }
+}
+
 static int
-luawav_read_pcm_frames_s16(lua_State *L) {
+luawav_read_pcm_frames_fetched(lua_State *L, int type) {
     luawav_userdata *u = NULL;
     drwav_uint64 framesToRead = 0;
-    drwav_uint64 r = 0;
+    drwav_uint64 frames = 0;
+    int reuse = 0;
+    int idx = 0;
+    luawav_layout l;
+
+    u = (luawav_userdata *)lua_touserdata(L,1);
+    framesToRead = luawav_touint64(L,2);
+
+    if(u->wav.onRead == NULL) {
+        return luaL_error(L,"drwav object not opened for reading");
+    }
+    luawav_check_layout(L,3,u->wav.channels,&l);
+
+    reuse = luawav_opt_isset(L,3,"buffer");
+    if(reuse) {
+        lua_getfield(L,3,"buffer");
+        if(!lua_istable(L,-1)) {
+            return luaL_error(L,"buffer must be a table");
+        }
+        luawav_reuse_samples(L,lua_gettop(L),framesToRead,&l);
+    } else {
+        luawav_new_samples(L,framesToRead,&l);
+    }
+    idx = lua_gettop(L);
+
+    LUAWAV_PROBE2(read__start,u,framesToRead);
+    if(!luawav_fill_threaded(L,u,idx,&l,framesToRead,type,&frames)) {
+        frames = luawav_fill_funcs[type](L,u,idx,&l,framesToRead);
+    }
+    if(reuse) luawav_trim_samples(L,idx,frames,&l);
+    LUAWAV_PROBE2(read__done,u,frames);
+
+    lua_pushinteger(L,(lua_Integer)frames);
+    return 2;
+}
+
+static int
+luawav_read_pcm_frames_k(lua_State *L, int status, lua_KContext ctx) {
+    luawav_userdata *u = (luawav_userdata *)lua_touserdata(L,1);
+    (void)status;
+    luawav_prefetch_add(L,&u->stream);
+    luawav_prefetch(L,u,luawav_touint64(L,2),ctx,luawav_read_pcm_frames_k);
+    return luawav_read_pcm_frames_fetched(L,(int)ctx);
+}
+
+static int
+luawav_read_pcm_frames(lua_State *L, int type) {
+    luawav_userdata *u = NULL;
+
+    u = luaL_checkudata(L,1,luawav_mt);
+    luawav_set_thread(u,L);
+
+    lua_settop(L,3);
+    luawav_follow_check(u);
+    luawav_prefetch(L,u,luawav_touint64(L,2),type,luawav_read_pcm_frames_k);
+    return luawav_read_pcm_frames_fetched(L,type);
+}
+
+static int
+luawav_read_pcm_frames_f32(lua_State *L) {
+    return luawav_read_pcm_frames(L,LUAWAV_F32);
+}
+
+static int
+luawav_read_pcm_frames_s32(lua_State *L) {
+    return luawav_read_pcm_frames(L,LUAWAV_S32);
+}
+
+static int
+luawav_read_pcm_frames_s16(lua_State *L) {
+    return luawav_read_pcm_frames(L,LUAWAV_S16);
+}
+
+/* upvalues:
+ *   1 - the drwav userdata
+ *   2 - the samples table, reused on every call
+ *   3 - index into luawav_fill_funcs
+ *   4 - frames per block
+ *   5 - number of samples currently in the table
+ *   6 - planar flag
+ *   7 - channel selection, or nil */
+static int
+luawav_frames_iter_fetched(lua_State *L) {
+    luawav_userdata *u = NULL;
+    luawav_fill_func fill = NULL;
+    drwav_uint64 blockFrames = 0;
     drwav_uint64 t = 0;
-    drwav_uint64 n = 0;
+    drwav_uint64 used = 0;
     drwav_uint64 i = 0;
+    int base = 0;
+    luawav_layout l;
+
+    u = (luawav_userdata *)lua_touserdata(L,lua_upvalueindex(1));
+    fill = luawav_fill_funcs[lua_tointeger(L,lua_upvalueindex(3))];
+    blockFrames = (drwav_uint64)lua_tointeger(L,lua_upvalueindex(4));
+    used = (drwav_uint64)lua_tointeger(L,lua_upvalueindex(5));
+
+    /* the reader was closed mid-loop */
+    if(u->wav.onRead == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    l.planar = lua_toboolean(L,lua_upvalueindex(6));
+    l.select = (const drwav_uint16 *)lua_touserdata(L,lua_upvalueindex(7));
+    l.channels = l.select ? lua_rawlen(L,lua_upvalueindex(7)) / sizeof(drwav_uint16) : u->wav.channels;
+
+    LUAWAV_PROBE2(read__start,u,blockFrames);
+    t = fill(L,u,lua_upvalueindex(2),&l,blockFrames);
+    LUAWAV_PROBE2(read__done,u,t);
+    if(t == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /* a short read leaves stale samples from the previous block behind */
+    i = t * l.channels;
+    if(used > i) {
+        if(l.planar) base = luawav_push_channels(L,lua_upvalueindex(2),l.channels);
+        while(used > i) {
+            lua_pushnil(L);
+            luawav_store_sample(L,lua_upvalueindex(2),base,--used,l.channels);
+        }
+        if(l.planar) lua_pop(L,l.channels);
+    }
+    lua_pushinteger(L,(lua_Integer)i);
+    lua_replace(L,lua_upvalueindex(5));
+
+    lua_pushvalue(L,lua_upvalueindex(2));
+    lua_pushinteger(L,(lua_Integer)t);
+    return 2;
+}
+
+static int
+luawav_frames_iter_k(lua_State *L, int status, lua_KContext ctx) {
+    luawav_userdata *u = (luawav_userdata *)lua_touserdata(L,lua_upvalueindex(1));
+    (void)status;
+    luawav_prefetch_add(L,&u->stream);
+    luawav_prefetch(L,u,(drwav_uint64)ctx,ctx,luawav_frames_iter_k);
+    return luawav_frames_iter_fetched(L);
+}
+
+static int
+luawav_frames_iter(lua_State *L) {
+    luawav_userdata *u = NULL;
+    lua_Integer blockFrames = 0;
+
+    u = (luawav_userdata *)lua_touserdata(L,lua_upvalueindex(1));
+    blockFrames = lua_tointeger(L,lua_upvalueindex(4));
+
+    if(u->wav.onRead != NULL) {
+        luawav_set_thread(u,L);
+        luawav_follow_check(u);
+        luawav_prefetch(L,u,(drwav_uint64)blockFrames,(lua_KContext)blockFrames,luawav_frames_iter_k);
+    }
+    return luawav_frames_iter_fetched(L);
+}
+
+static int
+luawav_frames(lua_State *L) {
+    luawav_userdata *u = NULL;
+    int type = 0;
+    lua_Integer blockFrames = 0;
+    luawav_layout l;
 
     u = luaL_checkudata(L,1,luawav_mt);
-    framesToRead = luawav_touint64(L,2);
+    type = luaL_checkoption(L,2,"s16",luawav_frame_types);
+    blockFrames = luaL_optinteger(L,3,1024);
+
+    if(u->wav.onRead == NULL) {
+        return luaL_error(L,"drwav object not opened for reading");
+    }
+    if(blockFrames < 1) {
+        return luaL_error(L,"blockFrames must be a positive integer");
+    }
+    luawav_check_layout(L,4,u->wav.channels,&l);
+
+    lua_replace(L,2); /* channel selection */
+    lua_settop(L,2);
+    luawav_new_samples(L,blockFrames,&l);
+    lua_pushinteger(L,type);
+    lua_pushinteger(L,blockFrames);
+    lua_pushinteger(L,0);
+    lua_pushboolean(L,l.planar);
+    lua_pushvalue(L,2);
+    lua_remove(L,2);
+    lua_pushcclosure(L,luawav_frames_iter,7);
+    return 1;
+}
 
-    lua_createtable(L,framesToRead * u->wav.channels,0);
+static int
+luawav_seek_to_pcm_frame_fetched(lua_State *L) {
+    luawav_userdata *u = (luawav_userdata *)lua_touserdata(L,1);
+    int r = 0;
 
-    while(r<framesToRead) {
-        n = WAV_MIN( framesToRead - r, S16_BUFFER / u->wav.channels);
-        t = drwav_read_pcm_frames_s16(&u->wav,n,u->pcm_int16);
-        i = 0;
-        while(i<(t * u->wav.channels)) {
-            lua_pushinteger(L,u->pcm_int16[i]);
-            lua_rawseti(L,-2,++i + r);
+    r = luawav_seek(&u->wav,&u->seekIndex,luawav_touint64(L,2));
+    LUAWAV_PROBE2(seek__done,u,r);
+    lua_pushboolean(L,r);
+    return 1;
+}
+
+/* frames an ADPCM seek decodes on its way to frame */
+static drwav_uint64
+luawav_seek_ahead(luawav_userdata *u, drwav_uint64 frame) {
+    return frame > u->wav.readCursorInPCMFrames ? frame - u->wav.readCursorInPCMFrames : 0;
+}
+
+static int
+luawav_seek_to_pcm_frame_k(lua_State *L, int status, lua_KContext ctx) {
+    luawav_userdata *u = (luawav_userdata *)lua_touserdata(L,1);
+    (void)status;
+    luawav_prefetch_add(L,&u->stream);
+    luawav_prefetch(L,u,luawav_seek_ahead(u,luawav_touint64(L,2)),ctx,luawav_seek_to_pcm_frame_k);
+    return luawav_seek_to_pcm_frame_fetched(L);
+}
+
+static int
+luawav_seek_to_pcm_frame(lua_State *L) {
+    luawav_userdata *u = NULL;
+    drwav_uint64 frame = 0;
+    drwav_uint64 cursor = 0;
+    drwav_uint32 fpb = 0;
+
+    u = luaL_checkudata(L,1,luawav_mt);
+    luawav_set_thread(u,L);
+    frame = luawav_touint64(L,2);
+
+    if(u->wav.onRead == NULL) {
+        return luaL_error(L,"drwav object not opened for reading");
+    }
+
+    luawav_follow_check(u);
+    LUAWAV_PROBE2(seek__start,u,frame);
+    if(u->stream.yieldable && (u->wav.translatedFormatTag == DR_WAVE_FORMAT_ADPCM || u->wav.translatedFormatTag == DR_WAVE_FORMAT_DVI_ADPCM)) {
+        fpb = luawav_adpcm_block_frames(&u->wav);
+    }
+    if(fpb > 0) {
+        /* ADPCM seeks decode from the start of the block, which is jumped
+         * to first so the bytes decoded can be fetched from here */
+        frame = WAV_MIN(frame,u->wav.totalPCMFrameCount);
+        cursor = u->wav.readCursorInPCMFrames;
+        if(frame < cursor || frame / fpb != cursor / fpb) {
+            if(!luawav_seek(&u->wav,&u->seekIndex,frame - (frame % fpb))) {
+                LUAWAV_PROBE2(seek__done,u,0);
+                lua_pushboolean(L,0);
+                return 1;
+            }
         }
-        if(n != t) break;
-        r += t;
+        lua_settop(L,2);
+        luawav_prefetch(L,u,luawav_seek_ahead(u,frame),0,luawav_seek_to_pcm_frame_k);
     }
+    return luawav_seek_to_pcm_frame_fetched(L);
+}
 
+static int
+luawav_get_stats(lua_State *L) {
+    luawav_userdata *u = NULL;
+    u = luaL_checkudata(L,1,luawav_mt);
+    if(u->stats == NULL) {
+        return luaL_error(L,"statistics not enabled, open with stats = true");
+    }
+    luawav_stats_push(L,u->stats);
     return 1;
 }
 
+/* reader:wait([timeout]) - for a reader opened with follow = true, waits
+ * up to timeout seconds (forever without one) for frames to be written,
+ * returning true when there are new frames to read */
+static int
+luawav_wait(lua_State *L) {
+    luawav_userdata *u = NULL;
+    double timeout = 0.0;
+    int r = 0;
+
+    u = luaL_checkudata(L,1,luawav_mt);
+    timeout = luaL_optnumber(L,2,-1.0);
+    if(u->follow.file == NULL) {
+        return luaL_error(L,"not following, open with follow = true");
+    }
+
+    r = luawav_follow_wait(&u->follow,&u->wav,timeout);
+    if(r) memset(&u->seekIndex,0,sizeof(luawav_block_index));
+    lua_pushboolean(L,r);
+    return 1;
+}
+
+static int
+luawav_get_counters(lua_State *L) {
+    luawav_userdata *u = NULL;
+    u = luaL_checkudata(L,1,luawav_mt);
+    if(!u->counters.enabled) {
+        return luaL_error(L,"counters not enabled, open with instrument = true");
+    }
+    luawav_counters_push(L,&u->counters);
+    return 1;
+}
+
+static void
+luawav_set_bin(lua_State *L, int idx, const char *key, lua_Integer bin, double v) {
+    lua_getfield(L,idx,key);
+    lua_pushnumber(L,v);
+    lua_rawseti(L,-2,bin);
+    lua_pop(L,1);
+}
+
+/* the type read_summary reduces samples in when it can read the data raw,
+ * -1 for anything that has to be decoded: 16-bit PCM as s16, 24 and 32-bit
+ * as s32, 8-bit and float as f32 (dr_wav's 8-bit scale isn't a power of
+ * two, so the values are its f32 ones) */
+static int
+luawav_summary_type(const drwav *wav) {
+    if(wav->container == drwav_container_aiff) return -1;
+    if(wav->translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT) {
+        return (wav->bitsPerSample == 32 || wav->bitsPerSample == 64) ? LUAWAV_F32 : -1;
+    }
+    if(wav->translatedFormatTag != DR_WAVE_FORMAT_PCM) return -1;
+    switch(wav->bitsPerSample) {
+        case 8: return LUAWAV_F32;
+        case 16: return LUAWAV_S16;
+        case 24: case 32: return LUAWAV_S32;
+        default: break;
+    }
+    return -1;
+}
+
+/* reads up to frames raw frames into the summary block, keeping
+ * statistics from them, and returns where the samples to reduce are:
+ * converted after the raw ones where the file's format isn't the type
+ * they're reduced in */
+static void *
+luawav_summary_read(luawav_userdata *u, drwav_uint64 frames, drwav_uint64 *read) {
+    drwav_uint8 *raw = u->block;
+    drwav_uint8 *out = u->block + (SUMMARY_BLOCK * 8);
+    drwav_uint64 t = 0;
+    drwav_uint64 start = 0;
+    size_t count = 0;
+    luawav_counters *counters = luawav_instrumented(u);
+
+    if(counters != NULL) start = luawav_now_ns();
+    t = drwav_read_pcm_frames_le(&u->wav,frames,raw);
+    if(counters != NULL) luawav_counter_add(&counters->decode,start,t);
+    *read = t;
+
+    if(u->stats != NULL) {
+        if(u->wav.translatedFormatTag == DR_WAVE_FORMAT_PCM && u->wav.bitsPerSample == 16) {
+            luawav_stats_update(u->stats,raw,t,LUAWAV_S16);
+        } else {
+            luawav_stats_update_raw(u->stats,&u->wav,raw,t);
+        }
+    }
+
+    count = (size_t)(t * u->wav.channels);
+    if(counters != NULL) start = luawav_now_ns();
+    if(u->wav.translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT) {
+        if(u->wav.bitsPerSample == 32) return raw;
+        drwav_f64_to_f32((float *)out,(const double *)raw,count);
+    } else {
+        switch(u->wav.bitsPerSample) {
+            case 8: drwav_u8_to_f32((float *)out,raw,count); break;
+            case 24: luawav_convert.s24_to_s32(out,raw,count); break;
+            default: return raw;
+        }
+    }
+    if(counters != NULL) luawav_counter_add(&counters->convert,start,count);
+    return out;
+}
+
+/* reader:read_summary(framesPerBin, bins) - per-channel min, max and rms
+ * of each bin of framesPerBin frames, on the f32 scale. Uncompressed PCM
+ * and float are read raw, SUMMARY_BLOCK samples at a time, and reduced
+ * with the luawav_convert kernels as s16, s32 or f32; anything else is
+ * decoded to f32. */
+static int
+luawav_read_summary(lua_State *L) {
+    luawav_userdata *u = NULL;
+    drwav_uint64 framesPerBin = 0;
+    lua_Integer bins = 0;
+    lua_Integer bin = 0;
+    drwav_uint64 binFrames = 0;
+    drwav_uint64 n = 0;
+    drwav_uint64 t = 0;
+    unsigned int channels = 0;
+    unsigned int c = 0;
+    int type = 0;
+    int res = 0;
+    const void *in = NULL;
+    double *fsq = NULL;
+    drwav_uint64 *isq = NULL;
+    float *fmn = NULL;
+    float *fmx = NULL;
+    drwav_int32 *imn = NULL;
+    drwav_int32 *imx = NULL;
+    double mn = 0.0;
+    double mx = 0.0;
+    double sq = 0.0;
+
+    u = luaL_checkudata(L,1,luawav_mt);
+    luawav_set_thread(u,L);
+    framesPerBin = luawav_touint64(L,2);
+    bins = luaL_checkinteger(L,3);
+
+    if(u->wav.onRead == NULL) {
+        return luaL_error(L,"drwav object not opened for reading");
+    }
+    if(framesPerBin == 0 || bins < 1) {
+        return luaL_error(L,"framesPerBin and bins must be positive");
+    }
+    luawav_follow_check(u);
+
+    channels = u->wav.channels;
+    type = luawav_summary_type(&u->wav);
+    if(type >= 0 && u->block == NULL) {
+        u->block = (drwav_uint8 *)malloc(SUMMARY_BLOCK * (8 + sizeof(float)));
+        if(u->block == NULL) {
+            return luaL_error(L,"out of memory");
+        }
+    }
+
+    fsq = (double *)lua_newuserdata(L,channels * (sizeof(double) + sizeof(drwav_uint64) + (sizeof(float) * 2) + (sizeof(drwav_int32) * 2)));
+    isq = (drwav_uint64 *)(fsq + channels);
+    fmn = (float *)(isq + channels);
+    fmx = fmn + channels;
+    imn = (drwav_int32 *)(fmx + channels);
+    imx = imn + channels;
+
+    lua_createtable(L,channels,0);
+    res = lua_gettop(L);
+    for(c=0;c<channels;c++) {
+        lua_createtable(L,0,3);
+        lua_createtable(L,bins,0);
+        lua_setfield(L,-2,"min");
+        lua_createtable(L,bins,0);
+        lua_setfield(L,-2,"max");
+        lua_createtable(L,bins,0);
+        lua_setfield(L,-2,"rms");
+        lua_rawseti(L,res,c + 1);
+    }
+
+    while(bin < bins) {
+        if(binFrames == 0) {
+            for(c=0;c<channels;c++) {
+                fsq[c] = 0.0;
+                isq[c] = 0;
+                fmn[c] = FLT_MAX;
+                fmx[c] = -FLT_MAX;
+                imn[c] = type == LUAWAV_S16 ? 32767 : 0x7FFFFFFF;
+                imx[c] = type == LUAWAV_S16 ? -32768 : -0x7FFFFFFF - 1;
+            }
+        }
+
+        if(type >= 0) {
+            n = WAV_MIN(framesPerBin - binFrames, SUMMARY_BLOCK / channels);
+            in = luawav_summary_read(u,n,&t);
+            switch(type) {
+                case LUAWAV_S16: luawav_convert.reduce_s16((const drwav_int16 *)in,(size_t)t,channels,imn,imx,isq); break;
+                case LUAWAV_S32: luawav_convert.reduce_s32((const drwav_int32 *)in,(size_t)t,channels,imn,imx,fsq); break;
+                default: luawav_convert.reduce_f32((const float *)in,(size_t)t,channels,fmn,fmx,fsq); break;
+            }
+        } else {
+            n = WAV_MIN(framesPerBin - binFrames, F32_BUFFER / channels);
+            t = luawav_read_native(u,n,u->pcm_float,LUAWAV_F32);
+            luawav_convert.reduce_f32(u->pcm_float,(size_t)t,channels,fmn,fmx,fsq);
+        }
+        binFrames += t;
+
+        if(binFrames > 0 && (binFrames == framesPerBin || t != n)) {
+            bin++;
+            for(c=0;c<channels;c++) {
+                if(type == LUAWAV_S16) {
+                    mn = imn[c] / 32768.0;
+                    mx = imx[c] / 32768.0;
+                    sq = isq[c] / (32768.0 * 32768.0);
+                } else if(type == LUAWAV_S32) {
+                    mn = imn[c] / 2147483648.0;
+                    mx = imx[c] / 2147483648.0;
+                    sq = fsq[c] / (2147483648.0 * 2147483648.0);
+                } else {
+                    mn = fmn[c];
+                    mx = fmx[c];
+                    sq = fsq[c];
+                }
+                lua_rawgeti(L,res,c + 1);
+                luawav_set_bin(L,lua_gettop(L),"min",bin,mn);
+                luawav_set_bin(L,lua_gettop(L),"max",bin,mx);
+                luawav_set_bin(L,lua_gettop(L),"rms",bin,sqrt(sq / binFrames));
+                lua_pop(L,1);
+            }
+            binFrames = 0;
+        }
+        if(t != n) break;
+    }
+
+    lua_pushinteger(L,bin);
+    return 2;
+}
 
 static int
 luawav_write_pcm_frames(lua_State *L) {
     luawav_userdata *u = NULL;
+    int type = -1;
+    int r = 0;
     u = luaL_checkudata(L,1,luawav_mt);
-    return u->write(L,u);
+    luawav_set_thread(u,L);
+    if(u->write == NULL || (u->wav.onWrite == NULL && u->adpcm == NULL)) {
+        return luaL_error(L,"drwav object not opened for writing");
+    }
+    if(!lua_isnoneornil(L,3)) {
+        type = luaL_checkoption(L,3,NULL,luawav_frame_types);
+    }
+    LUAWAV_PROBE1(write__start,u);
+    if(type >= 0 && type != u->writeType) {
+        r = luawav_write_pcm_frames_packed(L,u,type);
+    } else {
+        r = u->write(L,u);
+    }
+    LUAWAV_PROBE2(write__done,u,lua_tointeger(L,-1));
+    if(luawav_flush_due(&u->flush,(drwav_uint64)lua_tointeger(L,-1) / u->format.channels)) {
+        if(u->adpcm != NULL) {
+            luawav_adpcm_writer_flush(u->adpcm,&u->flush);
+        } else {
+            luawav_flush_drwav(&u->flush,&u->wav);
+        }
+    }
+    return r;
 }
 
 static int
@@ -763,39 +2490,102 @@ luawav_version_string(lua_State *L) {
     return 1;
 }
 
+/* the push functions take the fully decoded, interleaved file, and push
+ * the selected channels (or all of them, when sel is NULL) */
 static void
-luawav_push_f32_samples(lua_State *L, float *samples, drwav_uint64 sampleCount) {
+luawav_push_f32_samples(lua_State *L, float *samples, drwav_uint64 frameCount, unsigned int channels, const drwav_uint16 *sel, unsigned int selCount) {
     drwav_uint64 i = 0;
-    lua_createtable(L,sampleCount,0);
-    while(i<sampleCount) {
-        lua_pushnumber(L,samples[i]);
-        lua_rawseti(L,-2,++i);
+    drwav_uint64 f = 0;
+    unsigned int j = 0;
+    if(sel == NULL) {
+        lua_createtable(L,frameCount * channels,0);
+        while(i<frameCount * channels) {
+            lua_pushnumber(L,samples[i]);
+            lua_rawseti(L,-2,++i);
+        }
+        return;
+    }
+    lua_createtable(L,frameCount * selCount,0);
+    for(f=0;f<frameCount;f++) {
+        for(j=0;j<selCount;j++) {
+            lua_pushnumber(L,samples[(f * channels) + sel[j]]);
+            lua_rawseti(L,-2,++i);
+        }
     }
 }
 
 static void
-luawav_push_s32_samples(lua_State *L, drwav_int32 *samples, drwav_uint64 sampleCount) {
+luawav_push_s32_samples(lua_State *L, drwav_int32 *samples, drwav_uint64 frameCount, unsigned int channels, const drwav_uint16 *sel, unsigned int selCount) {
     drwav_uint64 i = 0;
-    lua_createtable(L,sampleCount,0);
-    while(i<sampleCount) {
-        lua_pushinteger(L,samples[i]);
-        lua_rawseti(L,-2,++i);
+    drwav_uint64 f = 0;
+    unsigned int j = 0;
+    if(sel == NULL) {
+        lua_createtable(L,frameCount * channels,0);
+        while(i<frameCount * channels) {
+            lua_pushinteger(L,samples[i]);
+            lua_rawseti(L,-2,++i);
+        }
+        return;
+    }
+    lua_createtable(L,frameCount * selCount,0);
+    for(f=0;f<frameCount;f++) {
+        for(j=0;j<selCount;j++) {
+            lua_pushinteger(L,samples[(f * channels) + sel[j]]);
+            lua_rawseti(L,-2,++i);
+        }
     }
 }
 
 static void
-luawav_push_s16_samples(lua_State *L, drwav_int16 *samples, drwav_uint64 sampleCount) {
+luawav_push_s16_samples(lua_State *L, drwav_int16 *samples, drwav_uint64 frameCount, unsigned int channels, const drwav_uint16 *sel, unsigned int selCount) {
     drwav_uint64 i = 0;
-    lua_createtable(L,sampleCount,0);
-    while(i<sampleCount) {
-        lua_pushinteger(L,samples[i]);
-        lua_rawseti(L,-2,++i);
+    drwav_uint64 f = 0;
+    unsigned int j = 0;
+    if(sel == NULL) {
+        lua_createtable(L,frameCount * channels,0);
+        while(i<frameCount * channels) {
+            lua_pushinteger(L,samples[i]);
+            lua_rawseti(L,-2,++i);
+        }
+        return;
+    }
+    lua_createtable(L,frameCount * selCount,0);
+    for(f=0;f<frameCount;f++) {
+        for(j=0;j<selCount;j++) {
+            lua_pushinteger(L,samples[(f * channels) + sel[j]]);
+            lua_rawseti(L,-2,++i);
+        }
     }
 }
 
-typedef void *(*luawav_open_and_read_func)(drwav_read_proc onRead, drwav_seek_proc onSeek, void* pUserData, unsigned int* channelsOut, unsigned int* sampleRateOut, drwav_uint64* totalFrameCountOut, const drwav_allocation_callbacks* pAllocationCallbacks);
+typedef void *(*luawav_open_and_read_func)(drwav_read_proc onRead, drwav_seek_proc onSeek, drwav_tell_proc onTell, void* pUserData, unsigned int* channelsOut, unsigned int* sampleRateOut, drwav_uint64* totalFrameCountOut, const drwav_allocation_callbacks* pAllocationCallbacks);
 typedef void *(*luawav_open_and_read_file_func)(const char *filename, unsigned int* channelsOut, unsigned int* sampleRateOut, drwav_uint64* totalFrameCountOut, const drwav_allocation_callbacks* pAllocationCallbacks);
-typedef void (*luawav_push_samples_func)(lua_State *L, void *samples, drwav_uint64 sampleCount);
+typedef void (*luawav_push_samples_func)(lua_State *L, void *samples, drwav_uint64 frameCount, unsigned int channels, const drwav_uint16 *sel, unsigned int selCount);
+
+/* the open_and_read functions with ADPCM decoded on several threads,
+ * reads the opened file into a malloc'd buffer (freed with drwav_free,
+ * like dr_wav's) and closes it */
+static void *
+luawav_read_all(drwav *wav, int type, unsigned int threads, unsigned int *channels, unsigned int *sampleRate, drwav_uint64 *frameCount) {
+    static const size_t sizes[] = { sizeof(float), sizeof(drwav_int32), sizeof(drwav_int16) };
+    void *samples = NULL;
+
+    /* same checks as dr_wav: no overflow, and a short read is a failure */
+    if(wav->channels != 0 && wav->totalPCMFrameCount <= ((size_t)-1) / wav->channels / sizes[type]) {
+        samples = malloc((size_t)(wav->totalPCMFrameCount * wav->channels * sizes[type]));
+    }
+    if(samples != NULL && luawav_read_threaded(wav,wav->totalPCMFrameCount,samples,type,threads) != wav->totalPCMFrameCount) {
+        free(samples);
+        samples = NULL;
+    }
+    if(samples != NULL) {
+        *frameCount = wav->totalPCMFrameCount;
+        *channels = wav->channels;
+        *sampleRate = wav->sampleRate;
+    }
+    drwav_uninit(wav);
+    return samples;
+}
 
 static int
 luawav_open_and_read_pcm_frames(lua_State *L) {
@@ -808,6 +2598,11 @@ luawav_open_and_read_pcm_frames(lua_State *L) {
     luawav_open_and_read_func f = NULL;
     luawav_open_and_read_file_func file_f = NULL;
     luawav_push_samples_func push = NULL;
+    drwav_uint16 *sel = NULL;
+    unsigned int selCount = 0;
+    unsigned int threads = 1;
+    int type = 0;
+    drwav wav;
 
     if(lua_isstring(L,1)) {
         filename = lua_tostring(L,1);
@@ -818,8 +2613,14 @@ luawav_open_and_read_pcm_frames(lua_State *L) {
     f = lua_touserdata(L,lua_upvalueindex(1));
     file_f = lua_touserdata(L,lua_upvalueindex(2));
     push = lua_touserdata(L,lua_upvalueindex(3));
+    type = (int)lua_tointeger(L,lua_upvalueindex(4));
+
+    selCount = luawav_check_select(L,2);
+    sel = (drwav_uint16 *)lua_touserdata(L,-1);
+    threads = luawav_opt_threads(L,2);
 
     if(filename == NULL) {
+        memset(&u,0,sizeof(luawav_stream_userdata));
         u.L = L;
         lua_newtable(L);
 
@@ -839,15 +2640,26 @@ luawav_open_and_read_pcm_frames(lua_State *L) {
         lua_setfield(L,-2,"userData");
 
         u.table_ref = luaL_ref(L,LUA_REGISTRYINDEX);
-        samples = f(
-          luawav_read_proc,
-          luawav_seek_proc,
-          &u,
-          &channels,
-          &sampleRate,
-          &frameCount,
-          NULL);
+        if(threads > 1) {
+            if(drwav_init(&wav,luawav_read_proc,luawav_seek_proc,luawav_tell_proc,&u,NULL)) {
+                samples = luawav_read_all(&wav,type,threads,&channels,&sampleRate,&frameCount);
+            }
+        } else {
+            samples = f(
+              luawav_read_proc,
+              luawav_seek_proc,
+              luawav_tell_proc,
+              &u,
+              &channels,
+              &sampleRate,
+              &frameCount,
+              NULL);
+        }
         luaL_unref(L,LUA_REGISTRYINDEX,u.table_ref);
+    } else if(threads > 1) {
+        if(drwav_init_file(&wav,filename,NULL)) {
+            samples = luawav_read_all(&wav,type,threads,&channels,&sampleRate,&frameCount);
+        }
     } else {
         samples = file_f(
           filename,
@@ -857,15 +2669,20 @@ luawav_open_and_read_pcm_frames(lua_State *L) {
           NULL);
     }
 
+    if(samples && !luawav_select_valid(sel,selCount,channels)) {
+        drwav_free(samples, NULL);
+        return luaL_error(L,"channel out of range, file has %d channels",(int)channels);
+    }
+
     if(samples) {
         lua_newtable(L);
-        lua_pushinteger(L,channels);
+        lua_pushinteger(L,selCount ? selCount : channels);
         lua_setfield(L,-2,"channels");
         lua_pushinteger(L,sampleRate);
         lua_setfield(L,-2,"sampleRate");
         luawav_pushuint64(L,frameCount);
         lua_setfield(L,-2,"frameCount");
-        push(L, samples, channels * frameCount);
+        push(L, samples, frameCount, channels, sel, selCount);
         lua_setfield(L,-2,"samples");
         drwav_free(samples, NULL);
     } else {
@@ -885,6 +2702,21 @@ static const struct luaL_Reg luawav_functions[] = {
     { "drwav_read_pcm_frames_s32", luawav_read_pcm_frames_s32 },
     { "drwav_read_pcm_frames_s16", luawav_read_pcm_frames_s16 },
     { "drwav_write_pcm_frames", luawav_write_pcm_frames },
+    { "drwav_frames", luawav_frames },
+    { "drwav_seek_to_pcm_frame", luawav_seek_to_pcm_frame },
+    { "drwav_read_summary", luawav_read_summary },
+    { "drwav_stats", luawav_get_stats },
+    { "drwav_counters", luawav_get_counters },
+    { "drwav_wait", luawav_wait },
+    { "allocations", luawav_allocations },
+    { "analyze", luawav_analyze },
+    { "rewrap", luawav_rewrap },
+    { "concat", luawav_concat },
+    { "split", luawav_split },
+    { "build_peaks", luawav_build_peaks },
+    { "open_peaks", luawav_open_peaks },
+    { "loudness", luawav_loudness },
+    { "transcode", luawav_transcode },
     { NULL, NULL },
 };
 
@@ -896,6 +2728,12 @@ static const luawav_metamethods luawav_mm[] = {
     { "drwav_read_pcm_frames_s32", "read_pcm_frames_s32" },
     { "drwav_read_pcm_frames_s16", "read_pcm_frames_s16" },
     { "drwav_write_pcm_frames", "write_pcm_frames" },
+    { "drwav_frames", "frames" },
+    { "drwav_seek_to_pcm_frame", "seek_to_pcm_frame" },
+    { "drwav_read_summary", "read_summary" },
+    { "drwav_stats", "stats" },
+    { "drwav_counters", "counters" },
+    { "drwav_wait", "wait" },
     { NULL, NULL },
 };
 
@@ -978,6 +2816,8 @@ LUAWAV_PUBLIC
 int luaopen_luawav(lua_State *L) {
     const luawav_metamethods *mm   = luawav_mm;
     const luawav_const *cc   = luawav_consts;
+    int i = 0;
+    luawav_convert_init();
     lua_newtable(L);
 
     copydown(L,"luawav.version");
@@ -992,8 +2832,25 @@ int luaopen_luawav(lua_State *L) {
     lua_call(L,1,1);
     lua_setfield(L,-2,"drwav_uint64");
 
+    lua_getglobal(L,"require");
+    lua_pushstring(L,"luawav.decoder");
+    lua_call(L,1,1);
+    lua_setfield(L,-2,"decoder");
+
     luaL_setfuncs(L,luawav_functions,0);
 
+    /* option names looked up on every read stay interned, so the lookup
+     * never has to create the string */
+    lua_newtable(L);
+    for(i=0;luawav_pinned_keys[i] != NULL;i++) {
+        lua_pushstring(L,luawav_pinned_keys[i]);
+        lua_rawseti(L,-2,i + 1);
+    }
+    lua_setfield(L,LUA_REGISTRYINDEX,"luawav.keys");
+
+    lua_pushstring(L,luawav_convert.isa);
+    lua_setfield(L,-2,"simd");
+
     luaL_newmetatable(L,luawav_mt);
     lua_getfield(L,-2,"drwav_uninit");
     lua_setfield(L,-2,"__gc");
@@ -1006,6 +2863,8 @@ int luaopen_luawav(lua_State *L) {
     lua_setfield(L,-2,"__index");
     lua_pop(L,1);
 
+    luawav_peaks_register(L);
+
     while(cc->name != NULL) {
         lua_pushinteger(L,cc->value);
         lua_setfield(L,-2,cc->name);
@@ -1015,19 +2874,22 @@ int luaopen_luawav(lua_State *L) {
     lua_pushlightuserdata(L,drwav_open_and_read_pcm_frames_s16);
     lua_pushlightuserdata(L,drwav_open_file_and_read_pcm_frames_s16);
     lua_pushlightuserdata(L,luawav_push_s16_samples);
-    lua_pushcclosure(L,luawav_open_and_read_pcm_frames,3);
+    lua_pushinteger(L,LUAWAV_S16);
+    lua_pushcclosure(L,luawav_open_and_read_pcm_frames,4);
     lua_setfield(L,-2,"drwav_open_and_read_pcm_frames_s16");
 
     lua_pushlightuserdata(L,drwav_open_and_read_pcm_frames_s32);
     lua_pushlightuserdata(L,drwav_open_file_and_read_pcm_frames_s32);
     lua_pushlightuserdata(L,luawav_push_s32_samples);
-    lua_pushcclosure(L,luawav_open_and_read_pcm_frames,3);
+    lua_pushinteger(L,LUAWAV_S32);
+    lua_pushcclosure(L,luawav_open_and_read_pcm_frames,4);
     lua_setfield(L,-2,"drwav_open_and_read_pcm_frames_s32");
 
     lua_pushlightuserdata(L,drwav_open_and_read_pcm_frames_f32);
     lua_pushlightuserdata(L,drwav_open_file_and_read_pcm_frames_f32);
     lua_pushlightuserdata(L,luawav_push_f32_samples);
-    lua_pushcclosure(L,luawav_open_and_read_pcm_frames,3);
+    lua_pushinteger(L,LUAWAV_F32);
+    lua_pushcclosure(L,luawav_open_and_read_pcm_frames,4);
     lua_setfield(L,-2,"drwav_open_and_read_pcm_frames_f32");
 
     return 1;
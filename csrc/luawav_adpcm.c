@@ -0,0 +1,780 @@
+/* IMA (DVI) ADPCM encoding. dr_wav only decodes ADPCM, so the writer
+ * produces the RIFF header itself: a 20-byte fmt chunk carrying
+ * samplesPerBlock, a fact chunk with the frame count, and the data
+ * chunk, laid out the way dr_wav reads it back - each block starts with
+ * a 4-byte header per channel, followed by groups of 4 bytes (8 samples)
+ * per channel.
+ *
+ * Also block-level seeking and multi-threaded decoding for both MS and
+ * IMA ADPCM files opened with dr_wav. */
+
+#include "luawav_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ADPCM_FACT_POS 48
+#define ADPCM_DATA_SIZE_POS 56
+#define ADPCM_HEADER_SIZE 60
+
+#define ADPCM_MAX_THREADS 16
+#define ADPCM_BATCH_BYTES (4 * 1024 * 1024) /* raw blocks read per pass */
+#define ADPCM_CONVERT_FRAMES 262144 /* frames decoded per pass for f32/s32 */
+
+static const drwav_int32 luawav_ima_index[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const drwav_int32 luawav_ima_step[89] = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,
+    19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+    50,    55,    60,    66,    73,    80,    88,    97,    107,   118,
+    130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+    337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+    876,   963,   1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+    2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+    5894,  6484,  7132,  7845,  8630,  9493,  10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+/* MS ADPCM tables, as used by dr_wav */
+static const drwav_int32 luawav_msadpcm_adapt[16] = {
+    230, 230, 230, 230, 307, 409, 512, 614,
+    768, 614, 512, 409, 307, 230, 230, 230
+};
+
+static const drwav_int32 luawav_msadpcm_coeff1[7] = { 256, 512, 0, 192, 240, 460, 392 };
+static const drwav_int32 luawav_msadpcm_coeff2[7] = { 0, -256, 0, 64, 0, -208, -232 };
+
+struct luawav_adpcm_writer_s {
+    FILE *file;
+    drwav_write_proc onWrite;
+    drwav_seek_proc onSeek;
+    void *userData;
+    unsigned int channels;
+    drwav_uint32 blockAlign;
+    drwav_uint32 framesPerBlock;
+    drwav_uint64 declaredFrames; /* frames promised in the header, 0 if unknown */
+    drwav_uint64 frames; /* frames taken so far */
+    drwav_uint64 dataSize;
+    drwav_int32 predictor[2];
+    drwav_int32 stepIndex[2];
+    drwav_uint32 pending; /* frames waiting for a full block */
+    drwav_int16 *block; /* framesPerBlock interleaved frames */
+    drwav_uint8 *out; /* one encoded block */
+    int failed;
+};
+
+static void
+luawav_adpcm_put(luawav_adpcm_writer *w, const void *data, size_t bytes) {
+    if(w->failed) return;
+    if(w->onWrite(w->userData,data,bytes) != bytes) w->failed = 1;
+}
+
+static void
+luawav_adpcm_put_u32(luawav_adpcm_writer *w, drwav_uint32 v) {
+    drwav_uint8 b[4];
+    b[0] = (drwav_uint8)v;
+    b[1] = (drwav_uint8)(v >> 8);
+    b[2] = (drwav_uint8)(v >> 16);
+    b[3] = (drwav_uint8)(v >> 24);
+    luawav_adpcm_put(w,b,4);
+}
+
+static void
+luawav_adpcm_put_u16(luawav_adpcm_writer *w, drwav_uint16 v) {
+    drwav_uint8 b[2];
+    b[0] = (drwav_uint8)v;
+    b[1] = (drwav_uint8)(v >> 8);
+    luawav_adpcm_put(w,b,2);
+}
+
+static drwav_uint64
+luawav_adpcm_data_size(const luawav_adpcm_writer *w, drwav_uint64 frames) {
+    return ((frames + w->framesPerBlock - 1) / w->framesPerBlock) * w->blockAlign;
+}
+
+static void
+luawav_adpcm_header(luawav_adpcm_writer *w, drwav_uint32 sampleRate, drwav_uint64 frames, drwav_uint64 dataSize) {
+    luawav_adpcm_put(w,"RIFF",4);
+    luawav_adpcm_put_u32(w,(drwav_uint32)(ADPCM_HEADER_SIZE - 8 + dataSize));
+    luawav_adpcm_put(w,"WAVEfmt ",8);
+    luawav_adpcm_put_u32(w,20);
+    luawav_adpcm_put_u16(w,DR_WAVE_FORMAT_DVI_ADPCM);
+    luawav_adpcm_put_u16(w,(drwav_uint16)w->channels);
+    luawav_adpcm_put_u32(w,sampleRate);
+    luawav_adpcm_put_u32(w,(drwav_uint32)(((drwav_uint64)sampleRate * w->blockAlign) / w->framesPerBlock));
+    luawav_adpcm_put_u16(w,(drwav_uint16)w->blockAlign);
+    luawav_adpcm_put_u16(w,4);
+    luawav_adpcm_put_u16(w,2);
+    luawav_adpcm_put_u16(w,(drwav_uint16)w->framesPerBlock);
+    luawav_adpcm_put(w,"fact",4);
+    luawav_adpcm_put_u32(w,4);
+    luawav_adpcm_put_u32(w,(drwav_uint32)frames);
+    luawav_adpcm_put(w,"data",4);
+    luawav_adpcm_put_u32(w,(drwav_uint32)dataSize);
+}
+
+/* picks the nibble whose decoded value lands closest to x, and steps
+ * the channel's state exactly the way the decoder will */
+static drwav_uint8
+luawav_adpcm_encode_sample(drwav_int32 *predictor, drwav_int32 *stepIndex, drwav_int32 x) {
+    drwav_int32 step = luawav_ima_step[*stepIndex];
+    drwav_int32 diff = 0;
+    drwav_int32 best = 0;
+    drwav_int32 bestErr = 0;
+    drwav_int32 v = 0;
+    drwav_int32 e = 0;
+    drwav_uint8 sign = x < *predictor ? 8 : 0;
+    drwav_uint8 nibble = 0;
+    drwav_uint8 n = 0;
+
+    for(n=0;n<8;n++) {
+        diff = step >> 3;
+        if(n & 1) diff += step >> 2;
+        if(n & 2) diff += step >> 1;
+        if(n & 4) diff += step;
+        v = *predictor + (sign ? -diff : diff);
+        v = v < -32768 ? -32768 : (v > 32767 ? 32767 : v);
+        e = v > x ? v - x : x - v;
+        if(n == 0 || e < bestErr) {
+            bestErr = e;
+            best = v;
+            nibble = n;
+        }
+    }
+    nibble |= sign;
+
+    *predictor = best;
+    *stepIndex += luawav_ima_index[nibble];
+    *stepIndex = *stepIndex < 0 ? 0 : (*stepIndex > 88 ? 88 : *stepIndex);
+    return nibble;
+}
+
+static void
+luawav_adpcm_encode_block(luawav_adpcm_writer *w) {
+    drwav_uint8 *o = w->out;
+    const drwav_int16 *s = NULL;
+    unsigned int c = 0;
+    drwav_uint32 g = 0;
+    drwav_uint32 k = 0;
+    drwav_uint32 f = 0;
+    drwav_uint8 lo = 0;
+    drwav_uint8 hi = 0;
+
+    /* the first frame of each block is stored as-is in the headers */
+    for(c=0;c<w->channels;c++) {
+        w->predictor[c] = w->block[c];
+        o[0] = (drwav_uint8)(w->block[c]);
+        o[1] = (drwav_uint8)((drwav_uint16)w->block[c] >> 8);
+        o[2] = (drwav_uint8)w->stepIndex[c];
+        o[3] = 0;
+        o += 4;
+    }
+
+    for(g=1;g<w->framesPerBlock;g+=8) {
+        for(c=0;c<w->channels;c++) {
+            for(k=0;k<4;k++) {
+                f = g + k * 2;
+                s = &w->block[f * w->channels + c];
+                lo = luawav_adpcm_encode_sample(&w->predictor[c],&w->stepIndex[c],s[0]);
+                hi = luawav_adpcm_encode_sample(&w->predictor[c],&w->stepIndex[c],s[w->channels]);
+                *o++ = (drwav_uint8)(lo | (hi << 4));
+            }
+        }
+    }
+
+    luawav_adpcm_put(w,w->out,w->blockAlign);
+    w->dataSize += w->blockAlign;
+}
+
+LUAWAV_PRIVATE
+luawav_adpcm_writer *
+luawav_adpcm_writer_new(const char *filename, drwav_write_proc onWrite, drwav_seek_proc onSeek, void *userData, const drwav_data_format *fmt, drwav_uint32 blockAlign, drwav_uint64 totalFrames, const char **err) {
+    luawav_adpcm_writer *w = NULL;
+
+    if(fmt->channels < 1 || fmt->channels > 2) {
+        *err = "ADPCM supports 1 or 2 channels";
+        return NULL;
+    }
+    if(fmt->container != drwav_container_riff) {
+        *err = "ADPCM is only written to RIFF containers";
+        return NULL;
+    }
+    if(blockAlign == 0) {
+        blockAlign = 512 * fmt->channels;
+    }
+    if(blockAlign <= 4 * fmt->channels || blockAlign % (4 * fmt->channels) != 0 || blockAlign > 0xFFFF) {
+        *err = "invalid blockAlign";
+        return NULL;
+    }
+
+    w = (luawav_adpcm_writer *)malloc(sizeof(luawav_adpcm_writer));
+    if(w == NULL) {
+        *err = "out of memory";
+        return NULL;
+    }
+    memset(w,0,sizeof(luawav_adpcm_writer));
+    w->channels = fmt->channels;
+    w->blockAlign = blockAlign;
+    w->framesPerBlock = ((blockAlign / fmt->channels) - 4) * 2 + 1;
+    w->declaredFrames = totalFrames;
+    w->block = (drwav_int16 *)calloc((size_t)w->framesPerBlock * w->channels,sizeof(drwav_int16));
+    w->out = (drwav_uint8 *)malloc(blockAlign);
+    if(w->block == NULL || w->out == NULL) {
+        *err = "out of memory";
+        goto error;
+    }
+
+    if(filename != NULL) {
+        w->file = fopen(filename,"wb");
+        if(w->file == NULL) {
+            *err = "unable to open file";
+            goto error;
+        }
+        w->onWrite = luawav_stdio_write;
+        w->onSeek = luawav_stdio_seek;
+        w->userData = w->file;
+    } else {
+        w->onWrite = onWrite;
+        w->onSeek = onSeek;
+        w->userData = userData;
+    }
+
+    luawav_adpcm_header(w,fmt->sampleRate,totalFrames,luawav_adpcm_data_size(w,totalFrames));
+    if(w->failed) {
+        *err = "write error";
+        goto error;
+    }
+    return w;
+
+    error:
+    if(w->file != NULL) fclose(w->file);
+    free(w->block);
+    free(w->out);
+    free(w);
+    return NULL;
+}
+
+/* takes interleaved full-scale 32-bit samples, whole frames only, the
+ * top 16 bits are encoded */
+LUAWAV_PRIVATE
+int
+luawav_adpcm_write(luawav_adpcm_writer *w, const drwav_int32 *samples, size_t count) {
+    size_t frames = count / w->channels;
+    size_t f = 0;
+    unsigned int c = 0;
+
+    for(f=0;f<frames && !w->failed;f++) {
+        for(c=0;c<w->channels;c++) {
+            w->block[w->pending * w->channels + c] = (drwav_int16)(*samples++ >> 16);
+        }
+        if(++w->pending == w->framesPerBlock) {
+            luawav_adpcm_encode_block(w);
+            w->pending = 0;
+        }
+        w->frames++;
+    }
+    return !w->failed;
+}
+
+/* flushes the last block and fixes up the header, then frees the writer */
+LUAWAV_PRIVATE
+int
+luawav_adpcm_writer_close(luawav_adpcm_writer *w) {
+    int ok = 0;
+    drwav_uint64 pad = 0;
+
+    /* a sequential writer has to deliver what the header promised */
+    if(w->onSeek == NULL && w->declaredFrames > w->frames) {
+        pad = w->declaredFrames - w->frames;
+        /* silence after the frames still waiting in the block */
+        memset(&w->block[w->pending * w->channels],0,sizeof(drwav_int16) * (w->framesPerBlock - w->pending) * w->channels);
+        while(pad > 0 && !w->failed) {
+            w->pending++;
+            w->frames++;
+            pad--;
+            if(w->pending == w->framesPerBlock) {
+                luawav_adpcm_encode_block(w);
+                w->pending = 0;
+                memset(w->block,0,sizeof(drwav_int16) * w->framesPerBlock * w->channels);
+            }
+        }
+    }
+
+    if(w->pending > 0) {
+        /* the rest of the block holds the last frame, the fact chunk
+         * says where the audio ends */
+        while(w->pending < w->framesPerBlock) {
+            memcpy(&w->block[w->pending * w->channels],&w->block[(w->pending - 1) * w->channels],sizeof(drwav_int16) * w->channels);
+            w->pending++;
+        }
+        luawav_adpcm_encode_block(w);
+        w->pending = 0;
+    }
+
+    if(w->onSeek != NULL && !w->failed) {
+        if(w->onSeek(w->userData,4,DRWAV_SEEK_SET)) {
+            luawav_adpcm_put_u32(w,(drwav_uint32)(ADPCM_HEADER_SIZE - 8 + w->dataSize));
+        } else {
+            w->failed = 1;
+        }
+        if(w->onSeek(w->userData,ADPCM_FACT_POS,DRWAV_SEEK_SET)) {
+            luawav_adpcm_put_u32(w,(drwav_uint32)w->frames);
+        } else {
+            w->failed = 1;
+        }
+        if(w->onSeek(w->userData,ADPCM_DATA_SIZE_POS,DRWAV_SEEK_SET)) {
+            luawav_adpcm_put_u32(w,(drwav_uint32)w->dataSize);
+        } else {
+            w->failed = 1;
+        }
+    }
+
+    ok = !w->failed;
+    if(w->file != NULL && fclose(w->file) != 0) ok = 0;
+    free(w->block);
+    free(w->out);
+    free(w);
+    return ok;
+}
+
+/* writes the header sizes for the whole blocks written so far, the
+ * frames still waiting for a block aren't in the file yet */
+LUAWAV_PRIVATE
+int
+luawav_adpcm_writer_flush(const luawav_adpcm_writer *w, luawav_flush *f) {
+    luawav_header_field fields[3];
+
+    if(w->onSeek == NULL || w->failed) return 0;
+    fields[0].offset = 4;
+    fields[0].value = (drwav_uint32)(ADPCM_HEADER_SIZE - 8 + w->dataSize);
+    fields[0].bytes = 4;
+    fields[1].offset = ADPCM_FACT_POS;
+    fields[1].value = (drwav_uint32)((w->dataSize / w->blockAlign) * w->framesPerBlock);
+    fields[1].bytes = 4;
+    fields[2].offset = ADPCM_DATA_SIZE_POS;
+    fields[2].value = (drwav_uint32)w->dataSize;
+    fields[2].bytes = 4;
+    return luawav_flush_fields(f,fields,3);
+}
+
+/* frames held by one block, from blockAlign the same way dr_wav's
+ * decoders walk it: MS ADPCM has a 7-byte header per channel holding two
+ * samples, IMA a 4-byte header holding one */
+LUAWAV_PRIVATE
+drwav_uint32
+luawav_adpcm_block_frames(const drwav *wav) {
+    drwav_uint32 header = wav->translatedFormatTag == DR_WAVE_FORMAT_ADPCM ? 7 : 4;
+
+    if(wav->channels == 0 || wav->channels > 2) return 0;
+    if(wav->fmt.blockAlign <= header * wav->channels) return 0;
+    if(wav->translatedFormatTag == DR_WAVE_FORMAT_ADPCM) {
+        return ((wav->fmt.blockAlign - 7 * wav->channels) * 2) / wav->channels + 2;
+    }
+    return ((wav->fmt.blockAlign - 4 * wav->channels) * 2) / wav->channels + 1;
+}
+
+static int
+luawav_block_index_build(drwav *wav, luawav_block_index *index) {
+    drwav_uint32 fpb = luawav_adpcm_block_frames(wav);
+
+    if(fpb == 0) return 0;
+    index->dataPos = wav->dataChunkDataPos;
+    index->blockAlign = wav->fmt.blockAlign;
+    index->blocks = (wav->dataChunkDataSize + index->blockAlign - 1) / index->blockAlign;
+    index->framesPerBlock = fpb;
+    return 1;
+}
+
+/* positions the stream at block n and clears the decoder, so the next
+ * read primes it from that block's header */
+static int
+luawav_block_index_jump(drwav *wav, const luawav_block_index *index, drwav_uint64 n) {
+    drwav_uint64 offset = n * index->blockAlign;
+    drwav_uint64 left = offset;
+    int step = 0;
+
+    if(index->dataPos > 0x7FFFFFFF) return 0;
+    if(!wav->onSeek(wav->pUserData,(int)index->dataPos,DRWAV_SEEK_SET)) return 0;
+    while(left > 0) {
+        step = left > 0x7FFFFFFF ? 0x7FFFFFFF : (int)left;
+        if(!wav->onSeek(wav->pUserData,step,DRWAV_SEEK_CUR)) return 0;
+        left -= (drwav_uint64)step;
+    }
+
+    if(wav->translatedFormatTag == DR_WAVE_FORMAT_ADPCM) {
+        memset(&wav->msadpcm,0,sizeof(wav->msadpcm));
+    } else {
+        memset(&wav->ima,0,sizeof(wav->ima));
+    }
+    wav->readCursorInPCMFrames = n * index->framesPerBlock;
+    wav->bytesRemaining = offset < wav->dataChunkDataSize ? wav->dataChunkDataSize - offset : 0;
+    return 1;
+}
+
+/* drwav_seek_to_pcm_frame, except that ADPCM seeks jump straight to the
+ * block holding the frame and decode from there, rather than decoding
+ * everything from the start of the data (or the cursor). Seeks within
+ * the current block, going forward, still just decode ahead. */
+LUAWAV_PRIVATE
+int
+luawav_seek(drwav *wav, luawav_block_index *index, drwav_uint64 frame) {
+    drwav_int16 skip[2048];
+    drwav_uint64 n = 0;
+    drwav_uint64 left = 0;
+    drwav_uint64 want = 0;
+    drwav_uint64 cursor = wav->readCursorInPCMFrames;
+
+    if(wav->translatedFormatTag != DR_WAVE_FORMAT_ADPCM && wav->translatedFormatTag != DR_WAVE_FORMAT_DVI_ADPCM) {
+        return drwav_seek_to_pcm_frame(wav,frame);
+    }
+    if(wav->onSeek == NULL || wav->onWrite != NULL) return 0;
+    if(frame > wav->totalPCMFrameCount) frame = wav->totalPCMFrameCount;
+
+    if(index->framesPerBlock == 0 && !luawav_block_index_build(wav,index)) {
+        return drwav_seek_to_pcm_frame(wav,frame);
+    }
+
+    n = frame / index->framesPerBlock;
+    if(frame >= cursor && n == cursor / index->framesPerBlock) {
+        return drwav_seek_to_pcm_frame(wav,frame);
+    }
+    if(!luawav_block_index_jump(wav,index,n)) return 0;
+
+    left = frame - wav->readCursorInPCMFrames;
+    while(left > 0) {
+        want = WAV_MIN(left,(drwav_uint64)(2048 / wav->channels));
+        if(drwav_read_pcm_frames_s16(wav,want,skip) != want) return 0;
+        left -= want;
+    }
+    return 1;
+}
+
+/* whether luawav_read_threaded can split this file's data at block
+ * boundaries. IMA blocks have to hold whole 8-sample groups, as that's
+ * all dr_wav decodes. */
+LUAWAV_PRIVATE
+int
+luawav_adpcm_threadable(const drwav *wav) {
+    if(wav->translatedFormatTag != DR_WAVE_FORMAT_ADPCM && wav->translatedFormatTag != DR_WAVE_FORMAT_DVI_ADPCM) return 0;
+    if(wav->onRead == NULL || wav->onWrite != NULL) return 0;
+    if(luawav_adpcm_block_frames(wav) == 0) return 0;
+    if(wav->translatedFormatTag == DR_WAVE_FORMAT_DVI_ADPCM) {
+        return (wav->fmt.blockAlign - 4 * wav->channels) % (4 * wav->channels) == 0;
+    }
+    return 1;
+}
+
+/* whether dr_wav is between blocks, with nothing cached from the last */
+static int
+luawav_adpcm_idle(const drwav *wav) {
+    if(wav->translatedFormatTag == DR_WAVE_FORMAT_ADPCM) {
+        return wav->msadpcm.cachedFrameCount == 0 && wav->msadpcm.bytesRemainingInBlock == 0;
+    }
+    return wav->ima.cachedFrameCount == 0 && wav->ima.bytesRemainingInBlock == 0;
+}
+
+/* whether dr_wav would decode the block, it gives up on the first one
+ * with a predictor or step index outside its tables */
+static int
+luawav_adpcm_block_valid(const drwav *wav, const drwav_uint8 *b) {
+    unsigned int c = 0;
+
+    for(c=0;c<wav->channels;c++) {
+        if(wav->translatedFormatTag == DR_WAVE_FORMAT_ADPCM) {
+            if(b[c] >= 7) return 0;
+        } else {
+            if(b[c * 4 + 2] >= 89) return 0;
+        }
+    }
+    return 1;
+}
+
+/* decodes one MS ADPCM block. The header holds each channel's predictor,
+ * delta and two starting samples, oldest last; after it every nibble,
+ * high one first, is the next sample of the next channel in turn */
+static void
+luawav_msadpcm_block(const drwav_uint8 *b, drwav_uint32 blockAlign, unsigned int channels, drwav_int16 *out) {
+    drwav_int32 predictor[2];
+    drwav_int32 delta[2];
+    drwav_int32 older[2];
+    drwav_int32 newer[2];
+    drwav_int32 nibble = 0;
+    drwav_int32 x = 0;
+    drwav_uint32 i = 0;
+    drwav_uint32 n = 0;
+    unsigned int c = 0;
+    drwav_uint8 u = 0;
+
+    for(c=0;c<channels;c++) {
+        predictor[c] = b[c];
+        delta[c] = drwav_bytes_to_s16(b + channels + c * 2);
+        newer[c] = drwav_bytes_to_s16(b + channels * 3 + c * 2);
+        older[c] = drwav_bytes_to_s16(b + channels * 5 + c * 2);
+        out[c] = (drwav_int16)older[c];
+        out[channels + c] = (drwav_int16)newer[c];
+    }
+    out += channels * 2;
+
+    for(i=channels * 7;i<blockAlign;i++) {
+        for(n=0;n<2;n++) {
+            u = n == 0 ? (drwav_uint8)(b[i] >> 4) : (drwav_uint8)(b[i] & 0x0F);
+            nibble = u & 0x08 ? (drwav_int32)u - 16 : (drwav_int32)u;
+            c = channels == 1 ? 0 : n;
+
+            x = ((newer[c] * luawav_msadpcm_coeff1[predictor[c]]) + (older[c] * luawav_msadpcm_coeff2[predictor[c]])) >> 8;
+            x += nibble * delta[c];
+            x = x < -32768 ? -32768 : (x > 32767 ? 32767 : x);
+
+            delta[c] = (drwav_int32)WAV_MIN(((drwav_int64)luawav_msadpcm_adapt[u] * delta[c]) >> 8,0x7FFFFFFF);
+            if(delta[c] < 16) delta[c] = 16;
+
+            older[c] = newer[c];
+            newer[c] = x;
+            *out++ = (drwav_int16)x;
+        }
+    }
+}
+
+/* decodes one IMA ADPCM block: a 4-byte header per channel with the
+ * first sample and step index, then per channel groups of 4 bytes
+ * holding 8 samples, low nibble first */
+static void
+luawav_ima_block(const drwav_uint8 *b, drwav_uint32 blockAlign, unsigned int channels, drwav_int16 *out) {
+    drwav_int32 predictor[2];
+    drwav_int32 stepIndex[2];
+    drwav_int32 step = 0;
+    drwav_int32 diff = 0;
+    drwav_uint32 g = 0;
+    drwav_uint32 groups = (blockAlign - 4 * channels) / (4 * channels);
+    unsigned int c = 0;
+    unsigned int k = 0;
+    drwav_uint8 u = 0;
+
+    for(c=0;c<channels;c++) {
+        predictor[c] = drwav_bytes_to_s16(b + c * 4);
+        stepIndex[c] = b[c * 4 + 2];
+        out[c] = (drwav_int16)predictor[c];
+    }
+    out += channels;
+    b += channels * 4;
+
+    for(g=0;g<groups;g++) {
+        for(c=0;c<channels;c++) {
+            for(k=0;k<8;k++) {
+                u = (drwav_uint8)((b[k >> 1] >> ((k & 1) * 4)) & 0x0F);
+                step = luawav_ima_step[stepIndex[c]];
+                diff = step >> 3;
+                if(u & 1) diff += step >> 2;
+                if(u & 2) diff += step >> 1;
+                if(u & 4) diff += step;
+                if(u & 8) diff = -diff;
+                predictor[c] += diff;
+                predictor[c] = predictor[c] < -32768 ? -32768 : (predictor[c] > 32767 ? 32767 : predictor[c]);
+                stepIndex[c] += luawav_ima_index[u];
+                stepIndex[c] = stepIndex[c] < 0 ? 0 : (stepIndex[c] > 88 ? 88 : stepIndex[c]);
+                out[k * channels + c] = (drwav_int16)predictor[c];
+            }
+            b += 4;
+        }
+        out += 8 * channels;
+    }
+}
+
+typedef struct luawav_adpcm_job_s {
+    const drwav *wav;
+    const drwav_uint8 *in;
+    drwav_int16 *out;
+    drwav_uint64 blocks;
+    drwav_uint32 framesPerBlock;
+} luawav_adpcm_job;
+
+static void *
+luawav_adpcm_worker(void *arg) {
+    luawav_adpcm_job *job = (luawav_adpcm_job *)arg;
+    const drwav *wav = job->wav;
+    drwav_uint32 blockAlign = wav->fmt.blockAlign;
+    drwav_uint64 i = 0;
+
+    for(i=0;i<job->blocks;i++) {
+        if(wav->translatedFormatTag == DR_WAVE_FORMAT_ADPCM) {
+            luawav_msadpcm_block(job->in + i * blockAlign,blockAlign,wav->channels,job->out + i * job->framesPerBlock * wav->channels);
+        } else {
+            luawav_ima_block(job->in + i * blockAlign,blockAlign,wav->channels,job->out + i * job->framesPerBlock * wav->channels);
+        }
+    }
+    return NULL;
+}
+
+/* splits the blocks into one run per thread, each decoding into its own
+ * stretch of out */
+static void
+luawav_adpcm_decode_blocks(const drwav *wav, const drwav_uint8 *in, drwav_uint64 blocks, drwav_uint32 framesPerBlock, drwav_int16 *out, unsigned int threads) {
+    luawav_adpcm_job jobs[ADPCM_MAX_THREADS];
+    drwav_uint64 per = 0;
+    drwav_uint64 first = 0;
+    unsigned int i = 0;
+#if LUAWAV_HAVE_THREADS
+    pthread_t tid[ADPCM_MAX_THREADS];
+    unsigned int started = 0;
+#endif
+
+    if(threads > blocks) threads = (unsigned int)blocks;
+    if(threads < 1) threads = 1;
+#if !LUAWAV_HAVE_THREADS
+    threads = 1;
+#endif
+    per = (blocks + threads - 1) / threads;
+
+    for(i=0;i<threads && first < blocks;i++) {
+        jobs[i].wav = wav;
+        jobs[i].in = in + first * wav->fmt.blockAlign;
+        jobs[i].out = out + first * framesPerBlock * wav->channels;
+        jobs[i].blocks = WAV_MIN(per,blocks - first);
+        jobs[i].framesPerBlock = framesPerBlock;
+        first += jobs[i].blocks;
+#if LUAWAV_HAVE_THREADS
+        /* the last run goes on this thread */
+        if(first == blocks) {
+            luawav_adpcm_worker(&jobs[i]);
+        } else if(pthread_create(&tid[started],NULL,luawav_adpcm_worker,&jobs[i]) != 0) {
+            luawav_adpcm_worker(&jobs[i]);
+        } else {
+            started++;
+        }
+#else
+        luawav_adpcm_worker(&jobs[i]);
+#endif
+    }
+#if LUAWAV_HAVE_THREADS
+    for(i=0;i<started;i++) {
+        pthread_join(tid[i],NULL);
+    }
+#endif
+}
+
+/* drwav_read_pcm_frames_s16, with the whole ADPCM blocks in the request
+ * read in raw and decoded on up to `threads` threads. Every block starts
+ * from the state in its own header, so they decode independently. The
+ * rest of the block the cursor is in, a partial block at the end, and
+ * anything from a block dr_wav would reject go through dr_wav. */
+static drwav_uint64
+luawav_read_s16_threaded(drwav *wav, drwav_uint64 frames, drwav_int16 *out, unsigned int threads) {
+    luawav_block_index index;
+    drwav_uint8 *raw = NULL;
+    drwav_uint64 done = 0;
+    drwav_uint64 t = 0;
+    drwav_uint64 first = 0;
+    drwav_uint64 blocks = 0;
+    drwav_uint64 good = 0;
+    drwav_uint64 batch = 0;
+    size_t bytes = 0;
+    size_t got = 0;
+    size_t r = 0;
+
+    if(threads < 2 || !luawav_adpcm_threadable(wav) || !luawav_block_index_build(wav,&index)) {
+        return drwav_read_pcm_frames_s16(wav,frames,out);
+    }
+    if(threads > ADPCM_MAX_THREADS) threads = ADPCM_MAX_THREADS;
+
+    t = wav->readCursorInPCMFrames % index.framesPerBlock;
+    if(t != 0) {
+        t = WAV_MIN(frames,index.framesPerBlock - t);
+        done = drwav_read_pcm_frames_s16(wav,t,out);
+        if(done != t) return done;
+    }
+    /* left part way through a block it gave up on */
+    if(!luawav_adpcm_idle(wav)) {
+        return done + drwav_read_pcm_frames_s16(wav,frames - done,out + done * wav->channels);
+    }
+
+    batch = ADPCM_BATCH_BYTES / index.blockAlign;
+    if(batch == 0) batch = 1;
+
+    while(wav->readCursorInPCMFrames < wav->totalPCMFrameCount) {
+        first = wav->readCursorInPCMFrames / index.framesPerBlock;
+        blocks = WAV_MIN(frames - done,wav->totalPCMFrameCount - wav->readCursorInPCMFrames) / index.framesPerBlock;
+        blocks = WAV_MIN(blocks,wav->dataChunkDataSize / index.blockAlign > first ? wav->dataChunkDataSize / index.blockAlign - first : 0);
+        blocks = WAV_MIN(blocks,batch);
+        if(blocks == 0) break;
+
+        if(raw == NULL) {
+            raw = (drwav_uint8 *)malloc((size_t)(blocks * index.blockAlign));
+            if(raw == NULL) break;
+        }
+        bytes = (size_t)(blocks * index.blockAlign);
+        got = 0;
+        while(got < bytes) {
+            r = wav->onRead(wav->pUserData,raw + got,bytes - got);
+            if(r == 0) break;
+            got += r;
+        }
+
+        for(good=0;good<got / index.blockAlign;good++) {
+            if(!luawav_adpcm_block_valid(wav,raw + good * index.blockAlign)) break;
+        }
+        luawav_adpcm_decode_blocks(wav,raw,good,index.framesPerBlock,out + done * wav->channels,threads);
+        done += good * index.framesPerBlock;
+        wav->readCursorInPCMFrames += good * index.framesPerBlock;
+
+        /* put the stream back at the first block not decoded, for dr_wav */
+        if(good != blocks) {
+            if(!luawav_block_index_jump(wav,&index,first + good)) {
+                free(raw);
+                return done;
+            }
+            break;
+        }
+    }
+    free(raw);
+
+    if(done < frames) {
+        done += drwav_read_pcm_frames_s16(wav,frames - done,out + done * wav->channels);
+    }
+    return done;
+}
+
+/* reads frames as one of the LUAWAV_* sample types, decoding ADPCM on up
+ * to `threads` threads. Other formats, and a single thread, are read the
+ * usual way. f32 and s32 go through s16 like dr_wav does for ADPCM, a
+ * pass at a time. */
+LUAWAV_PRIVATE
+drwav_uint64
+luawav_read_threaded(drwav *wav, drwav_uint64 frames, void *out, int type, unsigned int threads) {
+    drwav_int16 *s16 = NULL;
+    drwav_uint64 done = 0;
+    drwav_uint64 want = 0;
+    drwav_uint64 t = 0;
+    size_t count = 0;
+
+    if(threads > 1 && luawav_adpcm_threadable(wav)) {
+        if(type == LUAWAV_S16) {
+            return luawav_read_s16_threaded(wav,frames,(drwav_int16 *)out,threads);
+        }
+        s16 = (drwav_int16 *)malloc(sizeof(drwav_int16) * ADPCM_CONVERT_FRAMES * wav->channels);
+    }
+
+    if(s16 == NULL) {
+        switch(type) {
+            case LUAWAV_F32: return drwav_read_pcm_frames_f32(wav,frames,(float *)out);
+            case LUAWAV_S32: return drwav_read_pcm_frames_s32(wav,frames,(drwav_int32 *)out);
+            default: return drwav_read_pcm_frames_s16(wav,frames,(drwav_int16 *)out);
+        }
+    }
+
+    while(done < frames) {
+        want = WAV_MIN(frames - done,ADPCM_CONVERT_FRAMES);
+        t = luawav_read_s16_threaded(wav,want,s16,threads);
+        count = (size_t)(t * wav->channels);
+        if(type == LUAWAV_F32) {
+            luawav_convert.s16_to_f32((float *)out + done * wav->channels,s16,count);
+        } else {
+            luawav_convert.s16_to_s32((drwav_int32 *)out + done * wav->channels,s16,count);
+        }
+        done += t;
+        if(t == 0) break;
+    }
+    free(s16);
+    return done;
+}
@@ -0,0 +1,128 @@
+/* allocation counting, for checking that a read or write loop stops
+ * allocating once it's warmed up. wav.allocations() wraps the state's
+ * allocator with lua_setallocf on first use, and from then on readers
+ * and writers are opened with dr_wav allocation callbacks that count
+ * too. */
+
+#include "luawav_internal.h"
+#include <stdlib.h>
+
+typedef struct luawav_alloc_counter_s {
+    lua_Alloc alloc; /* the allocator being wrapped */
+    void *ud;
+    drwav_uint64 lua;   /* Lua allocations, and reallocations that grow */
+    drwav_uint64 drwav; /* dr_wav mallocs and reallocs */
+} luawav_alloc_counter;
+
+static const char * const luawav_alloc_mt = "luawav_alloc_counter";
+
+/* the registry key for the counter, a light userdata so looking it up
+ * doesn't allocate */
+static char luawav_alloc_key;
+
+static void *
+luawav_counting_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    luawav_alloc_counter *c = (luawav_alloc_counter *)ud;
+
+    /* osize is a type tag rather than a size when ptr is NULL */
+    if(nsize > 0 && (ptr == NULL || nsize > osize)) c->lua++;
+    return c->alloc(c->ud,ptr,osize,nsize);
+}
+
+static void *
+luawav_counting_malloc(size_t sz, void *pUserData) {
+    ((luawav_alloc_counter *)pUserData)->drwav++;
+    return malloc(sz);
+}
+
+static void *
+luawav_counting_realloc(void *p, size_t sz, void *pUserData) {
+    ((luawav_alloc_counter *)pUserData)->drwav++;
+    return realloc(p,sz);
+}
+
+/* doesn't touch the counter, handles can be collected after it when the
+ * state closes */
+static void
+luawav_counting_free(void *p, void *pUserData) {
+    (void)pUserData;
+    free(p);
+}
+
+/* the counter lives in a userdata in the registry. When the state closes
+ * it's finalized, which puts the original allocator back before the
+ * memory holding it goes away; blocks from either allocator are the same
+ * underneath. */
+static int
+luawav_alloc_counter_gc(lua_State *L) {
+    luawav_alloc_counter *c = (luawav_alloc_counter *)lua_touserdata(L,1);
+    void *ud = NULL;
+
+    if(lua_getallocf(L,&ud) == luawav_counting_alloc && ud == c) {
+        lua_setallocf(L,c->alloc,c->ud);
+    }
+    return 0;
+}
+
+static luawav_alloc_counter *
+luawav_alloc_counter_get(lua_State *L) {
+    luawav_alloc_counter *c = NULL;
+
+    lua_pushlightuserdata(L,&luawav_alloc_key);
+    lua_rawget(L,LUA_REGISTRYINDEX);
+    c = (luawav_alloc_counter *)lua_touserdata(L,-1);
+    lua_pop(L,1);
+    return c;
+}
+
+/* fills in cb to count dr_wav allocations once counting is on, returns
+ * NULL (dr_wav's defaults) otherwise */
+LUAWAV_PRIVATE
+const drwav_allocation_callbacks *
+luawav_allocation_callbacks(lua_State *L, drwav_allocation_callbacks *cb) {
+    luawav_alloc_counter *c = luawav_alloc_counter_get(L);
+
+    if(c == NULL) return NULL;
+    cb->pUserData = c;
+    cb->onMalloc = luawav_counting_malloc;
+    cb->onRealloc = luawav_counting_realloc;
+    cb->onFree = luawav_counting_free;
+    return cb;
+}
+
+/* lua, drwav = wav.allocations() - allocations made so far, counting
+ * from the first call. Returns plain integers so reading the counters
+ * doesn't allocate. */
+LUAWAV_PRIVATE
+int
+luawav_allocations(lua_State *L) {
+    luawav_alloc_counter *c = luawav_alloc_counter_get(L);
+    void *ud = NULL;
+
+    if(c == NULL) {
+        c = (luawav_alloc_counter *)lua_newuserdata(L,sizeof(luawav_alloc_counter));
+        c->alloc = lua_getallocf(L,&c->ud);
+        c->lua = 0;
+        c->drwav = 0;
+
+        if(luaL_newmetatable(L,luawav_alloc_mt)) {
+            lua_pushcfunction(L,luawav_alloc_counter_gc);
+            lua_setfield(L,-2,"__gc");
+        }
+        lua_setmetatable(L,-2);
+
+        lua_setallocf(L,luawav_counting_alloc,c);
+        /* LuaJIT ignores lua_setallocf */
+        if(lua_getallocf(L,&ud) != luawav_counting_alloc) {
+            return luaL_error(L,"unable to replace the allocator in this Lua");
+        }
+
+        lua_pushlightuserdata(L,&luawav_alloc_key);
+        lua_insert(L,-2);
+        lua_rawset(L,LUA_REGISTRYINDEX);
+    }
+
+    lua_pushinteger(L,(lua_Integer)c->lua);
+    lua_pushinteger(L,(lua_Integer)c->drwav);
+    return 2;
+}
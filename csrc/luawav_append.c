@@ -0,0 +1,202 @@
+/* append mode, for adding audio to the end of an existing file. The
+ * header is read with dr_wav from the file luawav opens for the writer,
+ * then dr_wav's writer is set up without writing a header of its own and
+ * carries on from the end of the data chunk. The sizes are written by
+ * luawav when the writer's closed, as dr_wav would work them out for its
+ * own header layout; a RIFF file that's grown past 4GB becomes RF64, if
+ * it has the 28-byte JUNK chunk reserved for that after "WAVE". Without
+ * one, writes stop short of 4GB rather than leave sizes that don't fit. */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "luawav_internal.h"
+#include <stdio.h>
+#include <string.h>
+
+#define APPEND_JUNK_POS 12
+#define APPEND_DS64_SIZE 28
+
+/* takes the header drwav_init_write would write, the file has one */
+LUAWAV_PRIVATE
+size_t
+luawav_append_discard(void *userData, const void *data, size_t bytes) {
+    (void)userData;
+    (void)data;
+    return bytes;
+}
+
+/* the most padding there can be after the data: W64 aligns chunks to 8
+ * bytes, though dr_wav writes size % 8 bytes rather than the rest of 8 */
+static drwav_uint64
+luawav_append_padding(drwav_container container) {
+    return container == drwav_container_w64 ? 7 : 1;
+}
+
+/* the size of a JUNK chunk right after "WAVE", 0 if there isn't one */
+static drwav_uint64
+luawav_append_junk(FILE *file) {
+    drwav_uint8 b[8];
+
+    if(luawav_fseek(file,APPEND_JUNK_POS,SEEK_SET) != 0) return 0;
+    if(fread(b,1,8,file) != 8 || memcmp(b,"JUNK",4) != 0) return 0;
+    return (drwav_uint64)b[4] | ((drwav_uint64)b[5] << 8) | ((drwav_uint64)b[6] << 16) | ((drwav_uint64)b[7] << 24);
+}
+
+/* whether an RF64 file's ds64 chunk has a sample count, dr_wav's writer
+ * leaves it 0 unless it was told the count up front */
+static int
+luawav_append_counted(FILE *file) {
+    drwav_uint8 b[8];
+
+    if(luawav_fseek(file,APPEND_JUNK_POS + 24,SEEK_SET) != 0) return 0;
+    if(fread(b,1,8,file) != 8) return 0;
+    return memcmp(b,"\0\0\0\0\0\0\0\0",8) != 0;
+}
+
+/* reads the header of the file opened in f, checks it holds the format
+ * being written and ends with the data chunk, and moves to the end of
+ * the data. A partial frame left at the end by a writer that died is
+ * written over. */
+LUAWAV_PRIVATE
+int
+luawav_append_open(luawav_flush *f, const drwav_data_format *format, const drwav_allocation_callbacks *cb, const char **err) {
+    drwav wav;
+    drwav_uint64 end = 0;
+    drwav_int64 fileSize = 0;
+    int ok = 0;
+
+    memset(&wav,0,sizeof(drwav));
+    if(!drwav_init_ex(&wav,luawav_stdio_read,luawav_stdio_seek,luawav_stdio_tell,NULL,f->file,NULL,0,cb)) {
+        *err = "not a WAV file";
+        return 0;
+    }
+
+    if(wav.container != format->container
+      || wav.translatedFormatTag != format->format
+      || wav.channels != format->channels
+      || wav.sampleRate != format->sampleRate
+      || wav.bitsPerSample != format->bitsPerSample) {
+        *err = "format doesn't match the file";
+        goto done;
+    }
+    if(wav.fmt.blockAlign == 0) {
+        *err = "invalid blockAlign";
+        goto done;
+    }
+
+    f->dataPos = wav.dataChunkDataPos;
+    f->dataSize = wav.dataChunkDataSize - (wav.dataChunkDataSize % wav.fmt.blockAlign);
+    end = wav.dataChunkDataPos + wav.dataChunkDataSize;
+    end += luawav_append_padding(wav.container);
+
+    if(luawav_fseek(f->file,0,SEEK_END) != 0 || (fileSize = (drwav_int64)luawav_ftell(f->file)) < 0) {
+        *err = "seek error";
+        goto done;
+    }
+    if((drwav_uint64)fileSize > end) {
+        *err = "the data chunk isn't the last chunk";
+        goto done;
+    }
+
+    f->junkSize = wav.container == drwav_container_riff ? luawav_append_junk(f->file) : 0;
+    f->ds64Count = wav.container == drwav_container_rf64 ? luawav_append_counted(f->file) : 0;
+    if(luawav_fseek(f->file,(drwav_int64)(f->dataPos + f->dataSize),SEEK_SET) != 0) {
+        *err = "seek error";
+        goto done;
+    }
+    f->append = 1;
+    ok = 1;
+
+    done:
+    drwav_uninit(&wav);
+    return ok;
+}
+
+/* points a writer fresh from drwav_init_write (given luawav_append_discard)
+ * at the data already in the file */
+LUAWAV_PRIVATE
+void
+luawav_append_start(const luawav_flush *f, drwav *wav, drwav_write_proc onWrite) {
+    wav->onWrite = onWrite;
+    /* with no onSeek drwav_uninit leaves the header to luawav_append_finish */
+    wav->onSeek = NULL;
+    wav->dataChunkDataPos = f->dataPos;
+    wav->dataChunkDataSize = f->dataSize;
+}
+
+/* rewrites the header of a RIFF file as RF64, turning the reserved JUNK
+ * chunk into ds64 (and a smaller JUNK chunk, for a bigger reservation) */
+static int
+luawav_append_promote(luawav_flush *f, const drwav *wav) {
+    luawav_header_field fields[11];
+    drwav_uint64 size = wav->dataChunkDataSize;
+    unsigned int n = 0;
+
+#define APPEND_FIELD(o,v,b) fields[n].offset = (o); fields[n].value = (v); fields[n].bytes = (b); n++
+    APPEND_FIELD(APPEND_JUNK_POS,0x34367364,4); /* "ds64" */
+    APPEND_FIELD(APPEND_JUNK_POS + 4,APPEND_DS64_SIZE,4);
+    APPEND_FIELD(APPEND_JUNK_POS + 8,wav->dataChunkDataPos - 8 + size + (size & 1),8);
+    APPEND_FIELD(APPEND_JUNK_POS + 16,size,8);
+    APPEND_FIELD(APPEND_JUNK_POS + 24,size / wav->fmt.blockAlign,8);
+    APPEND_FIELD(APPEND_JUNK_POS + 32,0,4); /* table length */
+    if(f->junkSize > APPEND_DS64_SIZE) {
+        APPEND_FIELD(APPEND_JUNK_POS + 8 + APPEND_DS64_SIZE,0x4B4E554A,4); /* "JUNK" */
+        APPEND_FIELD(APPEND_JUNK_POS + 12 + APPEND_DS64_SIZE,f->junkSize - APPEND_DS64_SIZE - 8,4);
+    }
+    APPEND_FIELD(wav->dataChunkDataPos - 4,0xFFFFFFFF,4);
+    /* last, so the file only claims to be RF64 once the rest is there */
+    APPEND_FIELD(0,0x34364652,4); /* "RF64" */
+    APPEND_FIELD(4,0xFFFFFFFF,4);
+#undef APPEND_FIELD
+    return luawav_flush_fields(f,fields,n);
+}
+
+/* whether the JUNK chunk can hold ds64, alone or with a JUNK chunk after */
+static int
+luawav_append_promotable(const luawav_flush *f) {
+    return f->junkSize == APPEND_DS64_SIZE || f->junkSize >= APPEND_DS64_SIZE + 8;
+}
+
+/* the frames that can still be written before the RIFF sizes would pass
+ * 4GB with no JUNK chunk to turn into ds64, all ones when there's
+ * no such limit. Writing past it would leave sizes the file can't hold. */
+LUAWAV_PRIVATE
+drwav_uint64
+luawav_append_room(const luawav_flush *f, const drwav *wav) {
+    drwav_uint64 limit = 0;
+
+    if(wav->container != drwav_container_riff || luawav_append_promotable(f)) {
+        return ~(drwav_uint64)0;
+    }
+    /* the RIFF size counts from offset 8 and includes the pad byte */
+    limit = 0xFFFFFFFF - (wav->dataChunkDataPos - 8) - 1;
+    if(wav->dataChunkDataSize >= limit) return 0;
+    return (limit - wav->dataChunkDataSize) / wav->fmt.blockAlign;
+}
+
+/* writes the sizes once drwav_uninit has written the padding, and the
+ * ds64 sample count of an RF64 file that has one, as dr_wav reads that
+ * over the data size */
+LUAWAV_PRIVATE
+int
+luawav_append_finish(luawav_flush *f, const drwav *wav) {
+    drwav_uint64 size = wav->dataChunkDataSize;
+    luawav_header_field count;
+
+    if(wav->container == drwav_container_riff
+      && wav->dataChunkDataPos - 8 + size + (size & 1) > 0xFFFFFFFF
+      && luawav_append_promotable(f)) {
+        return luawav_append_promote(f,wav);
+    }
+    if(!luawav_flush_drwav(f,wav)) return 0;
+    if(!f->ds64Count) return 1;
+    count.offset = APPEND_JUNK_POS + 24;
+    count.value = size / wav->fmt.blockAlign;
+    count.bytes = 8;
+    return luawav_flush_fields(f,&count,1);
+}
@@ -0,0 +1,192 @@
+/* per-handle instrumentation, for handles opened with instrument = true.
+ * dr_wav is given the counted callbacks below, which time the I/O
+ * callbacks they wrap; files are opened by luawav so their stdio calls
+ * can be wrapped the same way. The read and write paths in luawav.c add
+ * decode, conversion and table building times. */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "luawav_internal.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* a monotonic clock in nanoseconds */
+LUAWAV_PRIVATE
+drwav_uint64
+luawav_now_ns(void) {
+#if defined(_WIN32)
+    LARGE_INTEGER f;
+    LARGE_INTEGER t;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (drwav_uint64)((double)t.QuadPart * (1000000000.0 / (double)f.QuadPart));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ((drwav_uint64)ts.tv_sec * 1000000000) + (drwav_uint64)ts.tv_nsec;
+#endif
+}
+
+/* adds one call, started at `start`, that moved `amount` bytes, frames
+ * or samples */
+LUAWAV_PRIVATE
+void
+luawav_counter_add(luawav_counter *k, drwav_uint64 start, drwav_uint64 amount) {
+    k->calls++;
+    k->ns += luawav_now_ns() - start;
+    k->amount += amount;
+}
+
+/* stdio callbacks for dr_wav, for files luawav opens itself */
+LUAWAV_PRIVATE
+size_t
+luawav_stdio_read(void *userData, void *buffer, size_t bytes) {
+    return fread(buffer,1,bytes,(FILE *)userData);
+}
+
+LUAWAV_PRIVATE
+size_t
+luawav_stdio_write(void *userData, const void *data, size_t bytes) {
+    return fwrite(data,1,bytes,(FILE *)userData);
+}
+
+LUAWAV_PRIVATE
+drwav_bool32
+luawav_stdio_seek(void *userData, int offset, drwav_seek_origin origin) {
+    int whence = SEEK_SET;
+    switch(origin) {
+        case DRWAV_SEEK_CUR: whence = SEEK_CUR; break;
+        case DRWAV_SEEK_END: whence = SEEK_END; break;
+        default: break;
+    }
+    return luawav_fseek((FILE *)userData,offset,whence) == 0;
+}
+
+LUAWAV_PRIVATE
+drwav_bool32
+luawav_stdio_tell(void *userData, drwav_int64 *pCursor) {
+    *pCursor = (drwav_int64)luawav_ftell((FILE *)userData);
+    return *pCursor >= 0;
+}
+
+/* zeroes the counts and turns counting on or off, closing a file left
+ * from an earlier open */
+LUAWAV_PRIVATE
+void
+luawav_counters_reset(luawav_counters *c, int enabled) {
+    luawav_counters_close(c);
+    memset(c,0,sizeof(luawav_counters));
+    c->enabled = enabled;
+}
+
+/* sets the counted callbacks up to wrap these ones */
+LUAWAV_PRIVATE
+void
+luawav_counters_wrap(luawav_counters *c, drwav_read_proc onRead, drwav_write_proc onWrite, drwav_seek_proc onSeek, drwav_tell_proc onTell, void *pUserData) {
+    c->onRead = onRead;
+    c->onWrite = onWrite;
+    c->onSeek = onSeek;
+    c->onTell = onTell;
+    c->pUserData = pUserData;
+}
+
+/* opens filename to be read or written through the counted callbacks,
+ * mode is "rb" or "wb" */
+LUAWAV_PRIVATE
+int
+luawav_counters_open(luawav_counters *c, const char *filename, const char *mode) {
+    luawav_counters_close(c);
+    c->file = fopen(filename,mode);
+    if(c->file == NULL) return 0;
+    luawav_counters_wrap(c,luawav_stdio_read,luawav_stdio_write,luawav_stdio_seek,luawav_stdio_tell,c->file);
+    return 1;
+}
+
+/* closes the file opened by luawav_counters_open, the counts are kept */
+LUAWAV_PRIVATE
+void
+luawav_counters_close(luawav_counters *c) {
+    if(c->file != NULL) {
+        fclose(c->file);
+        c->file = NULL;
+    }
+}
+
+LUAWAV_PRIVATE
+size_t
+luawav_counted_read(void *userData, void *buffer, size_t bytes) {
+    luawav_counters *c = (luawav_counters *)userData;
+    drwav_uint64 start = luawav_now_ns();
+    size_t r = c->onRead(c->pUserData,buffer,bytes);
+    luawav_counter_add(&c->read,start,r);
+    return r;
+}
+
+LUAWAV_PRIVATE
+size_t
+luawav_counted_write(void *userData, const void *data, size_t bytes) {
+    luawav_counters *c = (luawav_counters *)userData;
+    drwav_uint64 start = luawav_now_ns();
+    size_t r = c->onWrite(c->pUserData,data,bytes);
+    luawav_counter_add(&c->write,start,r);
+    return r;
+}
+
+LUAWAV_PRIVATE
+drwav_bool32
+luawav_counted_seek(void *userData, int offset, drwav_seek_origin origin) {
+    luawav_counters *c = (luawav_counters *)userData;
+    drwav_uint64 start = luawav_now_ns();
+    drwav_bool32 r = c->onSeek(c->pUserData,offset,origin);
+    luawav_counter_add(&c->seek,start,0);
+    return r;
+}
+
+LUAWAV_PRIVATE
+drwav_bool32
+luawav_counted_tell(void *userData, drwav_int64 *pCursor) {
+    luawav_counters *c = (luawav_counters *)userData;
+    drwav_uint64 start = luawav_now_ns();
+    drwav_bool32 r = c->onTell(c->pUserData,pCursor);
+    luawav_counter_add(&c->tell,start,0);
+    return r;
+}
+
+static void
+luawav_counter_push(lua_State *L, const luawav_counter *k, const char *name, const char *amount) {
+    lua_createtable(L,0,3);
+    luawav_pushuint64(L,k->calls);
+    lua_setfield(L,-2,"calls");
+    luawav_pushuint64(L,k->ns);
+    lua_setfield(L,-2,"ns");
+    if(amount != NULL) {
+        luawav_pushuint64(L,k->amount);
+        lua_setfield(L,-2,amount);
+    }
+    lua_setfield(L,-2,name);
+}
+
+/* pushes the counters as a table of tables, one per counter */
+LUAWAV_PRIVATE
+void
+luawav_counters_push(lua_State *L, const luawav_counters *c) {
+    lua_createtable(L,0,7);
+    luawav_counter_push(L,&c->read,"read","bytes");
+    luawav_counter_push(L,&c->seek,"seek",NULL);
+    luawav_counter_push(L,&c->tell,"tell",NULL);
+    luawav_counter_push(L,&c->write,"write","bytes");
+    luawav_counter_push(L,&c->decode,"decode","frames");
+    luawav_counter_push(L,&c->convert,"convert","samples");
+    luawav_counter_push(L,&c->push,"push","samples");
+}
@@ -0,0 +1,426 @@
+/* push decoder, for WAV arriving in pieces off a socket:
+ *
+ *   local dec = wav.decoder({ type = "s16" })
+ *   local samples, frames = dec:feed(packet)
+ *
+ * dr_wav reads through callbacks, so it's given callbacks that serve a
+ * buffer the packets are copied into. Until the header has been parsed,
+ * the buffer holds everything from the start of the stream, and dr_wav
+ * parses it from the top again each time more arrives. After that, each
+ * feed only decodes the frames the buffer holds whole, so dr_wav never
+ * runs short partway through an ADPCM block, and the bytes it has had are
+ * dropped. Packets are copied in a piece at a time, which keeps the
+ * buffer to about one block however large they are. */
+
+#include "luawav_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define DECODER_CHUNK 16384 /* most bytes copied in before decoding */
+#define DECODER_SAMPLES 4096 /* samples decoded per dr_wav call */
+
+static const char * const luawav_decoder_mt = "luawav_decoder";
+
+/* option names, and the sample type each is */
+static const char * const luawav_decoder_types[] = { "s16", "s32", "f32", NULL };
+static const int luawav_decoder_type_ids[] = { LUAWAV_S16, LUAWAV_S32, LUAWAV_F32 };
+
+enum {
+    DECODER_HEADER = 0, /* waiting on the header */
+    DECODER_DATA,       /* decoding */
+    DECODER_DONE,       /* finished, or failed with err set */
+};
+
+typedef struct luawav_decoder_s {
+    drwav wav;
+    int state;
+    int type;
+    int planar;
+    int eof; /* finish was called, dr_wav can have whatever is left */
+    int starved; /* dr_wav asked for bytes that haven't arrived */
+    const char *err;
+    drwav_uint8 *buffer;
+    size_t size; /* bytes in the buffer */
+    size_t pos; /* bytes of it dr_wav has had */
+    size_t alloc;
+    drwav_uint64 base; /* stream offset of the start of the buffer */
+    union {
+        float f32[DECODER_SAMPLES];
+        drwav_int32 s32[DECODER_SAMPLES];
+        drwav_int16 s16[DECODER_SAMPLES];
+    } pcm;
+} luawav_decoder;
+
+static size_t
+luawav_decoder_read(void *userData, void *buffer, size_t bytes) {
+    luawav_decoder *d = (luawav_decoder *)userData;
+    size_t n = WAV_MIN(bytes,d->size - d->pos);
+
+    if(n > 0) {
+        memcpy(buffer,d->buffer + d->pos,n);
+        d->pos += n;
+    }
+    if(n < bytes && !d->eof) d->starved = 1;
+    return n;
+}
+
+static drwav_bool32
+luawav_decoder_seek(void *userData, int offset, drwav_seek_origin origin) {
+    luawav_decoder *d = (luawav_decoder *)userData;
+    drwav_int64 target = 0;
+
+    switch(origin) {
+        case DRWAV_SEEK_SET: target = offset - (drwav_int64)d->base; break;
+        case DRWAV_SEEK_CUR: target = (drwav_int64)d->pos + offset; break;
+        default: return 0;
+    }
+    if(target < 0) return 0;
+    if((drwav_uint64)target > d->size) {
+        if(!d->eof) d->starved = 1;
+        return 0;
+    }
+    d->pos = (size_t)target;
+    return 1;
+}
+
+static drwav_bool32
+luawav_decoder_tell(void *userData, drwav_int64 *pCursor) {
+    luawav_decoder *d = (luawav_decoder *)userData;
+    *pCursor = (drwav_int64)(d->base + d->pos);
+    return 1;
+}
+
+/* copies up to `bytes` in, returning how many it took. Once the header is
+ * parsed, bytes dr_wav has had are dropped first. */
+static size_t
+luawav_decoder_append(lua_State *L, luawav_decoder *d, const char *data, size_t bytes) {
+    drwav_uint8 *buffer = NULL;
+    size_t alloc = 0;
+    size_t room = DECODER_CHUNK;
+
+    if(d->state == DECODER_DATA) {
+        if(d->pos > 0) {
+            memmove(d->buffer,d->buffer + d->pos,d->size - d->pos);
+            d->size -= d->pos;
+            d->base += d->pos;
+            d->pos = 0;
+        }
+        /* room for a whole block past what's left of the last one */
+        room = WAV_MAX(room,(size_t)d->wav.fmt.blockAlign * 2);
+        room = room > d->size ? room - d->size : WAV_MAX(d->wav.fmt.blockAlign,1);
+    }
+    bytes = WAV_MIN(bytes,room);
+
+    if(d->size + bytes > d->alloc) {
+        alloc = d->alloc > 0 ? d->alloc : DECODER_CHUNK;
+        while(alloc < d->size + bytes) alloc *= 2;
+        buffer = (drwav_uint8 *)realloc(d->buffer,alloc);
+        if(buffer == NULL) {
+            luaL_error(L,"out of memory");
+            return 0;
+        }
+        d->buffer = buffer;
+        d->alloc = alloc;
+    }
+    if(bytes > 0) {
+        memcpy(d->buffer + d->size,data,bytes);
+        d->size += bytes;
+    }
+    return bytes;
+}
+
+/* has dr_wav go through the header again with what's arrived. Leaves the
+ * state at DECODER_HEADER when it ran short. */
+static void
+luawav_decoder_parse(lua_State *L, luawav_decoder *d) {
+    drwav_allocation_callbacks cb;
+
+    d->pos = 0;
+    d->starved = 0;
+    /* sequential, so AIFF doesn't look past the sound data for chunks */
+    if(drwav_init_ex(&d->wav,
+      luawav_decoder_read,
+      luawav_decoder_seek,
+      luawav_decoder_tell,
+      NULL,
+      d,
+      NULL,
+      DRWAV_SEQUENTIAL,
+      luawav_allocation_callbacks(L,&cb))) {
+        d->state = DECODER_DATA;
+        return;
+    }
+    memset(&d->wav,0,sizeof(drwav));
+    if(!d->starved) {
+        d->state = DECODER_DONE;
+        d->err = d->eof ? "incomplete header" : "invalid WAV stream";
+    }
+}
+
+/* how many frames can be decoded from the buffered bytes without dr_wav
+ * running out partway through */
+static drwav_uint64
+luawav_decoder_ready(luawav_decoder *d) {
+    drwav *wav = &d->wav;
+    drwav_uint64 avail = d->size - d->pos;
+    drwav_uint64 frames = 0;
+    drwav_uint64 cached = 0;
+    drwav_uint64 partial = 0;
+    drwav_uint64 perBlock = 0;
+    drwav_uint64 bytes = 0;
+    unsigned int channels = wav->channels;
+
+    if(wav->readCursorInPCMFrames >= wav->totalPCMFrameCount) return 0;
+    /* at the end, or the rest of the data has arrived, so a short last
+     * block can go too */
+    if(d->eof || d->base + d->size >= wav->dataChunkDataPos + wav->dataChunkDataSize) {
+        return wav->totalPCMFrameCount - wav->readCursorInPCMFrames;
+    }
+
+    switch(wav->translatedFormatTag) {
+        case DR_WAVE_FORMAT_ADPCM: {
+            cached = wav->msadpcm.cachedFrameCount;
+            partial = wav->msadpcm.bytesRemainingInBlock;
+            perBlock = luawav_adpcm_block_frames(wav);
+            break;
+        }
+        case DR_WAVE_FORMAT_DVI_ADPCM: {
+            cached = wav->ima.cachedFrameCount;
+            partial = wav->ima.bytesRemainingInBlock;
+            perBlock = luawav_adpcm_block_frames(wav);
+            break;
+        }
+        default: {
+            bytes = luawav_frame_bytes(wav);
+            frames = bytes > 0 ? avail / bytes : 0;
+            break;
+        }
+    }
+
+    if(perBlock > 0) {
+        /* what's cached, then the rest of the current block, a nibble per
+         * sample, then whole blocks */
+        frames = cached;
+        if(avail >= partial) {
+            frames += partial * 2 / channels;
+            frames += ((avail - partial) / wav->fmt.blockAlign) * perBlock;
+        }
+    }
+
+    return WAV_MIN(frames,wav->totalPCMFrameCount - wav->readCursorInPCMFrames);
+}
+
+/* decodes up to `frames` frames onto the samples table at idx, which
+ * already holds `done` frames. Returns the frames decoded. */
+static drwav_uint64
+luawav_decoder_decode(lua_State *L, luawav_decoder *d, int idx, drwav_uint64 done, drwav_uint64 frames) {
+    drwav_uint64 r = 0;
+    drwav_uint64 n = 0;
+    drwav_uint64 t = 0;
+    drwav_uint64 f = 0;
+    unsigned int c = 0;
+    unsigned int channels = d->wav.channels;
+    drwav_uint64 block = DECODER_SAMPLES / channels;
+
+    while(r < frames) {
+        n = WAV_MIN(frames - r,block);
+        switch(d->type) {
+            case LUAWAV_F32: t = drwav_read_pcm_frames_f32(&d->wav,n,d->pcm.f32); break;
+            case LUAWAV_S32: t = drwav_read_pcm_frames_s32(&d->wav,n,d->pcm.s32); break;
+            default: t = drwav_read_pcm_frames_s16(&d->wav,n,d->pcm.s16); break;
+        }
+        for(f=0;f<t;f++) {
+            for(c=0;c<channels;c++) {
+                switch(d->type) {
+                    case LUAWAV_F32: lua_pushnumber(L,d->pcm.f32[(f * channels) + c]); break;
+                    case LUAWAV_S32: lua_pushinteger(L,d->pcm.s32[(f * channels) + c]); break;
+                    default: lua_pushinteger(L,d->pcm.s16[(f * channels) + c]); break;
+                }
+                if(d->planar) {
+                    lua_rawgeti(L,idx,c + 1);
+                    lua_insert(L,-2);
+                    lua_rawseti(L,-2,(lua_Integer)(done + r + f + 1));
+                    lua_pop(L,1);
+                } else {
+                    lua_rawseti(L,idx,(lua_Integer)(((done + r + f) * channels) + c + 1));
+                }
+            }
+        }
+        r += t;
+        if(t < n) break;
+    }
+    return r;
+}
+
+static void
+luawav_decoder_samples(lua_State *L, luawav_decoder *d) {
+    unsigned int c = 0;
+
+    lua_newtable(L);
+    if(d->planar) {
+        for(c=0;c<d->wav.channels;c++) {
+            lua_newtable(L);
+            lua_rawseti(L,-2,c + 1);
+        }
+    }
+}
+
+/* pushes the samples table and frame count, or nil and why there are no
+ * frames */
+static int
+luawav_decoder_result(lua_State *L, luawav_decoder *d, drwav_uint64 frames) {
+    if(d->state == DECODER_DONE && d->err != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,d->err);
+        return 2;
+    }
+    if(frames == 0 && !d->eof) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"need more data");
+        return 2;
+    }
+    if(lua_isnil(L,-1)) {
+        lua_pop(L,1);
+        lua_newtable(L);
+    }
+    lua_pushinteger(L,(lua_Integer)frames);
+    return 2;
+}
+
+/* decoder = wav.decoder([options]) */
+static int
+luawav_decoder_new(lua_State *L) {
+    luawav_decoder *d = NULL;
+    int type = luawav_decoder_type_ids[luawav_opt_enum(L,1,"type",luawav_decoder_types)];
+    int planar = luawav_opt_boolean(L,1,"planar");
+
+    d = (luawav_decoder *)lua_newuserdata(L,sizeof(luawav_decoder));
+    if(d == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    memset(d,0,sizeof(luawav_decoder));
+    d->type = type;
+    d->planar = planar;
+    luaL_setmetatable(L,luawav_decoder_mt);
+    return 1;
+}
+
+/* samples, frames = decoder:feed(bytes) - nil, "need more data" when
+ * nothing could be decoded yet, nil and a message once the stream turns
+ * out not to be a WAV */
+static int
+luawav_decoder_feed(lua_State *L) {
+    luawav_decoder *d = luaL_checkudata(L,1,luawav_decoder_mt);
+    size_t len = 0;
+    const char *data = luaL_checklstring(L,2,&len);
+    size_t used = 0;
+    drwav_uint64 frames = 0;
+
+    if(d->eof) {
+        return luaL_error(L,"decoder already finished");
+    }
+    lua_settop(L,2);
+    lua_pushnil(L); /* samples, made on the first frames */
+
+    while(used < len && d->state != DECODER_DONE) {
+        used += luawav_decoder_append(L,d,data + used,len - used);
+        if(d->state == DECODER_HEADER) {
+            luawav_decoder_parse(L,d);
+            if(d->state != DECODER_DATA) continue;
+        }
+        if(d->wav.readCursorInPCMFrames >= d->wav.totalPCMFrameCount) {
+            /* past the data, nothing more is needed */
+            d->size = 0;
+            d->pos = 0;
+            continue;
+        }
+        if(luawav_decoder_ready(d) > 0) {
+            if(lua_isnil(L,3)) {
+                lua_pop(L,1);
+                luawav_decoder_samples(L,d);
+            }
+            frames += luawav_decoder_decode(L,d,3,frames,luawav_decoder_ready(d));
+        }
+    }
+
+    return luawav_decoder_result(L,d,frames);
+}
+
+/* samples, frames = decoder:finish() - decodes whatever's left, once the
+ * stream has ended. A short final ADPCM block is only decoded here. */
+static int
+luawav_decoder_finish(lua_State *L) {
+    luawav_decoder *d = luaL_checkudata(L,1,luawav_decoder_mt);
+    drwav_uint64 frames = 0;
+
+    if(d->eof) {
+        return luaL_error(L,"decoder already finished");
+    }
+    d->eof = 1;
+    lua_settop(L,1);
+    lua_pushnil(L);
+
+    if(d->state == DECODER_HEADER) {
+        luawav_decoder_parse(L,d);
+    }
+    if(d->state == DECODER_DATA) {
+        lua_pop(L,1);
+        luawav_decoder_samples(L,d);
+        frames = luawav_decoder_decode(L,d,2,0,luawav_decoder_ready(d));
+        drwav_uninit(&d->wav);
+        d->state = DECODER_DONE;
+    }
+    return luawav_decoder_result(L,d,frames);
+}
+
+/* fmt = decoder:format() - the stream's format, or nil until the header
+ * has arrived */
+static int
+luawav_decoder_format(lua_State *L) {
+    luawav_decoder *d = luaL_checkudata(L,1,luawav_decoder_mt);
+
+    if(d->wav.onRead == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    luawav_push_fmt(L,&d->wav.fmt);
+    return 1;
+}
+
+static int
+luawav_decoder_gc(lua_State *L) {
+    luawav_decoder *d = luaL_checkudata(L,1,luawav_decoder_mt);
+
+    if(d->state == DECODER_DATA) {
+        drwav_uninit(&d->wav);
+        d->state = DECODER_DONE;
+    }
+    memset(&d->wav,0,sizeof(drwav));
+    free(d->buffer);
+    d->buffer = NULL;
+    d->size = 0;
+    d->pos = 0;
+    d->alloc = 0;
+    return 0;
+}
+
+static const struct luaL_Reg luawav_decoder_methods[] = {
+    { "feed", luawav_decoder_feed },
+    { "finish", luawav_decoder_finish },
+    { "format", luawav_decoder_format },
+    { NULL, NULL },
+};
+
+LUAWAV_PUBLIC
+int luaopen_luawav_decoder(lua_State *L) {
+    if(luaL_newmetatable(L,luawav_decoder_mt)) {
+        lua_pushcfunction(L,luawav_decoder_gc);
+        lua_setfield(L,-2,"__gc");
+        lua_newtable(L);
+        luaL_setfuncs(L,luawav_decoder_methods,0);
+        lua_setfield(L,-2,"__index");
+    }
+    lua_pop(L,1);
+    lua_pushcfunction(L,luawav_decoder_new);
+    return 1;
+}
@@ -0,0 +1,1038 @@
+/* whole-file operations that work on the container directly, moving
+ * chunk bodies around without decoding any samples */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "luawav_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#define LUAWAV_HAVE_SENDFILE 1
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define LUAWAV_HAVE_COPY_FILE_RANGE 1
+#endif
+#endif
+
+#define COPY_BUFFER 65536
+#define RIFF_MAX 0xFFFFFFFFULL
+
+/* every chunk id is stored as a W64 GUID, RIFF fourccs get the
+ * standard ACF3-11D3-8CD1-00C04F8EDB8A suffix */
+static const drwav_uint8 luawav_w64_suffix[12] = {
+    0xF3,0xAC, 0xD3,0x11, 0x8C,0xD1, 0x00,0xC0,0x4F,0x8E,0xDB,0x8A
+};
+static const drwav_uint8 luawav_w64_riff[16] = {
+    0x72,0x69,0x66,0x66, 0x2E,0x91, 0xCF,0x11, 0xA5,0xD6, 0x28,0xDB,0x04,0xC1,0x00,0x00
+};
+static const drwav_uint8 luawav_w64_wave[16] = {
+    0x77,0x61,0x76,0x65, 0xF3,0xAC, 0xD3,0x11, 0x8C,0xD1, 0x00,0xC0,0x4F,0x8E,0xDB,0x8A
+};
+
+static void
+luawav_put_u32(drwav_uint8 *b, drwav_uint32 v) {
+    b[0] = (drwav_uint8)(v);
+    b[1] = (drwav_uint8)(v >> 8);
+    b[2] = (drwav_uint8)(v >> 16);
+    b[3] = (drwav_uint8)(v >> 24);
+}
+
+static void
+luawav_put_u64(drwav_uint8 *b, drwav_uint64 v) {
+    luawav_put_u32(b, (drwav_uint32)(v & 0xFFFFFFFF));
+    luawav_put_u32(b + 4, (drwav_uint32)(v >> 32));
+}
+
+static void
+luawav_fourcc_to_guid(drwav_uint8 guid[16], const char *fourcc) {
+    memcpy(guid,fourcc,4);
+    memcpy(guid+4,luawav_w64_suffix,12);
+}
+
+static int
+luawav_guid_has_fourcc(const drwav_uint8 guid[16]) {
+    return memcmp(guid+4,luawav_w64_suffix,12) == 0;
+}
+
+LUAWAV_PRIVATE
+int
+luawav_chunk_is(const luawav_chunk *c, const char *fourcc) {
+    return luawav_guid_has_fourcc(c->id) && memcmp(c->id,fourcc,4) == 0;
+}
+
+LUAWAV_PRIVATE
+unsigned int
+luawav_chunk_padding(drwav_container container, drwav_uint64 size) {
+    if(container == drwav_container_w64) {
+        return (unsigned int)((8 - (size % 8)) % 8);
+    }
+    return (unsigned int)(size % 2);
+}
+
+static int
+luawav_riff_add(luawav_riff *r, const drwav_uint8 id[16], drwav_uint64 offset, drwav_uint64 size) {
+    luawav_chunk *t = NULL;
+    if(r->count == r->alloc) {
+        t = realloc(r->chunks, sizeof(luawav_chunk) * (r->alloc ? r->alloc * 2 : 16));
+        if(t == NULL) return 0;
+        r->chunks = t;
+        r->alloc = r->alloc ? r->alloc * 2 : 16;
+    }
+    memcpy(r->chunks[r->count].id,id,16);
+    r->chunks[r->count].offset = offset;
+    r->chunks[r->count].size = size;
+    r->count++;
+    return 1;
+}
+
+LUAWAV_PRIVATE
+void
+luawav_riff_free(luawav_riff *r) {
+    free(r->chunks);
+    r->chunks = NULL;
+    r->count = 0;
+    r->alloc = 0;
+}
+
+static void
+luawav_riff_parse_fmt(luawav_riff *r) {
+    const drwav_uint8 *f = r->fmt;
+    r->formatTag = drwav_bytes_to_u16(f);
+    r->channels = drwav_bytes_to_u16(f+2);
+    r->sampleRate = drwav_bytes_to_u32(f+4);
+    r->blockAlign = drwav_bytes_to_u16(f+12);
+    r->bitsPerSample = drwav_bytes_to_u16(f+14);
+    r->translatedFormatTag = r->formatTag;
+    if(r->formatTag == DR_WAVE_FORMAT_EXTENSIBLE && r->fmtSize >= 40) {
+        r->translatedFormatTag = drwav_bytes_to_u16(f+24);
+    }
+}
+
+/* walks the chunk list of a RIFF, RF64 or W64 file, recording where
+ * each chunk body lives. the fmt chunk body is kept in memory. */
+LUAWAV_PRIVATE
+const char *
+luawav_riff_parse(FILE *f, luawav_riff *r) {
+    drwav_uint8 hdr[40];
+    drwav_uint8 id[16];
+    drwav_uint64 pos = 0;
+    drwav_uint64 size = 0;
+    drwav_uint64 end = 0;
+    drwav_uint64 ds64Data = 0;
+    int haveDs64 = 0;
+    unsigned int hdrlen = 0;
+
+    memset(r,0,sizeof(luawav_riff));
+    r->fmtIndex = -1;
+    r->dataIndex = -1;
+    r->factIndex = -1;
+
+    if(fread(hdr,1,12,f) != 12) return "unable to read header";
+    if(memcmp(hdr,"RIFF",4) == 0 && memcmp(hdr+8,"WAVE",4) == 0) {
+        r->container = drwav_container_riff;
+        end = 8 + (drwav_uint64)drwav_bytes_to_u32(hdr+4);
+        pos = 12;
+    } else if( (memcmp(hdr,"RF64",4) == 0 || memcmp(hdr,"BW64",4) == 0) && memcmp(hdr+8,"WAVE",4) == 0) {
+        r->container = drwav_container_rf64;
+        end = (drwav_uint64)-1;
+        pos = 12;
+    } else if(memcmp(hdr,luawav_w64_riff,12) == 0) {
+        if(fread(hdr+12,1,28,f) != 28) return "unable to read header";
+        if(memcmp(hdr,luawav_w64_riff,16) != 0 || memcmp(hdr+24,luawav_w64_wave,16) != 0) {
+            return "not a WAV file";
+        }
+        r->container = drwav_container_w64;
+        end = drwav_bytes_to_u64(hdr+16);
+        pos = 40;
+    } else {
+        return "not a WAV file";
+    }
+
+    hdrlen = r->container == drwav_container_w64 ? 24 : 8;
+
+    while(pos + hdrlen <= end) {
+        if(fread(hdr,1,hdrlen,f) != hdrlen) break;
+        pos += hdrlen;
+        if(r->container == drwav_container_w64) {
+            memcpy(id,hdr,16);
+            size = drwav_bytes_to_u64(hdr+16);
+            if(size < 24) return "invalid chunk size";
+            size -= 24;
+        } else {
+            luawav_fourcc_to_guid(id,(const char *)hdr);
+            size = drwav_bytes_to_u32(hdr+4);
+        }
+
+        if(r->container == drwav_container_rf64 && memcmp(hdr,"ds64",4) == 0) {
+            if(size < 24 || fread(hdr+8,1,24,f) != 24) return "invalid ds64 chunk";
+            ds64Data = drwav_bytes_to_u64(hdr+16);
+            r->sampleCount = drwav_bytes_to_u64(hdr+24);
+            haveDs64 = 1;
+            if(luawav_fseek(f,(drwav_int64)(pos + size + luawav_chunk_padding(r->container,size)),SEEK_SET) != 0) break;
+            pos += size + luawav_chunk_padding(r->container,size);
+            continue;
+        }
+
+        if(luawav_guid_has_fourcc(id) && memcmp(id,"data",4) == 0) {
+            if(r->container == drwav_container_rf64 && haveDs64 && size == 0xFFFFFFFF) {
+                size = ds64Data;
+            }
+            r->dataIndex = (int)r->count;
+        } else if(luawav_guid_has_fourcc(id) && memcmp(id,"fmt ",4) == 0) {
+            if(size < 16) return "invalid fmt chunk";
+            r->fmtSize = size > sizeof(r->fmt) ? (unsigned int)sizeof(r->fmt) : (unsigned int)size;
+            if(fread(r->fmt,1,r->fmtSize,f) != r->fmtSize) return "unable to read fmt chunk";
+            luawav_riff_parse_fmt(r);
+            r->fmtIndex = (int)r->count;
+        } else if(luawav_guid_has_fourcc(id) && memcmp(id,"fact",4) == 0) {
+            if(size >= 4 && fread(hdr,1,size >= 8 ? 8 : 4,f) == (size >= 8 ? 8 : 4)) {
+                if(r->container == drwav_container_w64 && size >= 8) {
+                    r->factCount = drwav_bytes_to_u64(hdr);
+                } else {
+                    r->factCount = drwav_bytes_to_u32(hdr);
+                }
+            }
+            r->factIndex = (int)r->count;
+        }
+
+        if(!luawav_riff_add(r,id,pos,size)) return "out of memory";
+
+        pos += size + luawav_chunk_padding(r->container,size);
+        if(luawav_fseek(f,(drwav_int64)pos,SEEK_SET) != 0) break;
+    }
+
+    if(r->fmtIndex < 0) return "missing fmt chunk";
+    if(r->dataIndex < 0) return "missing data chunk";
+
+    r->dataSize = r->chunks[r->dataIndex].size;
+    if(r->sampleCount == 0) {
+        r->sampleCount = r->factCount;
+    }
+    if(r->sampleCount == 0 && r->blockAlign > 0 && (
+        r->translatedFormatTag == DR_WAVE_FORMAT_PCM ||
+        r->translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT ||
+        r->translatedFormatTag == DR_WAVE_FORMAT_ALAW ||
+        r->translatedFormatTag == DR_WAVE_FORMAT_MULAW)) {
+        r->sampleCount = r->dataSize / r->blockAlign;
+    }
+
+    return NULL;
+}
+
+LUAWAV_PRIVATE
+drwav_uint64
+luawav_riff_chunk_total(drwav_container container, drwav_uint64 size) {
+    return (container == drwav_container_w64 ? 24 : 8) + size + luawav_chunk_padding(container,size);
+}
+
+/* size of everything following the container header, used for the
+ * RIFF/ds64/W64 size fields */
+LUAWAV_PRIVATE
+int
+luawav_riff_write_header(FILE *f, drwav_container container, drwav_uint64 bodySize, drwav_uint64 dataSize, drwav_uint64 sampleCount) {
+    drwav_uint8 hdr[48];
+
+    if(container == drwav_container_riff) {
+        if(4 + bodySize > RIFF_MAX) return 0;
+        memcpy(hdr,"RIFF",4);
+        luawav_put_u32(hdr+4,(drwav_uint32)(4 + bodySize));
+        memcpy(hdr+8,"WAVE",4);
+        return fwrite(hdr,1,12,f) == 12;
+    }
+
+    if(container == drwav_container_rf64) {
+        memcpy(hdr,"RF64",4);
+        luawav_put_u32(hdr+4,0xFFFFFFFF);
+        memcpy(hdr+8,"WAVE",4);
+        memcpy(hdr+12,"ds64",4);
+        luawav_put_u32(hdr+16,28);
+        luawav_put_u64(hdr+20,4 + 36 + bodySize);
+        luawav_put_u64(hdr+28,dataSize);
+        luawav_put_u64(hdr+36,sampleCount);
+        luawav_put_u32(hdr+44,0);
+        return fwrite(hdr,1,48,f) == 48;
+    }
+
+    if(container == drwav_container_w64) {
+        memcpy(hdr,luawav_w64_riff,16);
+        luawav_put_u64(hdr+16,40 + bodySize);
+        memcpy(hdr+24,luawav_w64_wave,16);
+        return fwrite(hdr,1,40,f) == 40;
+    }
+
+    return 0;
+}
+
+LUAWAV_PRIVATE
+int
+luawav_riff_write_chunk_header(FILE *f, drwav_container container, const drwav_uint8 id[16], drwav_uint64 size) {
+    drwav_uint8 hdr[24];
+
+    if(container == drwav_container_w64) {
+        memcpy(hdr,id,16);
+        luawav_put_u64(hdr+16,size + 24);
+        return fwrite(hdr,1,24,f) == 24;
+    }
+
+    memcpy(hdr,id,4);
+    if(container == drwav_container_rf64 && memcmp(id,"data",4) == 0) {
+        luawav_put_u32(hdr+4,0xFFFFFFFF);
+    } else {
+        if(size > RIFF_MAX) return 0;
+        luawav_put_u32(hdr+4,(drwav_uint32)size);
+    }
+    return fwrite(hdr,1,8,f) == 8;
+}
+
+LUAWAV_PRIVATE
+int
+luawav_riff_write_padding(FILE *f, drwav_container container, drwav_uint64 size) {
+    static const drwav_uint8 zero[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    unsigned int pad = luawav_chunk_padding(container,size);
+    if(pad == 0) return 1;
+    return fwrite(zero,1,pad,f) == pad;
+}
+
+/* writes the fact chunk body for the given container, W64 uses a
+ * 64-bit sample count */
+LUAWAV_PRIVATE
+int
+luawav_riff_write_fact(FILE *f, drwav_container container, drwav_uint64 sampleCount) {
+    drwav_uint8 id[16];
+    drwav_uint8 body[8];
+    drwav_uint64 size = container == drwav_container_w64 ? 8 : 4;
+
+    luawav_fourcc_to_guid(id,"fact");
+    if(container == drwav_container_w64) {
+        luawav_put_u64(body,sampleCount);
+    } else {
+        luawav_put_u32(body,sampleCount > RIFF_MAX ? 0xFFFFFFFF : (drwav_uint32)sampleCount);
+    }
+    return luawav_riff_write_chunk_header(f,container,id,size) &&
+      fwrite(body,1,(size_t)size,f) == size &&
+      luawav_riff_write_padding(f,container,size);
+}
+
+/* copies len bytes starting at offset of in to the current position of
+ * out. on Linux this stays in the kernel whenever possible. */
+LUAWAV_PRIVATE
+int
+luawav_copy_range(FILE *in, drwav_uint64 offset, FILE *out, drwav_uint64 outpos, drwav_uint64 len) {
+    char *buf = NULL;
+    size_t n = 0;
+    size_t t = 0;
+
+#if defined(LUAWAV_HAVE_SENDFILE)
+    int infd = fileno(in);
+    int outfd = fileno(out);
+    off_t off = (off_t)offset;
+    ssize_t r = 0;
+    drwav_uint64 done = 0;
+    size_t want = 0;
+
+    if(fflush(out) != 0) return 0;
+
+#if defined(LUAWAV_HAVE_COPY_FILE_RANGE)
+    while(done < len) {
+        want = (size_t)WAV_MIN(len - done, 0x40000000ULL);
+        r = copy_file_range(infd,&off,outfd,NULL,want,0);
+        if(r <= 0) break;
+        done += (drwav_uint64)r;
+    }
+#endif
+
+    while(done < len) {
+        want = (size_t)WAV_MIN(len - done, 0x40000000ULL);
+        r = sendfile(outfd,infd,&off,want);
+        if(r <= 0) break;
+        done += (drwav_uint64)r;
+    }
+
+    /* the FILE position is stale now that the fd has moved */
+    if(luawav_fseek(out,(drwav_int64)(outpos + done),SEEK_SET) != 0) return 0;
+    offset += done;
+    len -= done;
+    if(len == 0) return 1;
+#else
+    (void)outpos;
+#endif
+
+    if(luawav_fseek(in,(drwav_int64)offset,SEEK_SET) != 0) return 0;
+
+    buf = malloc(COPY_BUFFER);
+    if(buf == NULL) return 0;
+
+    while(len > 0) {
+        n = (size_t)WAV_MIN(len, COPY_BUFFER);
+        t = fread(buf,1,n,in);
+        if(t != n || fwrite(buf,1,t,out) != t) break;
+        len -= t;
+    }
+
+    free(buf);
+    return len == 0;
+}
+
+static int
+luawav_chunk_skip(const luawav_riff *r, unsigned int i, drwav_container to) {
+    const luawav_chunk *c = &r->chunks[i];
+    if((int)i == r->fmtIndex || (int)i == r->dataIndex || (int)i == r->factIndex) return 0;
+    if(luawav_chunk_is(c,"JUNK") || luawav_chunk_is(c,"junk") || luawav_chunk_is(c,"PAD ")) return 1;
+    /* only W64 can carry chunks that aren't identified by a fourcc */
+    if(to != drwav_container_w64 && !luawav_guid_has_fourcc(c->id)) return 1;
+    return 0;
+}
+
+/* which of the three output passes a chunk goes in: before the audio,
+ * the audio itself, after the audio. dr_wav stops looking at a W64 file
+ * once it finds the data chunk, so metadata goes after the audio there */
+static int
+luawav_chunk_pass(drwav_container to, const luawav_riff *r, unsigned int i) {
+    if((int)i == r->fmtIndex || (int)i == r->factIndex) return 0;
+    if((int)i == r->dataIndex) return 1;
+    if(to == drwav_container_w64) return 2;
+    return (int)i < r->dataIndex ? 0 : 2;
+}
+
+static const char *
+luawav_rewrap_file(FILE *in, FILE *out, drwav_container to) {
+    luawav_riff r;
+    const char *err = NULL;
+    drwav_uint64 body = 0;
+    drwav_uint64 pos = 0;
+    drwav_uint64 factSize = to == drwav_container_w64 ? 8 : 4;
+    unsigned int i = 0;
+    int pass = 0;
+    const luawav_chunk *c = NULL;
+
+    err = luawav_riff_parse(in,&r);
+    if(err != NULL) {
+        luawav_riff_free(&r);
+        return err;
+    }
+
+    for(i=0;i<r.count;i++) {
+        if(luawav_chunk_skip(&r,i,to)) continue;
+        if((int)i == r.factIndex) {
+            body += luawav_riff_chunk_total(to,factSize);
+        } else {
+            body += luawav_riff_chunk_total(to,r.chunks[i].size);
+        }
+    }
+    if(r.factIndex < 0 && r.translatedFormatTag != DR_WAVE_FORMAT_PCM && r.translatedFormatTag != DR_WAVE_FORMAT_IEEE_FLOAT) {
+        body += luawav_riff_chunk_total(to,factSize);
+    }
+
+    if(to == drwav_container_riff && 4 + body > RIFF_MAX) {
+        luawav_riff_free(&r);
+        return "too large for a RIFF container";
+    }
+
+    if(!luawav_riff_write_header(out,to,body,r.dataSize,r.sampleCount)) {
+        luawav_riff_free(&r);
+        return "unable to write header";
+    }
+
+    pos = to == drwav_container_riff ? 12 : (to == drwav_container_rf64 ? 48 : 40);
+
+    for(pass=0;pass<3;pass++) {
+        for(i=0;i<r.count;i++) {
+            c = &r.chunks[i];
+            if(luawav_chunk_skip(&r,i,to)) continue;
+            if(luawav_chunk_pass(to,&r,i) != pass) continue;
+
+            if((int)i == r.factIndex) {
+                if(!luawav_riff_write_fact(out,to,r.sampleCount)) err = "write error";
+                pos += luawav_riff_chunk_total(to,factSize);
+            } else {
+                if(!luawav_riff_write_chunk_header(out,to,c->id,c->size)) {
+                    err = "write error";
+                    break;
+                }
+                pos += luawav_riff_chunk_total(to,0);
+                if(!luawav_copy_range(in,c->offset,out,pos,c->size)) {
+                    err = "unable to copy chunk data";
+                    break;
+                }
+                if(!luawav_riff_write_padding(out,to,c->size)) err = "write error";
+                pos += c->size + luawav_chunk_padding(to,c->size);
+            }
+            if(err != NULL) break;
+
+            if((int)i == r.fmtIndex && r.factIndex < 0 && r.translatedFormatTag != DR_WAVE_FORMAT_PCM && r.translatedFormatTag != DR_WAVE_FORMAT_IEEE_FLOAT) {
+                if(!luawav_riff_write_fact(out,to,r.sampleCount)) err = "write error";
+                pos += luawav_riff_chunk_total(to,factSize);
+            }
+            if(err != NULL) break;
+        }
+        if(err != NULL) break;
+    }
+
+    luawav_riff_free(&r);
+    return err;
+}
+
+LUAWAV_PRIVATE
+drwav_container
+luawav_opt_container(lua_State *L, int idx, drwav_container def) {
+    drwav_container c = def;
+    if(lua_istable(L,idx)) {
+        lua_getfield(L,idx,"container");
+        if(!lua_isnil(L,-1)) {
+            c = (drwav_container)lua_tointeger(L,-1);
+        }
+        lua_pop(L,1);
+    }
+    if(c != drwav_container_riff && c != drwav_container_rf64 && c != drwav_container_w64) {
+        luaL_error(L,"container not supported");
+    }
+    return c;
+}
+
+LUAWAV_PRIVATE
+int
+luawav_opt_isset(lua_State *L, int idx, const char *key) {
+    int r = 0;
+    if(lua_istable(L,idx)) {
+        lua_getfield(L,idx,key);
+        r = !lua_isnil(L,-1);
+        lua_pop(L,1);
+    }
+    return r;
+}
+
+LUAWAV_PRIVATE
+int
+luawav_opt_boolean(lua_State *L, int idx, const char *key) {
+    int r = 0;
+    if(lua_istable(L,idx)) {
+        lua_getfield(L,idx,key);
+        r = lua_toboolean(L,-1);
+        lua_pop(L,1);
+    }
+    return r;
+}
+
+/* returns the index of the string option key in names, 0 when unset */
+LUAWAV_PRIVATE
+int
+luawav_opt_enum(lua_State *L, int idx, const char *key, const char * const *names) {
+    const char *name = NULL;
+    int r = 0;
+    if(!luawav_opt_isset(L,idx,key)) return 0;
+
+    lua_getfield(L,idx,key);
+    name = lua_tostring(L,-1);
+    for(r=0;name != NULL && names[r] != NULL;r++) {
+        if(strcmp(names[r],name) == 0) {
+            lua_pop(L,1);
+            return r;
+        }
+    }
+    return luaL_error(L,"invalid %s option '%s'",key,name ? name : "?");
+}
+
+LUAWAV_PRIVATE
+double
+luawav_opt_number(lua_State *L, int idx, const char *key, double def) {
+    double r = def;
+    if(luawav_opt_isset(L,idx,key)) {
+        lua_getfield(L,idx,key);
+        r = luaL_checknumber(L,-1);
+        lua_pop(L,1);
+    }
+    return r;
+}
+
+/* wav.rewrap(src, dst, { container = wav.drwav_container_rf64 }) */
+LUAWAV_PRIVATE
+int
+luawav_rewrap(lua_State *L) {
+    const char *src = NULL;
+    const char *dst = NULL;
+    const char *err = NULL;
+    drwav_container to;
+    FILE *in = NULL;
+    FILE *out = NULL;
+
+    src = luaL_checkstring(L,1);
+    dst = luaL_checkstring(L,2);
+    if(!lua_istable(L,3)) {
+        return luaL_error(L,"missing options table");
+    }
+    if(!luawav_opt_isset(L,3,"container")) {
+        return luaL_error(L,"missing required container");
+    }
+    to = luawav_opt_container(L,3,drwav_container_riff);
+
+    in = fopen(src,"rb");
+    if(in == NULL) {
+        lua_pushboolean(L,0);
+        lua_pushfstring(L,"unable to open %s",src);
+        return 2;
+    }
+    out = fopen(dst,"wb");
+    if(out == NULL) {
+        fclose(in);
+        lua_pushboolean(L,0);
+        lua_pushfstring(L,"unable to open %s",dst);
+        return 2;
+    }
+
+    err = luawav_rewrap_file(in,out,to);
+    fclose(in);
+    if(fclose(out) != 0 && err == NULL) {
+        err = "write error";
+    }
+
+    if(err != NULL) {
+        remove(dst);
+        lua_pushboolean(L,0);
+        lua_pushstring(L,err);
+        return 2;
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luawav_needs_fact(drwav_uint16 translatedFormatTag) {
+    return translatedFormatTag != DR_WAVE_FORMAT_PCM && translatedFormatTag != DR_WAVE_FORMAT_IEEE_FLOAT;
+}
+
+/* writes a header with just a fmt, optional fact, and data chunk,
+ * leaving the file positioned at the start of the audio */
+static const char *
+luawav_write_simple_header(FILE *out, drwav_container to, const luawav_riff *fmt, drwav_uint64 dataSize, drwav_uint64 sampleCount, drwav_uint64 *pos) {
+    drwav_uint8 id[16];
+    drwav_uint64 body = 0;
+    drwav_uint64 factSize = to == drwav_container_w64 ? 8 : 4;
+    int fact = luawav_needs_fact(fmt->translatedFormatTag);
+
+    body = luawav_riff_chunk_total(to,fmt->fmtSize) + luawav_riff_chunk_total(to,dataSize);
+    if(fact) body += luawav_riff_chunk_total(to,factSize);
+
+    if(to == drwav_container_riff && 4 + body > RIFF_MAX) {
+        return "too large for a RIFF container";
+    }
+
+    if(!luawav_riff_write_header(out,to,body,dataSize,sampleCount)) return "write error";
+    luawav_fourcc_to_guid(id,"fmt ");
+    if(!luawav_riff_write_chunk_header(out,to,id,fmt->fmtSize)) return "write error";
+    if(fwrite(fmt->fmt,1,fmt->fmtSize,out) != fmt->fmtSize) return "write error";
+    if(!luawav_riff_write_padding(out,to,fmt->fmtSize)) return "write error";
+    if(fact && !luawav_riff_write_fact(out,to,sampleCount)) return "write error";
+    luawav_fourcc_to_guid(id,"data");
+    if(!luawav_riff_write_chunk_header(out,to,id,dataSize)) return "write error";
+
+    *pos = (to == drwav_container_riff ? 12 : (to == drwav_container_rf64 ? 48 : 40)) + body - luawav_riff_chunk_total(to,dataSize) + luawav_riff_chunk_total(to,0);
+    return NULL;
+}
+
+/* decodes a file with dr_wav and re-encodes it in the format described
+ * by fmt, writing exactly frames * blockAlign bytes */
+static const char *
+luawav_convert_into(FILE *out, const char *filename, const luawav_riff *fmt, drwav_uint64 frames) {
+    drwav wav;
+    const char *err = NULL;
+    void *in = NULL;
+    void *packed = NULL;
+    drwav_uint64 chunk = 0;
+    drwav_uint64 n = 0;
+    drwav_uint64 t = 0;
+    int isFloat = fmt->translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT;
+
+    if(!drwav_init_file(&wav,filename,NULL)) return "unable to decode input";
+
+    chunk = WAV_MIN(4096, 65536 / fmt->channels);
+    if(chunk == 0) chunk = 1;
+    in = malloc((size_t)(chunk * fmt->channels * sizeof(drwav_int32)));
+    packed = malloc((size_t)(chunk * fmt->blockAlign));
+    if(in == NULL || packed == NULL) {
+        err = "out of memory";
+        goto cleanup;
+    }
+
+    while(frames > 0) {
+        n = WAV_MIN(frames, chunk);
+        if(isFloat) {
+            t = drwav_read_pcm_frames_f32(&wav,n,(float *)in);
+        } else {
+            t = drwav_read_pcm_frames_s32(&wav,n,(drwav_int32 *)in);
+        }
+        /* a short input still has to fill the space the header promised */
+        if(t < n) memset((char *)in + t * fmt->channels * sizeof(drwav_int32),0,(size_t)((n - t) * fmt->channels * sizeof(drwav_int32)));
+        if(isFloat) {
+            luawav_pack_f32(packed,(const float *)in,(size_t)(n * fmt->channels),fmt->bitsPerSample);
+        } else {
+            luawav_pack_s32(packed,(const drwav_int32 *)in,(size_t)(n * fmt->channels),fmt->translatedFormatTag,fmt->bitsPerSample);
+        }
+        if(fwrite(packed,1,(size_t)(n * fmt->blockAlign),out) != n * fmt->blockAlign) {
+            err = "write error";
+            goto cleanup;
+        }
+        frames -= n;
+    }
+
+    cleanup:
+    free(in);
+    free(packed);
+    drwav_uninit(&wav);
+    return err;
+}
+
+typedef struct luawav_concat_input_s {
+    const char *filename;
+    drwav_uint64 dataOffset;
+    drwav_uint64 dataSize;
+    drwav_uint64 sampleCount;
+    drwav_uint64 outSize;
+    int convert;
+} luawav_concat_input;
+
+static const char *
+luawav_concat_plan(luawav_concat_input *input, luawav_riff *ref, int first) {
+    luawav_riff r;
+    drwav wav;
+    FILE *f = NULL;
+    const char *err = NULL;
+
+    f = fopen(input->filename,"rb");
+    if(f == NULL) return "unable to open input";
+    err = luawav_riff_parse(f,&r);
+    fclose(f);
+    if(err != NULL) {
+        luawav_riff_free(&r);
+        return err;
+    }
+
+    input->dataOffset = r.chunks[r.dataIndex].offset;
+    input->dataSize = r.dataSize;
+    input->sampleCount = r.sampleCount;
+    input->outSize = r.dataSize;
+    input->convert = 0;
+    luawav_riff_free(&r);
+
+    if(first) {
+        *ref = r;
+        ref->chunks = NULL;
+        return NULL;
+    }
+
+    if(r.fmtSize == ref->fmtSize && memcmp(r.fmt,ref->fmt,r.fmtSize) == 0) {
+        return NULL;
+    }
+
+    /* formats differ, the samples have to go through dr_wav */
+    if(r.channels != ref->channels || r.sampleRate != ref->sampleRate) {
+        return "inputs differ in channels or sample rate";
+    }
+    if(!luawav_pack_supported(ref->translatedFormatTag,ref->bitsPerSample)) {
+        return "inputs differ in format, and the output format can't be encoded";
+    }
+    if(!drwav_init_file(&wav,input->filename,NULL)) return "unable to decode input";
+    input->sampleCount = wav.totalPCMFrameCount;
+    input->outSize = wav.totalPCMFrameCount * ref->blockAlign;
+    input->convert = 1;
+    drwav_uninit(&wav);
+    return NULL;
+}
+
+/* wav.concat({ "a.wav", "b.wav" }, "out.wav" [, { container = ... }]) */
+LUAWAV_PRIVATE
+int
+luawav_concat(lua_State *L) {
+    luawav_concat_input *inputs = NULL;
+    luawav_riff ref;
+    const char *dst = NULL;
+    const char *err = NULL;
+    drwav_container to;
+    drwav_uint64 dataSize = 0;
+    drwav_uint64 sampleCount = 0;
+    drwav_uint64 pos = 0;
+    size_t count = 0;
+    size_t i = 0;
+    FILE *in = NULL;
+    FILE *out = NULL;
+
+    luaL_checktype(L,1,LUA_TTABLE);
+    dst = luaL_checkstring(L,2);
+
+    count = lua_rawlen(L,1);
+    if(count == 0) {
+        return luaL_error(L,"no inputs given");
+    }
+
+    inputs = lua_newuserdata(L,sizeof(luawav_concat_input) * count);
+    for(i=0;i<count;i++) {
+        lua_rawgeti(L,1,i+1);
+        if(lua_type(L,-1) != LUA_TSTRING) {
+            return luaL_error(L,"invalid input at index %d",(int)i+1);
+        }
+        inputs[i].filename = lua_tostring(L,-1);
+        lua_pop(L,1); /* the string stays referenced by the inputs table */
+    }
+
+    memset(&ref,0,sizeof(ref));
+    for(i=0;i<count;i++) {
+        err = luawav_concat_plan(&inputs[i],&ref,i == 0);
+        if(err != NULL) {
+            lua_pushboolean(L,0);
+            lua_pushfstring(L,"%s: %s",inputs[i].filename,err);
+            return 2;
+        }
+        dataSize += inputs[i].outSize;
+        sampleCount += inputs[i].sampleCount;
+    }
+
+    to = luawav_opt_container(L,3,ref.container);
+    if(to == drwav_container_riff && dataSize + ref.fmtSize + 64 > RIFF_MAX && !luawav_opt_isset(L,3,"container")) {
+        to = drwav_container_rf64;
+    }
+
+    out = fopen(dst,"wb");
+    if(out == NULL) {
+        lua_pushboolean(L,0);
+        lua_pushfstring(L,"unable to open %s",dst);
+        return 2;
+    }
+
+    err = luawav_write_simple_header(out,to,&ref,dataSize,sampleCount,&pos);
+
+    for(i=0;i<count && err == NULL;i++) {
+        if(inputs[i].convert) {
+            err = luawav_convert_into(out,inputs[i].filename,&ref,inputs[i].sampleCount);
+        } else {
+            in = fopen(inputs[i].filename,"rb");
+            if(in == NULL) {
+                err = "unable to open input";
+                break;
+            }
+            if(!luawav_copy_range(in,inputs[i].dataOffset,out,pos,inputs[i].dataSize)) {
+                err = "unable to copy audio";
+            }
+            fclose(in);
+        }
+        pos += inputs[i].outSize;
+    }
+
+    if(err == NULL && !luawav_riff_write_padding(out,to,dataSize)) {
+        err = "write error";
+    }
+    if(fclose(out) != 0 && err == NULL) {
+        err = "write error";
+    }
+
+    if(err != NULL) {
+        remove(dst);
+        lua_pushboolean(L,0);
+        lua_pushstring(L,err);
+        return 2;
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* number of frames held in one fmt.blockAlign sized block */
+static drwav_uint64
+luawav_frames_per_block(const luawav_riff *r) {
+    if(r->translatedFormatTag == DR_WAVE_FORMAT_ADPCM || r->translatedFormatTag == DR_WAVE_FORMAT_DVI_ADPCM) {
+        if(r->fmtSize >= 20) return drwav_bytes_to_u16(r->fmt + 18);
+        return 0;
+    }
+    return 1;
+}
+
+static int
+luawav_cmp_u64(const void *a, const void *b) {
+    drwav_uint64 x = *(const drwav_uint64 *)a;
+    drwav_uint64 y = *(const drwav_uint64 *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* reads the sample offsets out of a cue chunk, pushes them as a table */
+static void
+luawav_push_cue_points(lua_State *L, FILE *f, const luawav_riff *r) {
+    drwav_uint8 buf[24];
+    drwav_uint32 count = 0;
+    drwav_uint32 i = 0;
+    unsigned int c = 0;
+
+    lua_newtable(L);
+    for(c=0;c<r->count;c++) {
+        if(!luawav_chunk_is(&r->chunks[c],"cue ")) continue;
+        if(r->chunks[c].size < 4) continue;
+        if(luawav_fseek(f,(drwav_int64)r->chunks[c].offset,SEEK_SET) != 0) continue;
+        if(fread(buf,1,4,f) != 4) continue;
+        count = drwav_bytes_to_u32(buf);
+        for(i=0;i<count && 4 + (drwav_uint64)(i+1) * 24 <= r->chunks[c].size;i++) {
+            if(fread(buf,1,24,f) != 24) break;
+            lua_pushinteger(L,drwav_bytes_to_u32(buf+20));
+            lua_rawseti(L,-2,lua_rawlen(L,-2)+1);
+        }
+    }
+}
+
+/* wav.split("in.wav", { 44100, 88200 } | "cue", "out-%02d.wav" | function(i) end [, { container = ... }]) */
+LUAWAV_PRIVATE
+int
+luawav_split(lua_State *L) {
+    luawav_riff r;
+    const char *src = NULL;
+    const char *dst = NULL;
+    const char *err = NULL;
+    drwav_container to;
+    drwav_uint64 *points = NULL;
+    drwav_uint64 fpb = 0;
+    drwav_uint64 total = 0;
+    drwav_uint64 start = 0;
+    drwav_uint64 end = 0;
+    drwav_uint64 startByte = 0;
+    drwav_uint64 endByte = 0;
+    drwav_uint64 dataOffset = 0;
+    drwav_uint64 pos = 0;
+    size_t count = 0;
+    size_t segs = 0;
+    size_t i = 0;
+    int cue = 0;
+    FILE *in = NULL;
+    FILE *out = NULL;
+
+    src = luaL_checkstring(L,1);
+    if(lua_type(L,2) == LUA_TSTRING && strcmp(lua_tostring(L,2),"cue") == 0) {
+        cue = 1;
+    } else if(!lua_istable(L,2)) {
+        return luaL_error(L,"split points must be a table or \"cue\"");
+    }
+    if(!lua_isstring(L,3) && !lua_isfunction(L,3)) {
+        return luaL_error(L,"missing output pattern");
+    }
+    lua_settop(L,4);
+
+    in = fopen(src,"rb");
+    if(in == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"unable to open %s",src);
+        return 2;
+    }
+    err = luawav_riff_parse(in,&r);
+    if(err == NULL) {
+        fpb = luawav_frames_per_block(&r);
+        dataOffset = r.chunks[r.dataIndex].offset;
+        total = r.sampleCount;
+        if(fpb == 0 || r.blockAlign == 0 || total == 0) {
+            err = "unable to determine block layout";
+        }
+    }
+    if(err == NULL && cue) {
+        luawav_push_cue_points(L,in,&r);
+        lua_replace(L,2);
+    }
+    fclose(in);
+    luawav_riff_free(&r);
+    if(err != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,err);
+        return 2;
+    }
+
+    /* one extra slot on each end for the implied start and end */
+    count = lua_rawlen(L,2);
+    points = lua_newuserdata(L,sizeof(drwav_uint64) * (count + 2));
+    for(i=0;i<count;i++) {
+        lua_rawgeti(L,2,i+1);
+        points[i+1] = luawav_touint64(L,-1);
+        lua_pop(L,1);
+        points[i+1] -= points[i+1] % fpb;
+    }
+    qsort(points+1,count,sizeof(drwav_uint64),luawav_cmp_u64);
+    points[0] = 0;
+    segs = 1;
+    for(i=0;i<count;i++) {
+        if(points[i+1] > points[segs-1] && points[i+1] < total) {
+            points[segs++] = points[i+1];
+        }
+    }
+    points[segs] = total;
+
+    to = luawav_opt_container(L,4,r.container);
+
+    /* work out every filename up front, so nothing can raise an error
+     * while a file is open */
+    lua_createtable(L,(int)segs,0);
+    for(i=0;i<segs;i++) {
+        if(lua_isfunction(L,3)) {
+            lua_pushvalue(L,3);
+            lua_pushinteger(L,i+1);
+            lua_call(L,1,1);
+        } else {
+            lua_getglobal(L,"string");
+            lua_getfield(L,-1,"format");
+            lua_remove(L,-2);
+            lua_pushvalue(L,3);
+            lua_pushinteger(L,i+1);
+            lua_call(L,2,1);
+        }
+        if(lua_type(L,-1) != LUA_TSTRING) {
+            return luaL_error(L,"output name for segment %d is not a string",(int)i+1);
+        }
+        lua_rawseti(L,-2,i+1);
+    }
+
+    in = fopen(src,"rb");
+    if(in == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"unable to open %s",src);
+        return 2;
+    }
+
+    for(i=0;i<segs && err == NULL;i++) {
+        start = points[i];
+        end = points[i+1];
+        startByte = (start / fpb) * r.blockAlign;
+        endByte = end == total ? r.dataSize : (end / fpb) * r.blockAlign;
+        if(endByte > r.dataSize) endByte = r.dataSize;
+
+        lua_rawgeti(L,-1,i+1);
+        dst = lua_tostring(L,-1);
+        lua_pop(L,1);
+
+        out = fopen(dst,"wb");
+        if(out == NULL) {
+            err = "unable to open output";
+            break;
+        }
+        err = luawav_write_simple_header(out,to,&r,endByte - startByte,end - start,&pos);
+        if(err == NULL && !luawav_copy_range(in,dataOffset + startByte,out,pos,endByte - startByte)) {
+            err = "unable to copy audio";
+        }
+        if(err == NULL && !luawav_riff_write_padding(out,to,endByte - startByte)) {
+            err = "write error";
+        }
+        if(fclose(out) != 0 && err == NULL) {
+            err = "write error";
+        }
+        if(err != NULL) remove(dst);
+    }
+
+    fclose(in);
+
+    if(err != NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: %s",dst,err);
+        return 2;
+    }
+
+    return 1;
+}
@@ -0,0 +1,164 @@
+/* periodic header flushes, for writers opened with flushInterval. The
+ * file is opened by luawav, and every flushInterval frames the size
+ * fields dr_wav (or the ADPCM writer) would fill in when closing are
+ * written in place with pwrite, so the write position never moves. With
+ * flushSync the data is pushed to disk after each flush as well. A
+ * recording that dies is then readable up to the last flush. */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "luawav_internal.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/* sets how often to flush, 0 frames turns it off */
+LUAWAV_PRIVATE
+void
+luawav_flush_reset(luawav_flush *f, drwav_uint64 interval, int sync) {
+    luawav_flush_close(f);
+    f->interval = interval;
+    f->pending = 0;
+    f->sync = sync;
+    f->append = 0;
+    f->dataPos = 0;
+    f->dataSize = 0;
+    f->junkSize = 0;
+    f->ds64Count = 0;
+}
+
+/* opens filename for writing, with mode "wb", or "r+b" to extend it */
+LUAWAV_PRIVATE
+int
+luawav_flush_open(luawav_flush *f, const char *filename, const char *mode) {
+    luawav_flush_close(f);
+    f->file = fopen(filename,mode);
+    return f->file != NULL;
+}
+
+/* closes the file, once the writer using it has been closed */
+LUAWAV_PRIVATE
+int
+luawav_flush_close(luawav_flush *f) {
+    int r = 1;
+    if(f->file != NULL) {
+        r = fclose(f->file) == 0;
+        f->file = NULL;
+    }
+    return r;
+}
+
+/* counts frames written, returning 1 when a flush is due */
+LUAWAV_PRIVATE
+int
+luawav_flush_due(luawav_flush *f, drwav_uint64 frames) {
+    if(f->file == NULL || f->interval == 0) return 0;
+    f->pending += frames;
+    if(f->pending < f->interval) return 0;
+    f->pending = 0;
+    return 1;
+}
+
+static int
+luawav_flush_pwrite(FILE *file, const drwav_uint8 *b, size_t bytes, drwav_uint64 offset) {
+#if defined(_WIN32)
+    drwav_int64 pos = (drwav_int64)luawav_ftell(file);
+    int r = 0;
+
+    if(pos < 0 || luawav_fseek(file,(drwav_int64)offset,SEEK_SET) != 0) return 0;
+    r = fwrite(b,1,bytes,file) == bytes;
+    if(luawav_fseek(file,pos,SEEK_SET) != 0) r = 0;
+    return r;
+#else
+    return pwrite(fileno(file),b,bytes,(off_t)offset) == (ssize_t)bytes;
+#endif
+}
+
+/* writes the fields, little-endian, after what's been buffered so the
+ * header never gets ahead of the data */
+LUAWAV_PRIVATE
+int
+luawav_flush_fields(luawav_flush *f, const luawav_header_field *fields, unsigned int count) {
+    drwav_uint8 b[8];
+    drwav_uint64 v = 0;
+    unsigned int i = 0;
+    unsigned int k = 0;
+    int r = 1;
+
+    if(f->file == NULL) return 0;
+    if(fflush(f->file) != 0) return 0;
+
+    for(i=0;i<count;i++) {
+        v = fields[i].value;
+        for(k=0;k<fields[i].bytes;k++) {
+            b[k] = (drwav_uint8)(v & 0xFF);
+            v >>= 8;
+        }
+        if(!luawav_flush_pwrite(f->file,b,fields[i].bytes,fields[i].offset)) r = 0;
+    }
+
+    if(f->sync) {
+#if defined(_WIN32)
+        if(_commit(_fileno(f->file)) != 0) r = 0;
+#elif defined(__APPLE__)
+        if(fsync(fileno(f->file)) != 0) r = 0;
+#else
+        if(fdatasync(fileno(f->file)) != 0) r = 0;
+#endif
+    }
+    return r;
+}
+
+/* the size fields drwav_uninit writes, from what's been written so far */
+LUAWAV_PRIVATE
+int
+luawav_flush_drwav(luawav_flush *f, const drwav *wav) {
+    luawav_header_field fields[2];
+    drwav_uint64 size = wav->dataChunkDataSize;
+
+    switch(wav->container) {
+        case drwav_container_riff: {
+            /* everything up to the data is header, plus the pad byte */
+            fields[0].offset = 4;
+            fields[0].value = WAV_MIN(wav->dataChunkDataPos - 8 + size + (size & 1),0xFFFFFFFF);
+            fields[0].bytes = 4;
+            fields[1].offset = wav->dataChunkDataPos - 4;
+            fields[1].value = WAV_MIN(size,0xFFFFFFFF);
+            fields[1].bytes = 4;
+            break;
+        }
+        case drwav_container_w64: {
+            /* dr_wav pads W64 data by size % 8, not up to a multiple
+             * of 8, so that's what the file holds */
+            fields[0].offset = 16;
+            fields[0].value = wav->dataChunkDataPos + size + (size & 7);
+            fields[0].bytes = 8;
+            fields[1].offset = wav->dataChunkDataPos - 8;
+            fields[1].value = 24 + size;
+            fields[1].bytes = 8;
+            break;
+        }
+        case drwav_container_rf64: {
+            /* the RIFF and data sizes in the ds64 chunk */
+            fields[0].offset = 20;
+            fields[0].value = wav->dataChunkDataPos - 8 + size + (size & 1);
+            fields[0].bytes = 8;
+            fields[1].offset = 28;
+            fields[1].value = size;
+            fields[1].bytes = 8;
+            break;
+        }
+        default: return 0;
+    }
+    return luawav_flush_fields(f,fields,2);
+}
@@ -0,0 +1,252 @@
+/* follow mode, for reading a file that's still being written. The data
+ * chunk is taken to run to the end of the file, unless its size field has
+ * been filled in with something smaller; before each read the file is
+ * stat'ed again, and dr_wav's idea of the data size is moved on to cover
+ * whatever whole frames (or ADPCM blocks) have been added since. Waiting
+ * for more uses inotify on Linux, elsewhere it sleeps and checks again. */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "luawav_internal.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#define luawav_fstat _fstat64
+#define luawav_fileno _fileno
+typedef struct __stat64 luawav_stat;
+#else
+#include <time.h>
+#include <unistd.h>
+#define luawav_fstat fstat
+#define luawav_fileno fileno
+typedef struct stat luawav_stat;
+#endif
+
+#if defined(__linux__)
+#define LUAWAV_HAVE_INOTIFY 1
+#include <poll.h>
+#include <sys/inotify.h>
+#else
+#define LUAWAV_HAVE_INOTIFY 0
+#endif
+
+#define FOLLOW_POLL_MS 50 /* between checks where there's no inotify */
+
+/* opens filename to be read in follow mode, and starts watching it */
+LUAWAV_PRIVATE
+int
+luawav_follow_open(luawav_follow *f, const char *filename) {
+    luawav_follow_close(f);
+    f->file = fopen(filename,"rb");
+    if(f->file == NULL) return 0;
+#if LUAWAV_HAVE_INOTIFY
+    f->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(f->notify >= 0 && inotify_add_watch(f->notify,filename,IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+        close(f->notify);
+        f->notify = -1;
+    }
+#endif
+    return 1;
+}
+
+LUAWAV_PRIVATE
+void
+luawav_follow_close(luawav_follow *f) {
+    if(f->file != NULL) {
+        fclose(f->file);
+        f->file = NULL;
+    }
+#if LUAWAV_HAVE_INOTIFY
+    if(f->notify >= 0) close(f->notify);
+#endif
+    f->notify = -1;
+}
+
+/* reads a little-endian field of `bytes` bytes at offset, without
+ * moving the read position or dropping what stdio has buffered where
+ * pread is there */
+static int
+luawav_follow_field(FILE *file, drwav_uint64 offset, int bytes, drwav_uint64 *value) {
+    drwav_uint8 b[8];
+    int r = 0;
+    int i = 0;
+#if defined(_WIN32)
+    drwav_int64 pos = (drwav_int64)luawav_ftell(file);
+
+    if(pos < 0 || luawav_fseek(file,(drwav_int64)offset,SEEK_SET) != 0) return 0;
+    r = fread(b,1,bytes,file) == (size_t)bytes;
+    if(luawav_fseek(file,pos,SEEK_SET) != 0) r = 0;
+    clearerr(file);
+#else
+    r = pread(luawav_fileno(file),b,bytes,(off_t)offset) == (ssize_t)bytes;
+#endif
+    if(!r) return 0;
+
+    *value = 0;
+    for(i=bytes-1;i>=0;i--) {
+        *value = (*value << 8) | b[i];
+    }
+    return 1;
+}
+
+/* finds the field holding the data size, once dr_wav has read the header */
+LUAWAV_PRIVATE
+void
+luawav_follow_start(luawav_follow *f, drwav *wav) {
+    drwav_uint64 id = 0;
+
+    f->sizePos = 0;
+    f->sizeBytes = 0;
+    f->sizeBias = 0;
+    switch(wav->container) {
+        case drwav_container_riff: {
+            f->sizePos = wav->dataChunkDataPos - 4;
+            f->sizeBytes = 4;
+            break;
+        }
+        case drwav_container_w64: {
+            /* the size counts the 24-byte chunk header */
+            f->sizePos = wav->dataChunkDataPos - 8;
+            f->sizeBytes = 8;
+            f->sizeBias = 24;
+            break;
+        }
+        case drwav_container_rf64: {
+            /* the size is in the ds64 chunk, which follows the RF64 header */
+            if(luawav_follow_field(f->file,12,4,&id) && id == 0x34367364) { /* "ds64" */
+                f->sizePos = 28;
+                f->sizeBytes = 8;
+            }
+            break;
+        }
+        default: break;
+    }
+
+    /* dr_wav went by the header, or a fact chunk, and nothing's been
+     * read yet */
+    wav->bytesRemaining = 0;
+    wav->dataChunkDataSize = 0;
+    wav->totalPCMFrameCount = 0;
+    luawav_follow_update(f,wav);
+}
+
+/* frames held in `bytes` of ADPCM data, counting a short last block only
+ * when `tail` is set */
+static drwav_uint64
+luawav_follow_adpcm_frames(const drwav *wav, drwav_uint64 bytes, int tail) {
+    drwav_uint64 perBlock = luawav_adpcm_block_frames(wav);
+    drwav_uint64 rem = bytes % wav->fmt.blockAlign;
+    drwav_uint64 frames = (bytes / wav->fmt.blockAlign) * perBlock;
+    drwav_uint64 header = (wav->translatedFormatTag == DR_WAVE_FORMAT_ADPCM ? 7 : 4) * wav->channels;
+
+    if(!tail || rem < header) return frames;
+    if(wav->translatedFormatTag == DR_WAVE_FORMAT_ADPCM) {
+        return frames + 2 + ((rem - header) * 2) / wav->channels;
+    }
+    /* IMA decodes 8 frames per 4 bytes per channel */
+    return frames + 1 + ((rem - header) / (4 * wav->channels)) * 8;
+}
+
+/* moves the end of the data on to cover what's been written since the
+ * last check, returning 1 when there are frames that weren't there
+ * before */
+LUAWAV_PRIVATE
+int
+luawav_follow_update(luawav_follow *f, drwav *wav) {
+    luawav_stat st;
+    drwav_uint64 avail = 0;
+    drwav_uint64 size = 0;
+    drwav_uint64 field = 0;
+    drwav_uint64 frames = 0;
+    drwav_uint32 frameBytes = 0;
+    int final = 0;
+    int adpcm = wav->translatedFormatTag == DR_WAVE_FORMAT_ADPCM || wav->translatedFormatTag == DR_WAVE_FORMAT_DVI_ADPCM;
+
+    if(f->file == NULL || luawav_fstat(luawav_fileno(f->file),&st) != 0) return 0;
+    clearerr(f->file);
+    if((drwav_uint64)st.st_size <= wav->dataChunkDataPos) return 0;
+    avail = (drwav_uint64)st.st_size - wav->dataChunkDataPos;
+    size = avail;
+
+    /* a size field that's been filled in ends the data, even if the
+     * file carries on with other chunks */
+    if(f->sizeBytes > 0 && luawav_follow_field(f->file,f->sizePos,f->sizeBytes,&field)) {
+        if(field > f->sizeBias && field != (f->sizeBytes == 4 ? 0xFFFFFFFF : ~(drwav_uint64)0)) {
+            field -= f->sizeBias;
+            if(field <= avail) {
+                size = field;
+                final = 1;
+            }
+        }
+    }
+
+    if(adpcm) {
+        if(luawav_adpcm_block_frames(wav) == 0) return 0;
+        frames = luawav_follow_adpcm_frames(wav,size,final);
+        if(!final) size -= size % wav->fmt.blockAlign;
+    } else {
+        frameBytes = luawav_frame_bytes(wav);
+        if(frameBytes == 0) return 0;
+        size -= size % frameBytes;
+        frames = size / frameBytes;
+    }
+
+    if(frames <= wav->totalPCMFrameCount) return 0;
+    wav->bytesRemaining += size - wav->dataChunkDataSize;
+    wav->dataChunkDataSize = size;
+    wav->totalPCMFrameCount = frames;
+    return 1;
+}
+
+/* waits up to timeout seconds (forever when negative) for frames to be
+ * added, returning 1 if they were */
+LUAWAV_PRIVATE
+int
+luawav_follow_wait(luawav_follow *f, drwav *wav, double timeout) {
+    drwav_uint64 start = luawav_now_ns();
+    double waited = 0.0;
+    int ms = FOLLOW_POLL_MS;
+#if LUAWAV_HAVE_INOTIFY
+    char events[4096];
+    struct pollfd pfd;
+#endif
+#if !defined(_WIN32)
+    struct timespec ts;
+#endif
+
+    for(;;) {
+        if(luawav_follow_update(f,wav)) return 1;
+        waited = (double)(luawav_now_ns() - start) / 1000000000.0;
+        if(timeout >= 0.0 && waited >= timeout) return 0;
+        if(timeout >= 0.0) {
+            ms = (int)((timeout - waited) * 1000.0) + 1;
+        }
+#if LUAWAV_HAVE_INOTIFY
+        if(f->notify >= 0) {
+            pfd.fd = f->notify;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if(poll(&pfd,1,timeout < 0.0 ? -1 : ms) > 0) {
+                while(read(f->notify,events,sizeof(events)) > 0);
+            }
+            continue;
+        }
+#endif
+        ms = WAV_MIN(ms,FOLLOW_POLL_MS);
+#if defined(_WIN32)
+        Sleep(ms);
+#else
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (long)(ms % 1000) * 1000000;
+        nanosleep(&ts,NULL);
+#endif
+    }
+}
@@ -1,5 +1,13 @@
 #include "luawav.h"
 #include "dr_wav.h"
+#include <stdio.h>
+
+#if !defined(_WIN32)
+#define LUAWAV_HAVE_THREADS 1
+#include <pthread.h>
+#else
+#define LUAWAV_HAVE_THREADS 0
+#endif
 
 #if __GNUC__ > 4
 #define LUAWAV_PRIVATE __attribute__ ((visibility ("hidden")))
@@ -7,6 +15,36 @@
 #define LUAWAV_PRIVATE
 #endif
 
+/* 64-bit seeking for files luawav opens itself. Sources that use these
+ * define _FILE_OFFSET_BITS, and _POSIX_C_SOURCE for fseeko, before
+ * including this header. */
+#if defined(_MSC_VER)
+#define luawav_fseek _fseeki64
+#define luawav_ftell _ftelli64
+#elif defined(_WIN32)
+#define luawav_fseek fseeko64
+#define luawav_ftell ftello64
+#else
+#define luawav_fseek fseeko
+#define luawav_ftell ftello
+#endif
+
+/* USDT probes for bpftrace, perf and friends, under the "luawav" provider.
+ * Built in when LUAWAV_USDT is defined (the cmake option of the same
+ * name), which needs sys/sdt.h from systemtap. Each probe is a nop until
+ * a tracer attaches; without LUAWAV_USDT they compile to nothing, and
+ * their arguments aren't evaluated. */
+#if defined(LUAWAV_USDT) && LUAWAV_USDT
+#include <sys/sdt.h>
+#define LUAWAV_PROBE1(name,a) DTRACE_PROBE1(luawav,name,a)
+#define LUAWAV_PROBE2(name,a,b) DTRACE_PROBE2(luawav,name,a,b)
+#define LUAWAV_PROBE3(name,a,b,c) DTRACE_PROBE3(luawav,name,a,b,c)
+#else
+#define LUAWAV_PROBE1(name,a)
+#define LUAWAV_PROBE2(name,a,b)
+#define LUAWAV_PROBE3(name,a,b,c)
+#endif
+
 typedef struct luawav_metamethods_s {
     const char *name;
     const char *metaname;
@@ -20,6 +58,197 @@ typedef struct luawav_metamethods_s {
 #endif
 
 #define luawav_push_const(x) lua_pushinteger(L,x) ; lua_setfield(L,-2, #x)
+#define WAV_MIN(a,b) ( (a) < (b) ? (a) : (b) )
+#define WAV_MAX(a,b) ( (a) > (b) ? (a) : (b) )
+
+/* sample types handed back to Lua */
+#define LUAWAV_F32 0
+#define LUAWAV_S32 1
+#define LUAWAV_S16 2
+
+/* a chunk found while walking a container, ids are always W64 GUIDs */
+typedef struct luawav_chunk_s {
+    drwav_uint8 id[16];
+    drwav_uint64 offset;
+    drwav_uint64 size;
+} luawav_chunk;
+
+typedef struct luawav_riff_s {
+    drwav_container container;
+    luawav_chunk *chunks;
+    unsigned int count;
+    unsigned int alloc;
+    int fmtIndex;
+    int dataIndex;
+    int factIndex;
+    drwav_uint8 fmt[256];
+    unsigned int fmtSize;
+    drwav_uint16 formatTag;
+    drwav_uint16 translatedFormatTag;
+    drwav_uint16 channels;
+    drwav_uint32 sampleRate;
+    drwav_uint16 blockAlign;
+    drwav_uint16 bitsPerSample;
+    drwav_uint64 dataSize;
+    drwav_uint64 factCount;
+    drwav_uint64 sampleCount;
+} luawav_riff;
+
+/* running statistics for one channel, on the f32 scale */
+typedef struct luawav_channel_stats_s {
+    double sum;
+    double sumsq;
+    double peak;
+    drwav_uint64 clipped;
+    drwav_uint64 zeroSamples;
+    drwav_uint64 zeroRun;
+    drwav_uint64 longestZeroRun;
+} luawav_channel_stats;
+
+/* requantization state for float to integer conversion */
+#define LUAWAV_DITHER_NONE 0
+#define LUAWAV_DITHER_TPDF 1
+#define LUAWAV_DITHER_SHAPED 2
+
+/* the TPDF noise comes from LUAWAV_DITHER_LANES xorshift32 generators
+ * stepped together, so the kernels in luawav_simd.c can run a vector of
+ * them at once. Each step gives half as many values, value j being the
+ * top 24 bits of state[j] less those of state[j + LUAWAV_DITHER_LANES / 2],
+ * over 2^24. */
+#define LUAWAV_DITHER_LANES 16
+
+typedef struct luawav_dither_s {
+    int mode;
+    unsigned int channels;
+    unsigned int channel; /* of the next sample, for shaping */
+    drwav_uint32 state[LUAWAV_DITHER_LANES];
+    float noise[LUAWAV_DITHER_LANES / 2]; /* from the last step, used up to next */
+    unsigned int next;
+    double *error; /* last quantization error per channel, for shaping */
+} luawav_dither;
+
+typedef struct luawav_adpcm_writer_s luawav_adpcm_writer;
+
+/* block positions for seeking in ADPCM, built on the first seek. Every
+ * block is fmt.blockAlign bytes, so block n starts at
+ * dataPos + n * blockAlign and holds framesPerBlock frames */
+typedef struct luawav_block_index_s {
+    drwav_uint64 dataPos;
+    drwav_uint64 blocks;
+    drwav_uint32 blockAlign;
+    drwav_uint32 framesPerBlock; /* 0 until built */
+} luawav_block_index;
+
+/* raw bytes staged per pass in luawav_read_converted */
+#define CONVERT_STAGING 16384
+
+/* converts count samples from the file's format to a LUAWAV_* type */
+typedef void (*luawav_convert_func)(void *out, const void *in, size_t count);
+
+/* fold interleaved frames into per-channel minimum, maximum and sum of
+ * squares, for reader:read_summary */
+typedef void (*luawav_reduce_s16_func)(const drwav_int16 *in, size_t frames, unsigned int channels, drwav_int32 *mn, drwav_int32 *mx, drwav_uint64 *sq);
+typedef void (*luawav_reduce_s32_func)(const drwav_int32 *in, size_t frames, unsigned int channels, drwav_int32 *mn, drwav_int32 *mx, double *sq);
+typedef void (*luawav_reduce_f32_func)(const float *in, size_t frames, unsigned int channels, float *mn, float *mx, double *sq);
+
+/* rounds float samples times gain to 16-bit PCM, little-endian; the
+ * dithered one adds the noise of d first, shaping it when d asks */
+typedef void (*luawav_quantize_func)(void *out, const float *in, size_t count, float gain);
+typedef void (*luawav_dither_func)(void *out, const float *in, size_t count, float gain, luawav_dither *d);
+
+/* the sample converters dr_wav runs when reading, and the packers luawav
+ * runs when writing, vectorized where the CPU allows it; see
+ * luawav_simd.c */
+typedef struct luawav_converters_s {
+    const char *isa;
+    luawav_convert_func s16_to_f32;
+    luawav_convert_func s24_to_f32;
+    luawav_convert_func s32_to_f32;
+    luawav_convert_func f32_to_s16;
+    luawav_convert_func s16_to_s32;
+    luawav_convert_func s24_to_s32;
+    luawav_convert_func s24_to_s16;
+    luawav_convert_func s32_to_s16;
+    /* packers for writing 24-bit PCM: the top 24 bits of full-scale s32,
+     * and f32 rounded like luawav_quantize_f32 with no gain or dither */
+    luawav_convert_func s32_to_s24;
+    luawav_convert_func f32_to_s24;
+    /* reductions; the sums of squares are exact for s16, and for s32 and
+     * f32 may differ from the scalar ones in the last bits, as they're
+     * added up in a different order */
+    luawav_reduce_s16_func reduce_s16;
+    luawav_reduce_s32_func reduce_s32;
+    luawav_reduce_f32_func reduce_f32;
+    /* the 16-bit quantizers behind luawav_quantize_f32, without and with
+     * dither; see luawav_scalar_quantize_s16 for how they round */
+    luawav_quantize_func quantize_s16;
+    luawav_dither_func dither_s16;
+} luawav_converters;
+
+/* call count and total time in nanoseconds of one kind of operation,
+ * and the bytes, frames or samples it moved */
+typedef struct luawav_counter_s {
+    drwav_uint64 calls;
+    drwav_uint64 ns;
+    drwav_uint64 amount;
+} luawav_counter;
+
+/* instrumentation for a handle opened with instrument = true. dr_wav
+ * gets the luawav_counted_* callbacks, which call the ones kept here */
+typedef struct luawav_counters_s {
+    int enabled;
+    luawav_counter read;    /* bytes */
+    luawav_counter seek;
+    luawav_counter tell;
+    luawav_counter write;   /* bytes */
+    luawav_counter decode;  /* frames, includes the I/O and conversion below it */
+    luawav_counter convert; /* samples converted by luawav itself */
+    luawav_counter push;    /* samples stored into Lua tables */
+    drwav_read_proc onRead;
+    drwav_write_proc onWrite;
+    drwav_seek_proc onSeek;
+    drwav_tell_proc onTell;
+    void *pUserData;
+    FILE *file; /* opened by luawav_counters_open */
+} luawav_counters;
+
+/* a reader opened with follow = true, see luawav_follow.c */
+typedef struct luawav_follow_s {
+    int enabled;
+    FILE *file;
+    int notify; /* inotify descriptor, or -1 */
+    drwav_uint64 sizePos; /* offset of the data size field */
+    int sizeBytes; /* 4 or 8, 0 when there's no field to look at */
+    drwav_uint64 sizeBias; /* counted in the field besides the data */
+} luawav_follow;
+
+/* a writer opened with flushInterval or append = true, see
+ * luawav_flush.c and luawav_append.c */
+typedef struct luawav_flush_s {
+    drwav_uint64 interval; /* frames between flushes, 0 when off */
+    drwav_uint64 pending; /* frames written since the last flush */
+    int sync; /* fdatasync after each flush */
+    FILE *file;
+    int append; /* the header is written by luawav_append_finish */
+    drwav_uint64 dataPos; /* where the file's data starts */
+    drwav_uint64 dataSize; /* whole frames of data already there */
+    drwav_uint64 junkSize; /* a JUNK chunk after "WAVE", to become ds64 */
+    int ds64Count; /* the ds64 sample count is set, and kept up to date */
+} luawav_flush;
+
+/* a little-endian header field, written in place by a flush */
+typedef struct luawav_header_field_s {
+    drwav_uint64 offset;
+    drwav_uint64 value;
+    unsigned int bytes;
+} luawav_header_field;
+
+typedef struct luawav_stats_s {
+    unsigned int channels;
+    double clip;
+    drwav_uint64 frames;
+    luawav_channel_stats *ch;
+} luawav_stats;
 
 #ifdef __cplusplus
 extern "C" {
@@ -47,6 +276,371 @@ extern const char * const luawav_uint64_mt;
 LUAWAV_PRIVATE
 extern const char * const luawav_int64_mt;
 
+LUAWAV_PRIVATE
+const char *
+luawav_riff_parse(FILE *f, luawav_riff *r);
+
+LUAWAV_PRIVATE
+void
+luawav_riff_free(luawav_riff *r);
+
+LUAWAV_PRIVATE
+int
+luawav_chunk_is(const luawav_chunk *c, const char *fourcc);
+
+LUAWAV_PRIVATE
+unsigned int
+luawav_chunk_padding(drwav_container container, drwav_uint64 size);
+
+LUAWAV_PRIVATE
+drwav_uint64
+luawav_riff_chunk_total(drwav_container container, drwav_uint64 size);
+
+LUAWAV_PRIVATE
+int
+luawav_riff_write_header(FILE *f, drwav_container container, drwav_uint64 bodySize, drwav_uint64 dataSize, drwav_uint64 sampleCount);
+
+LUAWAV_PRIVATE
+int
+luawav_riff_write_chunk_header(FILE *f, drwav_container container, const drwav_uint8 id[16], drwav_uint64 size);
+
+LUAWAV_PRIVATE
+int
+luawav_riff_write_padding(FILE *f, drwav_container container, drwav_uint64 size);
+
+LUAWAV_PRIVATE
+int
+luawav_riff_write_fact(FILE *f, drwav_container container, drwav_uint64 sampleCount);
+
+LUAWAV_PRIVATE
+int
+luawav_copy_range(FILE *in, drwav_uint64 offset, FILE *out, drwav_uint64 outpos, drwav_uint64 len);
+
+LUAWAV_PRIVATE
+int
+luawav_opt_isset(lua_State *L, int idx, const char *key);
+
+LUAWAV_PRIVATE
+int
+luawav_opt_boolean(lua_State *L, int idx, const char *key);
+
+LUAWAV_PRIVATE
+int
+luawav_opt_enum(lua_State *L, int idx, const char *key, const char * const *names);
+
+LUAWAV_PRIVATE
+double
+luawav_opt_number(lua_State *L, int idx, const char *key, double def);
+
+LUAWAV_PRIVATE
+drwav_container
+luawav_opt_container(lua_State *L, int idx, drwav_container def);
+
+LUAWAV_PRIVATE
+int
+luawav_pack_supported(drwav_uint16 formatTag, drwav_uint16 bitsPerSample);
+
+LUAWAV_PRIVATE
+drwav_uint32
+luawav_frame_bytes(const drwav *wav);
+
+LUAWAV_PRIVATE
+drwav_uint16
+luawav_quantize_bits(drwav_uint16 formatTag, drwav_uint16 bitsPerSample);
+
+LUAWAV_PRIVATE
+void
+luawav_pack_s32(void *out, const drwav_int32 *in, size_t count, drwav_uint16 formatTag, drwav_uint16 bitsPerSample);
+
+LUAWAV_PRIVATE
+void
+luawav_pack_f32(void *out, const float *in, size_t count, drwav_uint16 bitsPerSample);
+
+LUAWAV_PRIVATE
+extern const char * const luawav_dither_modes[];
+
+LUAWAV_PRIVATE
+int
+luawav_dither_init(luawav_dither *d, int mode, unsigned int channels);
+
+LUAWAV_PRIVATE
+void
+luawav_dither_free(luawav_dither *d);
+
+LUAWAV_PRIVATE
+void
+luawav_dither_step(luawav_dither *d);
+
+LUAWAV_PRIVATE
+float
+luawav_dither_noise(luawav_dither *d);
+
+LUAWAV_PRIVATE
+void
+luawav_quantize_f32(drwav_int32 *out, const float *in, size_t count, double gain, drwav_uint16 bitsPerSample, luawav_dither *d);
+
+LUAWAV_PRIVATE
+int
+luawav_quantize_pack_f32(void *out, const float *in, size_t count, double gain, drwav_uint16 formatTag, drwav_uint16 bitsPerSample, luawav_dither *d);
+
+LUAWAV_PRIVATE
+int
+luawav_rewrap(lua_State *L);
+
+LUAWAV_PRIVATE
+int
+luawav_concat(lua_State *L);
+
+LUAWAV_PRIVATE
+int
+luawav_split(lua_State *L);
+
+LUAWAV_PRIVATE
+luawav_stats *
+luawav_stats_new(const drwav *wav);
+
+LUAWAV_PRIVATE
+void
+luawav_stats_free(luawav_stats *s);
+
+LUAWAV_PRIVATE
+void
+luawav_stats_update(luawav_stats *s, const void *samples, drwav_uint64 frames, int type);
+
+LUAWAV_PRIVATE
+void
+luawav_stats_update_raw(luawav_stats *s, const drwav *wav, const void *raw, drwav_uint64 frames);
+
+LUAWAV_PRIVATE
+luawav_convert_func
+luawav_stats_kernel(const drwav *wav, int type);
+
+LUAWAV_PRIVATE
+void
+luawav_stats_push(lua_State *L, const luawav_stats *s);
+
+LUAWAV_PRIVATE
+int
+luawav_analyze(lua_State *L);
+
+LUAWAV_PRIVATE
+int
+luawav_build_peaks(lua_State *L);
+
+LUAWAV_PRIVATE
+int
+luawav_open_peaks(lua_State *L);
+
+LUAWAV_PRIVATE
+void
+luawav_peaks_register(lua_State *L);
+
+LUAWAV_PRIVATE
+drwav *
+luawav_todrwav(lua_State *L, int idx);
+
+LUAWAV_PRIVATE
+void
+luawav_push_fmt(lua_State *L, const drwav_fmt *fmt);
+
+LUAWAV_PRIVATE
+int
+luawav_loudness(lua_State *L);
+
+LUAWAV_PRIVATE
+const char *
+luawav_measure_lufs(drwav *wav, double *integrated);
+
+LUAWAV_PRIVATE
+int
+luawav_transcode(lua_State *L);
+
+LUAWAV_PRIVATE
+luawav_adpcm_writer *
+luawav_adpcm_writer_new(const char *filename, drwav_write_proc onWrite, drwav_seek_proc onSeek, void *userData, const drwav_data_format *fmt, drwav_uint32 blockAlign, drwav_uint64 totalFrames, const char **err);
+
+LUAWAV_PRIVATE
+int
+luawav_adpcm_write(luawav_adpcm_writer *w, const drwav_int32 *samples, size_t count);
+
+LUAWAV_PRIVATE
+int
+luawav_adpcm_writer_close(luawav_adpcm_writer *w);
+
+LUAWAV_PRIVATE
+int
+luawav_adpcm_writer_flush(const luawav_adpcm_writer *w, luawav_flush *f);
+
+LUAWAV_PRIVATE
+drwav_uint32
+luawav_adpcm_block_frames(const drwav *wav);
+
+LUAWAV_PRIVATE
+int
+luawav_seek(drwav *wav, luawav_block_index *index, drwav_uint64 frame);
+
+LUAWAV_PRIVATE
+int
+luawav_adpcm_threadable(const drwav *wav);
+
+LUAWAV_PRIVATE
+drwav_uint64
+luawav_read_threaded(drwav *wav, drwav_uint64 frames, void *out, int type, unsigned int threads);
+
+LUAWAV_PRIVATE
+const drwav_allocation_callbacks *
+luawav_allocation_callbacks(lua_State *L, drwav_allocation_callbacks *cb);
+
+LUAWAV_PRIVATE
+int
+luawav_allocations(lua_State *L);
+
+LUAWAV_PRIVATE
+extern luawav_converters luawav_convert;
+
+LUAWAV_PRIVATE
+extern const char * const luawav_convert_tiers[];
+
+LUAWAV_PRIVATE
+int
+luawav_convert_tier(luawav_converters *c, const char *isa);
+
+LUAWAV_PRIVATE
+void
+luawav_convert_init(void);
+
+LUAWAV_PRIVATE
+luawav_convert_func
+luawav_convert_kernel(const drwav *wav, int type);
+
+LUAWAV_PRIVATE
+drwav_uint64
+luawav_read_converted(drwav *wav, drwav_uint64 frames, void *out, int type, luawav_convert_func kernel, luawav_counters *counters, luawav_stats *stats);
+
+LUAWAV_PRIVATE
+drwav_uint64
+luawav_now_ns(void);
+
+LUAWAV_PRIVATE
+void
+luawav_counter_add(luawav_counter *k, drwav_uint64 start, drwav_uint64 amount);
+
+LUAWAV_PRIVATE
+void
+luawav_counters_reset(luawav_counters *c, int enabled);
+
+LUAWAV_PRIVATE
+void
+luawav_counters_wrap(luawav_counters *c, drwav_read_proc onRead, drwav_write_proc onWrite, drwav_seek_proc onSeek, drwav_tell_proc onTell, void *pUserData);
+
+LUAWAV_PRIVATE
+int
+luawav_counters_open(luawav_counters *c, const char *filename, const char *mode);
+
+LUAWAV_PRIVATE
+void
+luawav_counters_close(luawav_counters *c);
+
+LUAWAV_PRIVATE
+size_t
+luawav_counted_read(void *userData, void *buffer, size_t bytes);
+
+LUAWAV_PRIVATE
+size_t
+luawav_counted_write(void *userData, const void *data, size_t bytes);
+
+LUAWAV_PRIVATE
+drwav_bool32
+luawav_counted_seek(void *userData, int offset, drwav_seek_origin origin);
+
+LUAWAV_PRIVATE
+drwav_bool32
+luawav_counted_tell(void *userData, drwav_int64 *pCursor);
+
+LUAWAV_PRIVATE
+void
+luawav_counters_push(lua_State *L, const luawav_counters *c);
+
+LUAWAV_PRIVATE
+size_t
+luawav_stdio_read(void *userData, void *buffer, size_t bytes);
+
+LUAWAV_PRIVATE
+size_t
+luawav_stdio_write(void *userData, const void *data, size_t bytes);
+
+LUAWAV_PRIVATE
+drwav_bool32
+luawav_stdio_seek(void *userData, int offset, drwav_seek_origin origin);
+
+LUAWAV_PRIVATE
+drwav_bool32
+luawav_stdio_tell(void *userData, drwav_int64 *pCursor);
+
+LUAWAV_PRIVATE
+int
+luawav_follow_open(luawav_follow *f, const char *filename);
+
+LUAWAV_PRIVATE
+void
+luawav_follow_close(luawav_follow *f);
+
+LUAWAV_PRIVATE
+void
+luawav_follow_start(luawav_follow *f, drwav *wav);
+
+LUAWAV_PRIVATE
+int
+luawav_follow_update(luawav_follow *f, drwav *wav);
+
+LUAWAV_PRIVATE
+int
+luawav_follow_wait(luawav_follow *f, drwav *wav, double timeout);
+
+LUAWAV_PRIVATE
+void
+luawav_flush_reset(luawav_flush *f, drwav_uint64 interval, int sync);
+
+LUAWAV_PRIVATE
+int
+luawav_flush_open(luawav_flush *f, const char *filename, const char *mode);
+
+LUAWAV_PRIVATE
+int
+luawav_flush_close(luawav_flush *f);
+
+LUAWAV_PRIVATE
+int
+luawav_flush_due(luawav_flush *f, drwav_uint64 frames);
+
+LUAWAV_PRIVATE
+int
+luawav_flush_fields(luawav_flush *f, const luawav_header_field *fields, unsigned int count);
+
+LUAWAV_PRIVATE
+int
+luawav_flush_drwav(luawav_flush *f, const drwav *wav);
+
+LUAWAV_PRIVATE
+size_t
+luawav_append_discard(void *userData, const void *data, size_t bytes);
+
+LUAWAV_PRIVATE
+int
+luawav_append_open(luawav_flush *f, const drwav_data_format *format, const drwav_allocation_callbacks *cb, const char **err);
+
+LUAWAV_PRIVATE
+void
+luawav_append_start(const luawav_flush *f, drwav *wav, drwav_write_proc onWrite);
+
+LUAWAV_PRIVATE
+drwav_uint64
+luawav_append_room(const luawav_flush *f, const drwav *wav);
+
+LUAWAV_PRIVATE
+int
+luawav_append_finish(luawav_flush *f, const drwav *wav);
+
 #if !defined(luaL_newlibtable) \
   && (!defined LUA_VERSION_NUM || LUA_VERSION_NUM==501)
 LUAWAV_PRIVATE
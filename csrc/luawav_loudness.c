@@ -0,0 +1,542 @@
+/* ITU-R BS.1770-4 / EBU R128 loudness: K-weighted, gated integrated
+ * loudness, momentary and short-term maximums, loudness range (EBU Tech
+ * 3342) and true-peak (BS.1770 Annex 2, 4x oversampling).
+ *
+ * Audio is processed one second at a time. Each channel is filtered on
+ * its own, producing the mean square of every 100 ms sub-block, so
+ * channels can be spread across threads; the gating blocks (400 ms
+ * momentary, 3 s short-term, both with a 100 ms hop) are then built
+ * from the weighted sub-block sums. */
+
+#include "luawav_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define LOUDNESS_MAX_THREADS 16
+#define LOUDNESS_SUBBLOCKS 10 /* sub-blocks per processing block */
+#define TRUEPEAK_TAPS 12
+#define TRUEPEAK_PHASES 4
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* BS.1770-4 Annex 2 interpolation filter, one row per phase */
+static const double luawav_truepeak_coeffs[TRUEPEAK_PHASES][TRUEPEAK_TAPS] = {
+    {  0.0017089843750,  0.0109863281250, -0.0196533203125,  0.0332031250000,
+      -0.0594482421875,  0.1373291015625,  0.9721679687500, -0.1022949218750,
+       0.0476074218750, -0.0266113281250,  0.0148925781250, -0.0083007812500 },
+    { -0.0291748046875,  0.0292968750000, -0.0517578125000,  0.0891113281250,
+      -0.1665039062500,  0.4650878906250,  0.7797851562500, -0.2003173828125,
+       0.1015625000000, -0.0582275390625,  0.0330810546875, -0.0189208984375 },
+    { -0.0189208984375,  0.0330810546875, -0.0582275390625,  0.1015625000000,
+      -0.2003173828125,  0.7797851562500,  0.4650878906250, -0.1665039062500,
+       0.0891113281250, -0.0517578125000,  0.0292968750000, -0.0291748046875 },
+    { -0.0083007812500,  0.0148925781250, -0.0266113281250,  0.0476074218750,
+      -0.1022949218750,  0.9721679687500,  0.1373291015625, -0.0594482421875,
+       0.0332031250000, -0.0196533203125,  0.0109863281250,  0.0017089843750 },
+};
+
+typedef struct luawav_biquad_s {
+    double b0, b1, b2, a1, a2;
+} luawav_biquad;
+
+typedef struct luawav_loudness_channel_s {
+    double weight;
+    double z1[2]; /* filter state, per stage */
+    double z2[2];
+    double history[TRUEPEAK_TAPS];
+    double truePeak;
+    double samplePeak;
+    double *energy; /* mean square of each sub-block in the current block */
+} luawav_loudness_channel;
+
+typedef struct luawav_meter_s {
+    unsigned int channels;
+    drwav_uint32 sampleRate;
+    drwav_uint64 hop; /* frames per 100 ms sub-block */
+    int truepeak;
+    luawav_biquad stage[2];
+    luawav_loudness_channel *ch;
+    double *energy;
+    const float *block; /* interleaved input for the current block */
+    drwav_uint64 blockFrames;
+
+    double ring[30]; /* weighted energy of the most recent sub-blocks */
+    drwav_uint64 subblocks;
+    double momentaryMax;
+    double shortTermMax;
+    double *gated; /* 400 ms block energies */
+    size_t gatedCount;
+    size_t gatedAlloc;
+    double *shortTerm; /* 3 s block energies */
+    size_t shortTermCount;
+    size_t shortTermAlloc;
+} luawav_meter;
+
+typedef struct luawav_loudness_job_s {
+    luawav_meter *l;
+    unsigned int first;
+    unsigned int last;
+} luawav_loudness_job;
+
+/* K-weighting, the pre-filter and RLB high-pass from BS.1770, with the
+ * analog prototypes mapped to the file's sample rate */
+static void
+luawav_kweighting(luawav_biquad *stage, double rate) {
+    double f0 = 1681.974450955533;
+    double G = 3.999843853973347;
+    double Q = 0.7071752369554196;
+    double K = tan(M_PI * f0 / rate);
+    double Vh = pow(10.0,G / 20.0);
+    double Vb = pow(Vh,0.4996667741545416);
+    double a0 = 1.0 + K / Q + K * K;
+
+    stage[0].b0 = (Vh + Vb * K / Q + K * K) / a0;
+    stage[0].b1 = 2.0 * (K * K - Vh) / a0;
+    stage[0].b2 = (Vh - Vb * K / Q + K * K) / a0;
+    stage[0].a1 = 2.0 * (K * K - 1.0) / a0;
+    stage[0].a2 = (1.0 - K / Q + K * K) / a0;
+
+    f0 = 38.13547087602444;
+    Q = 0.5003270373238773;
+    K = tan(M_PI * f0 / rate);
+    a0 = 1.0 + K / Q + K * K;
+
+    stage[1].b0 = 1.0;
+    stage[1].b1 = -2.0;
+    stage[1].b2 = 1.0;
+    stage[1].a1 = 2.0 * (K * K - 1.0) / a0;
+    stage[1].a2 = (1.0 - K / Q + K * K) / a0;
+}
+
+/* channel weights from BS.1770 for the usual WAV channel orders:
+ * L R C LFE Ls Rs, with the LFE left out and surrounds at +1.5 dB */
+static double
+luawav_channel_weight(unsigned int channels, unsigned int c) {
+    if(channels == 4) return c >= 2 ? 1.41 : 1.0;
+    if(channels == 5) return c >= 3 ? 1.41 : 1.0;
+    if(channels >= 6) {
+        if(c == 3) return 0.0;
+        if(c == 4 || c == 5) return 1.41;
+    }
+    return 1.0;
+}
+
+static double
+luawav_lufs(double energy) {
+    if(energy <= 0.0) return -HUGE_VAL;
+    return -0.691 + 10.0 * log10(energy);
+}
+
+static double
+luawav_db(double v) {
+    if(v <= 0.0) return -HUGE_VAL;
+    return 20.0 * log10(v);
+}
+
+static void
+luawav_loudness_channel_block(luawav_meter *l, unsigned int c) {
+    luawav_loudness_channel *lc = &l->ch[c];
+    const luawav_biquad *s0 = &l->stage[0];
+    const luawav_biquad *s1 = &l->stage[1];
+    const float *in = l->block + c;
+    double x = 0.0;
+    double y = 0.0;
+    double v = 0.0;
+    double sum = 0.0;
+    drwav_uint64 f = 0;
+    drwav_uint64 k = 0;
+    unsigned int p = 0;
+    unsigned int i = 0;
+
+    for(f=0;f<l->blockFrames;f++) {
+        x = *in;
+        in += l->channels;
+
+        if(fabs(x) > lc->samplePeak) lc->samplePeak = fabs(x);
+
+        if(l->truepeak) {
+            memmove(&lc->history[1],&lc->history[0],sizeof(double) * (TRUEPEAK_TAPS - 1));
+            lc->history[0] = x;
+            for(p=0;p<TRUEPEAK_PHASES;p++) {
+                v = 0.0;
+                for(i=0;i<TRUEPEAK_TAPS;i++) {
+                    v += luawav_truepeak_coeffs[p][i] * lc->history[i];
+                }
+                if(fabs(v) > lc->truePeak) lc->truePeak = fabs(v);
+            }
+        }
+
+        /* transposed direct form II, two stages */
+        y = s0->b0 * x + lc->z1[0];
+        lc->z1[0] = s0->b1 * x - s0->a1 * y + lc->z2[0];
+        lc->z2[0] = s0->b2 * x - s0->a2 * y;
+        x = y;
+        y = s1->b0 * x + lc->z1[1];
+        lc->z1[1] = s1->b1 * x - s1->a1 * y + lc->z2[1];
+        lc->z2[1] = s1->b2 * x - s1->a2 * y;
+
+        sum += y * y;
+        if(++k == l->hop) {
+            lc->energy[f / l->hop] = sum / (double)l->hop;
+            sum = 0.0;
+            k = 0;
+        }
+    }
+    /* a partial sub-block only happens at the end of the file, where it's
+     * dropped */
+}
+
+static void *
+luawav_loudness_worker(void *arg) {
+    luawav_loudness_job *job = (luawav_loudness_job *)arg;
+    unsigned int c = 0;
+    for(c=job->first;c<job->last;c++) {
+        luawav_loudness_channel_block(job->l,c);
+    }
+    return NULL;
+}
+
+static int
+luawav_loudness_append(double **list, size_t *count, size_t *alloc, double v) {
+    double *n = NULL;
+    if(*count == *alloc) {
+        n = (double *)realloc(*list,sizeof(double) * (*alloc ? *alloc * 2 : 1024));
+        if(n == NULL) return 0;
+        *list = n;
+        *alloc = *alloc ? *alloc * 2 : 1024;
+    }
+    (*list)[(*count)++] = v;
+    return 1;
+}
+
+/* adds the finished sub-blocks of the current block to the gating lists */
+static int
+luawav_loudness_gate(luawav_meter *l, drwav_uint64 subblocks) {
+    drwav_uint64 k = 0;
+    unsigned int c = 0;
+    unsigned int i = 0;
+    double w = 0.0;
+    double m = 0.0;
+    double s = 0.0;
+
+    for(k=0;k<subblocks;k++) {
+        w = 0.0;
+        for(c=0;c<l->channels;c++) {
+            w += l->ch[c].weight * l->ch[c].energy[k];
+        }
+        l->ring[l->subblocks % 30] = w;
+        l->subblocks++;
+
+        if(l->subblocks >= 4) {
+            m = 0.0;
+            for(i=0;i<4;i++) m += l->ring[(l->subblocks - 1 - i) % 30];
+            m /= 4.0;
+            if(m > l->momentaryMax) l->momentaryMax = m;
+            if(!luawav_loudness_append(&l->gated,&l->gatedCount,&l->gatedAlloc,m)) return 0;
+        }
+        if(l->subblocks >= 30) {
+            s = 0.0;
+            for(i=0;i<30;i++) s += l->ring[i];
+            s /= 30.0;
+            if(s > l->shortTermMax) l->shortTermMax = s;
+            if(!luawav_loudness_append(&l->shortTerm,&l->shortTermCount,&l->shortTermAlloc,s)) return 0;
+        }
+    }
+    return 1;
+}
+
+static double
+luawav_loudness_integrated(const luawav_meter *l) {
+    double sum = 0.0;
+    double threshold = 0.0;
+    size_t n = 0;
+    size_t i = 0;
+
+    for(i=0;i<l->gatedCount;i++) {
+        if(luawav_lufs(l->gated[i]) > -70.0) {
+            sum += l->gated[i];
+            n++;
+        }
+    }
+    if(n == 0) return -HUGE_VAL;
+
+    threshold = luawav_lufs(sum / n) - 10.0;
+    sum = 0.0;
+    n = 0;
+    for(i=0;i<l->gatedCount;i++) {
+        if(luawav_lufs(l->gated[i]) > -70.0 && luawav_lufs(l->gated[i]) > threshold) {
+            sum += l->gated[i];
+            n++;
+        }
+    }
+    return n ? luawav_lufs(sum / n) : -HUGE_VAL;
+}
+
+static int
+luawav_cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* EBU Tech 3342: spread between the 10th and 95th percentiles of the
+ * short-term loudness, gated at -70 LUFS and 20 LU below the mean */
+static double
+luawav_loudness_range(luawav_meter *l) {
+    double sum = 0.0;
+    double threshold = 0.0;
+    size_t n = 0;
+    size_t i = 0;
+
+    for(i=0;i<l->shortTermCount;i++) {
+        if(luawav_lufs(l->shortTerm[i]) > -70.0) {
+            sum += l->shortTerm[i];
+            n++;
+        }
+    }
+    if(n == 0) return 0.0;
+    threshold = luawav_lufs(sum / n) - 20.0;
+
+    /* compacts the list down to the gated values */
+    n = 0;
+    for(i=0;i<l->shortTermCount;i++) {
+        if(luawav_lufs(l->shortTerm[i]) > -70.0 && luawav_lufs(l->shortTerm[i]) > threshold) {
+            l->shortTerm[n++] = l->shortTerm[i];
+        }
+    }
+    if(n == 0) return 0.0;
+    qsort(l->shortTerm,n,sizeof(double),luawav_cmp_double);
+    return luawav_lufs(l->shortTerm[(size_t)((n - 1) * 0.95 + 0.5)]) -
+           luawav_lufs(l->shortTerm[(size_t)((n - 1) * 0.10 + 0.5)]);
+}
+
+static void
+luawav_loudness_free(luawav_meter *l) {
+    free(l->ch);
+    free(l->energy);
+    free(l->gated);
+    free(l->shortTerm);
+}
+
+static const char *
+luawav_loudness_setup(luawav_meter *l, const drwav *wav) {
+    unsigned int c = 0;
+
+    if(wav->channels == 0 || wav->sampleRate < 10) {
+        return "unsupported format";
+    }
+
+    l->channels = wav->channels;
+    l->sampleRate = wav->sampleRate;
+    l->hop = (wav->sampleRate + 5) / 10;
+    luawav_kweighting(l->stage,(double)wav->sampleRate);
+
+    l->ch = (luawav_loudness_channel *)calloc(l->channels,sizeof(luawav_loudness_channel));
+    l->energy = (double *)calloc((size_t)l->channels * LOUDNESS_SUBBLOCKS,sizeof(double));
+    if(l->ch == NULL || l->energy == NULL) {
+        return "out of memory";
+    }
+
+    for(c=0;c<l->channels;c++) {
+        l->ch[c].weight = luawav_channel_weight(l->channels,c);
+        l->ch[c].energy = l->energy + (c * LOUDNESS_SUBBLOCKS);
+    }
+    return NULL;
+}
+
+/* reads the rest of the file, returns NULL or an error message */
+static const char *
+luawav_loudness_run(luawav_meter *l, drwav *wav, unsigned int threads) {
+    float *buffer = NULL;
+    drwav_uint64 t = 0;
+    unsigned int i = 0;
+    unsigned int per = 0;
+    const char *err = NULL;
+#if LUAWAV_HAVE_THREADS
+    pthread_t tid[LOUDNESS_MAX_THREADS];
+    luawav_loudness_job jobs[LOUDNESS_MAX_THREADS];
+    unsigned int started = 0;
+#else
+    luawav_loudness_job job;
+#endif
+
+    buffer = (float *)malloc(sizeof(float) * l->hop * LOUDNESS_SUBBLOCKS * l->channels);
+    if(buffer == NULL) {
+        return "out of memory";
+    }
+
+    if(threads > l->channels) threads = l->channels;
+    if(threads > LOUDNESS_MAX_THREADS) threads = LOUDNESS_MAX_THREADS;
+    if(threads < 1) threads = 1;
+    per = (l->channels + threads - 1) / threads;
+
+    l->block = buffer;
+    do {
+        t = drwav_read_pcm_frames_f32(wav,l->hop * LOUDNESS_SUBBLOCKS,buffer);
+        if(t == 0) break;
+        l->blockFrames = t;
+
+#if LUAWAV_HAVE_THREADS
+        started = 0;
+        for(i=0;i<threads;i++) {
+            jobs[i].l = l;
+            jobs[i].first = i * per;
+            jobs[i].last = WAV_MIN((i + 1) * per,l->channels);
+            if(jobs[i].first >= jobs[i].last) break;
+            /* the last group runs on this thread */
+            if(i + 1 == threads || jobs[i].last == l->channels) {
+                luawav_loudness_worker(&jobs[i]);
+            } else if(pthread_create(&tid[started],NULL,luawav_loudness_worker,&jobs[i]) != 0) {
+                luawav_loudness_worker(&jobs[i]);
+            } else {
+                started++;
+            }
+        }
+        for(i=0;i<started;i++) {
+            pthread_join(tid[i],NULL);
+        }
+#else
+        (void)i;
+        (void)per;
+        job.l = l;
+        job.first = 0;
+        job.last = l->channels;
+        luawav_loudness_worker(&job);
+#endif
+
+        if(!luawav_loudness_gate(l,t / l->hop)) {
+            err = "out of memory";
+            goto done;
+        }
+    } while(t == l->hop * LOUDNESS_SUBBLOCKS);
+
+    done:
+    free(buffer);
+    return err;
+}
+
+/* integrated loudness of the rest of an open file, for normalizing */
+LUAWAV_PRIVATE
+const char *
+luawav_measure_lufs(drwav *wav, double *integrated) {
+    luawav_meter l;
+    const char *err = NULL;
+
+    memset(&l,0,sizeof(luawav_meter));
+    err = luawav_loudness_setup(&l,wav);
+    if(err == NULL) err = luawav_loudness_run(&l,wav,1);
+    if(err == NULL) *integrated = luawav_loudness_integrated(&l);
+    luawav_loudness_free(&l);
+    return err;
+}
+
+/* wav.loudness(path | reader [, { truepeak = true, threads = n, weights = {...} }]) */
+LUAWAV_PRIVATE
+int
+luawav_loudness(lua_State *L) {
+    luawav_meter l;
+    const char *path = NULL;
+    const char *err = NULL;
+    drwav *reader = NULL;
+    drwav wav;
+    unsigned int threads = 1;
+    unsigned int c = 0;
+    double truePeak = 0.0;
+    double samplePeak = 0.0;
+
+    memset(&l,0,sizeof(luawav_meter));
+
+    if(lua_type(L,1) == LUA_TSTRING) {
+        path = lua_tostring(L,1);
+    } else {
+        reader = luawav_todrwav(L,1);
+        if(reader == NULL) {
+            return luaL_error(L,"expected a filename or a drwav object opened for reading");
+        }
+    }
+
+    l.truepeak = luawav_opt_boolean(L,2,"truepeak");
+    if(luawav_opt_isset(L,2,"threads")) {
+        lua_getfield(L,2,"threads");
+        threads = (unsigned int)luaL_checkinteger(L,-1);
+        lua_pop(L,1);
+    }
+    if(luawav_opt_isset(L,2,"weights")) {
+        lua_getfield(L,2,"weights");
+        luaL_checktype(L,-1,LUA_TTABLE);
+        lua_pop(L,1);
+    }
+
+    if(reader == NULL) {
+        if(!drwav_init_file(&wav,path,NULL)) {
+            lua_pushnil(L);
+            lua_pushfstring(L,"unable to open %s",path);
+            return 2;
+        }
+        reader = &wav;
+    }
+
+    err = luawav_loudness_setup(&l,reader);
+    if(err == NULL) {
+        if(luawav_opt_isset(L,2,"weights")) {
+            lua_getfield(L,2,"weights");
+            for(c=0;c<l.channels;c++) {
+                lua_rawgeti(L,-1,c + 1);
+                if(lua_isnumber(L,-1)) l.ch[c].weight = lua_tonumber(L,-1);
+                lua_pop(L,1);
+            }
+            lua_pop(L,1);
+        }
+        err = luawav_loudness_run(&l,reader,threads);
+    }
+    if(path != NULL) {
+        drwav_uninit(&wav);
+    }
+
+    if(err != NULL) {
+        luawav_loudness_free(&l);
+        lua_pushnil(L);
+        lua_pushstring(L,err);
+        return 2;
+    }
+
+    lua_newtable(L);
+    lua_pushnumber(L,luawav_loudness_integrated(&l));
+    lua_setfield(L,-2,"integrated");
+    lua_pushnumber(L,luawav_lufs(l.momentaryMax));
+    lua_setfield(L,-2,"momentaryMax");
+    lua_pushnumber(L,luawav_lufs(l.shortTermMax));
+    lua_setfield(L,-2,"shortTermMax");
+    lua_pushnumber(L,luawav_loudness_range(&l));
+    lua_setfield(L,-2,"range");
+
+    lua_createtable(L,l.channels,0);
+    for(c=0;c<l.channels;c++) {
+        if(l.ch[c].samplePeak > samplePeak) samplePeak = l.ch[c].samplePeak;
+        lua_pushnumber(L,luawav_db(l.ch[c].samplePeak));
+        lua_rawseti(L,-2,c + 1);
+    }
+    lua_setfield(L,-2,"samplePeaks");
+    lua_pushnumber(L,luawav_db(samplePeak));
+    lua_setfield(L,-2,"samplePeak");
+
+    if(l.truepeak) {
+        lua_createtable(L,l.channels,0);
+        for(c=0;c<l.channels;c++) {
+            /* the interpolated peak is never reported below the sample peak */
+            if(l.ch[c].samplePeak > l.ch[c].truePeak) l.ch[c].truePeak = l.ch[c].samplePeak;
+            if(l.ch[c].truePeak > truePeak) truePeak = l.ch[c].truePeak;
+            lua_pushnumber(L,luawav_db(l.ch[c].truePeak));
+            lua_rawseti(L,-2,c + 1);
+        }
+        lua_setfield(L,-2,"truePeaks");
+        lua_pushnumber(L,luawav_db(truePeak));
+        lua_setfield(L,-2,"truePeak");
+    }
+
+    luawav_loudness_free(&l);
+    return 1;
+}
@@ -0,0 +1,348 @@
+/* converts samples in native format into the little-endian byte layout
+ * stored in a WAV data chunk */
+
+#include "luawav_internal.h"
+#include <stdlib.h>
+#include <math.h>
+
+LUAWAV_PRIVATE
+int
+luawav_pack_supported(drwav_uint16 formatTag, drwav_uint16 bitsPerSample) {
+    if(formatTag == DR_WAVE_FORMAT_PCM) {
+        return bitsPerSample == 8 || bitsPerSample == 16 || bitsPerSample == 24 || bitsPerSample == 32;
+    }
+    if(formatTag == DR_WAVE_FORMAT_IEEE_FLOAT) {
+        return bitsPerSample == 32 || bitsPerSample == 64;
+    }
+    if(formatTag == DR_WAVE_FORMAT_ALAW || formatTag == DR_WAVE_FORMAT_MULAW) {
+        return bitsPerSample == 8;
+    }
+    return 0;
+}
+
+/* bytes per frame in the data chunk, worked out the way dr_wav does */
+LUAWAV_PRIVATE
+drwav_uint32
+luawav_frame_bytes(const drwav *wav) {
+    if((wav->bitsPerSample & 7) == 0) {
+        return (wav->bitsPerSample * wav->channels) / 8;
+    }
+    return wav->fmt.blockAlign;
+}
+
+/* the bit depth integer samples are rounded to before packing, G.711
+ * and ADPCM encode from 16-bit linear */
+LUAWAV_PRIVATE
+drwav_uint16
+luawav_quantize_bits(drwav_uint16 formatTag, drwav_uint16 bitsPerSample) {
+    if(formatTag == DR_WAVE_FORMAT_ALAW || formatTag == DR_WAVE_FORMAT_MULAW || formatTag == DR_WAVE_FORMAT_DVI_ADPCM) {
+        return 16;
+    }
+    return bitsPerSample;
+}
+
+/* G.711 segment ends, for 13-bit (A-law) and 14-bit (mu-law) magnitudes */
+static const drwav_int32 luawav_alaw_seg[8] = { 0x1F, 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF };
+static const drwav_int32 luawav_mulaw_seg[8] = { 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF, 0x1FFF };
+
+static unsigned int
+luawav_g711_segment(drwav_int32 v, const drwav_int32 *seg) {
+    unsigned int i = 0;
+    while(i < 8 && v > seg[i]) i++;
+    return i;
+}
+
+static drwav_uint8
+luawav_alaw(drwav_int32 pcm) {
+    drwav_uint8 mask = 0xD5;
+    unsigned int seg = 0;
+    drwav_uint8 a = 0;
+
+    pcm >>= 3;
+    if(pcm < 0) {
+        mask = 0x55;
+        pcm = -pcm - 1;
+    }
+    seg = luawav_g711_segment(pcm,luawav_alaw_seg);
+    if(seg >= 8) return (drwav_uint8)(0x7F ^ mask);
+    a = (drwav_uint8)(seg << 4);
+    a |= (drwav_uint8)((seg < 2 ? pcm >> 1 : pcm >> seg) & 0x0F);
+    return (drwav_uint8)(a ^ mask);
+}
+
+static drwav_uint8
+luawav_mulaw(drwav_int32 pcm) {
+    drwav_uint8 mask = 0xFF;
+    unsigned int seg = 0;
+
+    pcm >>= 2;
+    if(pcm < 0) {
+        mask = 0x7F;
+        pcm = -pcm;
+    }
+    if(pcm > 8159) pcm = 8159;
+    pcm += 0x84 >> 2;
+    seg = luawav_g711_segment(pcm,luawav_mulaw_seg);
+    if(seg >= 8) return (drwav_uint8)(0x7F ^ mask);
+    return (drwav_uint8)(((seg << 4) | ((pcm >> (seg + 1)) & 0x0F)) ^ mask);
+}
+
+/* packs full-scale signed 32-bit samples into 8, 16, 24 or 32-bit PCM,
+ * or A-law/mu-law from their top 16 bits */
+LUAWAV_PRIVATE
+void
+luawav_pack_s32(void *out, const drwav_int32 *in, size_t count, drwav_uint16 formatTag, drwav_uint16 bitsPerSample) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    drwav_uint32 s = 0;
+    size_t i = 0;
+
+    if(formatTag == DR_WAVE_FORMAT_ALAW) {
+        for(i=0;i<count;i++) {
+            o[i] = luawav_alaw(in[i] >> 16);
+        }
+        return;
+    }
+    if(formatTag == DR_WAVE_FORMAT_MULAW) {
+        for(i=0;i<count;i++) {
+            o[i] = luawav_mulaw(in[i] >> 16);
+        }
+        return;
+    }
+
+    switch(bitsPerSample) {
+        case 8: {
+            for(i=0;i<count;i++) {
+                o[i] = (drwav_uint8)((in[i] >> 24) + 128);
+            }
+            break;
+        }
+        case 16: {
+            for(i=0;i<count;i++) {
+                s = (drwav_uint32)in[i];
+                o[0] = (drwav_uint8)(s >> 16);
+                o[1] = (drwav_uint8)(s >> 24);
+                o += 2;
+            }
+            break;
+        }
+        case 24: {
+            luawav_convert.s32_to_s24(o,in,count);
+            break;
+        }
+        case 32: {
+            for(i=0;i<count;i++) {
+                s = (drwav_uint32)in[i];
+                o[0] = (drwav_uint8)(s);
+                o[1] = (drwav_uint8)(s >> 8);
+                o[2] = (drwav_uint8)(s >> 16);
+                o[3] = (drwav_uint8)(s >> 24);
+                o += 4;
+            }
+            break;
+        }
+        default: break;
+    }
+}
+
+/* packs float samples into 32 or 64-bit IEEE float */
+LUAWAV_PRIVATE
+void
+luawav_pack_f32(void *out, const float *in, size_t count, drwav_uint16 bitsPerSample) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    union { float f; drwav_uint32 u; } f32;
+    union { double f; drwav_uint64 u; } f64;
+    size_t i = 0;
+    unsigned int b = 0;
+
+    if(bitsPerSample == 32) {
+        for(i=0;i<count;i++) {
+            f32.f = in[i];
+            for(b=0;b<4;b++) {
+                o[b] = (drwav_uint8)(f32.u >> (b * 8));
+            }
+            o += 4;
+        }
+    } else if(bitsPerSample == 64) {
+        for(i=0;i<count;i++) {
+            f64.f = (double)in[i];
+            for(b=0;b<8;b++) {
+                o[b] = (drwav_uint8)(f64.u >> (b * 8));
+            }
+            o += 8;
+        }
+    }
+}
+
+LUAWAV_PRIVATE
+const char * const luawav_dither_modes[] = {
+    "none",
+    "tpdf",
+    "shaped",
+    NULL,
+};
+
+/* samples quantized to 16 bits at a time in luawav_quantize_f32 */
+#define QUANTIZE_BLOCK 256
+
+/* starts every generator at its own point in the xorshift sequence, from
+ * a hash of its index, so the lanes don't overlap */
+LUAWAV_PRIVATE
+int
+luawav_dither_init(luawav_dither *d, int mode, unsigned int channels) {
+    drwav_uint32 s = 0;
+    unsigned int j = 0;
+
+    d->mode = mode;
+    d->channels = channels;
+    d->channel = 0;
+    for(j=0;j<LUAWAV_DITHER_LANES;j++) {
+        s = (j + 1) * 0x9e3779b9;
+        s ^= s >> 16;
+        s *= 0x85ebca6b;
+        s ^= s >> 13;
+        s *= 0xc2b2ae35;
+        s ^= s >> 16;
+        d->state[j] = s;
+    }
+    for(j=0;j<LUAWAV_DITHER_LANES / 2;j++) d->noise[j] = 0.0f;
+    d->next = LUAWAV_DITHER_LANES / 2;
+    d->error = NULL;
+    if(mode == LUAWAV_DITHER_SHAPED) {
+        d->error = (double *)calloc(channels,sizeof(double));
+        if(d->error == NULL) return 0;
+    }
+    return 1;
+}
+
+LUAWAV_PRIVATE
+void
+luawav_dither_free(luawav_dither *d) {
+    free(d->error);
+    d->error = NULL;
+}
+
+/* steps every generator once, refilling the noise. The vector kernels
+ * do the same a register at a time */
+LUAWAV_PRIVATE
+void
+luawav_dither_step(luawav_dither *d) {
+    drwav_uint32 s = 0;
+    unsigned int j = 0;
+
+    for(j=0;j<LUAWAV_DITHER_LANES;j++) {
+        s = d->state[j];
+        s ^= s << 13;
+        s ^= s >> 17;
+        s ^= s << 5;
+        d->state[j] = s;
+    }
+    for(j=0;j<LUAWAV_DITHER_LANES / 2;j++) {
+        d->noise[j] = ((float)(drwav_int32)(d->state[j] >> 8)
+          - (float)(drwav_int32)(d->state[j + LUAWAV_DITHER_LANES / 2] >> 8)) * (1.0f / 16777216.0f);
+    }
+    d->next = 0;
+}
+
+/* triangular noise spanning +/- 1 LSB, the next value from the lanes */
+LUAWAV_PRIVATE
+float
+luawav_dither_noise(luawav_dither *d) {
+    if(d->next == LUAWAV_DITHER_LANES / 2) luawav_dither_step(d);
+    return d->noise[d->next++];
+}
+
+/* the 16-bit kernel luawav_convert has for d */
+static void
+luawav_quantize_s16(void *out, const float *in, size_t count, double gain, luawav_dither *d) {
+    if(d->mode == LUAWAV_DITHER_NONE) {
+        luawav_convert.quantize_s16(out,in,count,(float)gain);
+    } else {
+        luawav_convert.dither_s16(out,in,count,(float)gain,d);
+    }
+}
+
+/* scales float samples by gain and rounds them to bitsPerSample,
+ * clamping to the format's range. The result is left justified in 32
+ * bits, ready for luawav_pack_s32.
+ *
+ * With LUAWAV_DITHER_TPDF, triangular dither is added before rounding.
+ * LUAWAV_DITHER_SHAPED also feeds each channel's previous rounding error
+ * back in (first-order, 1 - z^-1), moving the noise towards high
+ * frequencies. That error, and the channel the next sample is for, carry
+ * over between calls.
+ *
+ * 16-bit output goes through the luawav_convert quantizers, which scale
+ * in single precision. */
+LUAWAV_PRIVATE
+void
+luawav_quantize_f32(drwav_int32 *out, const float *in, size_t count, double gain, drwav_uint16 bitsPerSample, luawav_dither *d) {
+    double scale = ldexp(1.0,bitsPerSample - 1);
+    double lo = -scale;
+    double hi = scale - 1.0;
+    double v = 0.0;
+    double q = 0.0;
+    unsigned int shift = 32 - bitsPerSample;
+    drwav_uint8 b[QUANTIZE_BLOCK * 2];
+    size_t i = 0;
+    size_t j = 0;
+    size_t m = 0;
+
+    if(bitsPerSample == 16) {
+        for(i=0;i<count;i+=m) {
+            m = WAV_MIN(count - i,QUANTIZE_BLOCK);
+            luawav_quantize_s16(b,in + i,m,gain,d);
+            for(j=0;j<m;j++) {
+                out[i + j] = (drwav_int32)(((drwav_uint32)b[j * 2] << 16) | ((drwav_uint32)b[j * 2 + 1] << 24));
+            }
+        }
+        return;
+    }
+
+    gain *= scale;
+
+    switch(d->mode) {
+        case LUAWAV_DITHER_TPDF: {
+            for(i=0;i<count;i++) {
+                v = floor(in[i] * gain + luawav_dither_noise(d) + 0.5);
+                v = v < lo ? lo : (v > hi ? hi : v);
+                out[i] = (drwav_int32)((drwav_uint32)(drwav_int32)v << shift);
+            }
+            break;
+        }
+        case LUAWAV_DITHER_SHAPED: {
+            for(i=0;i<count;i++) {
+                v = in[i] * gain - d->error[d->channel];
+                q = floor(v + luawav_dither_noise(d) + 0.5);
+                d->error[d->channel] = q - v;
+                q = q < lo ? lo : (q > hi ? hi : q);
+                out[i] = (drwav_int32)((drwav_uint32)(drwav_int32)q << shift);
+                if(++d->channel == d->channels) d->channel = 0;
+            }
+            break;
+        }
+        default: {
+            for(i=0;i<count;i++) {
+                v = floor(in[i] * gain + 0.5);
+                v = v < lo ? lo : (v > hi ? hi : v);
+                out[i] = (drwav_int32)((drwav_uint32)(drwav_int32)v << shift);
+            }
+            break;
+        }
+    }
+}
+
+/* luawav_quantize_f32 and luawav_pack_s32 in one pass, with a kernel from
+ * luawav_convert, for 16-bit PCM, and for 24-bit PCM when there's no gain
+ * or dither. Returns 0, doing nothing, for anything else. */
+LUAWAV_PRIVATE
+int
+luawav_quantize_pack_f32(void *out, const float *in, size_t count, double gain, drwav_uint16 formatTag, drwav_uint16 bitsPerSample, luawav_dither *d) {
+    if(formatTag != DR_WAVE_FORMAT_PCM) return 0;
+    if(bitsPerSample == 16) {
+        luawav_quantize_s16(out,in,count,gain,d);
+        return 1;
+    }
+    if(gain != 1.0 || d->mode != LUAWAV_DITHER_NONE || bitsPerSample != 24) return 0;
+    luawav_convert.f32_to_s24(out,in,count);
+    return 1;
+}
@@ -0,0 +1,605 @@
+/* multi-resolution peak files: min/max per channel at a few fixed zoom
+ * levels, so a waveform view can be redrawn without touching the audio.
+ *
+ * file layout, all values little-endian:
+ *   header (48 bytes)
+ *     "LWPK", u32 version, u16 channels, u16 levelCount, u32 sampleRate,
+ *     u64 frameCount, u64 sourceSize, i64 sourceMtime, u32 reserved[2]
+ *   levelCount level descriptors (24 bytes each)
+ *     u32 framesPerPeak, u32 reserved, u64 offset, u64 peakCount
+ *   level data
+ *     peakCount peaks, each being channels pairs of i16 min, i16 max
+ */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "luawav_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#define LUAWAV_HAVE_MMAP 0
+#else
+#define LUAWAV_HAVE_MMAP 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define PEAKS_VERSION 1
+#define PEAKS_HEADER 48
+#define PEAKS_LEVEL 24
+#define PEAKS_MAX_LEVELS 16
+#define PEAKS_BUFFER 4096
+
+LUAWAV_PRIVATE
+const char * const luawav_peaks_mt = "luawav_peaks";
+
+typedef struct luawav_peaks_level_s {
+    drwav_uint32 framesPerPeak;
+    drwav_uint64 offset;
+    drwav_uint64 count;
+} luawav_peaks_level;
+
+typedef struct luawav_peaks_s {
+    const drwav_uint8 *data;
+    size_t size;
+    int mapped;
+    drwav_uint16 channels;
+    drwav_uint16 levelCount;
+    drwav_uint32 sampleRate;
+    drwav_uint64 frameCount;
+    drwav_uint64 sourceSize;
+    drwav_int64 sourceMtime;
+    luawav_peaks_level levels[PEAKS_MAX_LEVELS];
+} luawav_peaks;
+
+static void
+luawav_peaks_put_u16(drwav_uint8 *p, drwav_uint16 v) {
+    p[0] = (drwav_uint8)v;
+    p[1] = (drwav_uint8)(v >> 8);
+}
+
+static void
+luawav_peaks_put_u32(drwav_uint8 *p, drwav_uint32 v) {
+    luawav_peaks_put_u16(p,(drwav_uint16)v);
+    luawav_peaks_put_u16(p + 2,(drwav_uint16)(v >> 16));
+}
+
+static void
+luawav_peaks_put_u64(drwav_uint8 *p, drwav_uint64 v) {
+    luawav_peaks_put_u32(p,(drwav_uint32)v);
+    luawav_peaks_put_u32(p + 4,(drwav_uint32)(v >> 32));
+}
+
+static drwav_uint16
+luawav_peaks_u16(const drwav_uint8 *p) {
+    return (drwav_uint16)(p[0] | (p[1] << 8));
+}
+
+static drwav_uint32
+luawav_peaks_u32(const drwav_uint8 *p) {
+    return (drwav_uint32)luawav_peaks_u16(p) | ((drwav_uint32)luawav_peaks_u16(p + 2) << 16);
+}
+
+static drwav_uint64
+luawav_peaks_u64(const drwav_uint8 *p) {
+    return (drwav_uint64)luawav_peaks_u32(p) | ((drwav_uint64)luawav_peaks_u32(p + 4) << 32);
+}
+
+static void
+luawav_peaks_reset(drwav_int16 *acc, unsigned int channels) {
+    unsigned int c = 0;
+    for(c=0;c<channels;c++) {
+        acc[c*2] = 32767;
+        acc[c*2+1] = -32768;
+    }
+}
+
+/* writes out a finished peak, folds it into the level above (if any) and
+ * starts the next one */
+static void
+luawav_peaks_emit(drwav_uint8 *p, drwav_int16 *acc, drwav_int16 *up, unsigned int channels) {
+    unsigned int c = 0;
+    for(c=0;c<channels;c++) {
+        luawav_peaks_put_u16(p + (c * 4),(drwav_uint16)acc[c*2]);
+        luawav_peaks_put_u16(p + (c * 4) + 2,(drwav_uint16)acc[c*2+1]);
+        if(up != NULL) {
+            if(acc[c*2] < up[c*2]) up[c*2] = acc[c*2];
+            if(acc[c*2+1] > up[c*2+1]) up[c*2+1] = acc[c*2+1];
+        }
+    }
+    luawav_peaks_reset(acc,channels);
+}
+
+static int
+luawav_peaks_stat(const char *path, drwav_uint64 *size, drwav_int64 *mtime) {
+    struct stat st;
+    if(stat(path,&st) != 0) return 0;
+    *size = (drwav_uint64)st.st_size;
+    *mtime = (drwav_int64)st.st_mtime;
+    return 1;
+}
+
+/* wav.build_peaks(src, peakfile [, { levels = { 256, 4096, 65536 } }]) */
+LUAWAV_PRIVATE
+int
+luawav_build_peaks(lua_State *L) {
+    const char *src = NULL;
+    const char *dst = NULL;
+    drwav_uint32 fpp[PEAKS_MAX_LEVELS];
+    drwav_uint64 counts[PEAKS_MAX_LEVELS];
+    drwav_uint64 offsets[PEAKS_MAX_LEVELS];
+    drwav_uint64 filled[PEAKS_MAX_LEVELS];
+    drwav_uint64 pending[PEAKS_MAX_LEVELS];
+    drwav_int16 buffer[PEAKS_BUFFER];
+    unsigned int levelCount = 3;
+    unsigned int k = 0;
+    unsigned int c = 0;
+    lua_Integer v = 0;
+    drwav_uint64 sourceSize = 0;
+    drwav_int64 sourceMtime = 0;
+    drwav_uint64 total = 0;
+    drwav_uint64 peakBytes = 0;
+    drwav_uint64 t = 0;
+    drwav_uint64 f = 0;
+    drwav_uint8 *out = NULL;
+    drwav_uint8 *p = NULL;
+    drwav_int16 *acc = NULL;
+    drwav_int16 x = 0;
+    const char *err = NULL;
+    FILE *o = NULL;
+    drwav wav;
+
+    src = luaL_checkstring(L,1);
+    dst = luaL_checkstring(L,2);
+
+    fpp[0] = 256;
+    fpp[1] = 4096;
+    fpp[2] = 65536;
+
+    if(luawav_opt_isset(L,3,"levels")) {
+        lua_getfield(L,3,"levels");
+        if(!lua_istable(L,-1)) {
+            return luaL_error(L,"levels must be a table");
+        }
+        levelCount = lua_rawlen(L,-1);
+        if(levelCount == 0 || levelCount > PEAKS_MAX_LEVELS) {
+            return luaL_error(L,"between 1 and %d levels are supported",PEAKS_MAX_LEVELS);
+        }
+        for(k=0;k<levelCount;k++) {
+            lua_rawgeti(L,-1,k + 1);
+            v = lua_tointeger(L,-1);
+            lua_pop(L,1);
+            if(v < 1 || v > 0x7FFFFFFF) {
+                return luaL_error(L,"invalid level %d",(int)v);
+            }
+            fpp[k] = (drwav_uint32)v;
+            if(k > 0 && (fpp[k] <= fpp[k-1] || fpp[k] % fpp[k-1] != 0)) {
+                return luaL_error(L,"each level must be a multiple of the one before it");
+            }
+        }
+        lua_pop(L,1);
+    }
+
+    if(!luawav_peaks_stat(src,&sourceSize,&sourceMtime)) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"unable to open %s",src);
+        return 2;
+    }
+
+    if(!drwav_init_file(&wav,src,NULL)) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"unable to open %s",src);
+        return 2;
+    }
+
+    /* every peak of every level is kept in memory and written at once, the
+     * finest level dominates at frames / fpp[0] peaks */
+    total = PEAKS_HEADER + (PEAKS_LEVEL * levelCount);
+    peakBytes = (drwav_uint64)wav.channels * 4;
+    for(k=0;k<levelCount;k++) {
+        counts[k] = (wav.totalPCMFrameCount + fpp[k] - 1) / fpp[k];
+        offsets[k] = total;
+        filled[k] = 0;
+        pending[k] = 0;
+        total += counts[k] * peakBytes;
+    }
+
+    if(total != (size_t)total || PEAKS_BUFFER / wav.channels == 0) {
+        drwav_uninit(&wav);
+        lua_pushnil(L);
+        lua_pushliteral(L,"file too large");
+        return 2;
+    }
+
+    out = (drwav_uint8 *)malloc((size_t)total + (sizeof(drwav_int16) * 2 * wav.channels * levelCount));
+    if(out == NULL) {
+        drwav_uninit(&wav);
+        return luaL_error(L,"out of memory");
+    }
+    acc = (drwav_int16 *)(out + total);
+
+    memcpy(out,"LWPK",4);
+    luawav_peaks_put_u32(out + 4,PEAKS_VERSION);
+    luawav_peaks_put_u16(out + 8,wav.channels);
+    luawav_peaks_put_u16(out + 10,(drwav_uint16)levelCount);
+    luawav_peaks_put_u32(out + 12,wav.sampleRate);
+    luawav_peaks_put_u64(out + 16,wav.totalPCMFrameCount);
+    luawav_peaks_put_u64(out + 24,sourceSize);
+    luawav_peaks_put_u64(out + 32,(drwav_uint64)sourceMtime);
+    luawav_peaks_put_u32(out + 40,0);
+    luawav_peaks_put_u32(out + 44,0);
+    for(k=0;k<levelCount;k++) {
+        p = out + PEAKS_HEADER + (PEAKS_LEVEL * k);
+        luawav_peaks_put_u32(p,fpp[k]);
+        luawav_peaks_put_u32(p + 4,0);
+        luawav_peaks_put_u64(p + 8,offsets[k]);
+        luawav_peaks_put_u64(p + 16,counts[k]);
+    }
+
+    /* acc holds a running min, max pair per channel for each level. The
+     * finest level is fed samples, each finished peak is folded into the
+     * next level up, where pending counts peaks of the level below. */
+    for(k=0;k<levelCount;k++) {
+        luawav_peaks_reset(acc + (2 * wav.channels * k),wav.channels);
+    }
+
+    do {
+        t = drwav_read_pcm_frames_s16(&wav,PEAKS_BUFFER / wav.channels,buffer);
+        for(f=0;f<t;f++) {
+            for(c=0;c<wav.channels;c++) {
+                x = buffer[(f * wav.channels) + c];
+                if(x < acc[c*2]) acc[c*2] = x;
+                if(x > acc[c*2+1]) acc[c*2+1] = x;
+            }
+            pending[0]++;
+            for(k=0;k<levelCount;k++) {
+                if(pending[k] != (k == 0 ? fpp[0] : fpp[k] / fpp[k-1])) break;
+                luawav_peaks_emit(out + offsets[k] + (filled[k]++ * peakBytes),
+                  acc + (2 * wav.channels * k),
+                  k + 1 < levelCount ? acc + (2 * wav.channels * (k + 1)) : NULL,
+                  wav.channels);
+                pending[k] = 0;
+                if(k + 1 < levelCount) pending[k+1]++;
+            }
+        }
+    } while(t == PEAKS_BUFFER / wav.channels);
+
+    /* partial peaks at the end of the file */
+    for(k=0;k<levelCount;k++) {
+        if(filled[k] >= counts[k]) continue;
+        if(pending[k] == 0) continue;
+        luawav_peaks_emit(out + offsets[k] + (filled[k]++ * peakBytes),
+          acc + (2 * wav.channels * k),
+          k + 1 < levelCount ? acc + (2 * wav.channels * (k + 1)) : NULL,
+          wav.channels);
+        if(k + 1 < levelCount) pending[k+1]++;
+    }
+    drwav_uninit(&wav);
+
+    for(k=0;k<levelCount;k++) {
+        if(filled[k] != counts[k]) {
+            err = "source ended early";
+        }
+    }
+
+    if(err == NULL) {
+        o = fopen(dst,"wb");
+        if(o == NULL) {
+            err = "unable to open output file";
+        } else {
+            if(fwrite(out,1,(size_t)total,o) != (size_t)total) err = "write failed";
+            if(fclose(o) != 0) err = "write failed";
+        }
+    }
+    free(out);
+
+    if(err != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,err);
+        return 2;
+    }
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static const char *
+luawav_peaks_parse(luawav_peaks *pk) {
+    const drwav_uint8 *p = pk->data;
+    unsigned int k = 0;
+
+    if(pk->size < PEAKS_HEADER || memcmp(p,"LWPK",4) != 0) {
+        return "not a peak file";
+    }
+    if(luawav_peaks_u32(p + 4) != PEAKS_VERSION) {
+        return "unsupported peak file version";
+    }
+    pk->channels = luawav_peaks_u16(p + 8);
+    pk->levelCount = luawav_peaks_u16(p + 10);
+    pk->sampleRate = luawav_peaks_u32(p + 12);
+    pk->frameCount = luawav_peaks_u64(p + 16);
+    pk->sourceSize = luawav_peaks_u64(p + 24);
+    pk->sourceMtime = (drwav_int64)luawav_peaks_u64(p + 32);
+
+    if(pk->channels == 0 || pk->levelCount == 0 || pk->levelCount > PEAKS_MAX_LEVELS) {
+        return "invalid peak file";
+    }
+    if(pk->size < (size_t)PEAKS_HEADER + (PEAKS_LEVEL * pk->levelCount)) {
+        return "truncated peak file";
+    }
+
+    for(k=0;k<pk->levelCount;k++) {
+        p = pk->data + PEAKS_HEADER + (PEAKS_LEVEL * k);
+        pk->levels[k].framesPerPeak = luawav_peaks_u32(p);
+        pk->levels[k].offset = luawav_peaks_u64(p + 8);
+        pk->levels[k].count = luawav_peaks_u64(p + 16);
+        if(pk->levels[k].framesPerPeak == 0) {
+            return "invalid peak file";
+        }
+        if(pk->levels[k].count > (pk->size / 4) / pk->channels ||
+           pk->levels[k].offset > pk->size - (pk->levels[k].count * pk->channels * 4)) {
+            return "truncated peak file";
+        }
+    }
+    return NULL;
+}
+
+static void
+luawav_peaks_release(luawav_peaks *pk) {
+    if(pk->data == NULL) return;
+#if LUAWAV_HAVE_MMAP
+    if(pk->mapped) {
+        munmap((void *)pk->data,pk->size);
+    } else {
+        free((void *)pk->data);
+    }
+#else
+    free((void *)pk->data);
+#endif
+    pk->data = NULL;
+    pk->size = 0;
+}
+
+/* maps the file read-only, or reads it into memory where mmap isn't
+ * available or fails (empty files, some filesystems) */
+static const char *
+luawav_peaks_load(luawav_peaks *pk, const char *path) {
+    FILE *f = NULL;
+    long len = 0;
+    void *buf = NULL;
+#if LUAWAV_HAVE_MMAP
+    struct stat st;
+    int fd = -1;
+
+    fd = open(path,O_RDONLY);
+    if(fd < 0) return "unable to open peak file";
+    if(fstat(fd,&st) == 0 && st.st_size > 0 && (drwav_uint64)st.st_size == (size_t)st.st_size) {
+        buf = mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_SHARED,fd,0);
+        if(buf != MAP_FAILED) {
+            close(fd);
+            pk->data = (const drwav_uint8 *)buf;
+            pk->size = (size_t)st.st_size;
+            pk->mapped = 1;
+            return NULL;
+        }
+        buf = NULL;
+    }
+    close(fd);
+#endif
+
+    f = fopen(path,"rb");
+    if(f == NULL) return "unable to open peak file";
+    if(fseek(f,0,SEEK_END) != 0 || (len = ftell(f)) < 0 || fseek(f,0,SEEK_SET) != 0) {
+        fclose(f);
+        return "unable to read peak file";
+    }
+    buf = malloc(len > 0 ? (size_t)len : 1);
+    if(buf == NULL) {
+        fclose(f);
+        return "out of memory";
+    }
+    if(fread(buf,1,(size_t)len,f) != (size_t)len) {
+        free(buf);
+        fclose(f);
+        return "unable to read peak file";
+    }
+    fclose(f);
+    pk->data = (const drwav_uint8 *)buf;
+    pk->size = (size_t)len;
+    pk->mapped = 0;
+    return NULL;
+}
+
+/* wav.open_peaks(peakfile [, src]) - when src is given, the peak file is
+ * only returned if it was built from the current version of src */
+LUAWAV_PRIVATE
+int
+luawav_open_peaks(lua_State *L) {
+    const char *path = NULL;
+    const char *src = NULL;
+    const char *err = NULL;
+    luawav_peaks *pk = NULL;
+    drwav_uint64 sourceSize = 0;
+    drwav_int64 sourceMtime = 0;
+
+    path = luaL_checkstring(L,1);
+    src = luaL_optstring(L,2,NULL);
+
+    pk = (luawav_peaks *)lua_newuserdata(L,sizeof(luawav_peaks));
+    memset(pk,0,sizeof(luawav_peaks));
+    luaL_setmetatable(L,luawav_peaks_mt);
+
+    err = luawav_peaks_load(pk,path);
+    if(err == NULL) {
+        err = luawav_peaks_parse(pk);
+    }
+    if(err == NULL && src != NULL) {
+        if(!luawav_peaks_stat(src,&sourceSize,&sourceMtime)) {
+            err = "unable to open source file";
+        } else if(sourceSize != pk->sourceSize || sourceMtime != pk->sourceMtime) {
+            err = "peak file is out of date";
+        }
+    }
+
+    if(err != NULL) {
+        luawav_peaks_release(pk);
+        lua_pushnil(L);
+        lua_pushstring(L,err);
+        return 2;
+    }
+    return 1;
+}
+
+static int
+luawav_peaks_close(lua_State *L) {
+    luawav_peaks *pk = luaL_checkudata(L,1,luawav_peaks_mt);
+    luawav_peaks_release(pk);
+    return 0;
+}
+
+static int
+luawav_peaks_info(lua_State *L) {
+    luawav_peaks *pk = luaL_checkudata(L,1,luawav_peaks_mt);
+    unsigned int k = 0;
+
+    if(pk->data == NULL) {
+        return luaL_error(L,"peak file is closed");
+    }
+
+    lua_newtable(L);
+    lua_pushinteger(L,pk->channels);
+    lua_setfield(L,-2,"channels");
+    lua_pushinteger(L,pk->sampleRate);
+    lua_setfield(L,-2,"sampleRate");
+    luawav_pushuint64(L,pk->frameCount);
+    lua_setfield(L,-2,"frameCount");
+    luawav_pushuint64(L,pk->sourceSize);
+    lua_setfield(L,-2,"sourceSize");
+    luawav_pushint64(L,pk->sourceMtime);
+    lua_setfield(L,-2,"sourceMtime");
+    lua_createtable(L,pk->levelCount,0);
+    for(k=0;k<pk->levelCount;k++) {
+        lua_pushinteger(L,pk->levels[k].framesPerPeak);
+        lua_rawseti(L,-2,k + 1);
+    }
+    lua_setfield(L,-2,"levels");
+    return 1;
+}
+
+/* peaks:range(firstFrame, lastFrame, pixels) - min and max per channel for
+ * each of `pixels` equal slices of [firstFrame, lastFrame), read from the
+ * coarsest level that still has at least one peak per pixel */
+static int
+luawav_peaks_range(lua_State *L) {
+    luawav_peaks *pk = NULL;
+    const luawav_peaks_level *lv = NULL;
+    const drwav_uint8 *p = NULL;
+    drwav_uint64 first = 0;
+    drwav_uint64 last = 0;
+    lua_Integer pixels = 0;
+    lua_Integer px = 0;
+    drwav_uint64 span = 0;
+    drwav_uint64 i0 = 0;
+    drwav_uint64 i1 = 0;
+    drwav_uint64 i = 0;
+    unsigned int k = 0;
+    unsigned int c = 0;
+    int res = 0;
+    int base = 0;
+    drwav_int16 mn = 0;
+    drwav_int16 mx = 0;
+    drwav_int16 x = 0;
+
+    pk = luaL_checkudata(L,1,luawav_peaks_mt);
+    first = luawav_touint64(L,2);
+    last = luawav_touint64(L,3);
+    pixels = luaL_checkinteger(L,4);
+
+    if(pk->data == NULL) {
+        return luaL_error(L,"peak file is closed");
+    }
+    if(pixels < 1 || last <= first) {
+        return luaL_error(L,"invalid range");
+    }
+    if(last > pk->frameCount) last = pk->frameCount;
+    if(first > last) first = last;
+
+    span = last - first;
+    lv = &pk->levels[0];
+    for(k=1;k<pk->levelCount;k++) {
+        if(pk->levels[k].framesPerPeak * (drwav_uint64)pixels > span) break;
+        lv = &pk->levels[k];
+    }
+
+    luaL_checkstack(L,pk->channels * 2 + 2,"too many channels");
+    lua_createtable(L,pk->channels,0);
+    res = lua_gettop(L);
+    base = res + 1;
+    for(c=0;c<pk->channels;c++) {
+        lua_createtable(L,0,2);
+        lua_createtable(L,pixels,0);
+        lua_pushvalue(L,-1);
+        lua_setfield(L,-3,"min");
+        lua_createtable(L,pixels,0);
+        lua_pushvalue(L,-1);
+        lua_setfield(L,-4,"max");
+        /* leave min, max on the stack for filling in */
+        lua_pushvalue(L,-3);
+        lua_rawseti(L,res,c + 1);
+        lua_remove(L,-3);
+    }
+
+    for(px=0;px<pixels;px++) {
+        i0 = (first + (span * px) / pixels) / lv->framesPerPeak;
+        i1 = (first + (span * (px + 1)) / pixels + lv->framesPerPeak - 1) / lv->framesPerPeak;
+        if(i1 <= i0) i1 = i0 + 1;
+        if(i1 > lv->count) i1 = lv->count;
+
+        for(c=0;c<pk->channels;c++) {
+            mn = 32767;
+            mx = -32768;
+            for(i=i0;i<i1;i++) {
+                p = pk->data + lv->offset + (((i * pk->channels) + c) * 4);
+                x = (drwav_int16)luawav_peaks_u16(p);
+                if(x < mn) mn = x;
+                x = (drwav_int16)luawav_peaks_u16(p + 2);
+                if(x > mx) mx = x;
+            }
+            if(i0 >= i1) {
+                mn = 0;
+                mx = 0;
+            }
+            lua_pushnumber(L,mn / 32768.0);
+            lua_rawseti(L,base + (c * 2),px + 1);
+            lua_pushnumber(L,mx / 32768.0);
+            lua_rawseti(L,base + (c * 2) + 1,px + 1);
+        }
+    }
+
+    lua_settop(L,res);
+    return 1;
+}
+
+static const struct luaL_Reg luawav_peaks_methods[] = {
+    { "range", luawav_peaks_range },
+    { "info", luawav_peaks_info },
+    { "close", luawav_peaks_close },
+    { NULL, NULL },
+};
+
+LUAWAV_PRIVATE
+void
+luawav_peaks_register(lua_State *L) {
+    luaL_newmetatable(L,luawav_peaks_mt);
+    lua_pushcfunction(L,luawav_peaks_close);
+    lua_setfield(L,-2,"__gc");
+    lua_newtable(L);
+    luaL_setfuncs(L,luawav_peaks_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+}
@@ -0,0 +1,1699 @@
+/* vectorized stand-ins for the dr_wav sample converters used when reading,
+ * for luawav's 24-bit packers and 16-bit quantizers used when writing, and
+ * for the reductions behind reader:read_summary, picked once at load time
+ * from what the CPU supports. Each kernel gives the same bits as the
+ * scalar function it replaces, which still handles the tail of every call
+ * and CPUs without a vector unit; the one exception is a floating-point
+ * sum of squares, added up in a different order.
+ *
+ * x86-64 always has SSE2; SSSE3 (for shuffling 24-bit samples) and AVX2
+ * are checked with CPUID through __builtin_cpu_supports, and built with
+ * target attributes so no extra compiler flags are needed. NEON is part of
+ * every AArch64 CPU. Define LUAWAV_NO_SIMD to build the scalar versions
+ * only. */
+
+#include "luawav_internal.h"
+#include <string.h>
+#include <math.h>
+
+#if !defined(LUAWAV_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define LUAWAV_SIMD_X86 1
+#include <immintrin.h>
+#define LUAWAV_TARGET(x) __attribute__ ((target (x)))
+#endif
+
+#if !defined(LUAWAV_NO_SIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+#define LUAWAV_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* scale factors dr_wav uses, all powers of two so the product is exact */
+#define SCALE_S16 0.000030517578125f
+#define SCALE_S24 0.00000011920928955078125f
+#define SCALE_S32 (1.0f / 2147483648.0f)
+
+static void
+luawav_scalar_s16_to_f32(void *out, const void *in, size_t count) {
+    drwav_s16_to_f32((float *)out,(const drwav_int16 *)in,count);
+}
+
+static void
+luawav_scalar_s24_to_f32(void *out, const void *in, size_t count) {
+    drwav_s24_to_f32((float *)out,(const drwav_uint8 *)in,count);
+}
+
+static void
+luawav_scalar_s32_to_f32(void *out, const void *in, size_t count) {
+    drwav_s32_to_f32((float *)out,(const drwav_int32 *)in,count);
+}
+
+static void
+luawav_scalar_f32_to_s16(void *out, const void *in, size_t count) {
+    drwav_f32_to_s16((drwav_int16 *)out,(const float *)in,count);
+}
+
+static void
+luawav_scalar_s16_to_s32(void *out, const void *in, size_t count) {
+    drwav_s16_to_s32((drwav_int32 *)out,(const drwav_int16 *)in,count);
+}
+
+static void
+luawav_scalar_s24_to_s32(void *out, const void *in, size_t count) {
+    drwav_s24_to_s32((drwav_int32 *)out,(const drwav_uint8 *)in,count);
+}
+
+static void
+luawav_scalar_s24_to_s16(void *out, const void *in, size_t count) {
+    drwav_s24_to_s16((drwav_int16 *)out,(const drwav_uint8 *)in,count);
+}
+
+static void
+luawav_scalar_s32_to_s16(void *out, const void *in, size_t count) {
+    drwav_s32_to_s16((drwav_int16 *)out,(const drwav_int32 *)in,count);
+}
+
+/* the packers luawav_pack_s32 and luawav_quantize_f32 would otherwise
+ * run, the scalar versions are the reference for the vectorized ones */
+static void
+luawav_scalar_s32_to_s24(void *out, const void *in, size_t count) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    const drwav_int32 *p = (const drwav_int32 *)in;
+    drwav_uint32 s = 0;
+    size_t i = 0;
+
+    for(i=0;i<count;i++) {
+        s = (drwav_uint32)p[i];
+        o[0] = (drwav_uint8)(s >> 8);
+        o[1] = (drwav_uint8)(s >> 16);
+        o[2] = (drwav_uint8)(s >> 24);
+        o += 3;
+    }
+}
+
+static void
+luawav_scalar_f32_to_s24(void *out, const void *in, size_t count) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    const float *p = (const float *)in;
+    drwav_uint32 s = 0;
+    double v = 0.0;
+    size_t i = 0;
+
+    for(i=0;i<count;i++) {
+        v = floor(p[i] * 8388608.0 + 0.5);
+        v = v < -8388608.0 ? -8388608.0 : (v > 8388607.0 ? 8388607.0 : v);
+        s = (drwav_uint32)(drwav_int32)v;
+        o[0] = (drwav_uint8)(s);
+        o[1] = (drwav_uint8)(s >> 8);
+        o[2] = (drwav_uint8)(s >> 16);
+        o += 3;
+    }
+}
+
+/* the 16-bit quantizers, and the references for the vectorized ones. A
+ * sample is scaled in single precision and clamped just outside 16 bits,
+ * which takes a NaN as silence and keeps the noise added next from being
+ * fused into the multiply. The sum is rounded half up, in double
+ * precision where the shaping error comes in. The noise is made
+ * DITHER_BLOCK samples at a time, before it's needed. */
+#define QUANTIZE_LO -32769.0f
+#define QUANTIZE_HI 32768.0f
+#define DITHER_BLOCK 64
+
+static float
+luawav_scalar_scale_s16(float x, float g) {
+    x = x * g;
+    x = x == x ? x : 0.0f;
+    x = x > QUANTIZE_LO ? x : QUANTIZE_LO;
+    return x < QUANTIZE_HI ? x : QUANTIZE_HI;
+}
+
+/* stores a sample already rounded, clamped to 16 bits */
+static void
+luawav_put_s16(drwav_uint8 *o, double v) {
+    drwav_uint16 s = 0;
+
+    v = v < -32768.0 ? -32768.0 : (v > 32767.0 ? 32767.0 : v);
+    s = (drwav_uint16)(drwav_int16)v;
+    o[0] = (drwav_uint8)s;
+    o[1] = (drwav_uint8)(s >> 8);
+}
+
+static void
+luawav_scalar_quantize_s16(void *out, const float *in, size_t count, float gain) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    float g = gain * 32768.0f;
+    size_t i = 0;
+
+    for(i=0;i<count;i++) {
+        luawav_put_s16(o + i * 2,floor((double)luawav_scalar_scale_s16(in[i],g) + 0.5));
+    }
+}
+
+/* count samples with the noise n added, g being gain * 2^15 */
+static void
+luawav_scalar_tpdf_s16(drwav_uint8 *o, const float *in, const float *n, size_t count, float g) {
+    float v = 0.0f;
+    size_t i = 0;
+
+    for(i=0;i<count;i++) {
+        v = luawav_scalar_scale_s16(in[i],g) + n[i];
+        luawav_put_s16(o + i * 2,floor((double)v + 0.5));
+    }
+}
+
+/* count samples already scaled, with the noise n and the error left by
+ * each channel's last sample taken off */
+static void
+luawav_shape_s16(drwav_uint8 *o, const float *x, const float *n, size_t count, luawav_dither *d) {
+    double v = 0.0;
+    double q = 0.0;
+    size_t i = 0;
+
+    for(i=0;i<count;i++) {
+        v = (double)x[i] - d->error[d->channel];
+        q = floor(v + n[i] + 0.5);
+        d->error[d->channel] = q - v;
+        luawav_put_s16(o + i * 2,q);
+        if(++d->channel == d->channels) d->channel = 0;
+    }
+}
+
+static void
+luawav_scalar_dither_s16(void *out, const float *in, size_t count, float gain, luawav_dither *d) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    float x[DITHER_BLOCK];
+    float n[DITHER_BLOCK];
+    float g = gain * 32768.0f;
+    size_t i = 0;
+    size_t j = 0;
+    size_t m = 0;
+
+    for(i=0;i<count;i+=m) {
+        m = WAV_MIN(count - i,DITHER_BLOCK);
+        for(j=0;j<m;j++) n[j] = luawav_dither_noise(d);
+        if(d->mode == LUAWAV_DITHER_SHAPED) {
+            for(j=0;j<m;j++) x[j] = luawav_scalar_scale_s16(in[i + j],g);
+            luawav_shape_s16(o + i * 2,x,n,m,d);
+        } else {
+            luawav_scalar_tpdf_s16(o + i * 2,in + i,n,m,g);
+        }
+    }
+}
+
+/* per-channel minimum, maximum and sum of squares over interleaved
+ * frames, the references for the vectorized reductions and what they run
+ * when the channels don't divide the vector width. A NaN sample leaves
+ * the minimum and maximum as they were. */
+static void
+luawav_scalar_reduce_s16(const drwav_int16 *in, size_t frames, unsigned int channels, drwav_int32 *mn, drwav_int32 *mx, drwav_uint64 *sq) {
+    size_t f = 0;
+    unsigned int c = 0;
+    drwav_int32 x = 0;
+
+    for(f=0;f<frames;f++) {
+        for(c=0;c<channels;c++) {
+            x = in[c];
+            mn[c] = x < mn[c] ? x : mn[c];
+            mx[c] = x > mx[c] ? x : mx[c];
+            sq[c] += (drwav_uint64)(x * x);
+        }
+        in += channels;
+    }
+}
+
+static void
+luawav_scalar_reduce_s32(const drwav_int32 *in, size_t frames, unsigned int channels, drwav_int32 *mn, drwav_int32 *mx, double *sq) {
+    size_t f = 0;
+    unsigned int c = 0;
+    drwav_int32 x = 0;
+
+    for(f=0;f<frames;f++) {
+        for(c=0;c<channels;c++) {
+            x = in[c];
+            mn[c] = x < mn[c] ? x : mn[c];
+            mx[c] = x > mx[c] ? x : mx[c];
+            sq[c] += (double)x * x;
+        }
+        in += channels;
+    }
+}
+
+static void
+luawav_scalar_reduce_f32(const float *in, size_t frames, unsigned int channels, float *mn, float *mx, double *sq) {
+    size_t f = 0;
+    unsigned int c = 0;
+    float x = 0.0f;
+
+    for(f=0;f<frames;f++) {
+        for(c=0;c<channels;c++) {
+            x = in[c];
+            mn[c] = x < mn[c] ? x : mn[c];
+            mx[c] = x > mx[c] ? x : mx[c];
+            sq[c] += (double)x * x;
+        }
+        in += channels;
+    }
+}
+
+/* folds the lanes of a vectorized reduction into the channels, lane j
+ * holding the samples of channel j % channels */
+static void
+luawav_fold_s32(const drwav_int32 *lmn, const drwav_int32 *lmx, unsigned int lanes, unsigned int channels, drwav_int32 *mn, drwav_int32 *mx) {
+    unsigned int j = 0;
+    unsigned int c = 0;
+
+    for(j=0;j<lanes;j++) {
+        c = j % channels;
+        mn[c] = lmn[j] < mn[c] ? lmn[j] : mn[c];
+        mx[c] = lmx[j] > mx[c] ? lmx[j] : mx[c];
+    }
+}
+
+static void
+luawav_fold_f32(const float *lmn, const float *lmx, const double *lsq, unsigned int lanes, unsigned int channels, float *mn, float *mx, double *sq) {
+    unsigned int j = 0;
+    unsigned int c = 0;
+
+    for(j=0;j<lanes;j++) {
+        c = j % channels;
+        mn[c] = lmn[j] < mn[c] ? lmn[j] : mn[c];
+        mx[c] = lmx[j] > mx[c] ? lmx[j] : mx[c];
+        sq[c] += lsq[j];
+    }
+}
+
+static void
+luawav_fold_sq(const double *lsq, unsigned int lanes, unsigned int channels, double *sq) {
+    unsigned int j = 0;
+    for(j=0;j<lanes;j++) sq[j % channels] += lsq[j];
+}
+
+static void
+luawav_fold_sq_u64(const drwav_uint64 *lsq, unsigned int lanes, unsigned int channels, drwav_uint64 *sq) {
+    unsigned int j = 0;
+    for(j=0;j<lanes;j++) sq[j % channels] += lsq[j];
+}
+
+#if LUAWAV_SIMD_X86
+
+static void
+luawav_sse2_s16_to_f32(void *out, const void *in, size_t count) {
+    float *o = (float *)out;
+    const drwav_int16 *p = (const drwav_int16 *)in;
+    const __m128 scale = _mm_set1_ps(SCALE_S16);
+    __m128i x;
+    size_t i = 0;
+
+    for(i=0;i+8<=count;i+=8) {
+        x = _mm_loadu_si128((const __m128i *)(p + i));
+        _mm_storeu_ps(o + i,_mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x,x),16)),scale));
+        _mm_storeu_ps(o + i + 4,_mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x,x),16)),scale));
+    }
+    drwav_s16_to_f32(o + i,p + i,count - i);
+}
+
+/* converting to float rounds once either way, and scaling by a power of
+ * two after that doesn't round again */
+static void
+luawav_sse2_s32_to_f32(void *out, const void *in, size_t count) {
+    float *o = (float *)out;
+    const drwav_int32 *p = (const drwav_int32 *)in;
+    const __m128 scale = _mm_set1_ps(SCALE_S32);
+    size_t i = 0;
+
+    for(i=0;i+4<=count;i+=4) {
+        _mm_storeu_ps(o + i,_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(p + i))),scale));
+    }
+    drwav_s32_to_f32(o + i,p + i,count - i);
+}
+
+/* drwav_f32_to_s16 on 4 samples, left sign-extended from 16 bits so
+ * packing can't saturate. The operand order of max and min passes NaN
+ * through like the scalar comparisons do. */
+static __inline __m128i
+luawav_sse2_f32_to_s16x4(__m128 x) {
+    __m128 c = _mm_min_ps(_mm_set1_ps(1.0f),_mm_max_ps(_mm_set1_ps(-1.0f),x));
+    __m128i r = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(c,_mm_set1_ps(1.0f)),_mm_set1_ps(32767.5f)));
+
+    r = _mm_sub_epi32(r,_mm_set1_epi32(32768));
+    return _mm_srai_epi32(_mm_slli_epi32(r,16),16);
+}
+
+static void
+luawav_sse2_f32_to_s16(void *out, const void *in, size_t count) {
+    drwav_int16 *o = (drwav_int16 *)out;
+    const float *p = (const float *)in;
+    __m128i a;
+    __m128i b;
+    size_t i = 0;
+
+    for(i=0;i+8<=count;i+=8) {
+        a = luawav_sse2_f32_to_s16x4(_mm_loadu_ps(p + i));
+        b = luawav_sse2_f32_to_s16x4(_mm_loadu_ps(p + i + 4));
+        _mm_storeu_si128((__m128i *)(o + i),_mm_packs_epi32(a,b));
+    }
+    drwav_f32_to_s16(o + i,p + i,count - i);
+}
+
+static void
+luawav_sse2_s16_to_s32(void *out, const void *in, size_t count) {
+    drwav_int32 *o = (drwav_int32 *)out;
+    const drwav_int16 *p = (const drwav_int16 *)in;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x;
+    size_t i = 0;
+
+    for(i=0;i+8<=count;i+=8) {
+        x = _mm_loadu_si128((const __m128i *)(p + i));
+        _mm_storeu_si128((__m128i *)(o + i),_mm_unpacklo_epi16(zero,x));
+        _mm_storeu_si128((__m128i *)(o + i + 4),_mm_unpackhi_epi16(zero,x));
+    }
+    drwav_s16_to_s32(o + i,p + i,count - i);
+}
+
+static void
+luawav_sse2_s32_to_s16(void *out, const void *in, size_t count) {
+    drwav_int16 *o = (drwav_int16 *)out;
+    const drwav_int32 *p = (const drwav_int32 *)in;
+    __m128i a;
+    __m128i b;
+    size_t i = 0;
+
+    for(i=0;i+8<=count;i+=8) {
+        a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(p + i)),16);
+        b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(p + i + 4)),16);
+        _mm_storeu_si128((__m128i *)(o + i),_mm_packs_epi32(a,b));
+    }
+    drwav_s32_to_s16(o + i,p + i,count - i);
+}
+
+/* the vectorized reductions keep a lane per sample position, so they
+ * need the channels to divide the width. Integer lanes start from the
+ * widest range and are only folded in after a whole vector, so every
+ * lane has seen a sample. */
+static void
+luawav_sse2_reduce_s16(const drwav_int16 *in, size_t frames, unsigned int channels, drwav_int32 *mn, drwav_int32 *mx, drwav_uint64 *sq) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = frames * channels;
+    drwav_int16 l16[16];
+    drwav_int32 lmn[8];
+    drwav_int32 lmx[8];
+    drwav_uint64 lsq[8];
+    __m128i vmn = _mm_set1_epi16(32767);
+    __m128i vmx = _mm_set1_epi16(-32768);
+    __m128i acc[4];
+    __m128i x;
+    __m128i lo;
+    __m128i hi;
+    size_t i = 0;
+    unsigned int j = 0;
+
+    if(8 % channels != 0 || count < 8) {
+        luawav_scalar_reduce_s16(in,frames,channels,mn,mx,sq);
+        return;
+    }
+    for(j=0;j<4;j++) acc[j] = zero;
+    for(i=0;i+8<=count;i+=8) {
+        x = _mm_loadu_si128((const __m128i *)(in + i));
+        vmn = _mm_min_epi16(vmn,x);
+        vmx = _mm_max_epi16(vmx,x);
+        /* squares fit in 31 bits, halves in order are the 32-bit ones */
+        lo = _mm_mullo_epi16(x,x);
+        hi = _mm_mulhi_epi16(x,x);
+        x = _mm_unpacklo_epi16(lo,hi);
+        acc[0] = _mm_add_epi64(acc[0],_mm_unpacklo_epi32(x,zero));
+        acc[1] = _mm_add_epi64(acc[1],_mm_unpackhi_epi32(x,zero));
+        x = _mm_unpackhi_epi16(lo,hi);
+        acc[2] = _mm_add_epi64(acc[2],_mm_unpacklo_epi32(x,zero));
+        acc[3] = _mm_add_epi64(acc[3],_mm_unpackhi_epi32(x,zero));
+    }
+    _mm_storeu_si128((__m128i *)l16,vmn);
+    _mm_storeu_si128((__m128i *)(l16 + 8),vmx);
+    for(j=0;j<8;j++) {
+        lmn[j] = l16[j];
+        lmx[j] = l16[j + 8];
+    }
+    for(j=0;j<4;j++) _mm_storeu_si128((__m128i *)(lsq + j * 2),acc[j]);
+    luawav_fold_s32(lmn,lmx,8,channels,mn,mx);
+    luawav_fold_sq_u64(lsq,8,channels,sq);
+    luawav_scalar_reduce_s16(in + i,(count - i) / channels,channels,mn,mx,sq);
+}
+
+/* SSE2 has no 32-bit min and max, they're picked with a comparison */
+static void
+luawav_sse2_reduce_s32(const drwav_int32 *in, size_t frames, unsigned int channels, drwav_int32 *mn, drwav_int32 *mx, double *sq) {
+    size_t count = frames * channels;
+    drwav_int32 lmn[4];
+    drwav_int32 lmx[4];
+    double lsq[4];
+    __m128i vmn = _mm_set1_epi32(0x7FFFFFFF);
+    __m128i vmx = _mm_set1_epi32(-0x7FFFFFFF - 1);
+    __m128d s0 = _mm_setzero_pd();
+    __m128d s1 = _mm_setzero_pd();
+    __m128d d;
+    __m128i x;
+    __m128i m;
+    size_t i = 0;
+
+    if(4 % channels != 0 || count < 4) {
+        luawav_scalar_reduce_s32(in,frames,channels,mn,mx,sq);
+        return;
+    }
+    for(i=0;i+4<=count;i+=4) {
+        x = _mm_loadu_si128((const __m128i *)(in + i));
+        m = _mm_cmpgt_epi32(vmn,x);
+        vmn = _mm_or_si128(_mm_and_si128(m,x),_mm_andnot_si128(m,vmn));
+        m = _mm_cmpgt_epi32(x,vmx);
+        vmx = _mm_or_si128(_mm_and_si128(m,x),_mm_andnot_si128(m,vmx));
+        d = _mm_cvtepi32_pd(x);
+        s0 = _mm_add_pd(s0,_mm_mul_pd(d,d));
+        d = _mm_cvtepi32_pd(_mm_srli_si128(x,8));
+        s1 = _mm_add_pd(s1,_mm_mul_pd(d,d));
+    }
+    _mm_storeu_si128((__m128i *)lmn,vmn);
+    _mm_storeu_si128((__m128i *)lmx,vmx);
+    _mm_storeu_pd(lsq,s0);
+    _mm_storeu_pd(lsq + 2,s1);
+    luawav_fold_s32(lmn,lmx,4,channels,mn,mx);
+    luawav_fold_sq(lsq,4,channels,sq);
+    luawav_scalar_reduce_s32(in + i,(count - i) / channels,channels,mn,mx,sq);
+}
+
+/* min and max return their second operand when either is NaN, so with
+ * the sample first a NaN leaves the lane alone like the scalar version.
+ * The lanes start from the channels' values, which a lane of nothing but
+ * NaNs folds back in unchanged. Squares of floats are exact as doubles. */
+static void
+luawav_sse2_reduce_f32(const float *in, size_t frames, unsigned int channels, float *mn, float *mx, double *sq) {
+    size_t count = frames * channels;
+    float lmn[4];
+    float lmx[4];
+    double lsq[4];
+    __m128 vmn;
+    __m128 vmx;
+    __m128 x;
+    __m128d s0 = _mm_setzero_pd();
+    __m128d s1 = _mm_setzero_pd();
+    __m128d d;
+    size_t i = 0;
+    unsigned int j = 0;
+
+    if(4 % channels != 0 || count < 4) {
+        luawav_scalar_reduce_f32(in,frames,channels,mn,mx,sq);
+        return;
+    }
+    for(j=0;j<4;j++) {
+        lmn[j] = mn[j % channels];
+        lmx[j] = mx[j % channels];
+    }
+    vmn = _mm_loadu_ps(lmn);
+    vmx = _mm_loadu_ps(lmx);
+    for(i=0;i+4<=count;i+=4) {
+        x = _mm_loadu_ps(in + i);
+        vmn = _mm_min_ps(x,vmn);
+        vmx = _mm_max_ps(x,vmx);
+        d = _mm_cvtps_pd(x);
+        s0 = _mm_add_pd(s0,_mm_mul_pd(d,d));
+        d = _mm_cvtps_pd(_mm_movehl_ps(x,x));
+        s1 = _mm_add_pd(s1,_mm_mul_pd(d,d));
+    }
+    _mm_storeu_ps(lmn,vmn);
+    _mm_storeu_ps(lmx,vmx);
+    _mm_storeu_pd(lsq,s0);
+    _mm_storeu_pd(lsq + 2,s1);
+    luawav_fold_f32(lmn,lmx,lsq,4,channels,mn,mx,sq);
+    luawav_scalar_reduce_f32(in + i,(count - i) / channels,channels,mn,mx,sq);
+}
+
+/* 16 packed 24-bit samples (48 bytes) as four vectors of 32-bit samples
+ * with the low byte zero, like drwav_s24_to_s32 makes them. The loads
+ * don't go past the 48 bytes. */
+/* luawav_scalar_scale_s16 on 4 samples; max and min pick the same
+ * operand as the scalar comparisons */
+static __inline __m128
+luawav_sse2_scale_s16(__m128 x, __m128 g) {
+    x = _mm_mul_ps(x,g);
+    x = _mm_and_ps(x,_mm_cmpord_ps(x,x));
+    return _mm_min_ps(_mm_max_ps(x,_mm_set1_ps(QUANTIZE_LO)),_mm_set1_ps(QUANTIZE_HI));
+}
+
+/* floor(x + 0.5), as in luawav_sse2_f32_to_s24x4 */
+static __inline __m128i
+luawav_sse2_round(__m128 x) {
+    __m128i r = _mm_cvtps_epi32(x);
+    return _mm_sub_epi32(r,_mm_castps_si128(_mm_cmpeq_ps(_mm_sub_ps(x,_mm_cvtepi32_ps(r)),_mm_set1_ps(0.5f))));
+}
+
+static __inline __m128i
+luawav_sse2_xorshift(__m128i s) {
+    s = _mm_xor_si128(s,_mm_slli_epi32(s,13));
+    s = _mm_xor_si128(s,_mm_srli_epi32(s,17));
+    return _mm_xor_si128(s,_mm_slli_epi32(s,5));
+}
+
+static __inline __m128
+luawav_sse2_tpdf(__m128i a, __m128i b) {
+    __m128 d = _mm_sub_ps(_mm_cvtepi32_ps(_mm_srli_epi32(a,8)),_mm_cvtepi32_ps(_mm_srli_epi32(b,8)));
+    return _mm_mul_ps(d,_mm_set1_ps(1.0f / 16777216.0f));
+}
+
+/* count values from luawav_dither_noise, the whole steps a register of
+ * generators at a time */
+static void
+luawav_sse2_noise(luawav_dither *d, float *n, size_t count) {
+    __m128i s[4];
+    size_t i = 0;
+    unsigned int j = 0;
+
+    for(i=0;i<count && d->next < LUAWAV_DITHER_LANES / 2;i++) n[i] = d->noise[d->next++];
+    if(count - i >= 8) {
+        for(j=0;j<4;j++) s[j] = _mm_loadu_si128((const __m128i *)(d->state + j * 4));
+        for(;i+8<=count;i+=8) {
+            for(j=0;j<4;j++) s[j] = luawav_sse2_xorshift(s[j]);
+            _mm_storeu_ps(n + i,luawav_sse2_tpdf(s[0],s[2]));
+            _mm_storeu_ps(n + i + 4,luawav_sse2_tpdf(s[1],s[3]));
+        }
+        for(j=0;j<4;j++) _mm_storeu_si128((__m128i *)(d->state + j * 4),s[j]);
+    }
+    for(;i<count;i++) n[i] = luawav_dither_noise(d);
+}
+
+static void
+luawav_sse2_quantize_s16(void *out, const float *in, size_t count, float gain) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    __m128 g = _mm_set1_ps(gain * 32768.0f);
+    __m128i a;
+    __m128i b;
+    size_t i = 0;
+
+    for(i=0;i+8<=count;i+=8) {
+        a = luawav_sse2_round(luawav_sse2_scale_s16(_mm_loadu_ps(in + i),g));
+        b = luawav_sse2_round(luawav_sse2_scale_s16(_mm_loadu_ps(in + i + 4),g));
+        _mm_storeu_si128((__m128i *)(o + i * 2),_mm_packs_epi32(a,b));
+    }
+    luawav_scalar_quantize_s16(o + i * 2,in + i,count - i,gain);
+}
+
+static void
+luawav_sse2_dither_s16(void *out, const float *in, size_t count, float gain, luawav_dither *d) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    float x[DITHER_BLOCK];
+    float n[DITHER_BLOCK];
+    __m128 g = _mm_set1_ps(gain * 32768.0f);
+    __m128i a;
+    __m128i b;
+    size_t i = 0;
+    size_t j = 0;
+    size_t m = 0;
+
+    for(i=0;i<count;i+=m) {
+        m = WAV_MIN(count - i,DITHER_BLOCK);
+        luawav_sse2_noise(d,n,m);
+        if(d->mode == LUAWAV_DITHER_SHAPED) {
+            for(j=0;j+4<=m;j+=4) _mm_storeu_ps(x + j,luawav_sse2_scale_s16(_mm_loadu_ps(in + i + j),g));
+            for(;j<m;j++) x[j] = luawav_scalar_scale_s16(in[i + j],gain * 32768.0f);
+            luawav_shape_s16(o + i * 2,x,n,m,d);
+            continue;
+        }
+        for(j=0;j+8<=m;j+=8) {
+            a = luawav_sse2_round(_mm_add_ps(luawav_sse2_scale_s16(_mm_loadu_ps(in + i + j),g),_mm_loadu_ps(n + j)));
+            b = luawav_sse2_round(_mm_add_ps(luawav_sse2_scale_s16(_mm_loadu_ps(in + i + j + 4),g),_mm_loadu_ps(n + j + 4)));
+            _mm_storeu_si128((__m128i *)(o + (i + j) * 2),_mm_packs_epi32(a,b));
+        }
+        luawav_scalar_tpdf_s16(o + (i + j) * 2,in + i + j,n + j,m - j,gain * 32768.0f);
+    }
+}
+
+LUAWAV_TARGET("ssse3")
+static __inline void
+luawav_ssse3_load_s24(const drwav_uint8 *p, __m128i v[4]) {
+    const __m128i mask = _mm_setr_epi8(-1,0,1,2, -1,3,4,5, -1,6,7,8, -1,9,10,11);
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+
+    v[0] = _mm_shuffle_epi8(a,mask);
+    v[1] = _mm_shuffle_epi8(_mm_alignr_epi8(b,a,12),mask);
+    v[2] = _mm_shuffle_epi8(_mm_alignr_epi8(c,b,8),mask);
+    v[3] = _mm_shuffle_epi8(_mm_srli_si128(c,4),mask);
+}
+
+LUAWAV_TARGET("ssse3")
+static void
+luawav_ssse3_s24_to_f32(void *out, const void *in, size_t count) {
+    float *o = (float *)out;
+    const drwav_uint8 *p = (const drwav_uint8 *)in;
+    const __m128 scale = _mm_set1_ps(SCALE_S24);
+    __m128i v[4];
+    size_t i = 0;
+    unsigned int j = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        luawav_ssse3_load_s24(p + i * 3,v);
+        for(j=0;j<4;j++) {
+            _mm_storeu_ps(o + i + j * 4,_mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(v[j],8)),scale));
+        }
+    }
+    drwav_s24_to_f32(o + i,p + i * 3,count - i);
+}
+
+LUAWAV_TARGET("ssse3")
+static void
+luawav_ssse3_s24_to_s32(void *out, const void *in, size_t count) {
+    drwav_int32 *o = (drwav_int32 *)out;
+    const drwav_uint8 *p = (const drwav_uint8 *)in;
+    __m128i v[4];
+    size_t i = 0;
+    unsigned int j = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        luawav_ssse3_load_s24(p + i * 3,v);
+        for(j=0;j<4;j++) {
+            _mm_storeu_si128((__m128i *)(o + i + j * 4),v[j]);
+        }
+    }
+    drwav_s24_to_s32(o + i,p + i * 3,count - i);
+}
+
+LUAWAV_TARGET("ssse3")
+static void
+luawav_ssse3_s24_to_s16(void *out, const void *in, size_t count) {
+    drwav_int16 *o = (drwav_int16 *)out;
+    const drwav_uint8 *p = (const drwav_uint8 *)in;
+    __m128i v[4];
+    size_t i = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        luawav_ssse3_load_s24(p + i * 3,v);
+        _mm_storeu_si128((__m128i *)(o + i),_mm_packs_epi32(_mm_srai_epi32(v[0],16),_mm_srai_epi32(v[1],16)));
+        _mm_storeu_si128((__m128i *)(o + i + 8),_mm_packs_epi32(_mm_srai_epi32(v[2],16),_mm_srai_epi32(v[3],16)));
+    }
+    drwav_s24_to_s16(o + i,p + i * 3,count - i);
+}
+
+/* shuffles three bytes of each sample in v, picked by mask, into 48
+ * packed bytes at o */
+LUAWAV_TARGET("ssse3")
+static __inline void
+luawav_ssse3_store_s24(drwav_uint8 *o, const __m128i v[4], __m128i mask) {
+    __m128i a = _mm_shuffle_epi8(v[0],mask);
+    __m128i b = _mm_shuffle_epi8(v[1],mask);
+    __m128i c = _mm_shuffle_epi8(v[2],mask);
+    __m128i d = _mm_shuffle_epi8(v[3],mask);
+
+    _mm_storeu_si128((__m128i *)o,_mm_or_si128(a,_mm_slli_si128(b,12)));
+    _mm_storeu_si128((__m128i *)(o + 16),_mm_or_si128(_mm_srli_si128(b,4),_mm_slli_si128(c,8)));
+    _mm_storeu_si128((__m128i *)(o + 32),_mm_or_si128(_mm_srli_si128(c,8),_mm_slli_si128(d,4)));
+}
+
+LUAWAV_TARGET("ssse3")
+static void
+luawav_ssse3_s32_to_s24(void *out, const void *in, size_t count) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    const drwav_int32 *p = (const drwav_int32 *)in;
+    const __m128i mask = _mm_setr_epi8(1,2,3, 5,6,7, 9,10,11, 13,14,15, -1,-1,-1,-1);
+    __m128i v[4];
+    size_t i = 0;
+    unsigned int j = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        for(j=0;j<4;j++) {
+            v[j] = _mm_loadu_si128((const __m128i *)(p + i + j * 4));
+        }
+        luawav_ssse3_store_s24(o + i * 3,v,mask);
+    }
+    luawav_scalar_s32_to_s24(o + i * 3,p + i,count - i);
+}
+
+/* floor(x * 2^23 + 0.5), clamped to 24 bits, on 4 samples. Scaling by a
+ * power of two is exact, so clamping first changes nothing; converting
+ * rounds to nearest even, and a sample exactly halfway that went down is
+ * put back up. The operand order of max and min passes NaN through to
+ * the conversion, which makes it 0x80000000 like the scalar cast. */
+static __inline __m128i
+luawav_sse2_f32_to_s24x4(__m128 x) {
+    __m128 v = _mm_mul_ps(x,_mm_set1_ps(8388608.0f));
+    __m128i r;
+
+    v = _mm_min_ps(_mm_set1_ps(8388607.0f),_mm_max_ps(_mm_set1_ps(-8388608.0f),v));
+    r = _mm_cvtps_epi32(v);
+    return _mm_sub_epi32(r,_mm_castps_si128(_mm_cmpeq_ps(_mm_sub_ps(v,_mm_cvtepi32_ps(r)),_mm_set1_ps(0.5f))));
+}
+
+LUAWAV_TARGET("ssse3")
+static void
+luawav_ssse3_f32_to_s24(void *out, const void *in, size_t count) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    const float *p = (const float *)in;
+    const __m128i mask = _mm_setr_epi8(0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1);
+    __m128i v[4];
+    size_t i = 0;
+    unsigned int j = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        for(j=0;j<4;j++) {
+            v[j] = luawav_sse2_f32_to_s24x4(_mm_loadu_ps(p + i + j * 4));
+        }
+        luawav_ssse3_store_s24(o + i * 3,v,mask);
+    }
+    luawav_scalar_f32_to_s24(o + i * 3,p + i,count - i);
+}
+
+LUAWAV_TARGET("avx2")
+static void
+luawav_avx2_s16_to_f32(void *out, const void *in, size_t count) {
+    float *o = (float *)out;
+    const drwav_int16 *p = (const drwav_int16 *)in;
+    const __m256 scale = _mm256_set1_ps(SCALE_S16);
+    __m256i a;
+    __m256i b;
+    size_t i = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        a = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(p + i)));
+        b = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(p + i + 8)));
+        _mm256_storeu_ps(o + i,_mm256_mul_ps(_mm256_cvtepi32_ps(a),scale));
+        _mm256_storeu_ps(o + i + 8,_mm256_mul_ps(_mm256_cvtepi32_ps(b),scale));
+    }
+    drwav_s16_to_f32(o + i,p + i,count - i);
+}
+
+LUAWAV_TARGET("avx2")
+static void
+luawav_avx2_s32_to_f32(void *out, const void *in, size_t count) {
+    float *o = (float *)out;
+    const drwav_int32 *p = (const drwav_int32 *)in;
+    const __m256 scale = _mm256_set1_ps(SCALE_S32);
+    size_t i = 0;
+
+    for(i=0;i+8<=count;i+=8) {
+        _mm256_storeu_ps(o + i,_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(p + i))),scale));
+    }
+    drwav_s32_to_f32(o + i,p + i,count - i);
+}
+
+/* same as luawav_ssse3_load_s24, as two vectors of 8. Each 128-bit lane
+ * takes 12 bytes; the last lane is loaded from 4 bytes early and shuffled
+ * with a shifted mask so nothing past the 48 bytes is read. */
+LUAWAV_TARGET("avx2")
+static __inline void
+luawav_avx2_load_s24(const drwav_uint8 *p, __m256i v[2]) {
+    const __m256i mask0 = _mm256_setr_epi8(
+      -1,0,1,2, -1,3,4,5, -1,6,7,8, -1,9,10,11,
+      -1,0,1,2, -1,3,4,5, -1,6,7,8, -1,9,10,11);
+    const __m256i mask1 = _mm256_setr_epi8(
+      -1,0,1,2, -1,3,4,5, -1,6,7,8, -1,9,10,11,
+      -1,4,5,6, -1,7,8,9, -1,10,11,12, -1,13,14,15);
+    __m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+      _mm_loadu_si128((const __m128i *)(p + 12)),1);
+    __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(p + 24))),
+      _mm_loadu_si128((const __m128i *)(p + 32)),1);
+
+    v[0] = _mm256_shuffle_epi8(a,mask0);
+    v[1] = _mm256_shuffle_epi8(b,mask1);
+}
+
+LUAWAV_TARGET("avx2")
+static void
+luawav_avx2_s24_to_f32(void *out, const void *in, size_t count) {
+    float *o = (float *)out;
+    const drwav_uint8 *p = (const drwav_uint8 *)in;
+    const __m256 scale = _mm256_set1_ps(SCALE_S24);
+    __m256i v[2];
+    size_t i = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        luawav_avx2_load_s24(p + i * 3,v);
+        _mm256_storeu_ps(o + i,_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(v[0],8)),scale));
+        _mm256_storeu_ps(o + i + 8,_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(v[1],8)),scale));
+    }
+    drwav_s24_to_f32(o + i,p + i * 3,count - i);
+}
+
+LUAWAV_TARGET("avx2")
+static void
+luawav_avx2_s24_to_s32(void *out, const void *in, size_t count) {
+    drwav_int32 *o = (drwav_int32 *)out;
+    const drwav_uint8 *p = (const drwav_uint8 *)in;
+    __m256i v[2];
+    size_t i = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        luawav_avx2_load_s24(p + i * 3,v);
+        _mm256_storeu_si256((__m256i *)(o + i),v[0]);
+        _mm256_storeu_si256((__m256i *)(o + i + 8),v[1]);
+    }
+    drwav_s24_to_s32(o + i,p + i * 3,count - i);
+}
+
+LUAWAV_TARGET("avx2")
+static __inline __m256i
+luawav_avx2_f32_to_s16x8(__m256 x) {
+    __m256 c = _mm256_min_ps(_mm256_set1_ps(1.0f),_mm256_max_ps(_mm256_set1_ps(-1.0f),x));
+    __m256i r = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_add_ps(c,_mm256_set1_ps(1.0f)),_mm256_set1_ps(32767.5f)));
+
+    r = _mm256_sub_epi32(r,_mm256_set1_epi32(32768));
+    return _mm256_srai_epi32(_mm256_slli_epi32(r,16),16);
+}
+
+LUAWAV_TARGET("avx2")
+static void
+luawav_avx2_f32_to_s16(void *out, const void *in, size_t count) {
+    drwav_int16 *o = (drwav_int16 *)out;
+    const float *p = (const float *)in;
+    __m256i a;
+    __m256i b;
+    size_t i = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        a = luawav_avx2_f32_to_s16x8(_mm256_loadu_ps(p + i));
+        b = luawav_avx2_f32_to_s16x8(_mm256_loadu_ps(p + i + 8));
+        /* packing works per 128-bit lane, put the quarters back in order */
+        _mm256_storeu_si256((__m256i *)(o + i),_mm256_permute4x64_epi64(_mm256_packs_epi32(a,b),0xD8));
+    }
+    drwav_f32_to_s16(o + i,p + i,count - i);
+}
+
+LUAWAV_TARGET("avx2")
+static void
+luawav_avx2_reduce_s16(const drwav_int16 *in, size_t frames, unsigned int channels, drwav_int32 *mn, drwav_int32 *mx, drwav_uint64 *sq) {
+    size_t count = frames * channels;
+    drwav_int16 l16[32];
+    drwav_int32 lmn[16];
+    drwav_int32 lmx[16];
+    drwav_uint64 lsq[16];
+    __m256i vmn = _mm256_set1_epi16(32767);
+    __m256i vmx = _mm256_set1_epi16(-32768);
+    __m256i acc[4];
+    __m256i x;
+    __m256i a;
+    size_t i = 0;
+    unsigned int j = 0;
+
+    if(16 % channels != 0 || count < 16) {
+        luawav_scalar_reduce_s16(in,frames,channels,mn,mx,sq);
+        return;
+    }
+    for(j=0;j<4;j++) acc[j] = _mm256_setzero_si256();
+    for(i=0;i+16<=count;i+=16) {
+        x = _mm256_loadu_si256((const __m256i *)(in + i));
+        vmn = _mm256_min_epi16(vmn,x);
+        vmx = _mm256_max_epi16(vmx,x);
+        a = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+        a = _mm256_mullo_epi32(a,a);
+        acc[0] = _mm256_add_epi64(acc[0],_mm256_cvtepu32_epi64(_mm256_castsi256_si128(a)));
+        acc[1] = _mm256_add_epi64(acc[1],_mm256_cvtepu32_epi64(_mm256_extracti128_si256(a,1)));
+        a = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x,1));
+        a = _mm256_mullo_epi32(a,a);
+        acc[2] = _mm256_add_epi64(acc[2],_mm256_cvtepu32_epi64(_mm256_castsi256_si128(a)));
+        acc[3] = _mm256_add_epi64(acc[3],_mm256_cvtepu32_epi64(_mm256_extracti128_si256(a,1)));
+    }
+    _mm256_storeu_si256((__m256i *)l16,vmn);
+    _mm256_storeu_si256((__m256i *)(l16 + 16),vmx);
+    for(j=0;j<16;j++) {
+        lmn[j] = l16[j];
+        lmx[j] = l16[j + 16];
+    }
+    for(j=0;j<4;j++) _mm256_storeu_si256((__m256i *)(lsq + j * 4),acc[j]);
+    luawav_fold_s32(lmn,lmx,16,channels,mn,mx);
+    luawav_fold_sq_u64(lsq,16,channels,sq);
+    luawav_scalar_reduce_s16(in + i,(count - i) / channels,channels,mn,mx,sq);
+}
+
+LUAWAV_TARGET("avx2")
+static void
+luawav_avx2_reduce_s32(const drwav_int32 *in, size_t frames, unsigned int channels, drwav_int32 *mn, drwav_int32 *mx, double *sq) {
+    size_t count = frames * channels;
+    drwav_int32 lmn[8];
+    drwav_int32 lmx[8];
+    double lsq[8];
+    __m256i vmn = _mm256_set1_epi32(0x7FFFFFFF);
+    __m256i vmx = _mm256_set1_epi32(-0x7FFFFFFF - 1);
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    __m256d d;
+    __m256i x;
+    size_t i = 0;
+
+    if(8 % channels != 0 || count < 8) {
+        luawav_scalar_reduce_s32(in,frames,channels,mn,mx,sq);
+        return;
+    }
+    for(i=0;i+8<=count;i+=8) {
+        x = _mm256_loadu_si256((const __m256i *)(in + i));
+        vmn = _mm256_min_epi32(vmn,x);
+        vmx = _mm256_max_epi32(vmx,x);
+        d = _mm256_cvtepi32_pd(_mm256_castsi256_si128(x));
+        s0 = _mm256_add_pd(s0,_mm256_mul_pd(d,d));
+        d = _mm256_cvtepi32_pd(_mm256_extracti128_si256(x,1));
+        s1 = _mm256_add_pd(s1,_mm256_mul_pd(d,d));
+    }
+    _mm256_storeu_si256((__m256i *)lmn,vmn);
+    _mm256_storeu_si256((__m256i *)lmx,vmx);
+    _mm256_storeu_pd(lsq,s0);
+    _mm256_storeu_pd(lsq + 4,s1);
+    luawav_fold_s32(lmn,lmx,8,channels,mn,mx);
+    luawav_fold_sq(lsq,8,channels,sq);
+    luawav_scalar_reduce_s32(in + i,(count - i) / channels,channels,mn,mx,sq);
+}
+
+LUAWAV_TARGET("avx2")
+static void
+luawav_avx2_reduce_f32(const float *in, size_t frames, unsigned int channels, float *mn, float *mx, double *sq) {
+    size_t count = frames * channels;
+    float lmn[8];
+    float lmx[8];
+    double lsq[8];
+    __m256 vmn;
+    __m256 vmx;
+    __m256 x;
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    __m256d d;
+    size_t i = 0;
+    unsigned int j = 0;
+
+    if(8 % channels != 0 || count < 8) {
+        luawav_scalar_reduce_f32(in,frames,channels,mn,mx,sq);
+        return;
+    }
+    for(j=0;j<8;j++) {
+        lmn[j] = mn[j % channels];
+        lmx[j] = mx[j % channels];
+    }
+    vmn = _mm256_loadu_ps(lmn);
+    vmx = _mm256_loadu_ps(lmx);
+    for(i=0;i+8<=count;i+=8) {
+        x = _mm256_loadu_ps(in + i);
+        vmn = _mm256_min_ps(x,vmn);
+        vmx = _mm256_max_ps(x,vmx);
+        d = _mm256_cvtps_pd(_mm256_castps256_ps128(x));
+        s0 = _mm256_add_pd(s0,_mm256_mul_pd(d,d));
+        d = _mm256_cvtps_pd(_mm256_extractf128_ps(x,1));
+        s1 = _mm256_add_pd(s1,_mm256_mul_pd(d,d));
+    }
+    _mm256_storeu_ps(lmn,vmn);
+    _mm256_storeu_ps(lmx,vmx);
+    _mm256_storeu_pd(lsq,s0);
+    _mm256_storeu_pd(lsq + 4,s1);
+    luawav_fold_f32(lmn,lmx,lsq,8,channels,mn,mx,sq);
+    luawav_scalar_reduce_f32(in + i,(count - i) / channels,channels,mn,mx,sq);
+}
+
+LUAWAV_TARGET("avx2")
+static __inline __m256
+luawav_avx2_scale_s16(__m256 x, __m256 g) {
+    x = _mm256_mul_ps(x,g);
+    x = _mm256_and_ps(x,_mm256_cmp_ps(x,x,_CMP_ORD_Q));
+    return _mm256_min_ps(_mm256_max_ps(x,_mm256_set1_ps(QUANTIZE_LO)),_mm256_set1_ps(QUANTIZE_HI));
+}
+
+LUAWAV_TARGET("avx2")
+static __inline __m256i
+luawav_avx2_round(__m256 x) {
+    __m256i r = _mm256_cvtps_epi32(x);
+    return _mm256_sub_epi32(r,_mm256_castps_si256(_mm256_cmp_ps(_mm256_sub_ps(x,_mm256_cvtepi32_ps(r)),_mm256_set1_ps(0.5f),_CMP_EQ_OQ)));
+}
+
+LUAWAV_TARGET("avx2")
+static __inline __m256i
+luawav_avx2_xorshift(__m256i s) {
+    s = _mm256_xor_si256(s,_mm256_slli_epi32(s,13));
+    s = _mm256_xor_si256(s,_mm256_srli_epi32(s,17));
+    return _mm256_xor_si256(s,_mm256_slli_epi32(s,5));
+}
+
+/* every generator in two registers, one step a store */
+LUAWAV_TARGET("avx2")
+static void
+luawav_avx2_noise(luawav_dither *d, float *n, size_t count) {
+    __m256i a;
+    __m256i b;
+    __m256 t;
+    size_t i = 0;
+
+    for(i=0;i<count && d->next < LUAWAV_DITHER_LANES / 2;i++) n[i] = d->noise[d->next++];
+    if(count - i >= 8) {
+        a = _mm256_loadu_si256((const __m256i *)d->state);
+        b = _mm256_loadu_si256((const __m256i *)(d->state + 8));
+        for(;i+8<=count;i+=8) {
+            a = luawav_avx2_xorshift(a);
+            b = luawav_avx2_xorshift(b);
+            t = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(a,8)),_mm256_cvtepi32_ps(_mm256_srli_epi32(b,8)));
+            _mm256_storeu_ps(n + i,_mm256_mul_ps(t,_mm256_set1_ps(1.0f / 16777216.0f)));
+        }
+        _mm256_storeu_si256((__m256i *)d->state,a);
+        _mm256_storeu_si256((__m256i *)(d->state + 8),b);
+    }
+    for(;i<count;i++) n[i] = luawav_dither_noise(d);
+}
+
+LUAWAV_TARGET("avx2")
+static void
+luawav_avx2_quantize_s16(void *out, const float *in, size_t count, float gain) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    __m256 g = _mm256_set1_ps(gain * 32768.0f);
+    __m256i a;
+    __m256i b;
+    size_t i = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        a = luawav_avx2_round(luawav_avx2_scale_s16(_mm256_loadu_ps(in + i),g));
+        b = luawav_avx2_round(luawav_avx2_scale_s16(_mm256_loadu_ps(in + i + 8),g));
+        _mm256_storeu_si256((__m256i *)(o + i * 2),_mm256_permute4x64_epi64(_mm256_packs_epi32(a,b),0xD8));
+    }
+    luawav_scalar_quantize_s16(o + i * 2,in + i,count - i,gain);
+}
+
+LUAWAV_TARGET("avx2")
+static void
+luawav_avx2_dither_s16(void *out, const float *in, size_t count, float gain, luawav_dither *d) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    float x[DITHER_BLOCK];
+    float n[DITHER_BLOCK];
+    __m256 g = _mm256_set1_ps(gain * 32768.0f);
+    __m256i a;
+    __m256i b;
+    size_t i = 0;
+    size_t j = 0;
+    size_t m = 0;
+
+    for(i=0;i<count;i+=m) {
+        m = WAV_MIN(count - i,DITHER_BLOCK);
+        luawav_avx2_noise(d,n,m);
+        if(d->mode == LUAWAV_DITHER_SHAPED) {
+            for(j=0;j+8<=m;j+=8) _mm256_storeu_ps(x + j,luawav_avx2_scale_s16(_mm256_loadu_ps(in + i + j),g));
+            for(;j<m;j++) x[j] = luawav_scalar_scale_s16(in[i + j],gain * 32768.0f);
+            luawav_shape_s16(o + i * 2,x,n,m,d);
+            continue;
+        }
+        for(j=0;j+16<=m;j+=16) {
+            a = luawav_avx2_round(_mm256_add_ps(luawav_avx2_scale_s16(_mm256_loadu_ps(in + i + j),g),_mm256_loadu_ps(n + j)));
+            b = luawav_avx2_round(_mm256_add_ps(luawav_avx2_scale_s16(_mm256_loadu_ps(in + i + j + 8),g),_mm256_loadu_ps(n + j + 8)));
+            _mm256_storeu_si256((__m256i *)(o + (i + j) * 2),_mm256_permute4x64_epi64(_mm256_packs_epi32(a,b),0xD8));
+        }
+        luawav_scalar_tpdf_s16(o + (i + j) * 2,in + i + j,n + j,m - j,gain * 32768.0f);
+    }
+}
+
+#endif /* LUAWAV_SIMD_X86 */
+
+#if LUAWAV_SIMD_NEON
+
+static void
+luawav_neon_s16_to_f32(void *out, const void *in, size_t count) {
+    float *o = (float *)out;
+    const drwav_int16 *p = (const drwav_int16 *)in;
+    int16x8_t x;
+    size_t i = 0;
+
+    for(i=0;i+8<=count;i+=8) {
+        x = vld1q_s16(p + i);
+        vst1q_f32(o + i,vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))),SCALE_S16));
+        vst1q_f32(o + i + 4,vmulq_n_f32(vcvtq_f32_s32(vmovl_high_s16(x)),SCALE_S16));
+    }
+    drwav_s16_to_f32(o + i,p + i,count - i);
+}
+
+static void
+luawav_neon_s32_to_f32(void *out, const void *in, size_t count) {
+    float *o = (float *)out;
+    const drwav_int32 *p = (const drwav_int32 *)in;
+    size_t i = 0;
+
+    for(i=0;i+4<=count;i+=4) {
+        vst1q_f32(o + i,vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(p + i)),SCALE_S32));
+    }
+    drwav_s32_to_f32(o + i,p + i,count - i);
+}
+
+/* a NaN goes through max and min and converts to 0, the same as the
+ * scalar version on this architecture */
+static __inline int16x4_t
+luawav_neon_f32_to_s16x4(float32x4_t x) {
+    float32x4_t c = vminq_f32(vmaxq_f32(x,vdupq_n_f32(-1.0f)),vdupq_n_f32(1.0f));
+    int32x4_t r = vcvtq_s32_f32(vmulq_n_f32(vaddq_f32(c,vdupq_n_f32(1.0f)),32767.5f));
+
+    return vmovn_s32(vsubq_s32(r,vdupq_n_s32(32768)));
+}
+
+static void
+luawav_neon_f32_to_s16(void *out, const void *in, size_t count) {
+    drwav_int16 *o = (drwav_int16 *)out;
+    const float *p = (const float *)in;
+    size_t i = 0;
+
+    for(i=0;i+8<=count;i+=8) {
+        vst1q_s16(o + i,vcombine_s16(luawav_neon_f32_to_s16x4(vld1q_f32(p + i)),luawav_neon_f32_to_s16x4(vld1q_f32(p + i + 4))));
+    }
+    drwav_f32_to_s16(o + i,p + i,count - i);
+}
+
+static void
+luawav_neon_s16_to_s32(void *out, const void *in, size_t count) {
+    drwav_int32 *o = (drwav_int32 *)out;
+    const drwav_int16 *p = (const drwav_int16 *)in;
+    int16x8_t x;
+    size_t i = 0;
+
+    for(i=0;i+8<=count;i+=8) {
+        x = vld1q_s16(p + i);
+        vst1q_s32(o + i,vshll_n_s16(vget_low_s16(x),16));
+        vst1q_s32(o + i + 4,vshll_n_s16(vget_high_s16(x),16));
+    }
+    drwav_s16_to_s32(o + i,p + i,count - i);
+}
+
+static void
+luawav_neon_s32_to_s16(void *out, const void *in, size_t count) {
+    drwav_int16 *o = (drwav_int16 *)out;
+    const drwav_int32 *p = (const drwav_int32 *)in;
+    size_t i = 0;
+
+    for(i=0;i+8<=count;i+=8) {
+        vst1q_s16(o + i,vcombine_s16(vshrn_n_s32(vld1q_s32(p + i),16),vshrn_n_s32(vld1q_s32(p + i + 4),16)));
+    }
+    drwav_s32_to_s16(o + i,p + i,count - i);
+}
+
+/* 16 packed 24-bit samples, deinterleaved into low, middle and high
+ * bytes. The top two bytes are already a 16-bit sample. */
+typedef struct luawav_neon_s24_s {
+    uint8x16_t lo;
+    int16x8_t top[2];
+} luawav_neon_s24;
+
+static __inline void
+luawav_neon_load_s24(const drwav_uint8 *p, luawav_neon_s24 *s) {
+    uint8x16x3_t b = vld3q_u8(p);
+
+    s->lo = b.val[0];
+    s->top[0] = vreinterpretq_s16_u8(vzip1q_u8(b.val[1],b.val[2]));
+    s->top[1] = vreinterpretq_s16_u8(vzip2q_u8(b.val[1],b.val[2]));
+}
+
+/* samples 4n to 4n+3 as drwav_s24_to_s32 makes them */
+static __inline int32x4_t
+luawav_neon_s24_quarter(const luawav_neon_s24 *s, unsigned int n) {
+    int16x8_t top = s->top[n / 2];
+    uint16x8_t lo = (n / 2) ? vmovl_high_u8(s->lo) : vmovl_u8(vget_low_u8(s->lo));
+    int32x4_t t = vshll_n_s16((n & 1) ? vget_high_s16(top) : vget_low_s16(top),16);
+    uint32x4_t l = vshll_n_u16((n & 1) ? vget_high_u16(lo) : vget_low_u16(lo),8);
+
+    return vorrq_s32(t,vreinterpretq_s32_u32(l));
+}
+
+static void
+luawav_neon_s24_to_f32(void *out, const void *in, size_t count) {
+    float *o = (float *)out;
+    const drwav_uint8 *p = (const drwav_uint8 *)in;
+    luawav_neon_s24 s;
+    size_t i = 0;
+    unsigned int j = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        luawav_neon_load_s24(p + i * 3,&s);
+        for(j=0;j<4;j++) {
+            vst1q_f32(o + i + j * 4,vmulq_n_f32(vcvtq_f32_s32(vshrq_n_s32(luawav_neon_s24_quarter(&s,j),8)),SCALE_S24));
+        }
+    }
+    drwav_s24_to_f32(o + i,p + i * 3,count - i);
+}
+
+static void
+luawav_neon_s24_to_s32(void *out, const void *in, size_t count) {
+    drwav_int32 *o = (drwav_int32 *)out;
+    const drwav_uint8 *p = (const drwav_uint8 *)in;
+    luawav_neon_s24 s;
+    size_t i = 0;
+    unsigned int j = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        luawav_neon_load_s24(p + i * 3,&s);
+        for(j=0;j<4;j++) {
+            vst1q_s32(o + i + j * 4,luawav_neon_s24_quarter(&s,j));
+        }
+    }
+    drwav_s24_to_s32(o + i,p + i * 3,count - i);
+}
+
+static void
+luawav_neon_s24_to_s16(void *out, const void *in, size_t count) {
+    drwav_int16 *o = (drwav_int16 *)out;
+    const drwav_uint8 *p = (const drwav_uint8 *)in;
+    luawav_neon_s24 s;
+    size_t i = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        luawav_neon_load_s24(p + i * 3,&s);
+        vst1q_s16(o + i,s.top[0]);
+        vst1q_s16(o + i + 8,s.top[1]);
+    }
+    drwav_s24_to_s16(o + i,p + i * 3,count - i);
+}
+
+static void
+luawav_neon_s32_to_s24(void *out, const void *in, size_t count) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    const drwav_int32 *p = (const drwav_int32 *)in;
+    uint8x16x4_t b;
+    uint8x16x3_t t;
+    size_t i = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        b = vld4q_u8((const drwav_uint8 *)(p + i));
+        t.val[0] = b.val[1];
+        t.val[1] = b.val[2];
+        t.val[2] = b.val[3];
+        vst3q_u8(o + i * 3,t);
+    }
+    luawav_scalar_s32_to_s24(o + i * 3,p + i,count - i);
+}
+
+/* same as luawav_sse2_f32_to_s24x4; max and min pass NaN through and
+ * it converts to 0, like the scalar cast on this architecture */
+static __inline int32x4_t
+luawav_neon_f32_to_s24x4(float32x4_t x) {
+    float32x4_t v = vmulq_n_f32(x,8388608.0f);
+    int32x4_t r;
+
+    v = vminq_f32(vmaxq_f32(v,vdupq_n_f32(-8388608.0f)),vdupq_n_f32(8388607.0f));
+    r = vcvtnq_s32_f32(v);
+    return vsubq_s32(r,vreinterpretq_s32_u32(vceqq_f32(vsubq_f32(v,vcvtq_f32_s32(r)),vdupq_n_f32(0.5f))));
+}
+
+static void
+luawav_neon_f32_to_s24(void *out, const void *in, size_t count) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    const float *p = (const float *)in;
+    drwav_int32 s[16];
+    uint8x16x4_t b;
+    uint8x16x3_t t;
+    size_t i = 0;
+    unsigned int j = 0;
+
+    for(i=0;i+16<=count;i+=16) {
+        for(j=0;j<4;j++) {
+            vst1q_s32(s + j * 4,luawav_neon_f32_to_s24x4(vld1q_f32(p + i + j * 4)));
+        }
+        b = vld4q_u8((const drwav_uint8 *)s);
+        t.val[0] = b.val[0];
+        t.val[1] = b.val[1];
+        t.val[2] = b.val[2];
+        vst3q_u8(o + i * 3,t);
+    }
+    luawav_scalar_f32_to_s24(o + i * 3,p + i,count - i);
+}
+
+static void
+luawav_neon_reduce_s16(const drwav_int16 *in, size_t frames, unsigned int channels, drwav_int32 *mn, drwav_int32 *mx, drwav_uint64 *sq) {
+    size_t count = frames * channels;
+    drwav_int16 l16[16];
+    drwav_int32 lmn[8];
+    drwav_int32 lmx[8];
+    drwav_uint64 lsq[8];
+    int16x8_t vmn = vdupq_n_s16(32767);
+    int16x8_t vmx = vdupq_n_s16(-32768);
+    uint64x2_t acc[4];
+    int16x8_t x;
+    uint32x4_t a;
+    size_t i = 0;
+    unsigned int j = 0;
+
+    if(8 % channels != 0 || count < 8) {
+        luawav_scalar_reduce_s16(in,frames,channels,mn,mx,sq);
+        return;
+    }
+    for(j=0;j<4;j++) acc[j] = vdupq_n_u64(0);
+    for(i=0;i+8<=count;i+=8) {
+        x = vld1q_s16(in + i);
+        vmn = vminq_s16(vmn,x);
+        vmx = vmaxq_s16(vmx,x);
+        a = vreinterpretq_u32_s32(vmull_s16(vget_low_s16(x),vget_low_s16(x)));
+        acc[0] = vaddw_u32(acc[0],vget_low_u32(a));
+        acc[1] = vaddw_high_u32(acc[1],a);
+        a = vreinterpretq_u32_s32(vmull_high_s16(x,x));
+        acc[2] = vaddw_u32(acc[2],vget_low_u32(a));
+        acc[3] = vaddw_high_u32(acc[3],a);
+    }
+    vst1q_s16(l16,vmn);
+    vst1q_s16(l16 + 8,vmx);
+    for(j=0;j<8;j++) {
+        lmn[j] = l16[j];
+        lmx[j] = l16[j + 8];
+    }
+    for(j=0;j<4;j++) vst1q_u64(lsq + j * 2,acc[j]);
+    luawav_fold_s32(lmn,lmx,8,channels,mn,mx);
+    luawav_fold_sq_u64(lsq,8,channels,sq);
+    luawav_scalar_reduce_s16(in + i,(count - i) / channels,channels,mn,mx,sq);
+}
+
+static void
+luawav_neon_reduce_s32(const drwav_int32 *in, size_t frames, unsigned int channels, drwav_int32 *mn, drwav_int32 *mx, double *sq) {
+    size_t count = frames * channels;
+    drwav_int32 lmn[4];
+    drwav_int32 lmx[4];
+    double lsq[4];
+    int32x4_t vmn = vdupq_n_s32(0x7FFFFFFF);
+    int32x4_t vmx = vdupq_n_s32(-0x7FFFFFFF - 1);
+    float64x2_t s0 = vdupq_n_f64(0.0);
+    float64x2_t s1 = vdupq_n_f64(0.0);
+    float64x2_t d;
+    int32x4_t x;
+    size_t i = 0;
+
+    if(4 % channels != 0 || count < 4) {
+        luawav_scalar_reduce_s32(in,frames,channels,mn,mx,sq);
+        return;
+    }
+    for(i=0;i+4<=count;i+=4) {
+        x = vld1q_s32(in + i);
+        vmn = vminq_s32(vmn,x);
+        vmx = vmaxq_s32(vmx,x);
+        d = vcvtq_f64_s64(vmovl_s32(vget_low_s32(x)));
+        s0 = vaddq_f64(s0,vmulq_f64(d,d));
+        d = vcvtq_f64_s64(vmovl_high_s32(x));
+        s1 = vaddq_f64(s1,vmulq_f64(d,d));
+    }
+    vst1q_s32(lmn,vmn);
+    vst1q_s32(lmx,vmx);
+    vst1q_f64(lsq,s0);
+    vst1q_f64(lsq + 2,s1);
+    luawav_fold_s32(lmn,lmx,4,channels,mn,mx);
+    luawav_fold_sq(lsq,4,channels,sq);
+    luawav_scalar_reduce_s32(in + i,(count - i) / channels,channels,mn,mx,sq);
+}
+
+/* NEON min and max return NaN if either operand is, so the lanes are
+ * picked with a comparison instead, which a NaN sample fails */
+static void
+luawav_neon_reduce_f32(const float *in, size_t frames, unsigned int channels, float *mn, float *mx, double *sq) {
+    size_t count = frames * channels;
+    float lmn[4];
+    float lmx[4];
+    double lsq[4];
+    float32x4_t vmn;
+    float32x4_t vmx;
+    float32x4_t x;
+    float64x2_t s0 = vdupq_n_f64(0.0);
+    float64x2_t s1 = vdupq_n_f64(0.0);
+    float64x2_t d;
+    size_t i = 0;
+    unsigned int j = 0;
+
+    if(4 % channels != 0 || count < 4) {
+        luawav_scalar_reduce_f32(in,frames,channels,mn,mx,sq);
+        return;
+    }
+    for(j=0;j<4;j++) {
+        lmn[j] = mn[j % channels];
+        lmx[j] = mx[j % channels];
+    }
+    vmn = vld1q_f32(lmn);
+    vmx = vld1q_f32(lmx);
+    for(i=0;i+4<=count;i+=4) {
+        x = vld1q_f32(in + i);
+        vmn = vbslq_f32(vcltq_f32(x,vmn),x,vmn);
+        vmx = vbslq_f32(vcgtq_f32(x,vmx),x,vmx);
+        d = vcvt_f64_f32(vget_low_f32(x));
+        s0 = vaddq_f64(s0,vmulq_f64(d,d));
+        d = vcvt_high_f64_f32(x);
+        s1 = vaddq_f64(s1,vmulq_f64(d,d));
+    }
+    vst1q_f32(lmn,vmn);
+    vst1q_f32(lmx,vmx);
+    vst1q_f64(lsq,s0);
+    vst1q_f64(lsq + 2,s1);
+    luawav_fold_f32(lmn,lmx,lsq,4,channels,mn,mx,sq);
+    luawav_scalar_reduce_f32(in + i,(count - i) / channels,channels,mn,mx,sq);
+}
+
+/* the quantizers as for SSE2. NaN is cleared before max and min, which
+ * would return it here */
+static __inline float32x4_t
+luawav_neon_scale_s16(float32x4_t x, float32x4_t g) {
+    x = vmulq_f32(x,g);
+    x = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(x),vceqq_f32(x,x)));
+    return vminq_f32(vmaxq_f32(x,vdupq_n_f32(QUANTIZE_LO)),vdupq_n_f32(QUANTIZE_HI));
+}
+
+static __inline int32x4_t
+luawav_neon_round(float32x4_t x) {
+    int32x4_t r = vcvtnq_s32_f32(x);
+    return vsubq_s32(r,vreinterpretq_s32_u32(vceqq_f32(vsubq_f32(x,vcvtq_f32_s32(r)),vdupq_n_f32(0.5f))));
+}
+
+static __inline uint32x4_t
+luawav_neon_xorshift(uint32x4_t s) {
+    s = veorq_u32(s,vshlq_n_u32(s,13));
+    s = veorq_u32(s,vshrq_n_u32(s,17));
+    return veorq_u32(s,vshlq_n_u32(s,5));
+}
+
+static __inline float32x4_t
+luawav_neon_tpdf(uint32x4_t a, uint32x4_t b) {
+    float32x4_t d = vsubq_f32(vcvtq_f32_u32(vshrq_n_u32(a,8)),vcvtq_f32_u32(vshrq_n_u32(b,8)));
+    return vmulq_n_f32(d,1.0f / 16777216.0f);
+}
+
+static void
+luawav_neon_noise(luawav_dither *d, float *n, size_t count) {
+    uint32x4_t s[4];
+    size_t i = 0;
+    unsigned int j = 0;
+
+    for(i=0;i<count && d->next < LUAWAV_DITHER_LANES / 2;i++) n[i] = d->noise[d->next++];
+    if(count - i >= 8) {
+        for(j=0;j<4;j++) s[j] = vld1q_u32(d->state + j * 4);
+        for(;i+8<=count;i+=8) {
+            for(j=0;j<4;j++) s[j] = luawav_neon_xorshift(s[j]);
+            vst1q_f32(n + i,luawav_neon_tpdf(s[0],s[2]));
+            vst1q_f32(n + i + 4,luawav_neon_tpdf(s[1],s[3]));
+        }
+        for(j=0;j<4;j++) vst1q_u32(d->state + j * 4,s[j]);
+    }
+    for(;i<count;i++) n[i] = luawav_dither_noise(d);
+}
+
+static void
+luawav_neon_quantize_s16(void *out, const float *in, size_t count, float gain) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    float32x4_t g = vdupq_n_f32(gain * 32768.0f);
+    int16x4_t a;
+    int16x4_t b;
+    size_t i = 0;
+
+    for(i=0;i+8<=count;i+=8) {
+        a = vqmovn_s32(luawav_neon_round(luawav_neon_scale_s16(vld1q_f32(in + i),g)));
+        b = vqmovn_s32(luawav_neon_round(luawav_neon_scale_s16(vld1q_f32(in + i + 4),g)));
+        vst1q_s16((drwav_int16 *)(o + i * 2),vcombine_s16(a,b));
+    }
+    luawav_scalar_quantize_s16(o + i * 2,in + i,count - i,gain);
+}
+
+static void
+luawav_neon_dither_s16(void *out, const float *in, size_t count, float gain, luawav_dither *d) {
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    float x[DITHER_BLOCK];
+    float n[DITHER_BLOCK];
+    float32x4_t g = vdupq_n_f32(gain * 32768.0f);
+    int16x4_t a;
+    int16x4_t b;
+    size_t i = 0;
+    size_t j = 0;
+    size_t m = 0;
+
+    for(i=0;i<count;i+=m) {
+        m = WAV_MIN(count - i,DITHER_BLOCK);
+        luawav_neon_noise(d,n,m);
+        if(d->mode == LUAWAV_DITHER_SHAPED) {
+            for(j=0;j+4<=m;j+=4) vst1q_f32(x + j,luawav_neon_scale_s16(vld1q_f32(in + i + j),g));
+            for(;j<m;j++) x[j] = luawav_scalar_scale_s16(in[i + j],gain * 32768.0f);
+            luawav_shape_s16(o + i * 2,x,n,m,d);
+            continue;
+        }
+        for(j=0;j+8<=m;j+=8) {
+            a = vqmovn_s32(luawav_neon_round(vaddq_f32(luawav_neon_scale_s16(vld1q_f32(in + i + j),g),vld1q_f32(n + j))));
+            b = vqmovn_s32(luawav_neon_round(vaddq_f32(luawav_neon_scale_s16(vld1q_f32(in + i + j + 4),g),vld1q_f32(n + j + 4))));
+            vst1q_s16((drwav_int16 *)(o + (i + j) * 2),vcombine_s16(a,b));
+        }
+        luawav_scalar_tpdf_s16(o + (i + j) * 2,in + i + j,n + j,m - j,gain * 32768.0f);
+    }
+}
+
+#endif /* LUAWAV_SIMD_NEON */
+
+static const luawav_converters luawav_scalar = {
+    "scalar",
+    luawav_scalar_s16_to_f32,
+    luawav_scalar_s24_to_f32,
+    luawav_scalar_s32_to_f32,
+    luawav_scalar_f32_to_s16,
+    luawav_scalar_s16_to_s32,
+    luawav_scalar_s24_to_s32,
+    luawav_scalar_s24_to_s16,
+    luawav_scalar_s32_to_s16,
+    luawav_scalar_s32_to_s24,
+    luawav_scalar_f32_to_s24,
+    luawav_scalar_reduce_s16,
+    luawav_scalar_reduce_s32,
+    luawav_scalar_reduce_f32,
+    luawav_scalar_quantize_s16,
+    luawav_scalar_dither_s16,
+};
+
+LUAWAV_PRIVATE
+luawav_converters luawav_convert = {
+    "scalar",
+    luawav_scalar_s16_to_f32,
+    luawav_scalar_s24_to_f32,
+    luawav_scalar_s32_to_f32,
+    luawav_scalar_f32_to_s16,
+    luawav_scalar_s16_to_s32,
+    luawav_scalar_s24_to_s32,
+    luawav_scalar_s24_to_s16,
+    luawav_scalar_s32_to_s16,
+    luawav_scalar_s32_to_s24,
+    luawav_scalar_f32_to_s24,
+    luawav_scalar_reduce_s16,
+    luawav_scalar_reduce_s32,
+    luawav_scalar_reduce_f32,
+    luawav_scalar_quantize_s16,
+    luawav_scalar_dither_s16,
+};
+
+/* the tiers built in, best first */
+LUAWAV_PRIVATE
+const char * const luawav_convert_tiers[] = {
+#if LUAWAV_SIMD_X86
+    "avx2",
+    "ssse3",
+    "sse2",
+#elif LUAWAV_SIMD_NEON
+    "neon",
+#endif
+    "scalar",
+    NULL
+};
+
+/* fills in c with the kernels of one tier from luawav_convert_tiers, and
+ * the ones below it where it has none of its own. Returns 0, leaving c
+ * partly filled in, when the CPU doesn't support the tier. */
+LUAWAV_PRIVATE
+int
+luawav_convert_tier(luawav_converters *c, const char *isa) {
+    *c = luawav_scalar;
+    if(strcmp(isa,"scalar") == 0) return 1;
+
+#if LUAWAV_SIMD_X86
+    __builtin_cpu_init();
+
+    c->isa = "sse2";
+    c->s16_to_f32 = luawav_sse2_s16_to_f32;
+    c->s32_to_f32 = luawav_sse2_s32_to_f32;
+    c->f32_to_s16 = luawav_sse2_f32_to_s16;
+    c->s16_to_s32 = luawav_sse2_s16_to_s32;
+    c->s32_to_s16 = luawav_sse2_s32_to_s16;
+    c->reduce_s16 = luawav_sse2_reduce_s16;
+    c->reduce_s32 = luawav_sse2_reduce_s32;
+    c->reduce_f32 = luawav_sse2_reduce_f32;
+    c->quantize_s16 = luawav_sse2_quantize_s16;
+    c->dither_s16 = luawav_sse2_dither_s16;
+    if(strcmp(isa,"sse2") == 0) return 1;
+
+    if(!__builtin_cpu_supports("ssse3")) return 0;
+    c->isa = "ssse3";
+    c->s24_to_f32 = luawav_ssse3_s24_to_f32;
+    c->s24_to_s32 = luawav_ssse3_s24_to_s32;
+    c->s24_to_s16 = luawav_ssse3_s24_to_s16;
+    c->s32_to_s24 = luawav_ssse3_s32_to_s24;
+    c->f32_to_s24 = luawav_ssse3_f32_to_s24;
+    if(strcmp(isa,"ssse3") == 0) return 1;
+
+    if(!__builtin_cpu_supports("avx2")) return 0;
+    c->isa = "avx2";
+    c->s16_to_f32 = luawav_avx2_s16_to_f32;
+    c->s24_to_f32 = luawav_avx2_s24_to_f32;
+    c->s32_to_f32 = luawav_avx2_s32_to_f32;
+    c->f32_to_s16 = luawav_avx2_f32_to_s16;
+    c->s24_to_s32 = luawav_avx2_s24_to_s32;
+    c->reduce_s16 = luawav_avx2_reduce_s16;
+    c->reduce_s32 = luawav_avx2_reduce_s32;
+    c->reduce_f32 = luawav_avx2_reduce_f32;
+    c->quantize_s16 = luawav_avx2_quantize_s16;
+    c->dither_s16 = luawav_avx2_dither_s16;
+    if(strcmp(isa,"avx2") == 0) return 1;
+#elif LUAWAV_SIMD_NEON
+    c->isa = "neon";
+    c->s16_to_f32 = luawav_neon_s16_to_f32;
+    c->s24_to_f32 = luawav_neon_s24_to_f32;
+    c->s32_to_f32 = luawav_neon_s32_to_f32;
+    c->f32_to_s16 = luawav_neon_f32_to_s16;
+    c->s16_to_s32 = luawav_neon_s16_to_s32;
+    c->s24_to_s32 = luawav_neon_s24_to_s32;
+    c->s24_to_s16 = luawav_neon_s24_to_s16;
+    c->s32_to_s16 = luawav_neon_s32_to_s16;
+    c->s32_to_s24 = luawav_neon_s32_to_s24;
+    c->f32_to_s24 = luawav_neon_f32_to_s24;
+    c->reduce_s16 = luawav_neon_reduce_s16;
+    c->reduce_s32 = luawav_neon_reduce_s32;
+    c->reduce_f32 = luawav_neon_reduce_f32;
+    c->quantize_s16 = luawav_neon_quantize_s16;
+    c->dither_s16 = luawav_neon_dither_s16;
+    if(strcmp(isa,"neon") == 0) return 1;
+#endif
+    return 0;
+}
+
+/* fills in luawav_convert with the best tier for this CPU, called when
+ * the module loads. Every thread that gets here stores the same
+ * pointers. */
+LUAWAV_PRIVATE
+void
+luawav_convert_init(void) {
+    luawav_converters c;
+    unsigned int i = 0;
+
+    for(i=0;luawav_convert_tiers[i] != NULL;i++) {
+        if(luawav_convert_tier(&c,luawav_convert_tiers[i])) {
+            luawav_convert = c;
+            return;
+        }
+    }
+}
+
+/* the luawav_convert kernel dr_wav would otherwise run when reading the
+ * file as type, NULL when it's some other converter or none at all. Only
+ * uncompressed formats, where frames can be read raw with
+ * drwav_read_pcm_frames_le, and a whole frame fits in the staging buffer. */
+LUAWAV_PRIVATE
+luawav_convert_func
+luawav_convert_kernel(const drwav *wav, int type) {
+    if(wav->container == drwav_container_aiff) return NULL;
+    if((size_t)wav->channels * (wav->bitsPerSample / 8) > CONVERT_STAGING) return NULL;
+
+    if(wav->translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT) {
+        return (wav->bitsPerSample == 32 && type == LUAWAV_S16) ? luawav_convert.f32_to_s16 : NULL;
+    }
+    if(wav->translatedFormatTag != DR_WAVE_FORMAT_PCM) return NULL;
+
+    switch(wav->bitsPerSample) {
+        case 16: {
+            if(type == LUAWAV_F32) return luawav_convert.s16_to_f32;
+            if(type == LUAWAV_S32) return luawav_convert.s16_to_s32;
+            break;
+        }
+        case 24: {
+            if(type == LUAWAV_F32) return luawav_convert.s24_to_f32;
+            if(type == LUAWAV_S32) return luawav_convert.s24_to_s32;
+            return luawav_convert.s24_to_s16;
+        }
+        case 32: {
+            if(type == LUAWAV_F32) return luawav_convert.s32_to_f32;
+            if(type == LUAWAV_S16) return luawav_convert.s32_to_s16;
+            break;
+        }
+        default: break;
+    }
+    return NULL;
+}
@@ -0,0 +1,292 @@
+/* per-channel signal statistics, accumulated over blocks of samples as
+ * they're read */
+
+#include "luawav_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define STATS_BUFFER 4096
+
+/* the level a sample has to reach to count as clipped, on the f32 scale:
+ * the largest positive value the file's format can hold */
+static double
+luawav_stats_clip_level(const drwav *wav) {
+    if(wav->translatedFormatTag == DR_WAVE_FORMAT_PCM && wav->bitsPerSample > 1 && wav->bitsPerSample <= 32) {
+        return 1.0 - (1.0 / (double)((drwav_uint64)1 << (wav->bitsPerSample - 1)));
+    }
+    return 1.0;
+}
+
+LUAWAV_PRIVATE
+luawav_stats *
+luawav_stats_new(const drwav *wav) {
+    luawav_stats *s = NULL;
+
+    s = (luawav_stats *)malloc(sizeof(luawav_stats) + (sizeof(luawav_channel_stats) * wav->channels));
+    if(s == NULL) return NULL;
+    memset(s,0,sizeof(luawav_stats) + (sizeof(luawav_channel_stats) * wav->channels));
+    s->channels = wav->channels;
+    s->clip = luawav_stats_clip_level(wav);
+    s->ch = (luawav_channel_stats *)(s + 1);
+    return s;
+}
+
+LUAWAV_PRIVATE
+void
+luawav_stats_free(luawav_stats *s) {
+    free(s);
+}
+
+static void
+luawav_stats_sample(luawav_channel_stats *c, double x, double clip) {
+    double a = fabs(x);
+
+    c->sum += x;
+    c->sumsq += x * x;
+    if(a > c->peak) c->peak = a;
+    if(a >= clip) c->clipped++;
+    if(x == 0.0) {
+        c->zeroSamples++;
+        if(++c->zeroRun > c->longestZeroRun) c->longestZeroRun = c->zeroRun;
+    } else {
+        c->zeroRun = 0;
+    }
+}
+
+/* adds `frames` interleaved frames, in the sample type read (one of
+ * LUAWAV_F32, LUAWAV_S32, LUAWAV_S16), to the running totals. Only for
+ * reads luawav_stats_kernel has no kernel for, where the type holds every
+ * sample exactly. */
+LUAWAV_PRIVATE
+void
+luawav_stats_update(luawav_stats *s, const void *samples, drwav_uint64 frames, int type) {
+    const float *f32 = (const float *)samples;
+    const drwav_int32 *s32 = (const drwav_int32 *)samples;
+    const drwav_int16 *s16 = (const drwav_int16 *)samples;
+    drwav_uint64 f = 0;
+    unsigned int c = 0;
+
+    switch(type) {
+        case LUAWAV_F32: {
+            for(f=0;f<frames;f++) {
+                for(c=0;c<s->channels;c++) luawav_stats_sample(&s->ch[c],*f32++,s->clip);
+            }
+            break;
+        }
+        case LUAWAV_S32: {
+            for(f=0;f<frames;f++) {
+                for(c=0;c<s->channels;c++) luawav_stats_sample(&s->ch[c],*s32++ / 2147483648.0,s->clip);
+            }
+            break;
+        }
+        default: {
+            for(f=0;f<frames;f++) {
+                for(c=0;c<s->channels;c++) luawav_stats_sample(&s->ch[c],*s16++ / 32768.0,s->clip);
+            }
+            break;
+        }
+    }
+    s->frames += frames;
+}
+
+/* adds `frames` raw little-endian frames, as read with
+ * drwav_read_pcm_frames_le, for the formats luawav_stats_kernel converts */
+LUAWAV_PRIVATE
+void
+luawav_stats_update_raw(luawav_stats *s, const drwav *wav, const void *raw, drwav_uint64 frames) {
+    const drwav_uint8 *b = (const drwav_uint8 *)raw;
+    drwav_uint64 f = 0;
+    unsigned int c = 0;
+    float x32 = 0.0f;
+    double x64 = 0.0;
+
+    if(wav->translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT) {
+        if(wav->bitsPerSample == 32) {
+            for(f=0;f<frames;f++) {
+                for(c=0;c<s->channels;c++) {
+                    memcpy(&x32,b,4);
+                    b += 4;
+                    luawav_stats_sample(&s->ch[c],x32,s->clip);
+                }
+            }
+        } else {
+            for(f=0;f<frames;f++) {
+                for(c=0;c<s->channels;c++) {
+                    memcpy(&x64,b,8);
+                    b += 8;
+                    luawav_stats_sample(&s->ch[c],x64,s->clip);
+                }
+            }
+        }
+    } else {
+        switch(wav->bitsPerSample) {
+            case 8: {
+                for(f=0;f<frames;f++) {
+                    for(c=0;c<s->channels;c++) luawav_stats_sample(&s->ch[c],((int)*b++ - 128) / 128.0,s->clip);
+                }
+                break;
+            }
+            case 24: {
+                for(f=0;f<frames;f++) {
+                    for(c=0;c<s->channels;c++) {
+                        luawav_stats_sample(&s->ch[c],(drwav_int32)(((drwav_uint32)b[0] << 8) | ((drwav_uint32)b[1] << 16) | ((drwav_uint32)b[2] << 24)) / 2147483648.0,s->clip);
+                        b += 3;
+                    }
+                }
+                break;
+            }
+            default: {
+                for(f=0;f<frames;f++) {
+                    for(c=0;c<s->channels;c++) {
+                        luawav_stats_sample(&s->ch[c],(drwav_int32)((drwav_uint32)b[0] | ((drwav_uint32)b[1] << 8) | ((drwav_uint32)b[2] << 16) | ((drwav_uint32)b[3] << 24)) / 2147483648.0,s->clip);
+                        b += 4;
+                    }
+                }
+                break;
+            }
+        }
+    }
+    s->frames += frames;
+}
+
+/* dr_wav's converters for the reads luawav_convert has no kernel for */
+static void
+luawav_stats_u8_to_f32(void *out, const void *in, size_t count) {
+    drwav_u8_to_f32((float *)out,(const drwav_uint8 *)in,count);
+}
+
+static void
+luawav_stats_f32_to_s32(void *out, const void *in, size_t count) {
+    drwav_f32_to_s32((drwav_int32 *)out,(const float *)in,count);
+}
+
+static void
+luawav_stats_f64_to_f32(void *out, const void *in, size_t count) {
+    drwav_f64_to_f32((float *)out,(const double *)in,count);
+}
+
+static void
+luawav_stats_f64_to_s32(void *out, const void *in, size_t count) {
+    drwav_f64_to_s32((drwav_int32 *)out,(const double *)in,count);
+}
+
+static void
+luawav_stats_f64_to_s16(void *out, const void *in, size_t count) {
+    drwav_f64_to_s16((drwav_int16 *)out,(const double *)in,count);
+}
+
+/* reading some formats as some types loses part of what the statistics
+ * are taken from: the low bits of 24- and 32-bit samples, float samples
+ * beyond full scale, and 8-bit samples, which dr_wav scales differently
+ * to f32. Those reads are made raw, the statistics taken from the raw
+ * samples with luawav_stats_update_raw, and converted to type with the
+ * kernel returned here, which gives what dr_wav would. NULL when type
+ * holds every sample of the file exactly. */
+LUAWAV_PRIVATE
+luawav_convert_func
+luawav_stats_kernel(const drwav *wav, int type) {
+    if(wav->container == drwav_container_aiff) return NULL;
+    if((size_t)wav->channels * (wav->bitsPerSample / 8) > CONVERT_STAGING) return NULL;
+
+    if(wav->translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT) {
+        if(wav->bitsPerSample == 32) {
+            if(type == LUAWAV_S16) return luawav_convert.f32_to_s16;
+            if(type == LUAWAV_S32) return luawav_stats_f32_to_s32;
+        } else if(wav->bitsPerSample == 64) {
+            if(type == LUAWAV_F32) return luawav_stats_f64_to_f32;
+            if(type == LUAWAV_S32) return luawav_stats_f64_to_s32;
+            return luawav_stats_f64_to_s16;
+        }
+        return NULL;
+    }
+    if(wav->translatedFormatTag != DR_WAVE_FORMAT_PCM) return NULL;
+
+    switch(wav->bitsPerSample) {
+        case 8: return type == LUAWAV_F32 ? luawav_stats_u8_to_f32 : NULL;
+        case 24: return type == LUAWAV_S16 ? luawav_convert.s24_to_s16 : NULL;
+        case 32: {
+            if(type == LUAWAV_F32) return luawav_convert.s32_to_f32;
+            if(type == LUAWAV_S16) return luawav_convert.s32_to_s16;
+            break;
+        }
+        default: break;
+    }
+    return NULL;
+}
+
+LUAWAV_PRIVATE
+void
+luawav_stats_push(lua_State *L, const luawav_stats *s) {
+    const luawav_channel_stats *c = NULL;
+    unsigned int i = 0;
+    double n = s->frames ? (double)s->frames : 1.0;
+
+    lua_createtable(L,s->channels,1);
+    luawav_pushuint64(L,s->frames);
+    lua_setfield(L,-2,"frames");
+
+    for(i=0;i<s->channels;i++) {
+        c = &s->ch[i];
+        lua_createtable(L,0,6);
+        lua_pushnumber(L,c->peak);
+        lua_setfield(L,-2,"peak");
+        lua_pushnumber(L,sqrt(c->sumsq / n));
+        lua_setfield(L,-2,"rms");
+        lua_pushnumber(L,c->sum / n);
+        lua_setfield(L,-2,"dc");
+        luawav_pushuint64(L,c->clipped);
+        lua_setfield(L,-2,"clipped");
+        luawav_pushuint64(L,c->zeroSamples);
+        lua_setfield(L,-2,"zeroSamples");
+        luawav_pushuint64(L,c->longestZeroRun);
+        lua_setfield(L,-2,"longestZeroRun");
+        lua_rawseti(L,-2,i + 1);
+    }
+}
+
+/* wav.analyze(path) - statistics for a whole file in one pass */
+LUAWAV_PRIVATE
+int
+luawav_analyze(lua_State *L) {
+    const char *path = NULL;
+    luawav_stats *s = NULL;
+    luawav_convert_func kernel = NULL;
+    float buffer[STATS_BUFFER];
+    drwav_uint64 t = 0;
+    drwav_uint64 n = 0;
+    drwav wav;
+
+    path = luaL_checkstring(L,1);
+
+    if(!drwav_init_file(&wav,path,NULL)) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"unable to open %s",path);
+        return 2;
+    }
+
+    n = STATS_BUFFER / wav.channels;
+    s = n ? luawav_stats_new(&wav) : NULL;
+    if(s == NULL) {
+        drwav_uninit(&wav);
+        lua_pushnil(L);
+        lua_pushstring(L,n ? "out of memory" : "too many channels");
+        return 2;
+    }
+
+    /* the same as a reader's statistics, read as f32 */
+    kernel = luawav_stats_kernel(&wav,LUAWAV_F32);
+    do {
+        if(kernel != NULL) {
+            t = luawav_read_converted(&wav,n,buffer,LUAWAV_F32,kernel,NULL,s);
+        } else {
+            t = drwav_read_pcm_frames_f32(&wav,n,buffer);
+            luawav_stats_update(s,buffer,t,LUAWAV_F32);
+        }
+    } while(t == n);
+
+    drwav_uninit(&wav);
+    luawav_stats_push(L,s);
+    luawav_stats_free(s);
+    return 1;
+}
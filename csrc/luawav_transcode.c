@@ -0,0 +1,235 @@
+/* decode, process and re-encode a file in one pass through a fixed-size
+ * staging buffer, with an optional first pass to measure the level for
+ * normalizing */
+
+#include "luawav_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define TRANSCODE_BUFFER 16384 /* samples */
+
+#define NORMALIZE_NONE 0
+#define NORMALIZE_PEAK 1
+#define NORMALIZE_LUFS 2
+
+static const char * const luawav_normalize_modes[] = {
+    "none",
+    "peak",
+    "lufs",
+    NULL,
+};
+
+/* largest absolute sample of the rest of the file */
+static double
+luawav_measure_peak(drwav *wav, float *buffer, drwav_uint64 frames) {
+    drwav_uint64 t = 0;
+    size_t i = 0;
+    double peak = 0.0;
+
+    do {
+        t = drwav_read_pcm_frames_f32(wav,frames,buffer);
+        for(i=0;i<t * wav->channels;i++) {
+            if(fabs(buffer[i]) > peak) peak = fabs(buffer[i]);
+        }
+    } while(t == frames);
+    return peak;
+}
+
+static const char *
+luawav_transcode_run(drwav *in, drwav *out, double gain, luawav_dither *d, drwav_uint64 *written) {
+    const char *err = NULL;
+    float *f32 = NULL;
+    drwav_int32 *s32 = NULL;
+    void *packed = NULL;
+    drwav_uint64 frames = TRANSCODE_BUFFER / in->channels;
+    drwav_uint64 t = 0;
+    size_t count = 0;
+    size_t bytes = 0;
+    size_t i = 0;
+    int isFloat = out->translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT;
+    /* integer output with nothing to do can skip the trip through float */
+    int direct = !isFloat && gain == 1.0 && d->mode == LUAWAV_DITHER_NONE;
+
+    f32 = (float *)malloc(sizeof(float) * TRANSCODE_BUFFER);
+    s32 = (drwav_int32 *)malloc(sizeof(drwav_int32) * TRANSCODE_BUFFER);
+    packed = malloc((size_t)(TRANSCODE_BUFFER * (out->bitsPerSample / 8)));
+    if(f32 == NULL || s32 == NULL || packed == NULL) {
+        err = "out of memory";
+        goto cleanup;
+    }
+
+    do {
+        if(direct) {
+            t = drwav_read_pcm_frames_s32(in,frames,s32);
+        } else {
+            t = drwav_read_pcm_frames_f32(in,frames,f32);
+        }
+        if(t == 0) break;
+        count = (size_t)(t * in->channels);
+        bytes = count * (out->bitsPerSample / 8);
+
+        if(isFloat) {
+            if(gain != 1.0) {
+                for(i=0;i<count;i++) f32[i] = (float)(f32[i] * gain);
+            }
+            luawav_pack_f32(packed,f32,count,out->bitsPerSample);
+        } else if(direct || !luawav_quantize_pack_f32(packed,f32,count,gain,out->translatedFormatTag,out->bitsPerSample,d)) {
+            if(!direct) luawav_quantize_f32(s32,f32,count,gain,luawav_quantize_bits(out->translatedFormatTag,out->bitsPerSample),d);
+            luawav_pack_s32(packed,s32,count,out->translatedFormatTag,out->bitsPerSample);
+        }
+
+        if(drwav_write_raw(out,bytes,packed) != bytes) {
+            err = "write error";
+            goto cleanup;
+        }
+        *written += t;
+    } while(t == frames);
+
+    cleanup:
+    free(f32);
+    free(s32);
+    free(packed);
+    return err;
+}
+
+/* wav.transcode(src, dst [, { format, bitsPerSample, container, gain,
+ *   normalize = "peak" | "lufs", target, dither = "tpdf" }]) */
+LUAWAV_PRIVATE
+int
+luawav_transcode(lua_State *L) {
+    const char *src = NULL;
+    const char *dst = NULL;
+    const char *err = NULL;
+    drwav in;
+    drwav out;
+    drwav_data_format fmt;
+    luawav_dither d;
+    float *buffer = NULL;
+    int normalize = NORMALIZE_NONE;
+    int dither = LUAWAV_DITHER_NONE;
+    double gain = 0.0;
+    double target = 0.0;
+    double level = 0.0;
+    drwav_uint64 written = 0;
+    drwav_container container;
+    int format = -1;
+    int bitsPerSample = 0;
+
+    src = luaL_checkstring(L,1);
+    dst = luaL_checkstring(L,2);
+
+    normalize = luawav_opt_enum(L,3,"normalize",luawav_normalize_modes);
+    dither = luawav_opt_enum(L,3,"dither",luawav_dither_modes);
+    gain = luawav_opt_number(L,3,"gain",0.0);
+    target = luawav_opt_number(L,3,"target",normalize == NORMALIZE_LUFS ? -23.0 : -1.0);
+    container = luawav_opt_container(L,3,drwav_container_riff);
+    if(luawav_opt_isset(L,3,"format")) {
+        lua_getfield(L,3,"format");
+        format = (int)luaL_checkinteger(L,-1);
+        lua_pop(L,1);
+    }
+    if(luawav_opt_isset(L,3,"bitsPerSample")) {
+        lua_getfield(L,3,"bitsPerSample");
+        bitsPerSample = (int)luaL_checkinteger(L,-1);
+        lua_pop(L,1);
+    }
+
+    if(!drwav_init_file(&in,src,NULL)) {
+        lua_pushboolean(L,0);
+        lua_pushfstring(L,"unable to open %s",src);
+        return 2;
+    }
+
+    if(in.channels == 0 || in.channels > TRANSCODE_BUFFER) {
+        drwav_uninit(&in);
+        lua_pushboolean(L,0);
+        lua_pushstring(L,"unsupported channel count");
+        return 2;
+    }
+
+    memset(&fmt,0,sizeof(drwav_data_format));
+    fmt.channels = in.channels;
+    fmt.sampleRate = in.sampleRate;
+    fmt.container = container;
+    fmt.format = in.translatedFormatTag;
+    fmt.bitsPerSample = in.bitsPerSample;
+    if(!luawav_pack_supported((drwav_uint16)fmt.format,(drwav_uint16)fmt.bitsPerSample)) {
+        fmt.format = DR_WAVE_FORMAT_PCM;
+        fmt.bitsPerSample = 16;
+    }
+    if(format >= 0) {
+        fmt.format = (drwav_uint32)format;
+        if(!luawav_pack_supported((drwav_uint16)fmt.format,(drwav_uint16)fmt.bitsPerSample)) {
+            switch(fmt.format) {
+                case DR_WAVE_FORMAT_IEEE_FLOAT: fmt.bitsPerSample = 32; break;
+                case DR_WAVE_FORMAT_ALAW: /* fall-through */
+                case DR_WAVE_FORMAT_MULAW: fmt.bitsPerSample = 8; break;
+                default: fmt.bitsPerSample = 16; break;
+            }
+        }
+    }
+    if(bitsPerSample > 0) {
+        fmt.bitsPerSample = (drwav_uint32)bitsPerSample;
+    }
+    if(!luawav_pack_supported((drwav_uint16)fmt.format,(drwav_uint16)fmt.bitsPerSample)) {
+        drwav_uninit(&in);
+        lua_pushboolean(L,0);
+        lua_pushstring(L,"format not supported");
+        return 2;
+    }
+
+    /* the first pass reads the whole file, then it's read again from the
+     * start rather than holding it in memory */
+    if(normalize != NORMALIZE_NONE) {
+        if(normalize == NORMALIZE_PEAK) {
+            buffer = (float *)malloc(sizeof(float) * TRANSCODE_BUFFER);
+            if(buffer == NULL) {
+                err = "out of memory";
+            } else {
+                level = 20.0 * log10(luawav_measure_peak(&in,buffer,TRANSCODE_BUFFER / in.channels));
+                free(buffer);
+            }
+        } else {
+            err = luawav_measure_lufs(&in,&level);
+        }
+        if(err == NULL && !drwav_seek_to_pcm_frame(&in,0)) {
+            err = "unable to rewind input";
+        }
+        if(err != NULL) {
+            drwav_uninit(&in);
+            lua_pushboolean(L,0);
+            lua_pushstring(L,err);
+            return 2;
+        }
+        /* silence is left alone */
+        if(level > -HUGE_VAL) gain += target - level;
+    }
+
+    if(!drwav_init_file_write(&out,dst,&fmt,NULL)) {
+        drwav_uninit(&in);
+        lua_pushboolean(L,0);
+        lua_pushfstring(L,"unable to open %s",dst);
+        return 2;
+    }
+
+    if(luawav_dither_init(&d,dither,in.channels)) {
+        err = luawav_transcode_run(&in,&out,pow(10.0,gain / 20.0),&d,&written);
+    } else {
+        err = "out of memory";
+    }
+    luawav_dither_free(&d);
+    drwav_uninit(&in);
+    drwav_uninit(&out);
+
+    if(err != NULL) {
+        remove(dst);
+        lua_pushboolean(L,0);
+        lua_pushstring(L,err);
+        return 2;
+    }
+
+    lua_pushboolean(L,1);
+    lua_pushnumber(L,gain);
+    return 2;
+}
@@ -0,0 +1,575 @@
+/* checks every vectorized converter in luawav_simd.c gives the same bits
+ * as the scalar one it stands in for, at every tier the CPU supports:
+ * all 16-bit and 24-bit samples, random 32-bit samples, and random float
+ * bit patterns along with the values around every rounding boundary.
+ * Each kernel is also run on every short count at a few misalignments,
+ * to cover the tails and check nothing past the end is written. The
+ * scalar f32_to_s24 packer is checked against luawav_quantize_f32 and
+ * luawav_pack_s32, the two steps it replaces, and the scalar 16-bit
+ * quantizer against rounding in double precision.
+ *
+ * The 16-bit quantizers are run on the same samples at a few gains, the
+ * dithered one with both dithers over 1 to DITHER_CHANNELS channels; the
+ * dither state has to end up the same as the scalar one's, and the scalar
+ * noise can't depend on how the samples are split between calls.
+ *
+ * The reductions are run over every channel count up to REDUCE_CHANNELS,
+ * and must give the same minimum and maximum, and the same sum of squares
+ * bar the rounding of floating-point sums added up in another order.
+ *
+ * Exits with a failure status if any kernel differs. */
+
+#include "luawav_internal.h"
+#include <float.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK 65536
+#define RANDOM_SAMPLES (1 << 22)
+#define TAIL_COUNT 80
+#define TAIL_OFFSETS 4
+#define GUARD 16
+#define MAX_CHECKED 64
+#define REDUCE_CHANNELS 9
+#define REDUCE_FRAMES 4099
+#define REDUCE_S16 0
+#define REDUCE_S32 1
+#define REDUCE_F32 2
+#define DITHER_CHANNELS 3
+#define DITHER_SAMPLES 1000
+
+typedef struct kernel_s {
+    const char *name;
+    size_t offset; /* of the kernel in luawav_converters */
+    size_t inSize;
+    size_t outSize;
+    /* for float input, boundary i of the points where rounding changes
+     * is at (i + bias) / scale - 1 */
+    drwav_uint32 points;
+    double scale;
+    double bias;
+} kernel;
+
+#define KERNEL(n,i,o) { #n, offsetof(luawav_converters,n), i, o, 0, 0.0, 0.0 }
+#define FLOAT_KERNEL(n,o,p,s,b) { #n, offsetof(luawav_converters,n), 4, o, p, s, b }
+
+static const kernel kernels[] = {
+    KERNEL(s16_to_f32,2,4),
+    KERNEL(s24_to_f32,3,4),
+    KERNEL(s32_to_f32,4,4),
+    FLOAT_KERNEL(f32_to_s16,2,65536,32767.5,0.0),
+    KERNEL(s16_to_s32,2,4),
+    KERNEL(s24_to_s32,3,4),
+    KERNEL(s24_to_s16,3,2),
+    KERNEL(s32_to_s16,4,2),
+    KERNEL(s32_to_s24,4,3),
+    FLOAT_KERNEL(f32_to_s24,3,1 << 24,8388608.0,0.5),
+};
+
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+/* rounding boundaries for 16-bit quantizing are at (i + 0.5) / 2^15 - 1 */
+static const kernel quantize_kernel = FLOAT_KERNEL(quantize_s16,2,65536,32768.0,0.5);
+static const kernel dither_kernel = FLOAT_KERNEL(dither_s16,2,65536,32768.0,0.5);
+
+static drwav_uint32 seed = 1;
+
+static drwav_uint32
+next_random(void) {
+    /* xorshift32 */
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static luawav_convert_func
+get_kernel(const luawav_converters *c, const kernel *k) {
+    return *(const luawav_convert_func *)((const char *)c + k->offset);
+}
+
+static void
+put_sample(drwav_uint8 *p, size_t size, drwav_uint32 v) {
+    size_t i = 0;
+    for(i=0;i<size;i++) {
+        p[i] = (drwav_uint8)(v >> (8 * i));
+    }
+}
+
+/* runs both kernels on count samples from in, 0 if the output or the
+ * guard bytes after it differ */
+static int
+compare(luawav_convert_func test, luawav_convert_func ref, const kernel *k, const drwav_uint8 *in, size_t count, drwav_uint8 *a, drwav_uint8 *b) {
+    memset(a,0xA5,(count + GUARD) * k->outSize);
+    memset(b,0xA5,(count + GUARD) * k->outSize);
+    ref(a,in,count);
+    test(b,in,count);
+    return memcmp(a,b,(count + GUARD) * k->outSize) == 0;
+}
+
+static int
+report(const char *tier, const kernel *k, const char *what, size_t count, size_t offset) {
+    fprintf(stderr,"%-8s %-12s FAIL %s, %u samples at offset %u\n",tier,k->name,what,(unsigned int)count,(unsigned int)offset);
+    return 0;
+}
+
+/* every count up to TAIL_COUNT, starting a few samples into in */
+static int
+check_tails(const char *tier, const kernel *k, luawav_convert_func test, luawav_convert_func ref, const drwav_uint8 *in, drwav_uint8 *a, drwav_uint8 *b) {
+    size_t count = 0;
+    size_t offset = 0;
+
+    for(offset=0;offset<TAIL_OFFSETS;offset++) {
+        for(count=0;count<=TAIL_COUNT;count++) {
+            if(!compare(test,ref,k,in + offset * k->inSize,count,a,b)) return report(tier,k,"tail",count,offset);
+        }
+    }
+    return 1;
+}
+
+/* the floats around the points where k rounds differently, from point
+ * start, as many as fit in a chunk; returns the number of points */
+static size_t
+float_boundaries(const kernel *k, drwav_uint8 *in, size_t start) {
+    size_t n = 0;
+    size_t i = 0;
+    float f = 0.0f;
+    drwav_uint32 bits = 0;
+    int d = 0;
+
+    for(i=start;i<k->points && n + 8 <= CHUNK;i++) {
+        f = (float)(((double)i + k->bias) / k->scale - 1.0);
+        memcpy(&bits,&f,4);
+        for(d=-3;d<=3;d++) {
+            put_sample(in + n * 4,4,bits + (drwav_uint32)d);
+            n++;
+        }
+    }
+    return i - start;
+}
+
+static int
+check_kernel(const char *tier, const kernel *k, luawav_convert_func test, luawav_convert_func ref, drwav_uint8 *in, drwav_uint8 *a, drwav_uint8 *b) {
+    drwav_uint32 v = 0;
+    size_t i = 0;
+    size_t n = 0;
+    size_t start = 0;
+    static const drwav_uint32 specials[] = {
+        0x00000000, 0x80000000, 0x00000001, 0x80000001, 0x007FFFFF, 0x00800000,
+        0x3F800000, 0xBF800000, 0x3F7FFFFF, 0xBF7FFFFF, 0x3F800001, 0xBF800001,
+        0x7F800000, 0xFF800000, 0x7FC00000, 0xFFC00000, 0x7F800001, 0x7FFFFFFF,
+        0x4F000000, 0xCF000000, 0x7F7FFFFF, 0xFF7FFFFF,
+    };
+
+    if(k->inSize == 2) {
+        /* every 16-bit sample */
+        for(i=0;i<65536;i++) put_sample(in + i * 2,2,(drwav_uint32)i);
+        if(!compare(test,ref,k,in,65536,a,b)) return report(tier,k,"all samples",65536,0);
+    } else if(k->inSize == 3) {
+        /* every 24-bit sample, a chunk at a time */
+        for(v=0;v<(1 << 24);v+=CHUNK) {
+            for(i=0;i<CHUNK;i++) put_sample(in + i * 3,3,v + (drwav_uint32)i);
+            if(!compare(test,ref,k,in,CHUNK,a,b)) return report(tier,k,"all samples",CHUNK,v);
+        }
+    } else {
+        /* random bit patterns, which for floats include NaNs, infinities
+         * and denormals, and the values where rounding changes */
+        for(n=0;n<RANDOM_SAMPLES;n+=CHUNK) {
+            for(i=0;i<CHUNK;i++) put_sample(in + i * 4,4,next_random());
+            if(!compare(test,ref,k,in,CHUNK,a,b)) return report(tier,k,"random samples",CHUNK,n);
+        }
+        for(i=0;i<sizeof(specials) / sizeof(specials[0]);i++) put_sample(in + i * 4,4,specials[i]);
+        if(!compare(test,ref,k,in,i,a,b)) return report(tier,k,"special values",i,0);
+        while(start < k->points) {
+            n = float_boundaries(k,in,start);
+            if(!compare(test,ref,k,in,n * 7,a,b)) return report(tier,k,"rounding boundaries",n * 7,start);
+            start += n;
+        }
+    }
+
+    for(i=0;i<(TAIL_COUNT + TAIL_OFFSETS) * k->inSize;i++) in[i] = (drwav_uint8)next_random();
+    return check_tails(tier,k,test,ref,in,a,b);
+}
+
+/* the per-channel results of a reduction, for either kernel */
+typedef struct reduction_s {
+    drwav_int32 imn[REDUCE_CHANNELS];
+    drwav_int32 imx[REDUCE_CHANNELS];
+    drwav_uint64 isq[REDUCE_CHANNELS];
+    float fmn[REDUCE_CHANNELS];
+    float fmx[REDUCE_CHANNELS];
+    double fsq[REDUCE_CHANNELS];
+} reduction;
+
+static const char * const reduce_names[] = { "reduce_s16", "reduce_s32", "reduce_f32" };
+
+static int
+same_sum(double a, double b) {
+    if(a != a) return b != b;
+    if(a == b) return 1;
+    return fabs(a - b) <= 1e-12 * fabs(a);
+}
+
+static void
+reduce_reset(reduction *r, int kind) {
+    unsigned int c = 0;
+
+    for(c=0;c<REDUCE_CHANNELS;c++) {
+        r->imn[c] = kind == REDUCE_S16 ? 32767 : 0x7FFFFFFF;
+        r->imx[c] = kind == REDUCE_S16 ? -32768 : -0x7FFFFFFF - 1;
+        r->isq[c] = 0;
+        r->fmn[c] = FLT_MAX;
+        r->fmx[c] = -FLT_MAX;
+        r->fsq[c] = 0.0;
+    }
+}
+
+static void
+reduce_run(const luawav_converters *c, int kind, const drwav_uint8 *in, size_t frames, unsigned int channels, reduction *r) {
+    switch(kind) {
+        case REDUCE_S16: c->reduce_s16((const drwav_int16 *)in,frames,channels,r->imn,r->imx,r->isq); break;
+        case REDUCE_S32: c->reduce_s32((const drwav_int32 *)in,frames,channels,r->imn,r->imx,r->fsq); break;
+        default: c->reduce_f32((const float *)in,frames,channels,r->fmn,r->fmx,r->fsq); break;
+    }
+}
+
+static int
+reduce_same(const reduction *a, const reduction *b, unsigned int channels) {
+    unsigned int c = 0;
+
+    for(c=0;c<channels;c++) {
+        if(a->imn[c] != b->imn[c] || a->imx[c] != b->imx[c] || a->isq[c] != b->isq[c]) return 0;
+        if(a->fmn[c] != b->fmn[c] || a->fmx[c] != b->fmx[c] || !same_sum(a->fsq[c],b->fsq[c])) return 0;
+    }
+    return 1;
+}
+
+/* random samples for a reduction; floats are finite, but for every 37th
+ * with nans, which the minimum and maximum have to skip */
+static void
+reduce_fill(drwav_uint8 *in, size_t count, int kind, int nans) {
+    float f = 0.0f;
+    size_t i = 0;
+
+    for(i=0;i<count;i++) {
+        if(kind == REDUCE_S16) {
+            put_sample(in + i * 2,2,next_random());
+        } else if(kind == REDUCE_S32) {
+            put_sample(in + i * 4,4,next_random());
+        } else {
+            f = (float)((next_random() / 4294967296.0) * 8.0 - 4.0);
+            if(nans && i % 37 == 0) f = (float)NAN;
+            memcpy(in + i * 4,&f,4);
+        }
+    }
+}
+
+/* the tier's reduction against the scalar one, at every channel count,
+ * a few misalignments and the counts around each vector width, twice so
+ * the second call folds into what the first left */
+static int
+check_reduce(const char *tier, const luawav_converters *c, const luawav_converters *ref, int kind, drwav_uint8 *in) {
+    static const size_t counts[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, REDUCE_FRAMES };
+    size_t size = kind == REDUCE_S16 ? 2 : 4;
+    reduction a;
+    reduction b;
+    unsigned int channels = 0;
+    unsigned int offset = 0;
+    unsigned int k = 0;
+    int nans = 0;
+
+    for(nans=0;nans<(kind == REDUCE_F32 ? 2 : 1);nans++) {
+        reduce_fill(in,(REDUCE_FRAMES * 2 + 1) * REDUCE_CHANNELS + TAIL_OFFSETS,kind,nans);
+        for(channels=1;channels<=REDUCE_CHANNELS;channels++) {
+            for(offset=0;offset<TAIL_OFFSETS;offset++) {
+                for(k=0;k<sizeof(counts) / sizeof(counts[0]);k++) {
+                    reduce_reset(&a,kind);
+                    reduce_reset(&b,kind);
+                    reduce_run(ref,kind,in + offset * size,counts[k],channels,&a);
+                    reduce_run(c,kind,in + offset * size,counts[k],channels,&b);
+                    reduce_run(ref,kind,in + (offset + counts[k] * channels) * size,counts[k] + 1,channels,&a);
+                    reduce_run(c,kind,in + (offset + counts[k] * channels) * size,counts[k] + 1,channels,&b);
+                    if(!reduce_same(&a,&b,channels)) {
+                        fprintf(stderr,"%-8s %-12s FAIL %u channels, %u frames at offset %u%s\n",tier,reduce_names[kind],
+                          channels,(unsigned int)counts[k],offset,nans ? " with nans" : "");
+                        return 0;
+                    }
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+static int
+reduce_differs(const luawav_converters *c, const luawav_converters *last, int kind) {
+    switch(kind) {
+        case REDUCE_S16: return c->reduce_s16 != last->reduce_s16;
+        case REDUCE_S32: return c->reduce_s32 != last->reduce_s32;
+        default: return c->reduce_f32 != last->reduce_f32;
+    }
+}
+
+/* luawav_quantize_f32 then luawav_pack_s32 into a, for 24-bit PCM */
+static void
+quantize_pack(void *out, const void *in, size_t count) {
+    static drwav_int32 s32[CHUNK];
+    luawav_dither d;
+
+    luawav_dither_init(&d,LUAWAV_DITHER_NONE,1);
+    luawav_quantize_f32(s32,(const float *)in,count,1.0,24,&d);
+    luawav_pack_s32(out,s32,count,DR_WAVE_FORMAT_PCM,24);
+}
+
+/* the quantizers being compared, behind the luawav_convert_func
+ * signature check_kernel takes */
+static luawav_quantize_func quantize_test_func;
+static luawav_quantize_func quantize_ref_func;
+static luawav_dither_func dither_test_func;
+static luawav_dither_func dither_ref_func;
+static luawav_dither dither_test;
+static luawav_dither dither_ref;
+static float quantize_gain = 1.0f;
+
+static void
+quantize_test(void *out, const void *in, size_t count) {
+    quantize_test_func(out,(const float *)in,count,quantize_gain);
+}
+
+static void
+quantize_ref(void *out, const void *in, size_t count) {
+    quantize_ref_func(out,(const float *)in,count,quantize_gain);
+}
+
+static void
+dither_run_test(void *out, const void *in, size_t count) {
+    dither_test_func(out,(const float *)in,count,quantize_gain,&dither_test);
+}
+
+static void
+dither_run_ref(void *out, const void *in, size_t count) {
+    dither_ref_func(out,(const float *)in,count,quantize_gain,&dither_ref);
+}
+
+/* what luawav_quantize_f32 did for 16 bits before the quantizers, with
+ * NaN as silence */
+static void
+quantize_double(void *out, const void *in, size_t count) {
+    const float *p = (const float *)in;
+    drwav_uint8 *o = (drwav_uint8 *)out;
+    drwav_uint16 s = 0;
+    double v = 0.0;
+    size_t i = 0;
+
+    for(i=0;i<count;i++) {
+        v = p[i] != p[i] ? 0.0 : floor(p[i] * 32768.0 + 0.5);
+        v = v < -32768.0 ? -32768.0 : (v > 32767.0 ? 32767.0 : v);
+        s = (drwav_uint16)(drwav_int16)v;
+        o[i * 2] = (drwav_uint8)s;
+        o[i * 2 + 1] = (drwav_uint8)(s >> 8);
+    }
+}
+
+static int
+dither_same(const luawav_dither *a, const luawav_dither *b) {
+    unsigned int c = 0;
+
+    if(a->channel != b->channel || a->next != b->next) return 0;
+    if(memcmp(a->state,b->state,sizeof(a->state)) != 0) return 0;
+    if(memcmp(a->noise,b->noise,sizeof(a->noise)) != 0) return 0;
+    for(c=0;a->error != NULL && c<a->channels;c++) {
+        if(a->error[c] != b->error[c]) return 0;
+    }
+    return 1;
+}
+
+static const float quantize_gains[] = { 1.0f, 0.70710677f, 3.0f };
+
+static int
+check_quantize(const char *tier, const luawav_converters *c, const luawav_converters *ref, drwav_uint8 *in, drwav_uint8 *a, drwav_uint8 *b) {
+    unsigned int g = 0;
+
+    quantize_test_func = c->quantize_s16;
+    quantize_ref_func = ref->quantize_s16;
+    for(g=0;g<sizeof(quantize_gains) / sizeof(quantize_gains[0]);g++) {
+        quantize_gain = quantize_gains[g];
+        seed = 1;
+        if(!check_kernel(tier,&quantize_kernel,quantize_test,quantize_ref,in,a,b)) {
+            fprintf(stderr,"%-8s %-12s at gain %g\n",tier,quantize_kernel.name,quantize_gain);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* a different gain for each channel count, to keep the run short */
+static int
+check_dither(const char *tier, const luawav_converters *c, const luawav_converters *ref, drwav_uint8 *in, drwav_uint8 *a, drwav_uint8 *b) {
+    unsigned int channels = 0;
+    int mode = 0;
+    int ok = 1;
+
+    dither_test_func = c->dither_s16;
+    dither_ref_func = ref->dither_s16;
+    for(mode=LUAWAV_DITHER_TPDF;mode<=LUAWAV_DITHER_SHAPED && ok;mode++) {
+        for(channels=1;channels<=DITHER_CHANNELS && ok;channels++) {
+            quantize_gain = quantize_gains[channels % (sizeof(quantize_gains) / sizeof(quantize_gains[0]))];
+            luawav_dither_init(&dither_test,mode,channels);
+            luawav_dither_init(&dither_ref,mode,channels);
+            seed = 1;
+            ok = check_kernel(tier,&dither_kernel,dither_run_test,dither_run_ref,in,a,b);
+            if(ok && !dither_same(&dither_test,&dither_ref)) {
+                fprintf(stderr,"%-8s %-12s FAIL dither state\n",tier,dither_kernel.name);
+                ok = 0;
+            }
+            if(!ok) {
+                fprintf(stderr,"%-8s %-12s %s, %u channels, gain %g\n",tier,dither_kernel.name,
+                  luawav_dither_modes[mode],channels,quantize_gain);
+            }
+            luawav_dither_free(&dither_test);
+            luawav_dither_free(&dither_ref);
+        }
+    }
+    return ok;
+}
+
+/* the scalar dither over DITHER_SAMPLES samples in one call, then in
+ * calls of 1 to 7 samples, must come out the same */
+static int
+check_dither_split(const luawav_converters *ref, drwav_uint8 *in, drwav_uint8 *a, drwav_uint8 *b) {
+    size_t i = 0;
+    size_t m = 0;
+    int mode = 0;
+    int ok = 1;
+
+    for(i=0;i<DITHER_SAMPLES;i++) put_sample(in + i * 4,4,next_random() >> 1 | 0x30000000);
+    for(mode=LUAWAV_DITHER_TPDF;mode<=LUAWAV_DITHER_SHAPED && ok;mode++) {
+        luawav_dither_init(&dither_test,mode,DITHER_CHANNELS);
+        luawav_dither_init(&dither_ref,mode,DITHER_CHANNELS);
+        ref->dither_s16(a,(const float *)in,DITHER_SAMPLES,1.0f,&dither_ref);
+        for(i=0;i<DITHER_SAMPLES;i+=m) {
+            m = WAV_MIN(DITHER_SAMPLES - i,i % 7 + 1);
+            ref->dither_s16(b + i * 2,(const float *)in + i,m,1.0f,&dither_test);
+        }
+        if(memcmp(a,b,DITHER_SAMPLES * 2) != 0 || !dither_same(&dither_test,&dither_ref)) {
+            fprintf(stderr,"%-8s %-12s FAIL %s split between calls\n","scalar",dither_kernel.name,luawav_dither_modes[mode]);
+            ok = 0;
+        }
+        luawav_dither_free(&dither_test);
+        luawav_dither_free(&dither_ref);
+    }
+    return ok;
+}
+
+int
+main(void) {
+    luawav_converters ref;
+    luawav_converters last;
+    luawav_converters c;
+    drwav_uint8 *in = NULL;
+    drwav_uint8 *a = NULL;
+    drwav_uint8 *b = NULL;
+    luawav_convert_func checked[MAX_CHECKED];
+    luawav_convert_func f = NULL;
+    unsigned int count = 0;
+    unsigned int t = 0;
+    unsigned int j = 0;
+    unsigned int k = 0;
+    int failures = 0;
+
+    in = (drwav_uint8 *)malloc(CHUNK * 4 + ((REDUCE_FRAMES * 2 + 1) * REDUCE_CHANNELS + TAIL_OFFSETS) * 4);
+    a = (drwav_uint8 *)malloc((CHUNK + GUARD) * 4);
+    b = (drwav_uint8 *)malloc((CHUNK + GUARD) * 4);
+    if(in == NULL || a == NULL || b == NULL) {
+        fprintf(stderr,"out of memory\n");
+        return 1;
+    }
+
+    luawav_convert_tier(&ref,"scalar");
+    for(j=0;j<KERNEL_COUNT;j++) {
+        if(strcmp(kernels[j].name,"f32_to_s24") != 0) continue;
+        seed = 1;
+        if(check_kernel("quantize",&kernels[j],get_kernel(&ref,&kernels[j]),quantize_pack,in,a,b)) {
+            fprintf(stderr,"%-8s %-12s ok\n","quantize",kernels[j].name);
+        } else {
+            failures++;
+        }
+    }
+
+    quantize_ref_func = ref.quantize_s16;
+    quantize_gain = 1.0f;
+    seed = 1;
+    if(check_kernel("quantize",&quantize_kernel,quantize_ref,quantize_double,in,a,b)) {
+        fprintf(stderr,"%-8s %-12s ok\n","quantize",quantize_kernel.name);
+    } else {
+        failures++;
+    }
+    seed = 1;
+    if(check_dither_split(&ref,in,a,b)) {
+        fprintf(stderr,"%-8s %-12s ok\n","split",dither_kernel.name);
+    } else {
+        failures++;
+    }
+
+    /* lowest tier first, so each kernel is checked under the tier that
+     * brings it in */
+    last = ref;
+    for(t=0;luawav_convert_tiers[t] != NULL;t++);
+    while(t-- > 0) {
+        if(!luawav_convert_tier(&c,luawav_convert_tiers[t])) {
+            fprintf(stderr,"%-8s not supported by this CPU, skipped\n",luawav_convert_tiers[t]);
+            continue;
+        }
+        for(j=0;j<KERNEL_COUNT;j++) {
+            /* a tier without its own kernel has the one below it */
+            f = get_kernel(&c,&kernels[j]);
+            if(f == get_kernel(&ref,&kernels[j])) continue;
+            for(k=0;k<count && checked[k] != f;k++);
+            if(k < count) continue;
+            if(count < MAX_CHECKED) checked[count++] = f;
+
+            seed = 1;
+            if(check_kernel(c.isa,&kernels[j],f,get_kernel(&ref,&kernels[j]),in,a,b)) {
+                fprintf(stderr,"%-8s %-12s ok\n",c.isa,kernels[j].name);
+            } else {
+                failures++;
+            }
+        }
+        for(j=0;j<sizeof(reduce_names) / sizeof(reduce_names[0]);j++) {
+            if(!reduce_differs(&c,&last,(int)j)) continue;
+            seed = 1;
+            if(check_reduce(c.isa,&c,&ref,(int)j,in)) {
+                fprintf(stderr,"%-8s %-12s ok\n",c.isa,reduce_names[j]);
+            } else {
+                failures++;
+            }
+        }
+        if(c.quantize_s16 != last.quantize_s16) {
+            if(check_quantize(c.isa,&c,&ref,in,a,b)) {
+                fprintf(stderr,"%-8s %-12s ok\n",c.isa,quantize_kernel.name);
+            } else {
+                failures++;
+            }
+        }
+        if(c.dither_s16 != last.dither_s16) {
+            if(check_dither(c.isa,&c,&ref,in,a,b)) {
+                fprintf(stderr,"%-8s %-12s ok\n",c.isa,dither_kernel.name);
+            } else {
+                failures++;
+            }
+        }
+        last = c;
+    }
+
+    free(in);
+    free(a);
+    free(b);
+    if(failures > 0) {
+        fprintf(stderr,"%d kernels differ from dr_wav\n",failures);
+        return 1;
+    }
+    return 0;
+}